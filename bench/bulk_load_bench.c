@@ -0,0 +1,119 @@
+#include "../src/bptree.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Loading a tree one bpt_insert at a time (keys in order and in random
+// order) against bpt_bulk_load of the same keys in order, and a cold scan of
+// the result. Inserts split leaves in half, so random order leaves them
+// about 70% full and scattered over the file. The bulk load packs them to
+// its fill factor and lays out each leaf before its data pages.
+
+#define BENCH_FILE "db/bulk_load_bench.db"
+#define NUM_KEYS 2000000
+#define RECORD_SIZE 100
+
+uint32_t pseudo_random(uint32_t v) {
+    return (1103515245ULL * (unsigned long long)v + 12345ULL) & 0x7fffffff;
+}
+
+double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void drop_os_cache() {
+    int fd = open(BENCH_FILE, O_RDONLY);
+    assert(fd >= 0);
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+typedef struct Source {
+    uint32_t next;
+    uint8_t record[RECORD_SIZE];
+} Source;
+
+int next_record(void *context, uint32_t *key, void **data, size_t *size) {
+    Source *source = context;
+    if (source->next == NUM_KEYS) return 0;
+    *key = source->next;
+    *(uint32_t*)source->record = source->next++;
+    *data = source->record;
+    *size = RECORD_SIZE;
+    return 1;
+}
+
+static uint64_t scanned;
+void count_cb(uint32_t key, void *data) {
+    assert(*(uint32_t*)data == key);
+    scanned++;
+}
+
+// mode 0 inserts in key order, 1 in random order, 2 bulk loads. Returns
+// the time the load took.
+double run(const char *name, uint8_t mode, uint8_t fill_percent, double baseline_ns) {
+    FILE *f = fopen(BENCH_FILE, "w");
+    assert(f);
+    fclose(f);
+
+    BufferManager *bm = buffer_manager_init(BENCH_FILE, NULL);
+    BPTree *bpt = bpt_open(bm, 0);
+    double start = now_ns();
+    if (mode == 2) {
+        Source source = { 0, {0} };
+        assert(bpt_bulk_load(bpt, fill_percent, next_record, &source) == 0);
+    }
+    else {
+        uint8_t record[RECORD_SIZE] = {0};
+        for (uint32_t i = 0; i < NUM_KEYS; i++) {
+            // A full period permutation of the keys for random order
+            uint32_t key = mode ? (uint32_t)(i * 2654435761ULL % NUM_KEYS) : i;
+            *(uint32_t*)record = key;
+            bpt_insert(bpt, key, record, sizeof(record));
+        }
+    }
+    buffer_manager_sync(bm);
+    double load_ns = now_ns() - start;
+    uint32_t height = bpt_height(bpt);
+    bpt_free(bpt);
+    buffer_manager_free(bm);
+
+    struct stat st;
+    assert(stat(BENCH_FILE, &st) == 0);
+    drop_os_cache();
+    bm = buffer_manager_init(BENCH_FILE, NULL);
+    bpt = bpt_open(bm, 0);
+    scanned = 0;
+    start = now_ns();
+    bpt_range_query(bpt, 0, 0x7fffffff, count_cb);
+    double scan_ns = now_ns() - start;
+    assert(scanned == NUM_KEYS);
+    bpt_free(bpt);
+    buffer_manager_free(bm);
+
+    printf("%-14s %10.0f %8.1fx %8u %10.1f %12.0f\n", name, NUM_KEYS / (load_ns / 1e9),
+        baseline_ns ? baseline_ns / load_ns : 1.0, height, st.st_size / 1048576.0,
+        scan_ns / 1e6);
+    remove(BENCH_FILE);
+    return load_ns;
+}
+
+int main() {
+    printf("%u keys with %u byte records, 16 MB pool, load includes the final sync\n",
+        NUM_KEYS, RECORD_SIZE);
+    printf("%-14s %10s %9s %8s %10s %12s\n", "load", "keys/s", "speedup", "height",
+        "file MB", "cold scan ms");
+
+    double baseline_ns = run("insert random", 1, 0, 0);
+    run("insert sorted", 0, 0, baseline_ns);
+    run("bulk 100%", 2, 100, baseline_ns);
+    run("bulk 90%", 2, 90, baseline_ns);
+    run("bulk 70%", 2, 70, baseline_ns);
+    return 0;
+}
@@ -0,0 +1,154 @@
+#include "../src/bptree.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Latency of a mixed bpt_get/bpt_insert workload over a write-ahead log,
+// and the time recovery takes when the process is killed at the end of it.
+// Without checkpoints recovery replays the whole log, blocking checkpoints
+// (buffer_manager_flush_cache) stall the operations that run into them,
+// the background checkpointer bounds the replay while updates go on.
+
+#define BENCH_FILE "db/checkpoint_bench.db"
+#define BENCH_WAL "db/checkpoint_bench.db-wal"
+#define NUM_KEYS 200000
+#define NUM_OPS 1000000
+#define UPDATE_PERCENT 20
+#define RECORD_SIZE 100
+#define FLUSH_EVERY 100000
+
+// Histogram buckets of 2^(i/4) ns, fine enough for the tail percentiles
+#define NUM_BUCKETS 160
+
+uint32_t pseudo_random(uint32_t v) {
+    return (1103515245ULL * (unsigned long long)v + 12345ULL) & 0x7fffffff;
+}
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint32_t bucket_of(uint64_t ns) {
+    uint32_t b = 0;
+    double bound = 1.0;
+    while (b < NUM_BUCKETS - 1 && ns > bound) {
+        bound *= 1.189207115; // 2^(1/4)
+        b++;
+    }
+    return b;
+}
+
+double bucket_bound(uint32_t b) {
+    double bound = 1.0;
+    for (uint32_t i = 0; i < b; i++) bound *= 1.189207115;
+    return bound;
+}
+
+double percentile(uint64_t *histogram, uint64_t total, double p) {
+    uint64_t target = (uint64_t)(total * p);
+    uint64_t seen = 0;
+    for (uint32_t b = 0; b < NUM_BUCKETS; b++) {
+        seen += histogram[b];
+        if (seen > target) return bucket_bound(b);
+    }
+    return bucket_bound(NUM_BUCKETS - 1);
+}
+
+// Runs the workload and exits without freeing anything, as if killed
+void crash_after_workload(const char *name, BufferManagerOptions *options,
+    uint8_t flush) {
+
+    BufferManager *bm = buffer_manager_init(BENCH_FILE, options);
+    BPTree *bpt = bpt_open(bm, 0);
+    uint8_t record[RECORD_SIZE] = {0};
+    for (uint32_t i = 0; i < NUM_KEYS; i++) {
+        bpt_insert(bpt, pseudo_random(i), record, sizeof(record));
+    }
+
+    uint64_t histogram[NUM_BUCKETS] = {0};
+    uint64_t max_ns = 0;
+    uint32_t state = 7;
+    for (uint32_t i = 0; i < NUM_OPS; i++) {
+        state = pseudo_random(state);
+        uint32_t key = pseudo_random(state % NUM_KEYS);
+        uint64_t start = now_ns();
+        if (state % 100 < UPDATE_PERCENT) {
+            bpt_insert(bpt, key, record, sizeof(record));
+        }
+        else {
+            void *v = bpt_get(bpt, key);
+            assert(v);
+            bpt_release(bpt, v);
+        }
+        if (flush && i % FLUSH_EVERY == FLUSH_EVERY - 1) {
+            buffer_manager_flush_cache(bm);
+        }
+        uint64_t ns = now_ns() - start;
+        histogram[bucket_of(ns)]++;
+        if (ns > max_ns) max_ns = ns;
+    }
+    buffer_manager_flush_log(bm);
+
+    BufferManagerStats stats = buffer_manager_get_stats(bm);
+    printf("%-12s %8.0f %8.0f %8.0f %10.1f %12lu", name,
+        percentile(histogram, NUM_OPS, 0.5),
+        percentile(histogram, NUM_OPS, 0.99),
+        percentile(histogram, NUM_OPS, 0.999),
+        max_ns / 1e6, stats.checkpoints);
+    fflush(stdout);
+    _exit(0);
+}
+
+void run(const char *name, BufferManagerOptions *options, uint8_t flush) {
+    FILE *f = fopen(BENCH_FILE, "w");
+    assert(f);
+    fclose(f);
+    remove(BENCH_WAL);
+
+    fflush(stdout);
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) crash_after_workload(name, options, flush);
+    int status;
+    waitpid(pid, &status, 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    // Space the log takes on disk, checkpoints punch out what they cover
+    struct stat st;
+    assert(stat(BENCH_WAL, &st) == 0);
+    uint64_t start = now_ns();
+    BufferManager *bm = buffer_manager_init(BENCH_FILE, options);
+    double recovery_ms = (now_ns() - start) / 1e6;
+    printf(" %10.1f %12.1f\n", st.st_blocks * 512 / 1048576.0, recovery_ms);
+
+    buffer_manager_free(bm);
+    remove(BENCH_FILE);
+    remove(BENCH_WAL);
+}
+
+int main() {
+    printf("%u keys, %u ops (%u%% inserts of %u bytes), log written every 1 ms\n",
+        NUM_KEYS, NUM_OPS, UPDATE_PERCENT, RECORD_SIZE);
+    printf("%-12s %8s %8s %8s %10s %12s %10s %12s\n", "checkpoints", "p50 ns", "p99 ns",
+        "p999 ns", "max ms", "checkpoints", "log MB", "recovery ms");
+
+    BufferManagerOptions options = { 0 };
+    options.wal = 1;
+    options.wal_commits_per_sync = UINT32_MAX;
+    options.wal_sync_interval_us = 1000;
+    run("none", &options, 0);
+    run("flush_cache", &options, 1);
+
+    options.checkpoint_replay_ms = 1000;
+    options.checkpoint_pages_per_second = 20000;
+    run("replay 1 s", &options, 0);
+    options.checkpoint_replay_ms = 100;
+    run("replay 100ms", &options, 0);
+    return 0;
+}
@@ -0,0 +1,116 @@
+#include "../src/bptree.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Latency distribution of a mixed bpt_get/bpt_insert workload over a tree
+// larger than the pool, with evictions done inline by the caller and with
+// the background cleaner keeping free frames between the watermarks
+
+#define BENCH_FILE "db/cleaner_bench.db"
+#define NUM_KEYS 1000000
+#define NUM_OPS 1000000
+#define UPDATE_PERCENT 20
+
+// Histogram buckets of 2^(i/4) ns, fine enough for the tail percentiles
+#define NUM_BUCKETS 160
+
+uint32_t pseudo_random(uint32_t v) {
+    return (1103515245ULL * (unsigned long long)v + 12345ULL) & 0x7fffffff;
+}
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint32_t bucket_of(uint64_t ns) {
+    uint32_t b = 0;
+    double bound = 1.0;
+    while (b < NUM_BUCKETS - 1 && ns > bound) {
+        bound *= 1.189207115; // 2^(1/4)
+        b++;
+    }
+    return b;
+}
+
+double bucket_bound(uint32_t b) {
+    double bound = 1.0;
+    for (uint32_t i = 0; i < b; i++) bound *= 1.189207115;
+    return bound;
+}
+
+double percentile(uint64_t *histogram, uint64_t total, double p) {
+    uint64_t target = (uint64_t)(total * p);
+    uint64_t seen = 0;
+    for (uint32_t b = 0; b < NUM_BUCKETS; b++) {
+        seen += histogram[b];
+        if (seen > target) return bucket_bound(b);
+    }
+    return bucket_bound(NUM_BUCKETS - 1);
+}
+
+void reset_file() {
+    FILE *f = fopen(BENCH_FILE, "w");
+    assert(f);
+    fclose(f);
+}
+
+void run(const char *name, BufferManagerOptions *options) {
+    reset_file();
+    BufferManager *bm = buffer_manager_init(BENCH_FILE, options);
+    BPTree *bpt = bpt_new(bm);
+    for (uint32_t i = 0; i < NUM_KEYS; i++) {
+        bpt_insert(bpt, pseudo_random(i), &i, sizeof(uint32_t));
+    }
+
+    uint64_t histogram[NUM_BUCKETS] = {0};
+    uint64_t max_ns = 0;
+    uint32_t state = 7;
+    for (uint32_t i = 0; i < NUM_OPS; i++) {
+        state = pseudo_random(state);
+        uint32_t key = pseudo_random(state % NUM_KEYS);
+        uint64_t start = now_ns();
+        if (state % 100 < UPDATE_PERCENT) {
+            bpt_insert(bpt, key, &i, sizeof(uint32_t));
+        }
+        else {
+            void *v = bpt_get(bpt, key);
+            assert(v);
+            bpt_release(bpt, v);
+        }
+        uint64_t ns = now_ns() - start;
+        histogram[bucket_of(ns)]++;
+        if (ns > max_ns) max_ns = ns;
+    }
+
+    BufferManagerStats stats = buffer_manager_get_stats(bm);
+    printf("%-10s %8.0f %8.0f %8.0f %8.0f %10lu %10lu\n", name,
+        percentile(histogram, NUM_OPS, 0.5),
+        percentile(histogram, NUM_OPS, 0.99),
+        percentile(histogram, NUM_OPS, 0.999),
+        (double)max_ns, stats.evictions - stats.cleaner_evictions,
+        stats.cleaner_evictions);
+
+    bpt_free(bpt);
+    buffer_manager_free(bm);
+    remove(BENCH_FILE);
+}
+
+int main() {
+    printf("%u keys, %u ops (%u%% updates), latency in ns\n",
+        NUM_KEYS, NUM_OPS, UPDATE_PERCENT);
+    printf("%-10s %8s %8s %8s %8s %10s %10s\n", "evictions", "p50", "p99",
+        "p999", "max", "inline", "cleaner");
+
+    BufferManagerOptions inline_options = { 0 };
+    run("inline", &inline_options);
+
+    BufferManagerOptions cleaner_options = { 0 };
+    cleaner_options.low_watermark = 256;
+    cleaner_options.high_watermark = 512;
+    run("cleaner", &cleaner_options);
+    return 0;
+}
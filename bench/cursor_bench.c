@@ -0,0 +1,118 @@
+#include "../src/bptree.h"
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+
+// "The n entries from a random key on", the LIMIT n query: bpt_range_query
+// (given the key the n-th entry is at, which a caller would not know), a
+// cursor stepped with next and value, and bpt_cursor_next_n, with a warm
+// pool. next_n copies the keys of a leaf in one go and reads the data
+// pages of the whole page of entries in one batch.
+
+#define BENCH_FILE "db/cursor_bench.db"
+#define NUM_KEYS 1000000
+#define RECORD_SIZE 100
+#define NUM_QUERIES 2000
+
+double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+uint32_t pseudo_random(uint32_t v) {
+    return (1103515245ULL * (unsigned long long)v + 12345ULL) & 0x7fffffff;
+}
+
+// Keys 0, 2, 4, ... so half the queries start at a key not in the tree
+int bench_next(void *context, uint32_t *key, void **data, size_t *size) {
+    static uint8_t record[RECORD_SIZE];
+    uint32_t *next = context;
+    if (*next == NUM_KEYS) return 0;
+    *key = *next * 2;
+    *(uint32_t*)record = *key;
+    *data = record;
+    *size = sizeof(record);
+    (*next)++;
+    return 1;
+}
+
+static uint64_t checksum;
+void sum_cb(uint32_t key, void *data) {
+    checksum += key + *(uint32_t*)data;
+}
+
+uint32_t start_key(uint32_t i, uint32_t n) {
+    return pseudo_random(i) % ((NUM_KEYS - n) * 2);
+}
+
+uint64_t page_requests(BufferManager *bm) {
+    BufferManagerStats stats = buffer_manager_get_stats(bm);
+    return stats.hits + stats.misses;
+}
+
+void report(const char *name, uint32_t n, double ns, uint64_t requests) {
+    printf("%-14s %6u %12.0f %14.1f\n", name, n, NUM_QUERIES / (ns / 1e9),
+        (double)requests / NUM_QUERIES);
+}
+
+int main() {
+    FILE *f = fopen(BENCH_FILE, "w");
+    assert(f);
+    fclose(f);
+    BufferManager *bm = buffer_manager_init(BENCH_FILE, NULL);
+    BPTree *bpt = bpt_open(bm, 0);
+    uint32_t next = 0;
+    assert(bpt_bulk_load(bpt, 100, bench_next, &next) == 0);
+
+    printf("%u keys with %u byte records, %u queries each, warm pool\n", NUM_KEYS,
+        RECORD_SIZE, NUM_QUERIES);
+    printf("%-14s %6s %12s %14s\n", "query", "n", "queries/s", "pages/query");
+    uint32_t limits[] = { 10, 100, 1000 };
+    uint32_t keys[1000];
+    void *values[1000];
+    BptCursor *cursor = bpt_cursor_open(bpt);
+    bpt_range_query(bpt, 0, 0x7fffffff, sum_cb);
+    for (uint32_t l = 0; l < sizeof(limits) / sizeof(limits[0]); l++) {
+        uint32_t n = limits[l];
+
+        checksum = 0;
+        uint64_t requests = page_requests(bm);
+        double start = now_ns();
+        for (uint32_t i = 0; i < NUM_QUERIES; i++) {
+            uint32_t key = start_key(i, n);
+            uint32_t first = (key + 1) / 2 * 2;
+            bpt_range_query(bpt, key, first + (n - 1) * 2, sum_cb);
+        }
+        report("range_query", n, now_ns() - start, page_requests(bm) - requests);
+        uint64_t expected = checksum;
+
+        checksum = 0;
+        requests = page_requests(bm);
+        start = now_ns();
+        for (uint32_t i = 0; i < NUM_QUERIES; i++) {
+            bpt_cursor_seek(cursor, start_key(i, n));
+            for (uint32_t j = 0; j < n; j++, bpt_cursor_next(cursor)) {
+                sum_cb(bpt_cursor_key(cursor), bpt_cursor_value(cursor));
+            }
+        }
+        report("cursor next", n, now_ns() - start, page_requests(bm) - requests);
+        assert(checksum == expected);
+
+        checksum = 0;
+        requests = page_requests(bm);
+        start = now_ns();
+        for (uint32_t i = 0; i < NUM_QUERIES; i++) {
+            bpt_cursor_seek(cursor, start_key(i, n));
+            assert(bpt_cursor_next_n(cursor, n, keys, values) == n);
+            for (uint32_t j = 0; j < n; j++) sum_cb(keys[j], values[j]);
+        }
+        report("cursor next_n", n, now_ns() - start, page_requests(bm) - requests);
+        assert(checksum == expected);
+    }
+    bpt_cursor_close(cursor);
+    bpt_free(bpt);
+    buffer_manager_free(bm);
+    remove(BENCH_FILE);
+    return 0;
+}
@@ -0,0 +1,121 @@
+#include "../src/bptree.h"
+#include "../src/external_sort.h"
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+// Loading unsorted records worth ten times the memory the load may use
+// into a new tree: bpt_insert one at a time with a pool of that size,
+// against an external sort within that memory streaming into
+// bpt_bulk_load. Sorting is split into forming the runs (while records are
+// added, sorted and written by num_threads threads) and the merge, which
+// runs as the bulk load pulls the records.
+
+#define BENCH_FILE "db/external_sort_bench.db"
+#define MEMORY ((size_t)32 << 20)
+#define RECORD_SIZE 100
+// Input of 10x MEMORY, counting the record and its entry in a sort buffer
+#define NUM_KEYS (uint32_t)(10 * MEMORY / (RECORD_SIZE + 16))
+
+double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// A full period permutation of the keys, in the order they are loaded
+uint32_t key_at(uint32_t i) {
+    return (uint32_t)(i * 2654435761ULL % NUM_KEYS);
+}
+
+void check_tree(BPTree *bpt) {
+    for (uint32_t i = 0; i < NUM_KEYS; i += NUM_KEYS / 1000) {
+        uint32_t *v = bpt_get(bpt, key_at(i));
+        assert(v && *v == i);
+        bpt_release(bpt, v);
+    }
+}
+
+// Returns the time the load took
+double run_inserts() {
+    FILE *f = fopen(BENCH_FILE, "w");
+    assert(f);
+    fclose(f);
+
+    BufferManagerOptions options = { 0 };
+    options.policy = REPLACEMENT_2Q;
+    options.pool_size = MEMORY;
+    BufferManager *bm = buffer_manager_init(BENCH_FILE, &options);
+    BPTree *bpt = bpt_open(bm, 0);
+    double start = now_ns();
+    uint8_t record[RECORD_SIZE] = {0};
+    for (uint32_t i = 0; i < NUM_KEYS; i++) {
+        *(uint32_t*)record = i;
+        bpt_insert(bpt, key_at(i), record, sizeof(record));
+    }
+    buffer_manager_sync(bm);
+    double load_ns = now_ns() - start;
+    check_tree(bpt);
+    bpt_free(bpt);
+    buffer_manager_free(bm);
+    remove(BENCH_FILE);
+
+    printf("%-22s %10s %10s %10.1f %10.0f %8s %8s %10s\n", "bpt_insert", "", "",
+        load_ns / 1e9, NUM_KEYS / (load_ns / 1e9), "", "", "");
+    return load_ns;
+}
+
+void run_sort(const char *name, size_t memory, uint32_t num_threads, double baseline_ns) {
+    FILE *f = fopen(BENCH_FILE, "w");
+    assert(f);
+    fclose(f);
+
+    // The pool only has to hold the nodes being filled, the sort gets the
+    // memory
+    BufferManagerOptions options = { 0 };
+    options.policy = REPLACEMENT_2Q;
+    options.pool_size = 4 << 20;
+    BufferManager *bm = buffer_manager_init(BENCH_FILE, &options);
+    BPTree *bpt = bpt_open(bm, 0);
+    double start = now_ns();
+    ExternalSort *sort = external_sort_init("db", memory, num_threads);
+    assert(sort);
+    uint8_t record[RECORD_SIZE] = {0};
+    for (uint32_t i = 0; i < NUM_KEYS; i++) {
+        *(uint32_t*)record = i;
+        assert(external_sort_add(sort, key_at(i), record, sizeof(record)) == 0);
+    }
+    assert(external_sort_finish(sort) == 0);
+    double runs_ns = now_ns() - start;
+    assert(bpt_bulk_load(bpt, 0, external_sort_next, sort) == 0);
+    buffer_manager_sync(bm);
+    double load_ns = now_ns() - start;
+    assert(!external_sort_failed(sort));
+    ExternalSortStats stats = external_sort_get_stats(sort);
+    external_sort_free(sort);
+    check_tree(bpt);
+    bpt_free(bpt);
+    buffer_manager_free(bm);
+    remove(BENCH_FILE);
+
+    printf("%-22s %10.1f %10.1f %10.1f %10.0f %8.1fx %8lu %10.0f\n", name, runs_ns / 1e9,
+        (load_ns - runs_ns) / 1e9, load_ns / 1e9, NUM_KEYS / (load_ns / 1e9),
+        baseline_ns / load_ns, stats.runs, stats.bytes_written / 1048576.0);
+}
+
+int main() {
+    printf("%u keys of %u bytes in random order (%.0f MB), %zu MB of memory, %ld cores\n",
+        NUM_KEYS, RECORD_SIZE, (double)NUM_KEYS * RECORD_SIZE / 1048576, MEMORY >> 20,
+        sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%-22s %10s %10s %10s %10s %9s %8s %10s\n", "load", "runs s", "merge s",
+        "total s", "keys/s", "speedup", "runs", "spilled MB");
+
+    double baseline_ns = run_inserts();
+    run_sort("sort, 1 thread", MEMORY, 1, baseline_ns);
+    run_sort("sort, 2 threads", MEMORY, 2, baseline_ns);
+    run_sort("sort, 1 thread/core", MEMORY, 0, baseline_ns);
+    // Too little memory to merge every run at once, merged in passes
+    run_sort("sort, 2 MB, 1 thread", 2 << 20, 1, baseline_ns);
+    return 0;
+}
@@ -0,0 +1,70 @@
+#include "../src/buffer_manager.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+// File growth of a long-running store that is restarted between rounds of
+// inserting records and deleting a random half of them. Free space left in
+// data pages is only reused after a restart if it can be found on disk.
+
+#define BENCH_FILE "db/fsm_bench.db"
+#define NUM_ROUNDS 10
+#define INSERTS_PER_ROUND 50000
+#define MAX_RECORDS (NUM_ROUNDS * INSERTS_PER_ROUND)
+
+uint32_t pseudo_random(uint32_t v) {
+    return (1103515245ULL * (unsigned long long)v + 12345ULL) & 0x7fffffff;
+}
+
+uint64_t file_pages() {
+    struct stat st;
+    assert(stat(BENCH_FILE, &st) == 0);
+    return st.st_size / PAGE_SIZE;
+}
+
+int main() {
+    FILE *f = fopen(BENCH_FILE, "w");
+    assert(f);
+    fclose(f);
+
+    static RID live[MAX_RECORDS];
+    static uint16_t sizes[MAX_RECORDS];
+    static uint8_t record[400];
+    uint32_t num_live = 0;
+    uint64_t live_bytes = 0;
+    uint32_t state = 3;
+
+    printf("%6s %10s %12s %12s %10s\n", "round", "records", "live MB",
+        "file pages", "reads");
+    for (uint32_t round = 0; round < NUM_ROUNDS; round++) {
+        BufferManager *bm = buffer_manager_init(BENCH_FILE, NULL);
+        for (uint32_t i = 0; i < INSERTS_PER_ROUND; i++) {
+            state = pseudo_random(state);
+            size_t size = 50 + state % 350;
+            sizes[num_live] = size;
+            live[num_live++] = buffer_manager_request_slot(bm, size, record);
+            live_bytes += size;
+        }
+
+        // Delete a random half, swapping the last live record into the gap
+        for (uint32_t n = num_live / 2; n > 0; n--) {
+            state = pseudo_random(state);
+            uint32_t idx = state % num_live;
+            buffer_manager_free_data(bm, live[idx]);
+            live_bytes -= sizes[idx];
+            num_live--;
+            live[idx] = live[num_live];
+            sizes[idx] = sizes[num_live];
+        }
+
+        buffer_manager_flush_cache(bm);
+        BufferManagerStats stats = buffer_manager_get_stats(bm);
+        buffer_manager_free(bm);
+        printf("%6u %10u %12.1f %12lu %10lu\n", round, num_live,
+            live_bytes / 1048576.0, file_pages(), stats.misses);
+    }
+
+    remove(BENCH_FILE);
+    return 0;
+}
@@ -0,0 +1,97 @@
+#include "../src/bptree.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+// Flush and cold-scan throughput of each batched I/O backend, on the disk
+// holding db/ and on tmpfs. The flush writes a pool full of dirty pages,
+// the scan reads the whole tree after it was dropped from the pool and
+// from the OS page cache (posix_fadvise, no effect on tmpfs).
+
+#define NUM_KEYS 400000
+#define RECORD_SIZE 100
+
+uint32_t pseudo_random(uint32_t v) {
+    return (1103515245ULL * (unsigned long long)v + 12345ULL) & 0x7fffffff;
+}
+
+double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void drop_os_cache(const char *path) {
+    int fd = open(path, O_RDONLY);
+    assert(fd >= 0);
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+static uint64_t scanned;
+void count_cb(uint32_t key, void *data) {
+    (void)key;
+    (void)data;
+    scanned++;
+}
+
+void run(const char *path, const char *name, uint8_t backend) {
+    FILE *f = fopen(path, "w");
+    assert(f);
+    fclose(f);
+
+    BufferManagerOptions options = { 0 };
+    options.io_backend = backend;
+    options.io_queue_depth = PAGER_DEFAULT_QUEUE_DEPTH;
+    options.io_max_coalesce = PAGER_DEFAULT_MAX_COALESCE;
+    BufferManager *bm = buffer_manager_init((char*)path, &options);
+    BPTree *bpt = bpt_new(bm);
+    uint8_t record[RECORD_SIZE] = {0};
+    for (uint32_t i = 0; i < NUM_KEYS; i++) {
+        bpt_insert(bpt, pseudo_random(i), record, sizeof(record));
+    }
+
+    BufferManagerStats before = buffer_manager_get_stats(bm);
+    double start = now_ns();
+    buffer_manager_flush_cache(bm);
+    double flush_ns = now_ns() - start;
+    BufferManagerStats after = buffer_manager_get_stats(bm);
+    uint64_t flushed = after.writes - before.writes;
+
+    drop_os_cache(path);
+    scanned = 0;
+    before = buffer_manager_get_stats(bm);
+    start = now_ns();
+    bpt_range_query(bpt, 0, 0x7fffffff, count_cb);
+    double scan_ns = now_ns() - start;
+    after = buffer_manager_get_stats(bm);
+    assert(scanned == NUM_KEYS);
+    uint64_t read = after.misses - before.misses + after.prefetches - before.prefetches;
+
+    printf("%-10s %-8s %8lu %10.1f %10lu %10.1f %10.2f\n", path[0] == '/' ? "tmpfs" : "disk",
+        name, flushed, flushed * PAGE_SIZE / (flush_ns / 1e9) / 1048576.0, read,
+        read * PAGE_SIZE / (scan_ns / 1e9) / 1048576.0,
+        (double)(after.prefetches - before.prefetches) / read);
+
+    bpt_free(bpt);
+    buffer_manager_free(bm);
+    remove(path);
+}
+
+int main() {
+    printf("%u keys of %u bytes, 16 MB pool, queue depth %u\n", NUM_KEYS, RECORD_SIZE,
+        PAGER_DEFAULT_QUEUE_DEPTH);
+    printf("%-10s %-8s %8s %10s %10s %10s %10s\n", "file", "backend", "flushed",
+        "flush MB/s", "scan reads", "scan MB/s", "prefetched");
+
+    const char *paths[] = { "db/io_bench.db", "/dev/shm/io_bench.db" };
+    for (uint32_t p = 0; p < 2; p++) {
+        run(paths[p], "sync", PAGER_IO_SYNC);
+        run(paths[p], "threads", PAGER_IO_THREADS);
+        run(paths[p], "io_uring", PAGER_IO_URING);
+    }
+    return 0;
+}
@@ -0,0 +1,102 @@
+#include "../src/bptree.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// How much of the database file the OS page cache holds next to the buffer
+// pool for each PAGER_OS_CACHE mode, after building a tree larger than the
+// pool and after scanning it. Everything the kernel caches here is memory
+// the pool could have used instead.
+
+#define BENCH_FILE "db/os_cache_bench.db"
+#define NUM_KEYS 400000
+#define RECORD_SIZE 100
+
+uint32_t pseudo_random(uint32_t v) {
+    return (1103515245ULL * (unsigned long long)v + 12345ULL) & 0x7fffffff;
+}
+
+double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Pages of the file in the OS page cache
+uint64_t resident_pages(uint64_t *file_pages) {
+    int fd = open(BENCH_FILE, O_RDONLY);
+    assert(fd >= 0);
+    struct stat st;
+    assert(fstat(fd, &st) == 0);
+    size_t size = st.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    assert(map != MAP_FAILED);
+    size_t os_page = sysconf(_SC_PAGESIZE);
+    size_t num = (size + os_page - 1) / os_page;
+    unsigned char *vec = malloc(num);
+    assert(mincore(map, size, vec) == 0);
+    uint64_t resident = 0;
+    for (size_t i = 0; i < num; i++) resident += vec[i] & 1;
+    free(vec);
+    munmap(map, size);
+    close(fd);
+    *file_pages = size / PAGE_SIZE;
+    return resident * os_page / PAGE_SIZE;
+}
+
+static uint64_t scanned;
+void count_cb(uint32_t key, void *data) {
+    (void)key;
+    (void)data;
+    scanned++;
+}
+
+void run(const char *name, uint8_t os_cache) {
+    FILE *f = fopen(BENCH_FILE, "w");
+    assert(f);
+    fclose(f);
+
+    BufferManagerOptions options = { 0 };
+    options.io_backend = PAGER_IO_SYNC;
+    options.os_cache = os_cache;
+    BufferManager *bm = buffer_manager_init(BENCH_FILE, &options);
+    BPTree *bpt = bpt_new(bm);
+    uint8_t record[RECORD_SIZE] = {0};
+    double start = now_ns();
+    for (uint32_t i = 0; i < NUM_KEYS; i++) {
+        bpt_insert(bpt, pseudo_random(i), record, sizeof(record));
+    }
+    buffer_manager_flush_cache(bm);
+    double build_ns = now_ns() - start;
+    uint64_t file_pages;
+    uint64_t after_build = resident_pages(&file_pages);
+
+    scanned = 0;
+    start = now_ns();
+    bpt_range_query(bpt, 0, 0x7fffffff, count_cb);
+    double scan_ns = now_ns() - start;
+    assert(scanned == NUM_KEYS);
+    uint64_t after_scan = resident_pages(&file_pages);
+
+    printf("%-8s %10lu %12lu %12lu %10.0f %10.0f\n", name, file_pages, after_build,
+        after_scan, build_ns / 1e6, scan_ns / 1e6);
+
+    bpt_free(bpt);
+    buffer_manager_free(bm);
+    remove(BENCH_FILE);
+}
+
+int main() {
+    printf("%u keys of %u bytes, 16 MB pool\n", NUM_KEYS, RECORD_SIZE);
+    printf("%-8s %10s %12s %12s %10s %10s\n", "os cache", "file pages", "cached built",
+        "cached scan", "build ms", "scan ms");
+    run("keep", PAGER_OS_CACHE_KEEP);
+    run("direct", PAGER_OS_CACHE_DIRECT);
+    run("drop", PAGER_OS_CACHE_DROP);
+    return 0;
+}
@@ -0,0 +1,129 @@
+#include "../src/bptree.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Point lookups and cold range scans for the PAGE_SIZE of this build, run
+// for every page size with make bench-page-sizes. The pool is the same
+// number of bytes for each, so larger pages mean fewer frames. One tree is
+// filled in random key order (records of neighbouring keys are on unrelated
+// data pages), the other in key order.
+
+#define BENCH_FILE "db/page_size_bench.db"
+#define NUM_KEYS 1000000
+#define NUM_LOOKUPS 200000
+#define RECORD_SIZE 100
+
+uint32_t pseudo_random(uint32_t v) {
+    return (1103515245ULL * (unsigned long long)v + 12345ULL) & 0x7fffffff;
+}
+
+double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void drop_os_cache() {
+    int fd = open(BENCH_FILE, O_RDONLY);
+    assert(fd >= 0);
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+static uint64_t scanned;
+void count_cb(uint32_t key, void *data) {
+    (void)key;
+    (void)data;
+    scanned++;
+}
+
+int main() {
+    FILE *f = fopen(BENCH_FILE, "w");
+    assert(f);
+    fclose(f);
+
+    BufferManager *bm = buffer_manager_init(BENCH_FILE, NULL);
+    BPTree *bpt = bpt_open(bm, 0);
+    uint8_t record[RECORD_SIZE] = {0};
+    for (uint32_t i = 0; i < NUM_KEYS; i++) {
+        *(uint32_t*)record = i;
+        bpt_insert(bpt, pseudo_random(i), record, sizeof(record));
+    }
+    uint32_t height = bpt_height(bpt);
+    bpt_free(bpt);
+    BPTree *ordered = bpt_open(bm, 1);
+    for (uint32_t i = 0; i < NUM_KEYS; i++) {
+        bpt_insert(ordered, i, record, sizeof(record));
+    }
+    buffer_manager_flush_cache(bm);
+    bpt_free(ordered);
+    buffer_manager_free(bm);
+    struct stat st;
+    assert(stat(BENCH_FILE, &st) == 0);
+    // Each tree takes about half of the file
+    double tree_mb = st.st_size / 2 / 1048576.0;
+
+    // Cold: neither the pool nor the OS cache holds a page
+    drop_os_cache();
+    bm = buffer_manager_init(BENCH_FILE, NULL);
+    ordered = bpt_open(bm, 1);
+    scanned = 0;
+    double start = now_ns();
+    bpt_range_query(ordered, 0, 0x7fffffff, count_cb);
+    double ordered_scan_ns = now_ns() - start;
+    assert(scanned == NUM_KEYS);
+    bpt_free(ordered);
+    buffer_manager_free(bm);
+
+    drop_os_cache();
+    bm = buffer_manager_init(BENCH_FILE, NULL);
+    bpt = bpt_open(bm, 0);
+    scanned = 0;
+    start = now_ns();
+    bpt_range_query(bpt, 0, 0x7fffffff, count_cb);
+    double scan_ns = now_ns() - start;
+    assert(scanned == NUM_KEYS);
+
+    // Warmed up, the file is in the OS cache and the pool holds what fits
+    uint32_t state = 1;
+    for (uint32_t i = 0; i < NUM_LOOKUPS; i++) {
+        state = pseudo_random(state);
+        void *v = bpt_get(bpt, pseudo_random(state % NUM_KEYS));
+        bpt_release(bpt, v);
+    }
+    BufferManagerStats before = buffer_manager_get_stats(bm);
+    start = now_ns();
+    for (uint32_t i = 0; i < NUM_LOOKUPS; i++) {
+        state = pseudo_random(state);
+        uint32_t idx = state % NUM_KEYS;
+        uint32_t *v = bpt_get(bpt, pseudo_random(idx));
+        assert(v && *v == idx);
+        bpt_release(bpt, v);
+    }
+    double get_ns = (now_ns() - start) / NUM_LOOKUPS;
+    BufferManagerStats after = buffer_manager_get_stats(bm);
+    uint64_t hits = after.hits - before.hits;
+    uint64_t misses = after.misses - before.misses;
+
+    // Printed by the first (smallest) page size only, so the runs of make
+    // bench-page-sizes form one table
+    if (PAGE_SIZE == 4096) {
+        printf("%u keys of %u bytes per tree, 16 MB pool, %u uniform bpt_get\n",
+            NUM_KEYS, RECORD_SIZE, NUM_LOOKUPS);
+        printf("%8s %8s %10s %10s %10s %14s %14s\n", "page KB", "height", "tree MB",
+            "ns/get", "hit ratio", "scan MB/s", "ordered MB/s");
+    }
+    printf("%8u %8u %10.1f %10.0f %10.4f %14.1f %14.1f\n", (uint32_t)(PAGE_SIZE / 1024),
+        height, tree_mb, get_ns, (double)hits / (hits + misses),
+        tree_mb / (scan_ns / 1e9), tree_mb / (ordered_scan_ns / 1e9));
+
+    bpt_free(bpt);
+    buffer_manager_free(bm);
+    remove(BENCH_FILE);
+    return 0;
+}
@@ -0,0 +1,77 @@
+#include "../src/page_table.h"
+#include "../src/util.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Hit-path latency of the buffer pool page table: the old RBTree map
+// (page_id -> pointer to a malloc'd value) against the open-addressing
+// PageTable (page_id -> frame index), at different numbers of cached pages
+
+#define NUM_LOOKUPS 2000000
+
+uint32_t pseudo_random(uint32_t v) {
+    return (1103515245ULL * (unsigned long long)v + 12345ULL) & 0x7fffffff;
+}
+
+double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void bench(uint32_t cached_pages) {
+    // Cached page_ids are spread over a file 4x the size of the cache
+    uint32_t *page_ids = malloc(sizeof(uint32_t) * cached_pages);
+    uint32_t v = cached_pages;
+    for (uint32_t i = 0; i < cached_pages; i++) {
+        v = pseudo_random(v);
+        page_ids[i] = i * 4 + (v & 0x3) + 1;
+    }
+
+    Map *m = rbt_init();
+    PageTable *pt = pt_init(cached_pages);
+    for (uint32_t i = 0; i < cached_pages; i++) {
+        rbt_insert(m, page_ids[i], &i, sizeof(uint32_t));
+        pt_insert(pt, page_ids[i], i);
+    }
+
+    // Random hits, the lookup order is precomputed so both loops
+    // only pay for the lookup itself
+    uint32_t *order = malloc(sizeof(uint32_t) * NUM_LOOKUPS);
+    for (uint32_t i = 0; i < NUM_LOOKUPS; i++) {
+        v = pseudo_random(v);
+        order[i] = page_ids[v % cached_pages];
+    }
+
+    uint64_t checksum = 0;
+    double start = now_ns();
+    for (uint32_t i = 0; i < NUM_LOOKUPS; i++) {
+        checksum += *(uint32_t*)rbt_get(m, order[i]);
+    }
+    double rbt_ns = (now_ns() - start) / NUM_LOOKUPS;
+
+    uint64_t checksum_pt = 0;
+    start = now_ns();
+    for (uint32_t i = 0; i < NUM_LOOKUPS; i++) {
+        checksum_pt += pt_get(pt, order[i]);
+    }
+    double pt_ns = (now_ns() - start) / NUM_LOOKUPS;
+    assert(checksum == checksum_pt);
+
+    printf("%-14u %14.1f %14.1f\n", cached_pages, rbt_ns, pt_ns);
+
+    rbt_free(m);
+    pt_free(pt);
+    free(order);
+    free(page_ids);
+}
+
+int main() {
+    printf("%-14s %14s %14s\n", "cached pages", "rbtree ns/hit", "ptable ns/hit");
+    bench(4096);
+    bench(65536);
+    bench(1048576);
+    return 0;
+}
@@ -0,0 +1,88 @@
+#include "../src/pager.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Compares the cost of a page miss through the old per-page
+// open/lseek/read/close path with the persistent Pager (one pread)
+
+#define BENCH_FILE "db/pager_bench.db"
+#define NUM_PAGES 4096
+#define NUM_MISSES 200000
+
+uint32_t pseudo_random(uint32_t v) {
+    return (1103515245ULL * (unsigned long long)v + 12345ULL) & 0x7fffffff;
+}
+
+double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// The previous read_page_from_db transfer, kept here as the baseline
+int legacy_read(char *db_file_path, uint32_t page_id, uint8_t buffer[PAGE_SIZE],
+    uint64_t *syscalls) {
+
+    int fd = open(db_file_path, O_RDONLY);
+    (*syscalls)++;
+    if (fd < 0) return -1;
+
+    off_t offset = (off_t)page_id * PAGE_SIZE;
+    (*syscalls)++;
+    if (lseek(fd, offset, SEEK_SET) == (off_t)-1) {
+        close(fd);
+        (*syscalls)++;
+        return -1;
+    }
+
+    ssize_t r = read(fd, buffer, PAGE_SIZE);
+    (*syscalls)++;
+    close(fd);
+    (*syscalls)++;
+    return r == PAGE_SIZE ? 0 : -1;
+}
+
+int main() {
+    Pager *pager = pager_open(BENCH_FILE, NULL);
+    assert(pager);
+
+    uint8_t buffer[PAGE_SIZE];
+    for (uint32_t i = 0; i < NUM_PAGES; i++) {
+        memset(buffer, i & 0xFF, PAGE_SIZE);
+        pager_write(pager, i, buffer);
+    }
+
+    uint64_t legacy_syscalls = 0;
+    double start = now_ns();
+    for (uint32_t i = 0; i < NUM_MISSES; i++) {
+        uint32_t page_id = pseudo_random(i) % NUM_PAGES;
+        int r = legacy_read(BENCH_FILE, page_id, buffer, &legacy_syscalls);
+        assert(r == 0 && buffer[0] == (page_id & 0xFF));
+    }
+    double legacy_ns = (now_ns() - start) / NUM_MISSES;
+
+    PagerStats before = pager_get_stats(pager);
+    start = now_ns();
+    for (uint32_t i = 0; i < NUM_MISSES; i++) {
+        uint32_t page_id = pseudo_random(i) % NUM_PAGES;
+        int r = pager_read(pager, page_id, buffer);
+        assert(r == 0 && buffer[0] == (page_id & 0xFF));
+    }
+    double pager_ns = (now_ns() - start) / NUM_MISSES;
+    PagerStats after = pager_get_stats(pager);
+
+    printf("%-28s %12s %12s\n", "path", "syscalls/miss", "ns/miss");
+    printf("%-28s %12.2f %12.0f\n", "open/lseek/read/close",
+        (double)legacy_syscalls / NUM_MISSES, legacy_ns);
+    printf("%-28s %12.2f %12.0f\n", "pager (pread)",
+        (double)(after.syscalls - before.syscalls) / NUM_MISSES, pager_ns);
+
+    pager_close(pager);
+    unlink(BENCH_FILE);
+    return 0;
+}
@@ -0,0 +1,124 @@
+#include "../src/bptree.h"
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Hit ratio of the replacement policies on skewed bpt_get traffic. The
+// tree is several times larger than the pool, lookups follow a Zipfian
+// distribution over the keys with the hottest keys scattered over the
+// key space (and therefore over the leaves). The tree is built once and
+// every policy starts from a cold pool over the same file.
+
+#define BENCH_FILE "db/policy_bench.db"
+#define NUM_KEYS 2000000
+#define NUM_LOOKUPS 1000000
+#define NUM_WARMUP 200000
+
+uint32_t pseudo_random(uint32_t v) {
+    return (1103515245ULL * (unsigned long long)v + 12345ULL) & 0x7fffffff;
+}
+
+// Cumulative distribution of a Zipf(s) distribution over n ranks
+double *zipf_cdf(uint32_t n, double s) {
+    double *cdf = malloc(sizeof(double) * n);
+    double sum = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        sum += 1.0 / pow(i + 1, s);
+        cdf[i] = sum;
+    }
+    for (uint32_t i = 0; i < n; i++) cdf[i] /= sum;
+    return cdf;
+}
+
+uint32_t zipf_sample(double *cdf, uint32_t n, uint32_t *state) {
+    *state = pseudo_random(*state);
+    double u = (double)*state / 0x7fffffff;
+    uint32_t l = 0, r = n - 1;
+    while (l < r) {
+        uint32_t mid = l + (r - l) / 2;
+        if (cdf[mid] < u) l = mid + 1;
+        else r = mid;
+    }
+    return l;
+}
+
+// Rank -> index of the inserted key, spreads hot ranks over the key space
+uint32_t rank_to_key(uint32_t rank) {
+    uint32_t i = (uint32_t)(((uint64_t)rank * 2654435761u) % NUM_KEYS);
+    return pseudo_random(i);
+}
+
+uint32_t build_tree() {
+    FILE *f = fopen(BENCH_FILE, "w");
+    assert(f);
+    fclose(f);
+
+    BufferManager *bm = buffer_manager_init(BENCH_FILE, NULL);
+    BPTree *bpt = bpt_new(bm);
+    for (uint32_t i = 0; i < NUM_KEYS; i++) {
+        bpt_insert(bpt, pseudo_random(i), &i, sizeof(uint32_t));
+    }
+    uint32_t root_page_id = bpt_root_page_id(bpt);
+    buffer_manager_flush_cache(bm);
+    bpt_free(bpt);
+    buffer_manager_free(bm);
+    return root_page_id;
+}
+
+double run(uint8_t policy, double *cdf, uint32_t root_page_id) {
+    BufferManagerOptions options = { 0 };
+    options.policy = policy;
+    BufferManager *bm = buffer_manager_init(BENCH_FILE, &options);
+    BPTree *bpt = bpt_read(bm, root_page_id);
+
+    uint32_t state = 42;
+    for (uint32_t i = 0; i < NUM_WARMUP; i++) {
+        void *v = bpt_get(bpt, rank_to_key(zipf_sample(cdf, NUM_KEYS, &state)));
+        assert(v);
+        bpt_release(bpt, v);
+    }
+
+    BufferManagerStats before = buffer_manager_get_stats(bm);
+    for (uint32_t i = 0; i < NUM_LOOKUPS; i++) {
+        void *v = bpt_get(bpt, rank_to_key(zipf_sample(cdf, NUM_KEYS, &state)));
+        assert(v);
+        bpt_release(bpt, v);
+    }
+    BufferManagerStats after = buffer_manager_get_stats(bm);
+
+    bpt_free(bpt);
+    buffer_manager_free(bm);
+
+    uint64_t hits = after.hits - before.hits;
+    uint64_t misses = after.misses - before.misses;
+    return (double)hits / (hits + misses);
+}
+
+int main() {
+    double skews[] = {0.8, 0.99, 1.2};
+    const char *names[] = {"clock", "2q", "fifo"};
+    uint8_t policies[] = {REPLACEMENT_CLOCK, REPLACEMENT_2Q, REPLACEMENT_FIFO};
+
+    uint32_t root_page_id = build_tree();
+
+    printf("%u keys, %u zipfian bpt_get per run, page hit ratio\n",
+        NUM_KEYS, NUM_LOOKUPS);
+    printf("%-8s", "zipf s");
+    for (int p = 0; p < 3; p++) printf(" %10s", names[p]);
+    printf("\n");
+
+    for (int s = 0; s < 3; s++) {
+        double *cdf = zipf_cdf(NUM_KEYS, skews[s]);
+        printf("%-8.2f", skews[s]);
+        for (int p = 0; p < 3; p++) {
+            printf(" %10.4f", run(policies[p], cdf, root_page_id));
+            fflush(stdout);
+        }
+        printf("\n");
+        free(cdf);
+    }
+
+    remove(BENCH_FILE);
+    return 0;
+}
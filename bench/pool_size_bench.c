@@ -0,0 +1,76 @@
+#include "../src/bptree.h"
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+
+// Online resizing: one buffer manager serves uniform bpt_get lookups while
+// its pool is grown and shrunk between runs, reporting the hit ratio and
+// the cost per lookup at each size
+
+#define BENCH_FILE "db/pool_size_bench.db"
+#define NUM_KEYS 2000000
+#define NUM_LOOKUPS 500000
+
+uint32_t pseudo_random(uint32_t v) {
+    return (1103515245ULL * (unsigned long long)v + 12345ULL) & 0x7fffffff;
+}
+
+double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main() {
+    FILE *f = fopen(BENCH_FILE, "w");
+    assert(f);
+    fclose(f);
+
+    BufferManager *bm = buffer_manager_init(BENCH_FILE, NULL);
+    BPTree *bpt = bpt_new(bm);
+    for (uint32_t i = 0; i < NUM_KEYS; i++) {
+        bpt_insert(bpt, pseudo_random(i), &i, sizeof(uint32_t));
+    }
+
+    size_t sizes_mb[] = {16, 64, 256, 64, 4, 1, 32};
+    printf("%u keys, %u uniform bpt_get per size\n", NUM_KEYS, NUM_LOOKUPS);
+    printf("%10s %10s %10s %10s\n", "pool MB", "resize us", "hit ratio", "ns/get");
+
+    uint32_t state = 1;
+    for (size_t s = 0; s < sizeof(sizes_mb) / sizeof(sizes_mb[0]); s++) {
+        double start = now_ns();
+        assert(buffer_manager_resize(bm, sizes_mb[s] << 20) == 0);
+        double resize_us = (now_ns() - start) / 1e3;
+
+        // Warm up, which also completes a shrink
+        for (uint32_t i = 0; i < NUM_LOOKUPS; i++) {
+            state = pseudo_random(state);
+            void *v = bpt_get(bpt, pseudo_random(state % NUM_KEYS));
+            assert(v);
+            bpt_release(bpt, v);
+        }
+        assert(buffer_manager_get_pool_size(bm) == sizes_mb[s] << 20);
+
+        BufferManagerStats before = buffer_manager_get_stats(bm);
+        start = now_ns();
+        for (uint32_t i = 0; i < NUM_LOOKUPS; i++) {
+            state = pseudo_random(state);
+            uint32_t idx = state % NUM_KEYS;
+            uint32_t *v = bpt_get(bpt, pseudo_random(idx));
+            assert(v && *v == idx);
+            bpt_release(bpt, v);
+        }
+        double ns = (now_ns() - start) / NUM_LOOKUPS;
+        BufferManagerStats after = buffer_manager_get_stats(bm);
+
+        uint64_t hits = after.hits - before.hits;
+        uint64_t misses = after.misses - before.misses;
+        printf("%10zu %10.0f %10.4f %10.0f\n", sizes_mb[s], resize_us,
+            (double)hits / (hits + misses), ns);
+    }
+
+    bpt_free(bpt);
+    buffer_manager_free(bm);
+    remove(BENCH_FILE);
+    return 0;
+}
@@ -0,0 +1,115 @@
+#include "../src/bptree.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+// bpt_range_query_reverse against bpt_range_query over the same ranges:
+// the whole tree read cold (after the OS cache is dropped) and warm, and
+// "the latest n entries up to a random key" queries with a warm pool. The
+// leaves link both ways, a scan back reads and prefetches them as a scan
+// forward does.
+
+#define BENCH_FILE "db/reverse_scan_bench.db"
+#define NUM_KEYS 1000000
+#define RECORD_SIZE 100
+#define NUM_QUERIES 2000
+
+double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void drop_os_cache() {
+    int fd = open(BENCH_FILE, O_RDONLY);
+    assert(fd >= 0);
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+uint32_t pseudo_random(uint32_t v) {
+    return (1103515245ULL * (unsigned long long)v + 12345ULL) & 0x7fffffff;
+}
+
+// A full period permutation of the keys, in the order they are inserted
+uint32_t key_at(uint32_t i) {
+    return (uint32_t)(i * 2654435761ULL % NUM_KEYS);
+}
+
+static uint64_t scanned;
+void count_cb(uint32_t key, void *data) {
+    assert(*(uint32_t*)data == key);
+    scanned++;
+}
+
+typedef void (*RangeQuery)(BPTree *bpt, uint32_t key_low, uint32_t key_high,
+    void (*callback)(uint32_t key, void *data));
+
+double full_scan(RangeQuery query, uint8_t cold) {
+    if (cold) drop_os_cache();
+    BufferManager *bm = buffer_manager_init(BENCH_FILE, NULL);
+    BPTree *bpt = bpt_open(bm, 0);
+    if (!cold) query(bpt, 0, UINT32_MAX, count_cb);
+    scanned = 0;
+    double start = now_ns();
+    query(bpt, 0, UINT32_MAX, count_cb);
+    double scan_ns = now_ns() - start;
+    assert(scanned == NUM_KEYS);
+    bpt_free(bpt);
+    buffer_manager_free(bm);
+    return scan_ns;
+}
+
+// Queries per second
+double latest(BPTree *bpt, RangeQuery query, uint32_t n) {
+    scanned = 0;
+    double start = now_ns();
+    for (uint32_t i = 0; i < NUM_QUERIES; i++) {
+        uint32_t high = n + pseudo_random(i) % (NUM_KEYS - n);
+        query(bpt, high - n + 1, high, count_cb);
+    }
+    double ns = now_ns() - start;
+    assert(scanned == (uint64_t)n * NUM_QUERIES);
+    return NUM_QUERIES / (ns / 1e9);
+}
+
+int main() {
+    FILE *f = fopen(BENCH_FILE, "w");
+    assert(f);
+    fclose(f);
+    BufferManager *bm = buffer_manager_init(BENCH_FILE, NULL);
+    BPTree *bpt = bpt_open(bm, 0);
+    uint8_t record[RECORD_SIZE] = {0};
+    for (uint32_t i = 0; i < NUM_KEYS; i++) {
+        *(uint32_t*)record = key_at(i);
+        bpt_insert(bpt, key_at(i), record, sizeof(record));
+    }
+    buffer_manager_sync(bm);
+    bpt_free(bpt);
+    buffer_manager_free(bm);
+
+    printf("%u keys inserted in random order with %u byte records\n", NUM_KEYS, RECORD_SIZE);
+    printf("%-16s %14s %14s\n", "scan", "forward", "reverse");
+    printf("%-16s %11.0f ms %11.0f ms\n", "full, cold", full_scan(bpt_range_query, 1) / 1e6,
+        full_scan(bpt_range_query_reverse, 1) / 1e6);
+    printf("%-16s %11.0f ms %11.0f ms\n", "full, warm", full_scan(bpt_range_query, 0) / 1e6,
+        full_scan(bpt_range_query_reverse, 0) / 1e6);
+
+    bm = buffer_manager_init(BENCH_FILE, NULL);
+    bpt = bpt_open(bm, 0);
+    bpt_range_query(bpt, 0, UINT32_MAX, count_cb);
+    uint32_t limits[] = { 10, 100, 1000 };
+    for (uint32_t l = 0; l < sizeof(limits) / sizeof(limits[0]); l++) {
+        char name[32];
+        snprintf(name, sizeof(name), "latest %u", limits[l]);
+        printf("%-16s %12.0f/s %12.0f/s\n", name, latest(bpt, bpt_range_query, limits[l]),
+            latest(bpt, bpt_range_query_reverse, limits[l]));
+    }
+    bpt_free(bpt);
+    buffer_manager_free(bm);
+    remove(BENCH_FILE);
+    return 0;
+}
@@ -0,0 +1,71 @@
+#include "../src/bptree.h"
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+
+// bpt_insert throughput without a log and with every insert committed to
+// the write-ahead log, for several numbers of commits per fdatasync. Only 1
+// makes every insert durable before it returns, with more the inserts not
+// yet synced are lost in a crash.
+
+#define BENCH_FILE "db/wal_bench.db"
+#define BENCH_WAL "db/wal_bench.db-wal"
+#define RECORD_SIZE 100
+
+uint32_t pseudo_random(uint32_t v) {
+    return (1103515245ULL * (unsigned long long)v + 12345ULL) & 0x7fffffff;
+}
+
+double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+double run(const char *name, uint8_t wal, uint32_t commits_per_sync,
+    uint32_t sync_interval_us, uint32_t num_keys, double baseline) {
+
+    FILE *f = fopen(BENCH_FILE, "w");
+    assert(f);
+    fclose(f);
+    remove(BENCH_WAL);
+
+    BufferManagerOptions options = { 0 };
+    options.wal = wal;
+    options.wal_commits_per_sync = commits_per_sync;
+    options.wal_sync_interval_us = sync_interval_us;
+    BufferManager *bm = buffer_manager_init(BENCH_FILE, &options);
+    BPTree *bpt = bpt_open(bm, 0);
+    uint8_t record[RECORD_SIZE] = {0};
+
+    double start = now_ns();
+    for (uint32_t i = 0; i < num_keys; i++) {
+        bpt_insert(bpt, pseudo_random(i), record, sizeof(record));
+    }
+    double insert_ns = now_ns() - start;
+    BufferManagerStats stats = buffer_manager_get_stats(bm);
+
+    double per_second = num_keys / (insert_ns / 1e9);
+    printf("%-14s %10u %12.0f %10.1f %10lu %12lu\n", name, num_keys, per_second,
+        baseline ? baseline / per_second : 1.0, stats.commits, stats.log_flushes);
+
+    bpt_free(bpt);
+    buffer_manager_free(bm);
+    remove(BENCH_FILE);
+    remove(BENCH_WAL);
+    return per_second;
+}
+
+int main() {
+    printf("Random inserts of %u byte records, 16 MB pool\n", RECORD_SIZE);
+    printf("%-14s %10s %12s %10s %10s %12s\n", "log", "inserts", "inserts/s",
+        "slowdown", "commits", "log flushes");
+    double baseline = run("none", 0, 0, 0, 200000, 0);
+    run("sync each", 1, 1, 0, 5000, baseline);
+    run("sync per 16", 1, 16, 0, 50000, baseline);
+    run("sync per 128", 1, 128, 0, 200000, baseline);
+    run("sync per 1024", 1, 1024, 0, 200000, baseline);
+    run("every 1 ms", 1, UINT32_MAX, 1000, 200000, baseline);
+    run("every 10 ms", 1, UINT32_MAX, 10000, 200000, baseline);
+    return 0;
+}
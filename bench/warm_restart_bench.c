@@ -0,0 +1,123 @@
+#include "../src/bptree.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+// Skewed bpt_get workload right after reopening the database with neither
+// the pool nor the OS cache holding a page. A cold start warms up through
+// misses one page at a time, a warm restart reads back the pages cached
+// when the last run ended, before buffer_manager_init returns (preload) or
+// while the lookups run (background).
+
+#define BENCH_FILE "db/warm_restart_bench.db"
+#define BENCH_WARM "db/warm_restart_bench.db-warm"
+#define NUM_KEYS 1000000
+#define RECORD_SIZE 100
+#define POOL_SIZE ((size_t)32 << 20)
+// HOT_PERCENT of the lookups go to the first HOT_KEYS keys
+#define HOT_KEYS 2000
+#define HOT_PERCENT 95
+#define WINDOW_OPS 20000
+#define NUM_WINDOWS 5
+
+uint32_t pseudo_random(uint32_t v) {
+    return (1103515245ULL * (unsigned long long)v + 12345ULL) & 0x7fffffff;
+}
+
+double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void drop_os_cache() {
+    int fd = open(BENCH_FILE, O_RDONLY);
+    assert(fd >= 0);
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+// Runs windows of lookups from the key sequence seed starts, printing the
+// throughput and hit ratio of each when print is set
+void lookups(BPTree *bpt, BufferManager *bm, uint32_t seed, uint32_t windows, uint8_t print) {
+    uint32_t state = seed;
+    for (uint32_t w = 0; w < windows; w++) {
+        BufferManagerStats before = buffer_manager_get_stats(bm);
+        double start = now_ns();
+        for (uint32_t i = 0; i < WINDOW_OPS; i++) {
+            state = pseudo_random(state);
+            uint32_t idx = state % 100 < HOT_PERCENT ? state % HOT_KEYS : state % NUM_KEYS;
+            uint32_t *v = bpt_get(bpt, pseudo_random(idx));
+            assert(v && *v == idx);
+            bpt_release(bpt, v);
+        }
+        double ns = now_ns() - start;
+        BufferManagerStats after = buffer_manager_get_stats(bm);
+        uint64_t hits = after.hits - before.hits;
+        uint64_t misses = after.misses - before.misses;
+        if (print) {
+            printf(" %9.0f/%.3f", WINDOW_OPS / (ns / 1e9), (double)hits / (hits + misses));
+        }
+    }
+}
+
+// Each run looks up other cold keys than the runs before, whose pages it
+// would otherwise find in the saved page set
+void run(const char *name, uint8_t warm_restart, uint32_t seed) {
+    drop_os_cache();
+    BufferManagerOptions options = { 0 };
+    options.policy = REPLACEMENT_2Q;
+    options.pool_size = POOL_SIZE;
+    options.warm_restart = warm_restart;
+    double start = now_ns();
+    BufferManager *bm = buffer_manager_init(BENCH_FILE, &options);
+    double open_ms = (now_ns() - start) / 1e6;
+    BPTree *bpt = bpt_open(bm, 0);
+    printf("%-12s %8.1f", name, open_ms);
+    lookups(bpt, bm, seed, NUM_WINDOWS, 1);
+    printf(" %9lu\n", buffer_manager_get_stats(bm).preloads);
+    bpt_free(bpt);
+    buffer_manager_free(bm);
+}
+
+int main() {
+    FILE *f = fopen(BENCH_FILE, "w");
+    assert(f);
+    fclose(f);
+    remove(BENCH_WARM);
+
+    // Fills the tree and runs the workload until the pool holds its hot
+    // pages, which are saved when the buffer manager is freed
+    BufferManagerOptions options = { 0 };
+    options.policy = REPLACEMENT_2Q;
+    options.pool_size = POOL_SIZE;
+    options.warm_restart = WARM_RESTART_PRELOAD;
+    BufferManager *bm = buffer_manager_init(BENCH_FILE, &options);
+    BPTree *bpt = bpt_open(bm, 0);
+    uint8_t record[RECORD_SIZE] = {0};
+    for (uint32_t i = 0; i < NUM_KEYS; i++) {
+        *(uint32_t*)record = i;
+        bpt_insert(bpt, pseudo_random(i), record, sizeof(record));
+    }
+    buffer_manager_sync(bm);
+    lookups(bpt, bm, 1, 20, 0);
+    bpt_free(bpt);
+    buffer_manager_free(bm);
+
+    printf("%u keys of %u bytes, 32 MB pool (2Q), %u%% of bpt_get on %u keys\n",
+        NUM_KEYS, RECORD_SIZE, HOT_PERCENT, HOT_KEYS);
+    printf("Gets/s and hit ratio of consecutive windows of %u gets\n", WINDOW_OPS);
+    printf("%-12s %8s", "start", "open ms");
+    for (uint32_t w = 0; w < NUM_WINDOWS; w++) printf(" %15s%u", "window ", w + 1);
+    printf(" %9s\n", "preloads");
+    run("cold", WARM_RESTART_OFF, 11);
+    run("preload", WARM_RESTART_PRELOAD, 22);
+    run("background", WARM_RESTART_BACKGROUND, 33);
+
+    remove(BENCH_FILE);
+    remove(BENCH_WARM);
+    return 0;
+}
@@ -0,0 +1,107 @@
+#include "../src/bptree.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Inserting keys in random order one bpt_insert at a time against
+// bpt_write_batch with batches of 10 to 100k of them, and a cold scan of
+// the result. A batch descends once per leaf its keys fall into, so the
+// larger it is the more of them share a descent, a split and the data
+// pages their records go to.
+
+#define BENCH_FILE "db/write_batch_bench.db"
+#define NUM_KEYS 1000000
+#define RECORD_SIZE 100
+
+double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void drop_os_cache() {
+    int fd = open(BENCH_FILE, O_RDONLY);
+    assert(fd >= 0);
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+// A full period permutation of the keys, in the order they are inserted
+uint32_t key_at(uint32_t i) {
+    return (uint32_t)(i * 2654435761ULL % NUM_KEYS);
+}
+
+static uint64_t scanned;
+void count_cb(uint32_t key, void *data) {
+    assert(key_at(*(uint32_t*)data) == key);
+    scanned++;
+}
+
+// batch_size 0 inserts one key at a time. Returns the time the inserts
+// took.
+double run(uint32_t batch_size, double baseline_ns) {
+    FILE *f = fopen(BENCH_FILE, "w");
+    assert(f);
+    fclose(f);
+
+    BufferManager *bm = buffer_manager_init(BENCH_FILE, NULL);
+    BPTree *bpt = bpt_open(bm, 0);
+    BptWriteBatch *batch = bpt_batch_init();
+    uint8_t record[RECORD_SIZE] = {0};
+    double start = now_ns();
+    for (uint32_t i = 0; i < NUM_KEYS; i++) {
+        *(uint32_t*)record = i;
+        if (!batch_size) {
+            bpt_insert(bpt, key_at(i), record, sizeof(record));
+            continue;
+        }
+        bpt_batch_insert(batch, key_at(i), record, sizeof(record));
+        if (bpt_batch_size(batch) == batch_size) bpt_write_batch(bpt, batch);
+    }
+    bpt_write_batch(bpt, batch);
+    buffer_manager_sync(bm);
+    double insert_ns = now_ns() - start;
+    uint32_t height = bpt_height(bpt);
+    bpt_batch_free(batch);
+    bpt_free(bpt);
+    buffer_manager_free(bm);
+
+    struct stat st;
+    assert(stat(BENCH_FILE, &st) == 0);
+    drop_os_cache();
+    bm = buffer_manager_init(BENCH_FILE, NULL);
+    bpt = bpt_open(bm, 0);
+    scanned = 0;
+    start = now_ns();
+    bpt_range_query(bpt, 0, 0x7fffffff, count_cb);
+    double scan_ns = now_ns() - start;
+    assert(scanned == NUM_KEYS);
+    bpt_free(bpt);
+    buffer_manager_free(bm);
+    remove(BENCH_FILE);
+
+    char name[32];
+    snprintf(name, sizeof(name), batch_size ? "batch %u" : "bpt_insert", batch_size);
+    printf("%-14s %10.0f %8.1fx %8u %10.1f %12.0f\n", name, NUM_KEYS / (insert_ns / 1e9),
+        baseline_ns ? baseline_ns / insert_ns : 1.0, height, st.st_size / 1048576.0,
+        scan_ns / 1e6);
+    return insert_ns;
+}
+
+int main() {
+    printf("%u keys in random order with %u byte records, 16 MB pool, inserts include the "
+        "final sync\n", NUM_KEYS, RECORD_SIZE);
+    printf("%-14s %10s %9s %8s %10s %12s\n", "inserts", "keys/s", "speedup", "height",
+        "file MB", "cold scan ms");
+
+    double baseline_ns = run(0, 0);
+    uint32_t batch_sizes[] = { 10, 100, 1000, 10000, 100000 };
+    for (uint32_t i = 0; i < sizeof(batch_sizes) / sizeof(batch_sizes[0]); i++) {
+        run(batch_sizes[i], baseline_ns);
+    }
+    return 0;
+}
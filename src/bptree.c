@@ -11,81 +11,196 @@
 // Remove comment for full debug
 // #define FULL_DEBUG
 
+// root_slot of trees not opened with bpt_open
+#define NO_ROOT_SLOT UINT32_MAX
+
 // Does not have ownership of buffer-manager
 struct BPTree {
-    // Very important change this for page_id as it will just be flushed otherwise
-    Page *root;
+    // Kept as a page_id, the frame holding the root can be evicted and reused
+    uint32_t root_page_id;
+    // Superblock slot kept up to date with root_page_id
+    uint32_t root_slot;
     Stack *parent_stack;
     BufferManager *bm;
+
+    // Pages pinned by the running operation, unpinned when it finishes
+    Page **pinned;
+    uint32_t num_pinned;
+    uint32_t pinned_size;
 };
 
 // Declarations
 void internal_insert(BPTree *bpt, uint32_t key, uint32_t page_id,
     Page *page, Stack *parent_stack);
 
+#define PINNED_DEFAULT_SIZE 32
 
-BPTree *bpt_read(BufferManager *bm, uint32_t root_page_id) {
+void remember_pin(BPTree *bpt, Page *page) {
+    if (bpt->num_pinned == bpt->pinned_size) {
+        bpt->pinned_size *= 2;
+        bpt->pinned = realloc(bpt->pinned, sizeof(Page*) * bpt->pinned_size);
+    }
+    bpt->pinned[bpt->num_pinned++] = page;
+}
+
+// Every page an operation touches stays pinned until the operation is done,
+// so pointers to it can be held across further page requests
+Page *pin_page(BPTree *bpt, uint32_t page_id) {
+    Page *page = buffer_manager_get_page(bpt->bm, page_id);
+    if (page) remember_pin(bpt, page);
+    return page;
+}
+
+Page *pin_new_page(BPTree *bpt, uint8_t is_leaf) {
+    Page *page = buffer_manager_new_bpt_page(bpt->bm, is_leaf);
+    if (page) remember_pin(bpt, page);
+    return page;
+}
+
+// 1 if pages more pages can be pinned. Checked before an operation changes
+// anything that would need more pages than the path it pinned, so that it
+// either runs out of frames before the tree changes or not at all.
+uint8_t frames_available(BPTree *bpt, uint32_t pages) {
+    return buffer_manager_unpinned_frames(bpt->bm) >= pages;
+}
+
+// Points the leaf page_id (none if 0) back at prev_page_id, after the leaf
+// before it was split or merged
+void link_prev_leaf(BPTree *bpt, uint32_t page_id, uint32_t prev_page_id) {
+    if (!page_id) return;
+    Page *page = pin_page(bpt, page_id);
+    if (!page) return;
+    buffer_manager_mark_dirty(bpt->bm, page);
+    page->leaf.prev_page_id = prev_page_id;
+}
+
+// Unpins the pages pinned after the first count
+void unpin_pages_from(BPTree *bpt, uint32_t count) {
+    for (uint32_t i = count; i < bpt->num_pinned; i++) {
+        buffer_manager_unpin_page(bpt->bm, bpt->pinned[i]);
+    }
+    bpt->num_pinned = count;
+}
+
+void unpin_pages(BPTree *bpt) {
+    unpin_pages_from(bpt, 0);
+}
+
+BPTree *bpt_init(BufferManager *bm, uint32_t root_page_id) {
     BPTree *bpt = malloc(sizeof(BPTree));
-    bpt->root = buffer_manager_get_page(bm, root_page_id);
+    bpt->root_page_id = root_page_id;
+    bpt->root_slot = NO_ROOT_SLOT;
     bpt->bm = bm;
     bpt->parent_stack = stack_init();
+    bpt->pinned_size = PINNED_DEFAULT_SIZE;
+    bpt->pinned = malloc(sizeof(Page*) * bpt->pinned_size);
+    bpt->num_pinned = 0;
     return bpt;
 }
 
+BPTree *bpt_read(BufferManager *bm, uint32_t root_page_id) {
+    return bpt_init(bm, root_page_id);
+}
+
 BPTree *bpt_new(BufferManager *bm) {
-    BPTree *bpt = malloc(sizeof(BPTree));
-    bpt->root = buffer_manager_new_bpt_page(bm, LEAF);
+    buffer_manager_begin_update(bm);
+    Page *root = buffer_manager_new_bpt_page(bm, LEAF);
+    if (!root) {
+        buffer_manager_end_update(bm);
+        return NULL;
+    }
+    BPTree *bpt = bpt_init(bm, root->header.page_id);
+    buffer_manager_unpin_page(bm, root);
+    buffer_manager_end_update(bm);
 
-    // TODO: Update the root bpt when we create a new bpt
+    return bpt;
+}
 
-    bpt->parent_stack = stack_init();
-    bpt->bm = bm;
+BPTree *bpt_open(BufferManager *bm, uint32_t slot) {
+    if (slot >= MAX_ROOTS) return NULL;
+    // A new root and the slot pointing to it are one commit
+    buffer_manager_begin_update(bm);
+    uint32_t root_page_id = buffer_manager_get_root(bm, slot);
+    BPTree *bpt = root_page_id ? bpt_init(bm, root_page_id) : bpt_new(bm);
+    if (bpt) {
+        bpt->root_slot = slot;
+        buffer_manager_set_root(bm, slot, bpt->root_page_id);
+    }
+    buffer_manager_end_update(bm);
     return bpt;
 }
 
+void set_root(BPTree *bpt, uint32_t root_page_id) {
+    bpt->root_page_id = root_page_id;
+    if (bpt->root_slot != NO_ROOT_SLOT) {
+        buffer_manager_set_root(bpt->bm, bpt->root_slot, root_page_id);
+    }
+}
+
 void bpt_free(BPTree *bpt) {
     stack_free(bpt->parent_stack);
+    free(bpt->pinned);
     free(bpt);
 }
 
-Page *search(BPTree *bpt, uint32_t key) {
-    Page *page = bpt->root;
+// Past every key, the upper bound of the last leaf
+#define NO_UPPER_BOUND ((uint64_t)UINT32_MAX + 1)
+
+// Descends to the leaf for key, the path above it is left in parent_stack.
+// high is set to the lowest key that belongs to a leaf after it. NULL,
+// with the path unpinned again, if a page of it could not be pinned.
+Page *search_bounded(BPTree *bpt, uint32_t key, uint64_t *high) {
+    uint32_t num_pinned = bpt->num_pinned;
+    Page *page = pin_page(bpt, bpt->root_page_id);
     stack_clear(bpt->parent_stack);
-    while (!page->header.is_leaf) {
+    *high = NO_UPPER_BOUND;
+    while (page && !page->header.is_leaf) {
         stack_push(bpt->parent_stack, page->header.page_id);
-        InternalPage *internal_page = page->internal;
+        InternalPage *internal_page = &page->internal;
         uint32_t idx = upper_bound(internal_page->keys, page->header.num_keys, key);
-        page = buffer_manager_get_page(bpt->bm, internal_page->children[idx]);
+        if (idx < page->header.num_keys) *high = internal_page->keys[idx];
+        page = pin_page(bpt, internal_page->children[idx]);
     }
+    if (!page) unpin_pages_from(bpt, num_pinned);
     return page;
 }
 
+Page *search(BPTree *bpt, uint32_t key) {
+    uint64_t high;
+    return search_bounded(bpt, key, &high);
+}
+
 uint32_t bpt_height(BPTree *bpt) {
-    Page *page = bpt->root;
-    if (!page) return 0;
-    uint32_t h = 1;
-    while (!page->header.is_leaf) {
+    Page *page = pin_page(bpt, bpt->root_page_id);
+    uint32_t h = 0;
+    while (page) {
         h++;
-        page = buffer_manager_get_page(bpt->bm, page->internal->children[0]);
+        if (page->header.is_leaf) break;
+        page = pin_page(bpt, page->internal.children[0]);
     }
+    unpin_pages(bpt);
     return h;
 }
 
+uint32_t bpt_root_page_id(BPTree *bpt) {
+    return bpt->root_page_id;
+}
+
 void promote_key(BPTree *bpt, uint32_t key, uint32_t left_id, 
     uint32_t right_id, Stack *parent_stack) {
 
     if (stack_is_empty(parent_stack)) {
         // Split root
-        Page *new_root = buffer_manager_new_bpt_page(bpt->bm, INTERNAL);
+        Page *new_root = pin_new_page(bpt, INTERNAL);
         new_root->header.num_keys = 1;
-        new_root->internal->keys[0] = key;
-        new_root->internal->children[0] = left_id;
-        new_root->internal->children[1] = right_id;
-        bpt->root = new_root;
+        new_root->internal.keys[0] = key;
+        new_root->internal.children[0] = left_id;
+        new_root->internal.children[1] = right_id;
+        set_root(bpt, new_root->header.page_id);
     }
     else {
         // Insert into parent
-        Page *parent = buffer_manager_get_page(bpt->bm, stack_top(parent_stack));
+        Page *parent = pin_page(bpt, stack_top(parent_stack));
         stack_pop(parent_stack);
         internal_insert(bpt, key, right_id, parent, parent_stack);
     }
@@ -94,134 +209,208 @@ void promote_key(BPTree *bpt, uint32_t key, uint32_t left_id,
 void internal_insert(BPTree *bpt, uint32_t key, uint32_t page_id,
     Page *page, Stack *parent_stack) {
 
-    // Insert into node
-    for (uint32_t i = 0; i <= page->header.num_keys; i++) {
-        
-        if (i == page->header.num_keys) {
-            page->internal->keys[page->header.num_keys] = key;
-            page->internal->children[page->header.num_keys + 1] = page_id;
-            break;
-        }
-
-        if (page->internal->keys[i] > key) {
-            memmove(&page->internal->keys[i + 1], &page->internal->keys[i],
-                (page->header.num_keys - i) * sizeof(uint32_t));
-            memmove(&page->internal->children[i + 2], &page->internal->children[i + 1],
-                (page->header.num_keys - i) * sizeof(uint32_t));
-            page->internal->keys[i] = key;
-            page->internal->children[i + 1] = page_id;
-            break;
-        }
-    }
-
-    page->header.num_keys++;
-
-    if (page->header.num_keys <= MAX_KEYS) {
+    InternalPage *internal = &page->internal;
+    uint32_t num_keys = page->header.num_keys;
+    uint32_t idx = upper_bound(internal->keys, num_keys, key);
+    buffer_manager_mark_dirty(bpt->bm, page);
+
+    if (num_keys < MAX_KEYS) {
+        // Insert into node
+        memmove(&internal->keys[idx + 1], &internal->keys[idx],
+            (num_keys - idx) * sizeof(uint32_t));
+        memmove(&internal->children[idx + 2], &internal->children[idx + 1],
+            (num_keys - idx) * sizeof(uint32_t));
+        internal->keys[idx] = key;
+        internal->children[idx + 1] = page_id;
+        page->header.num_keys++;
         return;
     }
 
-    // Split Node
-    uint32_t split_idx = page->header.num_keys / 2;
-    uint32_t promoted_key = page->internal->keys[split_idx];
-    Page *right_page = buffer_manager_new_bpt_page(bpt->bm, INTERNAL);    
-
-    memcpy(&right_page->internal->keys[0], &page->internal->keys[split_idx + 1],
-        (page->header.num_keys - split_idx - 1) * sizeof(uint32_t));
-    memcpy(&right_page->internal->children[0], &page->internal->children[split_idx + 1],
-        (page->header.num_keys - split_idx) * sizeof(uint32_t));
+    // Split Node, the node already fills its page so the overfull
+    // node is assembled in a scratch copy first
+    uint32_t keys[MAX_KEYS + 1];
+    uint32_t children[MAX_CHILDREN + 1];
+    memcpy(keys, internal->keys, idx * sizeof(uint32_t));
+    memcpy(&keys[idx + 1], &internal->keys[idx], (num_keys - idx) * sizeof(uint32_t));
+    memcpy(children, internal->children, (idx + 1) * sizeof(uint32_t));
+    memcpy(&children[idx + 2], &internal->children[idx + 1],
+        (num_keys - idx) * sizeof(uint32_t));
+    keys[idx] = key;
+    children[idx + 1] = page_id;
+    num_keys++;
+
+    uint32_t split_idx = num_keys / 2;
+    uint32_t promoted_key = keys[split_idx];
+    Page *right_page = pin_new_page(bpt, INTERNAL);    
 
-    right_page->header.num_keys = page->header.num_keys - split_idx;
-    page->header.num_keys = split_idx;
-    
     // Ignore top key, new leftmost-key splits two values
-    right_page->header.num_keys--;
+    memcpy(internal->keys, keys, split_idx * sizeof(uint32_t));
+    memcpy(internal->children, children, (split_idx + 1) * sizeof(uint32_t));
+    memcpy(&right_page->internal.keys[0], &keys[split_idx + 1],
+        (num_keys - split_idx - 1) * sizeof(uint32_t));
+    memcpy(&right_page->internal.children[0], &children[split_idx + 1],
+        (num_keys - split_idx) * sizeof(uint32_t));
+
+    right_page->header.num_keys = num_keys - split_idx - 1;
+    page->header.num_keys = split_idx;
 
     promote_key(bpt, promoted_key, page->header.page_id,
         right_page->header.page_id, parent_stack);
 }
 
-void leaf_insert(BPTree *bpt, uint32_t key, void *data,
+// -1 if no frame could be taken, the tree is unchanged
+int leaf_insert(BPTree *bpt, uint32_t key, void *data,
     size_t size, Page *page, Stack *parent_stack) {
 
-    RID rid = buffer_manager_request_slot(bpt->bm, size, data);
-    for (uint32_t i = 0; i <= page->header.num_keys; i++) {
+    LeafPage *leaf = &page->leaf;
+    uint32_t num_keys = page->header.num_keys;
+    // A split takes at most a new node on every level above and a new root,
+    // besides the new leaf, the leaf after it and a data page
+    if (num_keys == MAX_ENTRIES_LEAF &&
+        !frames_available(bpt, stack_size(parent_stack) + 4)) {
 
-        if (i == page->header.num_keys) {
-            page->leaf->keys[page->header.num_keys] = key;
-            page->leaf->page_ids[page->header.num_keys] = rid.page_id;
-            page->leaf->slot_ids[page->header.num_keys] = rid.slot_id;
-            break;
-        }
-
-        if (page->leaf->keys[i] > key) {
-            memmove(&page->leaf->keys[i + 1], &page->leaf->keys[i],
-                (page->header.num_keys - i) * sizeof(uint32_t));
-            memmove(&page->leaf->page_ids[i + 1], &page->leaf->page_ids[i], 
-                (page->header.num_keys - i) * sizeof(uint32_t));
-            memmove(&page->leaf->slot_ids[i + 1], &page->leaf->slot_ids[i], 
-                (page->header.num_keys - i) * sizeof(uint16_t));
-            page->leaf->keys[i] = key;
-            page->leaf->page_ids[i] = rid.page_id;
-            page->leaf->slot_ids[i] = rid.slot_id;
-            break;
-        }
+        return -1;
     }
-
-    page->header.num_keys++;
-
-    if (page->header.num_keys <= MAX_ENTRIES_LEAF) {
-        return;
+    RID rid = buffer_manager_request_slot(bpt->bm, size, data);
+    if (!rid.page_id) return -1;
+    uint32_t idx = upper_bound(leaf->keys, num_keys, key);
+    buffer_manager_mark_dirty(bpt->bm, page);
+
+    if (num_keys < MAX_ENTRIES_LEAF) {
+        memmove(&leaf->keys[idx + 1], &leaf->keys[idx],
+            (num_keys - idx) * sizeof(uint32_t));
+        memmove(&leaf->page_ids[idx + 1], &leaf->page_ids[idx], 
+            (num_keys - idx) * sizeof(uint32_t));
+        memmove(&leaf->slot_ids[idx + 1], &leaf->slot_ids[idx], 
+            (num_keys - idx) * sizeof(uint16_t));
+        leaf->keys[idx] = key;
+        leaf->page_ids[idx] = rid.page_id;
+        leaf->slot_ids[idx] = rid.slot_id;
+        page->header.num_keys++;
+        return 0;
     }
 
-    // Else, split node
-    uint32_t split_idx = page->header.num_keys / 2;
-    uint32_t promoted_key = page->leaf->keys[split_idx];
-    Page *right_leaf = buffer_manager_new_bpt_page(bpt->bm, LEAF);
-
-    memcpy(&right_leaf->leaf->keys[0], &page->leaf->keys[split_idx], 
-        (page->header.num_keys - split_idx) * sizeof(uint32_t));
-    memcpy(&right_leaf->leaf->page_ids[0], &page->leaf->page_ids[split_idx],
-        (page->header.num_keys - split_idx) * sizeof(uint32_t));
-    memcpy(&right_leaf->leaf->slot_ids[0], &page->leaf->slot_ids[split_idx],
-        (page->header.num_keys - split_idx) * sizeof(uint16_t));
-
-    right_leaf->header.num_keys = page->header.num_keys - split_idx;
+    // Else, split node. The leaf already fills its page so the overfull
+    // leaf is assembled in a scratch copy first
+    uint32_t keys[MAX_ENTRIES_LEAF + 1];
+    uint32_t page_ids[MAX_ENTRIES_LEAF + 1];
+    uint16_t slot_ids[MAX_ENTRIES_LEAF + 1];
+    memcpy(keys, leaf->keys, idx * sizeof(uint32_t));
+    memcpy(page_ids, leaf->page_ids, idx * sizeof(uint32_t));
+    memcpy(slot_ids, leaf->slot_ids, idx * sizeof(uint16_t));
+    memcpy(&keys[idx + 1], &leaf->keys[idx], (num_keys - idx) * sizeof(uint32_t));
+    memcpy(&page_ids[idx + 1], &leaf->page_ids[idx], (num_keys - idx) * sizeof(uint32_t));
+    memcpy(&slot_ids[idx + 1], &leaf->slot_ids[idx], (num_keys - idx) * sizeof(uint16_t));
+    keys[idx] = key;
+    page_ids[idx] = rid.page_id;
+    slot_ids[idx] = rid.slot_id;
+    num_keys++;
+
+    uint32_t split_idx = num_keys / 2;
+    uint32_t promoted_key = keys[split_idx];
+    Page *right_leaf = pin_new_page(bpt, LEAF);
+
+    memcpy(leaf->keys, keys, split_idx * sizeof(uint32_t));
+    memcpy(leaf->page_ids, page_ids, split_idx * sizeof(uint32_t));
+    memcpy(leaf->slot_ids, slot_ids, split_idx * sizeof(uint16_t));
+    memcpy(&right_leaf->leaf.keys[0], &keys[split_idx], 
+        (num_keys - split_idx) * sizeof(uint32_t));
+    memcpy(&right_leaf->leaf.page_ids[0], &page_ids[split_idx],
+        (num_keys - split_idx) * sizeof(uint32_t));
+    memcpy(&right_leaf->leaf.slot_ids[0], &slot_ids[split_idx],
+        (num_keys - split_idx) * sizeof(uint16_t));
+
+    right_leaf->header.num_keys = num_keys - split_idx;
     page->header.num_keys = split_idx;
-    right_leaf->leaf->next_page_id = page->leaf->next_page_id;
-    page->leaf->next_page_id = right_leaf->header.page_id;
+    right_leaf->leaf.next_page_id = leaf->next_page_id;
+    right_leaf->leaf.prev_page_id = page->header.page_id;
+    leaf->next_page_id = right_leaf->header.page_id;
+    link_prev_leaf(bpt, right_leaf->leaf.next_page_id, right_leaf->header.page_id);
 
     promote_key(bpt, promoted_key, page->header.page_id, 
         right_leaf->header.page_id, parent_stack);
+    return 0;
 }
 
-void bpt_insert(BPTree *bpt, uint32_t key, void *data, size_t size) {
+int insert_key(BPTree *bpt, uint32_t key, void *data, size_t size) {
     Page *leaf = search(bpt, key);
-    uint32_t keyidx = lower_bound(leaf->leaf->keys, leaf->header.num_keys, key);
-    if (keyidx != leaf->header.num_keys && leaf->leaf->keys[keyidx] == key) {
+    if (!leaf) return -1;
+    uint32_t keyidx = lower_bound(leaf->leaf.keys, leaf->header.num_keys, key);
+    if (keyidx != leaf->header.num_keys && leaf->leaf.keys[keyidx] == key) {
         // Overwrite old value
         RID rid = buffer_manager_request_slot(bpt->bm, size, data);
-        leaf->leaf->page_ids[keyidx] = rid.page_id;
-        leaf->leaf->slot_ids[keyidx] = rid.slot_id;
-        return;
+        if (!rid.page_id) return -1;
+        buffer_manager_mark_dirty(bpt->bm, leaf);
+        leaf->leaf.page_ids[keyidx] = rid.page_id;
+        leaf->leaf.slot_ids[keyidx] = rid.slot_id;
+        return 0;
     }
 
-    leaf_insert(bpt, key, data, size, leaf, bpt->parent_stack);
+    return leaf_insert(bpt, key, data, size, leaf, bpt->parent_stack);
 }
 
-// Currently returs nothing as a placeholder
+// Each insert and delete is one commit when the buffer manager keeps a log
+int bpt_insert(BPTree *bpt, uint32_t key, void *data, size_t size) {
+    buffer_manager_begin_update(bpt->bm);
+    int result = insert_key(bpt, key, data, size);
+    unpin_pages(bpt);
+    if (buffer_manager_end_update(bpt->bm) < 0) result = -1;
+    return result;
+}
+
+// The returned data stays pinned until passed to bpt_release
 void *bpt_get(BPTree *bpt, uint32_t key) {
+    void *data = NULL;
     Page *leaf = search(bpt, key);
-    uint32_t idx = lower_bound(leaf->leaf->keys, leaf->header.num_keys, key);
-    if (idx != leaf->header.num_keys && leaf->leaf->keys[idx] == key) {
+    if (!leaf) return NULL;
+    uint32_t idx = lower_bound(leaf->leaf.keys, leaf->header.num_keys, key);
+    if (idx != leaf->header.num_keys && leaf->leaf.keys[idx] == key) {
         RID rid = {
-            leaf->leaf->page_ids[idx],
-            leaf->leaf->slot_ids[idx]
+            leaf->leaf.page_ids[idx],
+            leaf->leaf.slot_ids[idx]
         };
-        return buffer_manager_get_data(bpt->bm, rid);
+        data = buffer_manager_get_data(bpt->bm, rid);
     }
-    else {
-        return NULL;
+    unpin_pages(bpt);
+    return data;
+}
+
+void bpt_release(BPTree *bpt, void *data) {
+    buffer_manager_unpin_page(bpt->bm, data);
+}
+
+// Helper to bpt_range_query, right after search(bpt, key). Prefetches the
+// leaves after the one found that share its parent and hold keys up to
+// key_high, returns how many.
+uint32_t prefetch_leaves(BPTree *bpt, uint32_t key, uint32_t key_high) {
+    if (bpt->num_pinned < 2) return 0;
+    Page *parent = bpt->pinned[bpt->num_pinned - 2];
+    uint32_t num_keys = parent->header.num_keys;
+    uint32_t first = upper_bound(parent->internal.keys, num_keys, key) + 1;
+    uint32_t last = upper_bound(parent->internal.keys, num_keys, key_high);
+    if (last < first) return 0;
+    buffer_manager_prefetch(bpt->bm, &parent->internal.children[first], last - first + 1);
+    return last - first + 1;
+}
+
+// Prefetches the data pages of the records of entries first to last - 1 of
+// leaf, in one batch
+void prefetch_data(BPTree *bpt, Page *leaf, uint32_t first, uint32_t last) {
+    uint32_t page_ids[MAX_ENTRIES_LEAF];
+    uint32_t count = 0;
+    for (uint32_t i = first; i < last; i++) {
+        // Records of a leaf are often in the same few pages
+        if (count && page_ids[count - 1] == leaf->leaf.page_ids[i]) continue;
+        page_ids[count++] = leaf->leaf.page_ids[i];
     }
+    if (count > 1) buffer_manager_prefetch(bpt->bm, page_ids, count);
+}
+
+// Keeps the page pinned last (the leaf search found) and unpins the rest
+Page *keep_last_pin(BPTree *bpt) {
+    Page *page = bpt->pinned[--bpt->num_pinned];
+    unpin_pages(bpt);
+    return page;
 }
 
 void bpt_range_query(BPTree *bpt, uint32_t key_low, uint32_t key_high, 
@@ -231,53 +420,646 @@ void bpt_range_query(BPTree *bpt, uint32_t key_low, uint32_t key_high,
         return;
     }
 
+    buffer_manager_begin_scan(bpt->bm);
     Page *leaf = search(bpt, key_low);
+    if (!leaf) {
+        buffer_manager_end_scan(bpt->bm);
+        return;
+    }
+    uint32_t prefetched = prefetch_leaves(bpt, key_low, key_high);
+
+    // The rest of the path is released, the scan holds one leaf at a time
+    keep_last_pin(bpt);
 
     while (leaf) {
+        prefetch_data(bpt, leaf,
+            lower_bound(leaf->leaf.keys, leaf->header.num_keys, key_low),
+            upper_bound(leaf->leaf.keys, leaf->header.num_keys, key_high));
         for (uint32_t i = 0; i < leaf->header.num_keys; i++) {
-            if (leaf->leaf->keys[i] > key_high) return;
+            if (leaf->leaf.keys[i] > key_high) {
+                buffer_manager_unpin_page(bpt->bm, leaf);
+                buffer_manager_end_scan(bpt->bm);
+                return;
+            }
         
-            if (leaf->leaf->keys[i] >= key_low) {
+            if (leaf->leaf.keys[i] >= key_low) {
                 RID rid = {
-                    leaf->leaf->page_ids[i],
-                    leaf->leaf->slot_ids[i]
+                    leaf->leaf.page_ids[i],
+                    leaf->leaf.slot_ids[i]
                 };
                 void *data = buffer_manager_get_data(bpt->bm, rid);
-                callback(leaf->leaf->keys[i], data);
+                if (!data) {
+                    buffer_manager_unpin_page(bpt->bm, leaf);
+                    buffer_manager_end_scan(bpt->bm);
+                    return;
+                }
+                callback(leaf->leaf.keys[i], data);
+                buffer_manager_unpin_page(bpt->bm, data);
+            }
+        }
+        Page *next = buffer_manager_get_page(bpt->bm, leaf->leaf.next_page_id);
+        buffer_manager_unpin_page(bpt->bm, leaf);
+        leaf = next;
+
+        // Past the leaves prefetched from the last parent, the next parent
+        // is found with a new descent
+        if (prefetched) {
+            prefetched--;
+        }
+        else if (leaf && leaf->header.num_keys && leaf->leaf.keys[0] <= key_high) {
+            search(bpt, leaf->leaf.keys[0]);
+            prefetched = prefetch_leaves(bpt, leaf->leaf.keys[0], key_high);
+            unpin_pages(bpt);
+        }
+    }
+    buffer_manager_end_scan(bpt->bm);
+}
+
+// Helper to bpt_range_query_reverse, right after search(bpt, key).
+// Prefetches the leaves before the one found that share its parent and hold
+// keys down to key_low, returns how many.
+uint32_t prefetch_leaves_back(BPTree *bpt, uint32_t key_low, uint32_t key) {
+    if (bpt->num_pinned < 2) return 0;
+    Page *parent = bpt->pinned[bpt->num_pinned - 2];
+    uint32_t num_keys = parent->header.num_keys;
+    uint32_t first = upper_bound(parent->internal.keys, num_keys, key_low);
+    uint32_t last = upper_bound(parent->internal.keys, num_keys, key);
+    if (last <= first) return 0;
+    buffer_manager_prefetch(bpt->bm, &parent->internal.children[first], last - first);
+    return last - first;
+}
+
+void bpt_range_query_reverse(BPTree *bpt, uint32_t key_low, uint32_t key_high,
+    void (*callback)(uint32_t key, void *data)) {
+
+    if (key_high < key_low) {
+        return;
+    }
+
+    buffer_manager_begin_scan(bpt->bm);
+    Page *leaf = search(bpt, key_high);
+    if (!leaf) {
+        buffer_manager_end_scan(bpt->bm);
+        return;
+    }
+    uint32_t prefetched = prefetch_leaves_back(bpt, key_low, key_high);
+    keep_last_pin(bpt);
+
+    while (1) {
+        uint32_t first = lower_bound(leaf->leaf.keys, leaf->header.num_keys, key_low);
+        uint32_t last = upper_bound(leaf->leaf.keys, leaf->header.num_keys, key_high);
+        prefetch_data(bpt, leaf, first, last);
+        uint32_t i;
+        for (i = last; i > first; i--) {
+            RID rid = {
+                leaf->leaf.page_ids[i - 1],
+                leaf->leaf.slot_ids[i - 1]
+            };
+            void *data = buffer_manager_get_data(bpt->bm, rid);
+            if (!data) break;
+            callback(leaf->leaf.keys[i - 1], data);
+            buffer_manager_unpin_page(bpt->bm, data);
+        }
+
+        // Keys down to key_low can only be before a leaf that starts above it
+        Page *prev = NULL;
+        if (i == first && leaf->header.num_keys && leaf->leaf.keys[0] > key_low &&
+            leaf->leaf.prev_page_id) {
+
+            prev = buffer_manager_get_page(bpt->bm, leaf->leaf.prev_page_id);
+        }
+        buffer_manager_unpin_page(bpt->bm, leaf);
+        leaf = prev;
+        if (!leaf) break;
+
+        // Past the leaves prefetched from the last parent, the parent before
+        // it is found with a new descent
+        uint32_t high = leaf->leaf.keys[leaf->header.num_keys - 1];
+        if (prefetched) {
+            prefetched--;
+        }
+        else if (high >= key_low) {
+            search(bpt, high);
+            prefetched = prefetch_leaves_back(bpt, key_low, high);
+            unpin_pages(bpt);
+        }
+    }
+    buffer_manager_end_scan(bpt->bm);
+}
+
+#define CURSOR_VALUES_DEFAULT_SIZE 16
+
+struct BptCursor {
+    BPTree *bpt;
+    // Pinned while the cursor is on one of its entries, NULL otherwise
+    Page *leaf;
+    uint32_t idx;
+    // Data of the entry once asked for, and the data handed out by
+    // bpt_cursor_next_n, pinned until the cursor moves
+    void *value;
+    void **values;
+    uint32_t num_values;
+    uint32_t values_size;
+};
+
+BptCursor *bpt_cursor_open(BPTree *bpt) {
+    BptCursor *cursor = malloc(sizeof(BptCursor));
+    cursor->bpt = bpt;
+    cursor->leaf = NULL;
+    cursor->idx = 0;
+    cursor->value = NULL;
+    cursor->values_size = CURSOR_VALUES_DEFAULT_SIZE;
+    cursor->values = malloc(sizeof(void*) * cursor->values_size);
+    cursor->num_values = 0;
+    return cursor;
+}
+
+// Unpins the data handed out since the cursor last moved
+void cursor_release_values(BptCursor *cursor) {
+    BufferManager *bm = cursor->bpt->bm;
+    if (cursor->value) buffer_manager_unpin_page(bm, cursor->value);
+    cursor->value = NULL;
+    for (uint32_t i = 0; i < cursor->num_values; i++) {
+        buffer_manager_unpin_page(bm, cursor->values[i]);
+    }
+    cursor->num_values = 0;
+}
+
+// Puts the cursor on entry idx of leaf (pinned, NULL for no entry), the
+// data handed out stays pinned
+void cursor_move(BptCursor *cursor, Page *leaf, uint32_t idx) {
+    if (cursor->leaf) buffer_manager_unpin_page(cursor->bpt->bm, cursor->leaf);
+    cursor->leaf = leaf;
+    cursor->idx = idx;
+}
+
+void cursor_set(BptCursor *cursor, Page *leaf, uint32_t idx) {
+    cursor_release_values(cursor);
+    cursor_move(cursor, leaf, idx);
+}
+
+void bpt_cursor_close(BptCursor *cursor) {
+    cursor_set(cursor, NULL, 0);
+    free(cursor->values);
+    free(cursor);
+}
+
+// Moves on along the next links while the cursor is past the last entry
+// of its leaf
+void cursor_skip_forward(BptCursor *cursor) {
+    while (cursor->leaf && cursor->idx >= cursor->leaf->header.num_keys) {
+        Page *next = buffer_manager_get_page(cursor->bpt->bm, cursor->leaf->leaf.next_page_id);
+        cursor_move(cursor, next, 0);
+    }
+}
+
+// Moves to the last entry of the leaf before, when the cursor is before the
+// first entry of its leaf (idx is then UINT32_MAX)
+void cursor_skip_back(BptCursor *cursor) {
+    while (cursor->leaf && cursor->idx == UINT32_MAX) {
+        uint32_t prev_page_id = cursor->leaf->leaf.prev_page_id;
+        Page *prev = prev_page_id ? buffer_manager_get_page(cursor->bpt->bm, prev_page_id) : NULL;
+        cursor_move(cursor, prev, prev ? prev->header.num_keys - 1 : 0);
+    }
+}
+
+void bpt_cursor_seek(BptCursor *cursor, uint32_t key) {
+    BPTree *bpt = cursor->bpt;
+    cursor_set(cursor, NULL, 0);
+    if (!search(bpt, key)) return;
+    Page *leaf = keep_last_pin(bpt);
+    cursor_set(cursor, leaf, lower_bound(leaf->leaf.keys, leaf->header.num_keys, key));
+    cursor_skip_forward(cursor);
+}
+
+void bpt_cursor_seek_last(BptCursor *cursor, uint32_t key) {
+    BPTree *bpt = cursor->bpt;
+    cursor_set(cursor, NULL, 0);
+    if (!search(bpt, key)) return;
+    Page *leaf = keep_last_pin(bpt);
+    // UINT32_MAX when every key of the leaf is above key
+    cursor_set(cursor, leaf, upper_bound(leaf->leaf.keys, leaf->header.num_keys, key) - 1);
+    cursor_skip_back(cursor);
+}
+
+int bpt_cursor_valid(BptCursor *cursor) {
+    return cursor->leaf != NULL;
+}
+
+void bpt_cursor_next(BptCursor *cursor) {
+    if (!cursor->leaf) return;
+    cursor_release_values(cursor);
+    cursor->idx++;
+    cursor_skip_forward(cursor);
+}
+
+void bpt_cursor_prev(BptCursor *cursor) {
+    if (!cursor->leaf) return;
+    cursor_release_values(cursor);
+    cursor->idx--;
+    cursor_skip_back(cursor);
+}
+
+uint32_t bpt_cursor_key(BptCursor *cursor) {
+    return cursor->leaf->leaf.keys[cursor->idx];
+}
+
+void *bpt_cursor_value(BptCursor *cursor) {
+    if (!cursor->value) {
+        LeafPage *leaf = &cursor->leaf->leaf;
+        RID rid = { leaf->page_ids[cursor->idx], leaf->slot_ids[cursor->idx] };
+        cursor->value = buffer_manager_get_data(cursor->bpt->bm, rid);
+    }
+    return cursor->value;
+}
+
+// Share of the pool's frames the data handed out by bpt_cursor_next_n may
+// pin, as 1 / CURSOR_PINNED_SHARE
+#define CURSOR_PINNED_SHARE 8
+
+uint32_t bpt_cursor_next_n(BptCursor *cursor, uint32_t n, uint32_t *keys, void **values) {
+    BufferManager *bm = cursor->bpt->bm;
+    cursor_release_values(cursor);
+    uint32_t max_pages = buffer_manager_get_pool_size(bm) / PAGE_SIZE / CURSOR_PINNED_SHARE;
+    if (max_pages == 0) max_pages = 1;
+    uint32_t pages = 0;
+    uint32_t last_page_id = 0;
+    uint32_t count = 0;
+    while (cursor->leaf && count < n && pages <= max_pages) {
+        Page *leaf = cursor->leaf;
+        uint32_t first = cursor->idx;
+        uint32_t last = leaf->header.num_keys;
+        if (last - first > n - count) last = first + n - count;
+        // Stops before the entry whose data page would be one too many
+        for (uint32_t i = first; values && i < last; i++) {
+            uint32_t page_id = leaf->leaf.page_ids[i];
+            if (page_id != last_page_id && ++pages > max_pages) {
+                last = i;
+                break;
+            }
+            last_page_id = page_id;
+        }
+        memcpy(&keys[count], &leaf->leaf.keys[first], (last - first) * sizeof(uint32_t));
+
+        if (values) {
+            if (cursor->num_values + last - first > cursor->values_size) {
+                while (cursor->num_values + last - first > cursor->values_size) {
+                    cursor->values_size *= 2;
+                }
+                cursor->values = realloc(cursor->values, sizeof(void*) * cursor->values_size);
+            }
+            prefetch_data(cursor->bpt, leaf, first, last);
+            for (uint32_t i = first; i < last; i++) {
+                RID rid = { leaf->leaf.page_ids[i], leaf->leaf.slot_ids[i] };
+                void *value = buffer_manager_get_data(bm, rid);
+                if (!value) {
+                    // Stays on the entry
+                    cursor->idx = i;
+                    return count + i - first;
+                }
+                values[count + i - first] = value;
+                cursor->values[cursor->num_values++] = value;
             }
         }
-        leaf = buffer_manager_get_page(bpt->bm, leaf->leaf->next_page_id);
+        count += last - first;
+        cursor->idx = last;
+        cursor_skip_forward(cursor);
+    }
+    return count;
+}
+
+// Levels of a tree built by bpt_bulk_load, far more than MIN_CHILDREN ever
+// needs for 2^32 keys
+#define MAX_BULK_LEVELS 16
+
+// One level of a tree built by bpt_bulk_load, leaves are level 0. node is
+// being filled, pending is the full node before it. pending is added to
+// the parent level once the next node fills up, or once the load ends and
+// the last node is made full enough with entries of pending.
+typedef struct BulkLevel {
+    Page *node;
+    uint32_t node_low;
+    Page *pending;
+    uint32_t pending_low;
+} BulkLevel;
+
+typedef struct BulkLoad {
+    BPTree *bpt;
+    BulkLevel levels[MAX_BULK_LEVELS];
+    uint32_t num_levels;
+    // Entries a leaf and children an internal node are filled with
+    uint32_t leaf_target;
+    uint32_t internal_target;
+    uint8_t fill_percent;
+    // Data page the last record went to
+    uint32_t data_page_id;
+} BulkLoad;
+
+// Keys of a leaf, children of an internal node (an empty one has none)
+uint32_t bulk_count(Page *node) {
+    if (node->header.is_leaf) return node->header.num_keys;
+    return node->internal.children[0] ? node->header.num_keys + 1 : 0;
+}
+
+int bulk_add_child(BulkLoad *bl, uint32_t level, uint32_t low, uint32_t page_id);
+
+// Starts a new node on level, the filled one becomes pending. -1 if the
+// pool had no frame left for a node, the levels are unchanged.
+int bulk_next_node(BulkLoad *bl, uint32_t level) {
+    BufferManager *bm = bl->bpt->bm;
+    BulkLevel *l = &bl->levels[level];
+    Page *node = buffer_manager_new_bpt_page(bm, level == 0);
+    if (!node) return -1;
+    if (l->pending) {
+        if (bulk_add_child(bl, level + 1, l->pending_low, l->pending->header.page_id) < 0) {
+            uint32_t page_id = node->header.page_id;
+            buffer_manager_unpin_page(bm, node);
+            buffer_manager_free_page(bm, page_id);
+            return -1;
+        }
+        buffer_manager_unpin_page(bm, l->pending);
+    }
+    l->pending = l->node;
+    l->pending_low = l->node_low;
+    l->node = node;
+    if (level == 0) {
+        buffer_manager_mark_dirty(bm, l->pending);
+        l->pending->leaf.next_page_id = l->node->header.page_id;
+        l->node->leaf.prev_page_id = l->pending->header.page_id;
+    }
+    return 0;
+}
+
+// Adds child, the lowest key under it is low, after the last child of level.
+// -1 as bulk_next_node.
+int bulk_add_child(BulkLoad *bl, uint32_t level, uint32_t low, uint32_t page_id) {
+    BulkLevel *l = &bl->levels[level];
+    if (level == bl->num_levels) {
+        assert(level < MAX_BULK_LEVELS);
+        l->node = buffer_manager_new_bpt_page(bl->bpt->bm, INTERNAL);
+        if (!l->node) return -1;
+        l->pending = NULL;
+        bl->num_levels++;
+    }
+    if (bulk_count(l->node) == bl->internal_target && bulk_next_node(bl, level) < 0) return -1;
+
+    Page *node = l->node;
+    buffer_manager_mark_dirty(bl->bpt->bm, node);
+    if (!node->internal.children[0]) {
+        node->internal.children[0] = page_id;
+        l->node_low = low;
+        return 0;
+    }
+    node->internal.keys[node->header.num_keys] = low;
+    node->internal.children[node->header.num_keys + 1] = page_id;
+    node->header.num_keys++;
+    return 0;
+}
+
+// Appends a record to the last leaf, -1 if key is below the last key or the
+// pool had no frame left for a page. An equal key replaces the record, as
+// in bpt_insert.
+int bulk_add_record(BulkLoad *bl, uint32_t key, void *data, size_t size) {
+    BufferManager *bm = bl->bpt->bm;
+    BulkLevel *l = &bl->levels[0];
+    Page *leaf = l->node;
+    uint32_t n = leaf->header.num_keys;
+    if (n && key < leaf->leaf.keys[n - 1]) return -1;
+    // Freed after the new record is stored, it could be the only record of
+    // the data page appended to
+    RID old = { 0, 0 };
+    if (n && key == leaf->leaf.keys[n - 1]) {
+        old.page_id = leaf->leaf.page_ids[n - 1];
+        old.slot_id = leaf->leaf.slot_ids[n - 1];
+        n--;
+    }
+    else if (n == bl->leaf_target) {
+        // Each leaf, with its records, is one commit
+        buffer_manager_end_update(bm);
+        buffer_manager_begin_update(bm);
+        if (bulk_next_node(bl, 0) < 0) return -1;
+        leaf = l->node;
+        n = 0;
+    }
+
+    RID rid = buffer_manager_append_data(bm, bl->data_page_id, size, data, bl->fill_percent);
+    if (!rid.page_id) return -1;
+    bl->data_page_id = rid.page_id;
+    if (n == 0) l->node_low = key;
+    leaf->leaf.keys[n] = key;
+    leaf->leaf.page_ids[n] = rid.page_id;
+    leaf->leaf.slot_ids[n] = rid.slot_id;
+    leaf->header.num_keys = n + 1;
+    if (old.page_id) buffer_manager_free_data(bm, old);
+    return 0;
+}
+
+// Helper to bulk_finish, when the last node of level is below the minimum
+// it is merged into pending if they fit in one node, and otherwise takes
+// entries from the end of pending until it reaches the minimum
+void bulk_balance(BulkLoad *bl, uint32_t level) {
+    BufferManager *bm = bl->bpt->bm;
+    BulkLevel *l = &bl->levels[level];
+    Page *left = l->pending;
+    Page *right = l->node;
+    uint32_t n_left = bulk_count(left);
+    uint32_t n_right = bulk_count(right);
+    uint32_t min = level ? MIN_CHILDREN : MIN_ENTRIES_LEAF;
+    uint32_t max = level ? MAX_CHILDREN : MAX_ENTRIES_LEAF;
+    if (n_right >= min) return;
+    buffer_manager_mark_dirty(bm, left);
+    buffer_manager_mark_dirty(bm, right);
+
+    if (level == 0) {
+        LeafPage *a = &left->leaf;
+        LeafPage *b = &right->leaf;
+        if (n_left + n_right <= max) {
+            memcpy(&a->keys[n_left], b->keys, n_right * sizeof(uint32_t));
+            memcpy(&a->page_ids[n_left], b->page_ids, n_right * sizeof(uint32_t));
+            memcpy(&a->slot_ids[n_left], b->slot_ids, n_right * sizeof(uint16_t));
+            left->header.num_keys = n_left + n_right;
+            a->next_page_id = b->next_page_id;
+        }
+        else {
+            uint32_t moved = min - n_right;
+            memmove(&b->keys[moved], b->keys, n_right * sizeof(uint32_t));
+            memmove(&b->page_ids[moved], b->page_ids, n_right * sizeof(uint32_t));
+            memmove(&b->slot_ids[moved], b->slot_ids, n_right * sizeof(uint16_t));
+            memcpy(b->keys, &a->keys[n_left - moved], moved * sizeof(uint32_t));
+            memcpy(b->page_ids, &a->page_ids[n_left - moved], moved * sizeof(uint32_t));
+            memcpy(b->slot_ids, &a->slot_ids[n_left - moved], moved * sizeof(uint16_t));
+            left->header.num_keys = n_left - moved;
+            right->header.num_keys = min;
+            l->node_low = b->keys[0];
+            return;
+        }
     }
+    else {
+        // Child i > 0 of a node has the lowest key keys[i - 1], the first
+        // child of right has node_low
+        InternalPage *a = &left->internal;
+        InternalPage *b = &right->internal;
+        if (n_left + n_right <= max) {
+            a->keys[n_left - 1] = l->node_low;
+            memcpy(&a->keys[n_left], b->keys, (n_right - 1) * sizeof(uint32_t));
+            memcpy(&a->children[n_left], b->children, n_right * sizeof(uint32_t));
+            left->header.num_keys = n_left + n_right - 1;
+        }
+        else {
+            uint32_t moved = min - n_right;
+            memmove(&b->keys[moved], b->keys, (n_right - 1) * sizeof(uint32_t));
+            memmove(&b->children[moved], b->children, n_right * sizeof(uint32_t));
+            b->keys[moved - 1] = l->node_low;
+            memcpy(b->keys, &a->keys[n_left - moved], (moved - 1) * sizeof(uint32_t));
+            memcpy(b->children, &a->children[n_left - moved], moved * sizeof(uint32_t));
+            l->node_low = a->keys[n_left - moved - 1];
+            left->header.num_keys = n_left - moved - 1;
+            right->header.num_keys = min - 1;
+            return;
+        }
+    }
+
+    // Merged into left
+    buffer_manager_free_page(bm, right->header.page_id);
+    l->node = left;
+    l->node_low = l->pending_low;
+    l->pending = NULL;
 }
 
-// Helper to bpt_delete
+// Adds the last nodes of each level to the level above, returns the root,
+// 0 if the pool had no frame left for a node
+uint32_t bulk_finish(BulkLoad *bl) {
+    BufferManager *bm = bl->bpt->bm;
+    for (uint32_t level = 0;; level++) {
+        BulkLevel *l = &bl->levels[level];
+        if (l->pending) bulk_balance(bl, level);
+        if (!l->pending && level + 1 == bl->num_levels) {
+            uint32_t root = l->node->header.page_id;
+            buffer_manager_unpin_page(bm, l->node);
+            return root;
+        }
+        if (l->pending) {
+            if (bulk_add_child(bl, level + 1, l->pending_low, l->pending->header.page_id) < 0) {
+                return 0;
+            }
+            buffer_manager_unpin_page(bm, l->pending);
+            l->pending = NULL;
+        }
+        if (bulk_add_child(bl, level + 1, l->node_low, l->node->header.page_id) < 0) return 0;
+        buffer_manager_unpin_page(bm, l->node);
+        l->node = NULL;
+    }
+}
+
+// Frees every page of the subtree and the records of its leaves, a page
+// the pool has no frame left for stays allocated
+void free_subtree(BPTree *bpt, uint32_t page_id) {
+    Page *page = buffer_manager_get_page(bpt->bm, page_id);
+    if (!page) return;
+    for (uint32_t i = 0; i < page->header.num_keys; i++) {
+        if (!page->header.is_leaf) continue;
+        RID rid = { page->leaf.page_ids[i], page->leaf.slot_ids[i] };
+        buffer_manager_free_data(bpt->bm, rid);
+    }
+    for (uint32_t i = 0; !page->header.is_leaf && i <= page->header.num_keys; i++) {
+        free_subtree(bpt, page->internal.children[i]);
+    }
+    buffer_manager_free_page(bpt->bm, page_id);
+}
+
+// Frees the nodes of a failed bpt_bulk_load. Every page built is under the
+// node or pending node of a level, those are not yet children of any node.
+void bulk_abort(BulkLoad *bl) {
+    BufferManager *bm = bl->bpt->bm;
+    for (uint32_t level = 0; level < bl->num_levels; level++) {
+        BulkLevel *l = &bl->levels[level];
+        Page *nodes[] = { l->pending, l->node };
+        for (uint32_t i = 0; i < 2; i++) {
+            if (!nodes[i]) continue;
+            uint32_t page_id = nodes[i]->header.page_id;
+            buffer_manager_unpin_page(bm, nodes[i]);
+            free_subtree(bl->bpt, page_id);
+        }
+    }
+}
+
+int bpt_bulk_load(BPTree *bpt, uint8_t fill_percent, BptRecordSource next, void *context) {
+    if (!bpt_empty(bpt)) return -1;
+    BufferManager *bm = bpt->bm;
+    if (!fill_percent || fill_percent > 100) fill_percent = 100;
+    BulkLoad bl;
+    bl.bpt = bpt;
+    bl.num_levels = 1;
+    bl.leaf_target = MAX_ENTRIES_LEAF * fill_percent / 100;
+    if (bl.leaf_target < MIN_ENTRIES_LEAF) bl.leaf_target = MIN_ENTRIES_LEAF;
+    bl.internal_target = MAX_CHILDREN * fill_percent / 100;
+    if (bl.internal_target < MIN_CHILDREN) bl.internal_target = MIN_CHILDREN;
+    bl.fill_percent = fill_percent;
+    bl.data_page_id = 0;
+
+    buffer_manager_begin_update(bm);
+    bl.levels[0].node = buffer_manager_new_bpt_page(bm, LEAF);
+    bl.levels[0].pending = NULL;
+    if (!bl.levels[0].node) {
+        buffer_manager_end_update(bm);
+        return -1;
+    }
+    int result = 0;
+    uint32_t key;
+    void *data;
+    size_t size;
+    while (result == 0 && next(context, &key, &data, &size)) {
+        result = bulk_add_record(&bl, key, data, size);
+    }
+
+    // The new tree is only reachable once it replaces the empty root
+    uint32_t root = result < 0 ? 0 : bulk_finish(&bl);
+    if (!root) {
+        bulk_abort(&bl);
+        result = -1;
+    }
+    else {
+        uint32_t old_root = bpt->root_page_id;
+        set_root(bpt, root);
+        buffer_manager_free_page(bm, old_root);
+    }
+    buffer_manager_end_update(bm);
+    return result;
+}
+
+// Helper to bpt_delete. old_separator, the first key of a subtree, is the
+// separator in the lowest ancestor the subtree is not the leftmost child
+// of, none for the leftmost subtree of the tree.
 void bpt_update_separators(BPTree *bpt, uint32_t new_separator, 
         uint32_t old_separator) {
     
-    uint32_t keyidx = 0;
-    while (keyidx == 0 && !stack_is_empty(bpt->parent_stack)) {
-        Page *parent = buffer_manager_get_page(bpt->bm,
+    while (!stack_is_empty(bpt->parent_stack)) {
+        Page *parent = pin_page(bpt,
             stack_top(bpt->parent_stack));
         stack_pop(bpt->parent_stack);
         
-        // If child is leftmost child then finished
-        if (old_separator < parent->internal->keys[0]) {
-            return;
+        // Leftmost child, the separator is further up
+        if (old_separator < parent->internal.keys[0]) {
+            continue;
         }
 
-        uint32_t pidx = lower_bound(parent->internal->keys,
+        uint32_t pidx = lower_bound(parent->internal.keys,
             parent->header.num_keys, old_separator);
-        assert(parent->internal->keys[pidx] == old_separator);
-        parent->internal->keys[pidx] = new_separator;
-        keyidx = pidx;
+        assert(parent->internal.keys[pidx] == old_separator);
+        buffer_manager_mark_dirty(bpt->bm, parent);
+        parent->internal.keys[pidx] = new_separator;
+        return;
     }
 }
 
-// Part of bpt_delete
+// Part of bpt_delete. Removes separator and the child right of it from
+// node, the first key of node's subtree stays the same. A node left below
+// MIN_CHILDREN borrows from or merges with a sibling, the separators in
+// the parent are the first keys of the siblings' subtrees.
 void bpt_remove_internal_separator(BPTree *bpt, uint32_t separator, 
     Page *node) {
     
-    InternalPage *internal = node->internal;
+    InternalPage *internal = &node->internal;
     PageHeader *header = &node->header;
     uint32_t keyidx = lower_bound(internal->keys, header->num_keys, separator);
     if (keyidx == header->num_keys || internal->keys[keyidx] != separator) {
@@ -286,25 +1068,13 @@ void bpt_remove_internal_separator(BPTree *bpt, uint32_t separator,
         return;
     }
 
+    buffer_manager_mark_dirty(bpt->bm, node);
     memmove(&internal->keys[keyidx], &internal->keys[keyidx + 1], 
         (header->num_keys - (keyidx + 1)) * sizeof(uint32_t));
     memmove(&internal->children[keyidx + 1], &internal->children[keyidx + 2],
         (header->num_keys - (keyidx + 1)) * sizeof(uint32_t));
     header->num_keys--;
 
-    // Update separators if separator was removed
-    if (keyidx == 0) {
-        // In a valid B+Tree, a non-root internal node must never become empty.
-        // If this invariant is violated it indicates a bug elsewhere. Fail fast.
-        assert(header->num_keys > 0 || stack_is_empty(bpt->parent_stack));
-        if (!stack_is_empty(bpt->parent_stack)) {
-            Stack *temp = stack_clone(bpt->parent_stack);
-            bpt_update_separators(bpt, internal->keys[0], separator);
-            stack_free(bpt->parent_stack);
-            bpt->parent_stack = temp;
-        }
-    }
-
     // Every interal node has (num_keys + 1) children
     if (header->num_keys + 1 >= MIN_CHILDREN) {
         return;
@@ -313,108 +1083,83 @@ void bpt_remove_internal_separator(BPTree *bpt, uint32_t separator,
     if (stack_is_empty(bpt->parent_stack)) {
         if (header->num_keys == 0) {
             // Decrease height
-            Page *new_root = buffer_manager_get_page(bpt->bm, 
-                internal->children[0]);
+            uint32_t new_root_page_id = internal->children[0];
             buffer_manager_free_page(bpt->bm, node->header.page_id);
-            bpt->root = new_root;
+            set_root(bpt, new_root_page_id);
         }
         return;
     }
 
     // Borrow
-    Page *parent = buffer_manager_get_page(bpt->bm, 
+    Page *parent = pin_page(bpt, 
         stack_top(bpt->parent_stack));
 
-    // Find the child index for this node using upper_bound (same logic as search)
-    uint32_t child_idx = lower_bound(parent->internal->keys,
-        parent->header.num_keys, internal->keys[0]);
+    // The node does not hold its own first key, it is found by page_id
+    uint32_t child_idx = 0;
+    while (parent->internal.children[child_idx] != header->page_id) child_idx++;
     Page *left_sibling = NULL;
-    if (parent->internal->keys[child_idx] == internal->keys[0]) {
-        uint32_t left_sibling_page_id = parent->internal->children[child_idx];
-        left_sibling = buffer_manager_get_page(bpt->bm, left_sibling_page_id);
+    if (child_idx > 0) {
+        left_sibling = pin_page(bpt, parent->internal.children[child_idx - 1]);
     }
 
     if (left_sibling && left_sibling->header.num_keys + 1 > MIN_CHILDREN) {
         // printf("Borrowing from left sibling internal\n");
-        uint32_t borrow_idx_child = left_sibling->header.num_keys - 1;
-        uint32_t borrowed_child_page_id = 
-            left_sibling->internal->children[borrow_idx_child + 1];
-        left_sibling->header.num_keys--;
-        
-        // New separator-key is leftmost key of leftmost child of "node" which was
-        // "ignored before when being leftmost"
-        Page *left_most_child = buffer_manager_get_page(bpt->bm, internal->children[0]);
-        uint32_t new_key;
-        if (left_most_child->header.is_leaf)
-            new_key = left_most_child->leaf->keys[0];
-        else 
-            new_key = left_most_child->internal->keys[0];
-
+        // The last child of the left sibling becomes the first of node
+        InternalPage *left_internal = &left_sibling->internal;
+        uint32_t left_keys = left_sibling->header.num_keys;
+        buffer_manager_mark_dirty(bpt->bm, left_sibling);
+        buffer_manager_mark_dirty(bpt->bm, parent);
         memmove(&internal->keys[1], &internal->keys[0],
             header->num_keys * sizeof(uint32_t));
         memmove(&internal->children[1], &internal->children[0],
             (header->num_keys + 1) * sizeof(uint32_t));
-        internal->keys[0] = new_key;
-        internal->children[0] = borrowed_child_page_id;
+        internal->keys[0] = parent->internal.keys[child_idx - 1];
+        internal->children[0] = left_internal->children[left_keys];
         header->num_keys++;
-        bpt_update_separators(bpt, internal->keys[0], internal->keys[1]);
+        parent->internal.keys[child_idx - 1] = left_internal->keys[left_keys - 1];
+        left_sibling->header.num_keys--;
         return;
     }
 
-    uint32_t right_sibling_idx;
     Page *right_sibling = NULL;
-    // child_idx is the index of the current node in parent's children
-    right_sibling_idx = child_idx + 1;
-
-    if (right_sibling_idx < parent->header.num_keys + 1) {
-        uint32_t right_sibling_page_id = parent->internal->children[right_sibling_idx];
-        right_sibling = buffer_manager_get_page(bpt->bm, right_sibling_page_id);
+    if (child_idx < parent->header.num_keys) {
+        right_sibling = pin_page(bpt, parent->internal.children[child_idx + 1]);
     }
 
     if (right_sibling && right_sibling->header.num_keys + 1 > MIN_CHILDREN) {
         // printf("Borrowing from right sibling internal\n");
-        uint32_t borrow_idx_child = 0;
-        uint32_t borrowed_child_page_id = 
-            right_sibling->internal->children[borrow_idx_child];
-        
-        InternalPage *right_internal = right_sibling->internal;
-        uint32_t old_separator = right_internal->keys[0];
+        // The first child of the right sibling becomes the last of node
+        InternalPage *right_internal = &right_sibling->internal;
+        buffer_manager_mark_dirty(bpt->bm, right_sibling);
+        buffer_manager_mark_dirty(bpt->bm, parent);
+        internal->keys[header->num_keys] = parent->internal.keys[child_idx];
+        internal->children[header->num_keys + 1] = right_internal->children[0];
+        header->num_keys++;
+        parent->internal.keys[child_idx] = right_internal->keys[0];
         memmove(&right_internal->keys[0], &right_internal->keys[1],
             (right_sibling->header.num_keys - 1) * sizeof(uint32_t));
         memmove(&right_internal->children[0], &right_internal->children[1],
             right_sibling->header.num_keys * sizeof(uint32_t));
         right_sibling->header.num_keys--;
-        bpt_update_separators(bpt, right_internal->keys[0], old_separator);
-
-        // New key is leftmost key of borrowed child
-        Page *borrowed_child = 
-            buffer_manager_get_page(bpt->bm, borrowed_child_page_id);
-        uint32_t new_key;
-        if (borrowed_child->header.is_leaf)
-            new_key = borrowed_child->leaf->keys[0];
-        else
-            new_key = borrowed_child->internal->keys[0];
-        
-        internal->keys[header->num_keys] = new_key;
-        internal->children[header->num_keys + 1] = borrowed_child_page_id;
-        header->num_keys++;
         return;
     }
 
-    // Merge
+    // Merge, the separator between the two comes down from the parent
     if (left_sibling) {
         // printf("Merging with left sibling internal\n");
-        uint32_t removed_separator = internal->keys[0];
-        InternalPage *left_internal = left_sibling->internal;
-        memcpy(&left_internal->keys[left_sibling->header.num_keys],
-            &internal->keys[0], node->header.num_keys * sizeof(uint32_t));
-        memcpy(&left_internal->children[left_sibling->header.num_keys + 1],
-            &internal->children[0], (node->header.num_keys + 1) * sizeof(uint32_t));
-        left_sibling->header.num_keys += node->header.num_keys;
-        buffer_manager_free_page(bpt->bm, node->header.page_id);
+        uint32_t removed_separator = parent->internal.keys[child_idx - 1];
+        InternalPage *left_internal = &left_sibling->internal;
+        uint32_t left_keys = left_sibling->header.num_keys;
+        buffer_manager_mark_dirty(bpt->bm, left_sibling);
+        left_internal->keys[left_keys] = removed_separator;
+        memcpy(&left_internal->keys[left_keys + 1],
+            &internal->keys[0], header->num_keys * sizeof(uint32_t));
+        memcpy(&left_internal->children[left_keys + 1],
+            &internal->children[0], (header->num_keys + 1) * sizeof(uint32_t));
+        left_sibling->header.num_keys += header->num_keys + 1;
+        buffer_manager_free_page(bpt->bm, header->page_id);
 
         // Recursively remove separator from parent
-        Page *parent = buffer_manager_get_page(bpt->bm, stack_top(bpt->parent_stack));
         stack_pop(bpt->parent_stack);
         bpt_remove_internal_separator(bpt, removed_separator, parent);
         return;
@@ -422,17 +1167,17 @@ void bpt_remove_internal_separator(BPTree *bpt, uint32_t separator,
 
     if (right_sibling) {
         // printf("Merging with right sibling internal\n");
-        uint32_t removed_separator = right_sibling->internal->keys[0];
-        InternalPage *right_internal = right_sibling->internal;
-        memcpy(&internal->keys[node->header.num_keys], &right_internal->keys[0],
+        uint32_t removed_separator = parent->internal.keys[child_idx];
+        InternalPage *right_internal = &right_sibling->internal;
+        internal->keys[header->num_keys] = removed_separator;
+        memcpy(&internal->keys[header->num_keys + 1], &right_internal->keys[0],
             right_sibling->header.num_keys * sizeof(uint32_t));
-        memcpy(&internal->children[node->header.num_keys + 1], &right_internal->children[0],
+        memcpy(&internal->children[header->num_keys + 1], &right_internal->children[0],
             (right_sibling->header.num_keys + 1) * sizeof(uint32_t));
-        node->header.num_keys += right_sibling->header.num_keys;
+        header->num_keys += right_sibling->header.num_keys + 1;
         buffer_manager_free_page(bpt->bm, right_sibling->header.page_id);
 
         // Recursively remove separator from parent
-        Page *parent = buffer_manager_get_page(bpt->bm, stack_top(bpt->parent_stack));
         stack_pop(bpt->parent_stack);
         bpt_remove_internal_separator(bpt, removed_separator, parent);
         return;
@@ -442,14 +1187,22 @@ void bpt_remove_internal_separator(BPTree *bpt, uint32_t separator,
     printf("DEBUG: Should never reach");
 }
 
-void bpt_delete(BPTree *bpt, uint32_t key) {
+// -1 if no frame could be taken, the tree is unchanged
+int delete_key(BPTree *bpt, uint32_t key) {
     Page *page = search(bpt, key);
-    if (!page) return;
-    LeafPage *leaf = page->leaf;
+    if (!page) return -1;
+    LeafPage *leaf = &page->leaf;
     uint32_t keyidx = lower_bound(leaf->keys, page->header.num_keys, key);
     if (keyidx == page->header.num_keys || leaf->keys[keyidx] != key) {
         // Value does not exist, skip
-        return;
+        return 0;
+    }
+    // Refilling or merging a leaf left below half full pins at most both
+    // siblings and a child or the leaf after them on every level
+    if (page->header.num_keys <= MIN_ENTRIES_LEAF && !stack_is_empty(bpt->parent_stack) &&
+        !frames_available(bpt, 4 * stack_size(bpt->parent_stack) + 2)) {
+
+        return -1;
     }
 
     RID rid = {
@@ -457,6 +1210,7 @@ void bpt_delete(BPTree *bpt, uint32_t key) {
         leaf->slot_ids[keyidx]
     };
     buffer_manager_free_data(bpt->bm, rid);
+    buffer_manager_mark_dirty(bpt->bm, page);
     memmove(&leaf->keys[keyidx], &leaf->keys[keyidx + 1],
         (page->header.num_keys - (keyidx + 1)) * sizeof(uint32_t));
     memmove(&leaf->page_ids[keyidx], &leaf->page_ids[keyidx + 1],
@@ -481,29 +1235,30 @@ void bpt_delete(BPTree *bpt, uint32_t key) {
     // If leaf is root the boundary does not have to hold
     if (page->header.num_keys >= MIN_ENTRIES_LEAF || 
             stack_is_empty(bpt->parent_stack)) {
-        return;
+        return 0;
     }
 
     // Otherwise try borrow (first with left sibling)
-    Page *parent = buffer_manager_get_page(bpt->bm, 
+    Page *parent = pin_page(bpt, 
         stack_top(bpt->parent_stack));
     
     // Determine the child index of this leaf, then pick the immediate left sibling
-    uint32_t child_idx = lower_bound(parent->internal->keys,
+    uint32_t child_idx = lower_bound(parent->internal.keys,
         parent->header.num_keys, leaf->keys[0]);
     Page *left_sibling = NULL;
-    if (parent->internal->keys[child_idx] == leaf->keys[0]) {
-        uint32_t left_sibling_page_id = parent->internal->children[child_idx];
-        left_sibling = buffer_manager_get_page(bpt->bm, left_sibling_page_id);
-        assert(left_sibling->leaf->next_page_id == page->header.page_id);
+    if (parent->internal.keys[child_idx] == leaf->keys[0]) {
+        uint32_t left_sibling_page_id = parent->internal.children[child_idx];
+        left_sibling = pin_page(bpt, left_sibling_page_id);
+        assert(left_sibling->leaf.next_page_id == page->header.page_id);
     }
     
     if (left_sibling && left_sibling->header.num_keys > MIN_ENTRIES_LEAF) {
         // printf("Borrowing from left sibling\n");
         uint32_t borrow_idx = left_sibling->header.num_keys - 1;
-        uint32_t borrowed_key = left_sibling->leaf->keys[borrow_idx];
-        uint32_t borrowed_page_id = left_sibling->leaf->page_ids[borrow_idx];
-        uint32_t borrowed_slot_id = left_sibling->leaf->slot_ids[borrow_idx];
+        uint32_t borrowed_key = left_sibling->leaf.keys[borrow_idx];
+        uint32_t borrowed_page_id = left_sibling->leaf.page_ids[borrow_idx];
+        uint32_t borrowed_slot_id = left_sibling->leaf.slot_ids[borrow_idx];
+        buffer_manager_mark_dirty(bpt->bm, left_sibling);
         left_sibling->header.num_keys--;
 
         memmove(&leaf->keys[1], &leaf->keys[0],
@@ -518,25 +1273,26 @@ void bpt_delete(BPTree *bpt, uint32_t key) {
         page->header.num_keys++;
 
         bpt_update_separators(bpt, leaf->keys[0], leaf->keys[1]);
-        return;
+        return 0;
     }
 
     // Otherwise the right sibling
     Page *right_sibling = NULL;
     // Make sure next leaf has the same parent (has to be a sibling i think)
-    if (parent->internal->keys[parent->header.num_keys - 1] != leaf->keys[0]) {
-        right_sibling = buffer_manager_get_page(bpt->bm, leaf->next_page_id);
+    if (parent->internal.keys[parent->header.num_keys - 1] != leaf->keys[0]) {
+        right_sibling = pin_page(bpt, leaf->next_page_id);
         if (right_sibling && right_sibling->header.num_keys > MIN_ENTRIES_LEAF) {
             // printf("Borrowing from right sibling\n");
             uint32_t borrow_idx = 0;
-            uint32_t borrowed_key = right_sibling->leaf->keys[borrow_idx];
-            uint32_t borrowed_page_id = right_sibling->leaf->page_ids[borrow_idx];
-            uint32_t borrowed_slot_id = right_sibling->leaf->slot_ids[borrow_idx];
-            memmove(&right_sibling->leaf->keys[0], &right_sibling->leaf->keys[1],
+            uint32_t borrowed_key = right_sibling->leaf.keys[borrow_idx];
+            uint32_t borrowed_page_id = right_sibling->leaf.page_ids[borrow_idx];
+            uint32_t borrowed_slot_id = right_sibling->leaf.slot_ids[borrow_idx];
+            buffer_manager_mark_dirty(bpt->bm, right_sibling);
+            memmove(&right_sibling->leaf.keys[0], &right_sibling->leaf.keys[1],
                 (right_sibling->header.num_keys - 1) * sizeof(uint32_t));
-            memmove(&right_sibling->leaf->page_ids[0], &right_sibling->leaf->page_ids[1],
+            memmove(&right_sibling->leaf.page_ids[0], &right_sibling->leaf.page_ids[1],
                 (right_sibling->header.num_keys - 1) * sizeof(uint32_t));
-            memmove(&right_sibling->leaf->slot_ids[0], &right_sibling->leaf->slot_ids[1],
+            memmove(&right_sibling->leaf.slot_ids[0], &right_sibling->leaf.slot_ids[1],
                 (right_sibling->header.num_keys - 1) * sizeof(uint16_t));
             right_sibling->header.num_keys--;
 
@@ -545,8 +1301,8 @@ void bpt_delete(BPTree *bpt, uint32_t key) {
             leaf->slot_ids[page->header.num_keys] = borrowed_slot_id;
             page->header.num_keys++;
 
-            bpt_update_separators(bpt, right_sibling->leaf->keys[0], borrowed_key);
-            return;
+            bpt_update_separators(bpt, right_sibling->leaf.keys[0], borrowed_key);
+            return 0;
         }
     }
 
@@ -554,7 +1310,8 @@ void bpt_delete(BPTree *bpt, uint32_t key) {
     if (left_sibling) {
         // printf("Merging with left sibling\n");
         uint32_t removed_separator = leaf->keys[0];
-        LeafPage *left_leaf = left_sibling->leaf;
+        LeafPage *left_leaf = &left_sibling->leaf;
+        buffer_manager_mark_dirty(bpt->bm, left_sibling);
         memcpy(&left_leaf->keys[left_sibling->header.num_keys],
             &leaf->keys[0], page->header.num_keys * sizeof(uint32_t));
         memcpy(&left_leaf->page_ids[left_sibling->header.num_keys],
@@ -563,20 +1320,21 @@ void bpt_delete(BPTree *bpt, uint32_t key) {
             &leaf->slot_ids[0], page->header.num_keys * sizeof(uint16_t));
         left_sibling->header.num_keys += page->header.num_keys;
         left_leaf->next_page_id = leaf->next_page_id;
+        link_prev_leaf(bpt, leaf->next_page_id, left_sibling->header.page_id);
         buffer_manager_free_page(bpt->bm, page->header.page_id);
 
         // Remove separator from parent
-        Page *parent = buffer_manager_get_page(bpt->bm, stack_top(bpt->parent_stack));
+        Page *parent = pin_page(bpt, stack_top(bpt->parent_stack));
         stack_pop(bpt->parent_stack);
         bpt_remove_internal_separator(bpt, removed_separator, parent);
-        return;
+        return 0;
     }
     
     // Else right sibling
     if (right_sibling) {
         // printf("Merging with right sibling\n");
-        uint32_t removed_separator = right_sibling->leaf->keys[0];
-        LeafPage *right_leaf = right_sibling->leaf;
+        uint32_t removed_separator = right_sibling->leaf.keys[0];
+        LeafPage *right_leaf = &right_sibling->leaf;
         memcpy(&leaf->keys[page->header.num_keys], &right_leaf->keys[0], 
             right_sibling->header.num_keys * sizeof(uint32_t));
         memcpy(&leaf->page_ids[page->header.num_keys], &right_leaf->page_ids[0], 
@@ -585,13 +1343,14 @@ void bpt_delete(BPTree *bpt, uint32_t key) {
             right_sibling->header.num_keys * sizeof(uint16_t));
         page->header.num_keys += right_sibling->header.num_keys;
         leaf->next_page_id = right_leaf->next_page_id;
+        link_prev_leaf(bpt, leaf->next_page_id, page->header.page_id);
         buffer_manager_free_page(bpt->bm, right_sibling->header.page_id);
 
         // Remove separator from parent
-        Page *parent = buffer_manager_get_page(bpt->bm, stack_top(bpt->parent_stack));
+        Page *parent = pin_page(bpt, stack_top(bpt->parent_stack));
         stack_pop(bpt->parent_stack);
         bpt_remove_internal_separator(bpt, removed_separator, parent);
-        return;
+        return 0;
     }
     
     // Unreachable as the leaf has to have atleast one sibling 
@@ -599,11 +1358,291 @@ void bpt_delete(BPTree *bpt, uint32_t key) {
     // from the root has to have atleast MIN_CHILDREN children and
     // if the root ever has only one child, that child becomes the new root)
     printf("DEBUG: Should never reach");
-    return;
+    return 0;
+}
+
+int bpt_delete(BPTree *bpt, uint32_t key) {
+    buffer_manager_begin_update(bpt->bm);
+    int result = delete_key(bpt, key);
+    unpin_pages(bpt);
+    if (buffer_manager_end_update(bpt->bm) < 0) result = -1;
+    return result;
+}
+
+#define BATCH_DEFAULT_SIZE 64
+
+// Most operations applied with one descent, the rest of a leaf's go to the
+// leaves it was split into with the next descent
+#define MAX_BATCH_GROUP (MAX_ENTRIES_LEAF * 8)
+
+typedef struct BatchOp {
+    uint32_t key;
+    // Order the operations were added in, the last on a key is applied
+    uint32_t seq;
+    uint8_t is_delete;
+    uint32_t size;
+    // Of the record in the batch's data
+    size_t offset;
+} BatchOp;
+
+struct BptWriteBatch {
+    BatchOp *ops;
+    uint32_t count;
+    uint32_t ops_size;
+    uint8_t *data;
+    size_t used;
+    size_t data_size;
+};
+
+BptWriteBatch *bpt_batch_init() {
+    BptWriteBatch *batch = malloc(sizeof(BptWriteBatch));
+    batch->ops_size = BATCH_DEFAULT_SIZE;
+    batch->ops = malloc(sizeof(BatchOp) * batch->ops_size);
+    batch->count = 0;
+    batch->data_size = BATCH_DEFAULT_SIZE * sizeof(uint32_t);
+    batch->data = malloc(batch->data_size);
+    batch->used = 0;
+    return batch;
+}
+
+void bpt_batch_free(BptWriteBatch *batch) {
+    free(batch->ops);
+    free(batch->data);
+    free(batch);
+}
+
+void batch_add(BptWriteBatch *batch, uint32_t key, void *data, size_t size,
+    uint8_t is_delete) {
+
+    if (batch->count == batch->ops_size) {
+        batch->ops_size *= 2;
+        batch->ops = realloc(batch->ops, sizeof(BatchOp) * batch->ops_size);
+    }
+    while (batch->used + size > batch->data_size) {
+        batch->data_size *= 2;
+        batch->data = realloc(batch->data, batch->data_size);
+    }
+    BatchOp op = { key, batch->count, is_delete, size, batch->used };
+    if (size) memcpy(batch->data + batch->used, data, size);
+    batch->used += size;
+    batch->ops[batch->count++] = op;
+}
+
+void bpt_batch_insert(BptWriteBatch *batch, uint32_t key, void *data, size_t size) {
+    batch_add(batch, key, data, size, 0);
+}
+
+void bpt_batch_delete(BptWriteBatch *batch, uint32_t key) {
+    batch_add(batch, key, NULL, 0, 1);
+}
+
+uint32_t bpt_batch_size(BptWriteBatch *batch) {
+    return batch->count;
+}
+
+void bpt_batch_clear(BptWriteBatch *batch) {
+    batch->count = 0;
+    batch->used = 0;
+}
+
+int batch_op_cmp(const void *a, const void *b) {
+    const BatchOp *x = a;
+    const BatchOp *y = b;
+    if (x->key != y->key) return x->key < y->key ? -1 : 1;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+// Helper to bpt_write_batch, applies ops (ascending keys, one per key) that
+// all belong to the leaf page, right after search_bounded found it. Returns
+// how many were applied, the ones after ran out of frames.
+uint32_t leaf_apply(BPTree *bpt, BptWriteBatch *batch, Page *page, BatchOp *ops,
+    uint32_t count) {
+
+    BufferManager *bm = bpt->bm;
+    LeafPage *leaf = &page->leaf;
+    uint32_t n = page->header.num_keys;
+
+    // Entries the leaf ends up with
+    uint32_t m = n;
+    uint32_t num_inserts = 0;
+    for (uint32_t i = 0, k = 0; i < count; i++) {
+        k += lower_bound(&leaf->keys[k], n - k, ops[i].key);
+        uint8_t found = k < n && leaf->keys[k] == ops[i].key;
+        if (ops[i].is_delete) {
+            m -= found;
+        }
+        else {
+            m += !found;
+            num_inserts++;
+        }
+    }
+
+    if (m < MIN_ENTRIES_LEAF && !stack_is_empty(bpt->parent_stack)) {
+        // A leaf left below half full is merged with or refilled from a
+        // sibling by the bpt_delete paths, one operation at a time
+        for (uint32_t i = 0; i < count; i++) {
+            int result;
+            if (ops[i].is_delete) {
+                result = delete_key(bpt, ops[i].key);
+            }
+            else {
+                result = insert_key(bpt, ops[i].key, batch->data + ops[i].offset, ops[i].size);
+            }
+            if (result < 0) return i;
+        }
+        return count;
+    }
+
+    // A leaf past MAX_ENTRIES_LEAF is split once, into as few leaves as
+    // hold its entries, all about as full. The leaf keeps the first.
+    uint32_t num_leaves = m > MAX_ENTRIES_LEAF ? (m + MAX_ENTRIES_LEAF - 1) / MAX_ENTRIES_LEAF : 1;
+
+    // The records of the inserts are stored together
+    size_t *sizes = malloc(sizeof(size_t) * num_inserts);
+    void **data = malloc(sizeof(void*) * num_inserts);
+    RID *rids = calloc(num_inserts, sizeof(RID));
+    size_t bytes = 0;
+    for (uint32_t i = 0, r = 0; i < count; i++) {
+        if (ops[i].is_delete) continue;
+        sizes[r] = ops[i].size;
+        bytes += ops[i].size;
+        data[r++] = batch->data + ops[i].offset;
+    }
+
+    // Every new leaf can split the nodes above it once more, besides the
+    // data pages (at least half full with the records) and the leaf after
+    // the new ones
+    uint32_t pages = bytes / (PAGE_SIZE / 2) + 2;
+    pages += num_leaves * (stack_size(bpt->parent_stack) + 1) + 1;
+    uint8_t failed = num_leaves > 1 && !frames_available(bpt, pages);
+    if (!failed) buffer_manager_request_slots(bm, num_inserts, sizes, data, rids);
+    for (uint32_t r = 0; r < num_inserts && !failed; r++) failed = !rids[r].page_id;
+    if (failed) {
+        for (uint32_t r = 0; r < num_inserts; r++) {
+            if (rids[r].page_id) buffer_manager_free_data(bm, rids[r]);
+        }
+        free(rids);
+        free(data);
+        free(sizes);
+        return 0;
+    }
+
+    // The leaf's entries merged with the operations, and the records of
+    // the entries deleted or replaced
+    uint32_t *keys = malloc(sizeof(uint32_t) * m);
+    uint32_t *page_ids = malloc(sizeof(uint32_t) * m);
+    uint16_t *slot_ids = malloc(sizeof(uint16_t) * m);
+    RID *freed = malloc(sizeof(RID) * count);
+    uint32_t num_freed = 0;
+    uint32_t out = 0;
+    uint32_t k = 0;
+    for (uint32_t i = 0, r = 0; i <= count; i++) {
+        // The entries up to the next operation are copied as they are
+        uint32_t run = i < count ? lower_bound(&leaf->keys[k], n - k, ops[i].key) : n - k;
+        memcpy(&keys[out], &leaf->keys[k], run * sizeof(uint32_t));
+        memcpy(&page_ids[out], &leaf->page_ids[k], run * sizeof(uint32_t));
+        memcpy(&slot_ids[out], &leaf->slot_ids[k], run * sizeof(uint16_t));
+        k += run;
+        out += run;
+        if (i == count) break;
+
+        if (k < n && leaf->keys[k] == ops[i].key) {
+            RID old = { leaf->page_ids[k], leaf->slot_ids[k] };
+            freed[num_freed++] = old;
+            k++;
+        }
+        if (!ops[i].is_delete) {
+            keys[out] = ops[i].key;
+            page_ids[out] = rids[r].page_id;
+            slot_ids[out++] = rids[r++].slot_id;
+        }
+    }
+    assert(out == m);
+
+    uint32_t old_low = n ? leaf->keys[0] : 0;
+    uint32_t done = 0;
+    Page *prev = NULL;
+    buffer_manager_mark_dirty(bm, page);
+    for (uint32_t c = 0; c < num_leaves; c++) {
+        uint32_t size = m / num_leaves + (c < m % num_leaves);
+        Page *target = c ? pin_new_page(bpt, LEAF) : page;
+        memcpy(target->leaf.keys, &keys[done], size * sizeof(uint32_t));
+        memcpy(target->leaf.page_ids, &page_ids[done], size * sizeof(uint32_t));
+        memcpy(target->leaf.slot_ids, &slot_ids[done], size * sizeof(uint16_t));
+        target->header.num_keys = size;
+        done += size;
+
+        if (c == 0) {
+            // The lowest key of a leaf is its separator, see delete_key
+            if (n && size && keys[0] != old_low && !stack_is_empty(bpt->parent_stack)) {
+                bpt_update_separators(bpt, keys[0], old_low);
+            }
+            prev = page;
+            continue;
+        }
+
+        target->leaf.next_page_id = prev->leaf.next_page_id;
+        target->leaf.prev_page_id = prev->header.page_id;
+        prev->leaf.next_page_id = target->header.page_id;
+        // The separators of the leaves before it are in place, the descent
+        // ends in prev with its parents on the stack
+        Page *left = search(bpt, target->leaf.keys[0]);
+        assert(left->header.page_id == prev->header.page_id);
+        promote_key(bpt, target->leaf.keys[0], left->header.page_id,
+            target->header.page_id, bpt->parent_stack);
+        prev = target;
+    }
+    if (num_leaves > 1) link_prev_leaf(bpt, prev->leaf.next_page_id, prev->header.page_id);
+
+    for (uint32_t i = 0; i < num_freed; i++) {
+        buffer_manager_free_data(bm, freed[i]);
+    }
+    free(freed);
+    free(slot_ids);
+    free(page_ids);
+    free(keys);
+    free(rids);
+    free(data);
+    free(sizes);
+    return count;
+}
+
+int bpt_write_batch(BPTree *bpt, BptWriteBatch *batch) {
+    BatchOp *ops = batch->ops;
+    qsort(ops, batch->count, sizeof(BatchOp), batch_op_cmp);
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < batch->count; i++) {
+        if (count && ops[count - 1].key == ops[i].key) count--;
+        ops[count++] = ops[i];
+    }
+
+    int result = 0;
+    for (uint32_t i = 0; i < count; ) {
+        buffer_manager_begin_update(bpt->bm);
+        uint64_t high;
+        Page *leaf = search_bounded(bpt, ops[i].key, &high);
+        uint32_t j = i + 1;
+        while (leaf && j < count && j - i < MAX_BATCH_GROUP && ops[j].key < high) j++;
+        uint32_t applied = leaf ? leaf_apply(bpt, batch, leaf, &ops[i], j - i) : 0;
+        unpin_pages(bpt);
+        if (buffer_manager_end_update(bpt->bm) < 0) result = -1;
+        if (applied < j - i) {
+            // The operations not applied stay in the batch, in key order
+            batch->count = count - i - applied;
+            memmove(ops, &ops[i + applied], batch->count * sizeof(BatchOp));
+            return -1;
+        }
+        i = j;
+    }
+    bpt_batch_clear(batch);
+    return result;
 }
 
 int bpt_empty(BPTree *bpt) {
-    return !bpt->root || bpt->root->header.num_keys == 0;
+    Page *root = pin_page(bpt, bpt->root_page_id);
+    int empty = !root || root->header.num_keys == 0;
+    unpin_pages(bpt);
+    return empty;
 }
 
 // WARNING, DO NOT USE unless familiar with tree
@@ -613,10 +1652,10 @@ int bpt_verify_recursively(BPTree *bpt, Page *node, int lower, int upper) {
 
     if (node->header.is_leaf) {
         // First of all assert that the seperator is correct
-        if (lower != 0) assert(node->leaf->keys[0] == lower);
+        if (lower != 0) assert(node->leaf.keys[0] == lower);
         for (int i = 1; i < node->header.num_keys; i++) {
-            assert(node->leaf->keys[i] > node->leaf->keys[i - 1]);
-            assert(node->leaf->keys[i] >= lower && node->leaf->keys[i] < upper);
+            assert(node->leaf.keys[i] > node->leaf.keys[i - 1]);
+            assert(node->leaf.keys[i] >= lower && node->leaf.keys[i] < upper);
         }
 
         if (!root) {
@@ -628,16 +1667,16 @@ int bpt_verify_recursively(BPTree *bpt, Page *node, int lower, int upper) {
         return 1;
     }
     else {
-        // First of all assert seperator is correct
-        if (lower != 0) assert(node->internal->keys[0] == lower);
-        Page *left_child = buffer_manager_get_page(bpt->bm, node->internal->children[0]);
+        // The separator is checked by the leftmost leaf below, keys[0]
+        // separates the first two children
+        Page *left_child = buffer_manager_get_page(bpt->bm, node->internal.children[0]);
 
         // Assert order
-        assert(node->internal->keys[0] >= lower);
+        assert(node->internal.keys[0] >= lower);
 
         // Assert leftmost child
         int sub_tree_height = bpt_verify_recursively(bpt, left_child, lower, 
-            node->internal->keys[0]);
+            node->internal.keys[0]);
         
         // For checking next_page_id
         Page *prev_child = left_child;
@@ -645,12 +1684,12 @@ int bpt_verify_recursively(BPTree *bpt, Page *node, int lower, int upper) {
         for (int i = 0; i < node->header.num_keys; i++) {
 
             // Assert order
-            if (i != 0) assert(node->internal->keys[i] > node->internal->keys[i - 1]);
+            if (i != 0) assert(node->internal.keys[i] > node->internal.keys[i - 1]);
 
-            int child_lower = node->internal->keys[i];
+            int child_lower = node->internal.keys[i];
             int child_upper = i == node->header.num_keys - 1 ? 
-                upper : node->internal->keys[i + 1];
-            Page *child = buffer_manager_get_page(bpt->bm, node->internal->children[i + 1]);
+                upper : node->internal.keys[i + 1];
+            Page *child = buffer_manager_get_page(bpt->bm, node->internal.children[i + 1]);
 
             // Assert child
             int child_tree_height = bpt_verify_recursively(bpt, 
@@ -661,20 +1700,45 @@ int bpt_verify_recursively(BPTree *bpt, Page *node, int lower, int upper) {
 
             // Assert linked list
             if (child->header.is_leaf) {
-                assert(prev_child->leaf->next_page_id == child->header.page_id);
-                prev_child = child;
+                assert(prev_child->leaf.next_page_id == child->header.page_id);
+                assert(child->leaf.prev_page_id == prev_child->header.page_id);
             }
+
+            // Only the previous child is kept pinned
+            buffer_manager_unpin_page(bpt->bm, prev_child);
+            prev_child = child;
         }
+        buffer_manager_unpin_page(bpt->bm, prev_child);
 
         if (!root) {
             assert(node->header.num_keys + 1 >= MIN_CHILDREN);
             assert(node->header.num_keys + 1 <= MAX_CHILDREN);
         }
+        return sub_tree_height + 1;
     }
 }
 
 void bpt_verify_tree(BPTree *bpt) {
-    bpt_verify_recursively(bpt, bpt->root, 0, INT32_MAX);
+    Page *root = buffer_manager_get_page(bpt->bm, bpt->root_page_id);
+    bpt_verify_recursively(bpt, root, 0, INT32_MAX);
+    buffer_manager_unpin_page(bpt->bm, root);
+
+    // The leaves link both ways, also between leaves of different parents
+    Page *leaf = buffer_manager_get_page(bpt->bm, bpt->root_page_id);
+    while (!leaf->header.is_leaf) {
+        Page *child = buffer_manager_get_page(bpt->bm, leaf->internal.children[0]);
+        buffer_manager_unpin_page(bpt->bm, leaf);
+        leaf = child;
+    }
+    assert(leaf->leaf.prev_page_id == 0);
+    while (leaf->leaf.next_page_id) {
+        Page *next = buffer_manager_get_page(bpt->bm, leaf->leaf.next_page_id);
+        assert(next->leaf.prev_page_id == leaf->header.page_id);
+        assert(next->leaf.keys[0] > leaf->leaf.keys[leaf->header.num_keys - 1]);
+        buffer_manager_unpin_page(bpt->bm, leaf);
+        leaf = next;
+    }
+    buffer_manager_unpin_page(bpt->bm, leaf);
 }
 
 /*
@@ -1,3 +1,4 @@
+#pragma once
 #include "buffer_manager.h"
 #include <stdint.h>
 
@@ -5,13 +6,96 @@ typedef struct BPTree BPTree;
 
 BPTree *bpt_new(BufferManager *bm);
 BPTree *bpt_read(BufferManager *bm, uint32_t root_page_id);
+// Tree whose root is kept in superblock slot (< MAX_ROOTS), created when the
+// slot is unused (NULL instead on a read-only buffer manager). Root changes
+// are persisted by buffer_manager_sync, or committed to the log with
+// the insert or delete that made them.
+BPTree *bpt_open(BufferManager *bm, uint32_t slot);
 void bpt_free(BPTree *bpt);
 uint32_t bpt_height(BPTree *bpt);
-void bpt_insert(BPTree *bpt, uint32_t key, void *data, size_t size);
+uint32_t bpt_root_page_id(BPTree *bpt);
+// -1 if the pool has no frames left for the pages it needs, the tree is
+// unchanged. -1 as well if the log could not be written for its commit, the
+// insert is then made but not durable until the log is written, see
+// buffer_manager_end_update.
+int bpt_insert(BPTree *bpt, uint32_t key, void *data, size_t size);
+// Source of records for bpt_bulk_load, sets the next one and returns 1, or
+// returns 0 once there are no more. data has to stay valid until the next
+// call.
+typedef int (*BptRecordSource)(void *context, uint32_t *key, void **data, size_t *size);
+// Builds the empty tree bottom-up from the records next returns in ascending
+// key order (a repeated key replaces the record before it), much faster than
+// bpt_insert one by one. Leaves, internal nodes and data pages are filled to
+// fill_percent (0 for 100) so later inserts find room without splitting,
+// nodes never less than half. Pages are allocated in the order they are
+// filled, each leaf right before the data pages of its records. Each leaf
+// is one commit, the tree is replaced by the new one with the last. -1 if
+// the tree is not empty, or a key was lower than the one before it or the
+// pool had no frames left, in which case the tree is left empty.
+int bpt_bulk_load(BPTree *bpt, uint8_t fill_percent, BptRecordSource next, void *context);
+// Inserts and deletes collected to be applied together by bpt_write_batch
+typedef struct BptWriteBatch BptWriteBatch;
+BptWriteBatch *bpt_batch_init();
+void bpt_batch_free(BptWriteBatch *batch);
+// The data is copied into the batch
+void bpt_batch_insert(BptWriteBatch *batch, uint32_t key, void *data, size_t size);
+void bpt_batch_delete(BptWriteBatch *batch, uint32_t key);
+uint32_t bpt_batch_size(BptWriteBatch *batch);
+void bpt_batch_clear(BptWriteBatch *batch);
+// Applies the operations of the batch as if one after the other in the
+// order they were added, and empties it. They are sorted by key and the
+// tree is descended once per leaf they fall into, where all of that leaf's
+// are applied together and the records of its inserts are stored in as
+// few data pages as hold them. A leaf that grows past its page is split
+// once, into as few leaves as needed, one left below half full goes
+// through the merges of bpt_delete one operation at a time. Each leaf's
+// operations are one commit. -1 if the pool ran out of frames for a leaf,
+// its operations and the ones after stay in the batch. -1 as well, with
+// the batch emptied, if the log could not be written for a commit, as for
+// bpt_insert.
+int bpt_write_batch(BPTree *bpt, BptWriteBatch *batch);
+// The data stays pinned in the cache until released with bpt_release, NULL
+// if the key is not in the tree or the pool has no frames left
 void *bpt_get(BPTree *bpt, uint32_t key);
+void bpt_release(BPTree *bpt, void *data);
+// data is only valid during the callback. The scan ends early if the pool
+// has no frames left for a page.
 void bpt_range_query(BPTree *bpt, uint32_t key_low, uint32_t key_high, 
     void (*callback)(uint32_t key, void *data));
-void bpt_delete(BPTree *bpt, uint32_t key);
+// As bpt_range_query, from key_high down to key_low along the links back
+// to the previous leaf
+void bpt_range_query_reverse(BPTree *bpt, uint32_t key_low, uint32_t key_high,
+    void (*callback)(uint32_t key, void *data));
+// Position on an entry of a tree, moved forward and back along the leaves.
+// The leaf it is on stays pinned, moving within it touches no other page.
+// The tree must not change while a cursor is on it, seek again after a
+// change.
+typedef struct BptCursor BptCursor;
+// On no entry until it seeks
+BptCursor *bpt_cursor_open(BPTree *bpt);
+void bpt_cursor_close(BptCursor *cursor);
+// To the first entry with a key >= key
+void bpt_cursor_seek(BptCursor *cursor, uint32_t key);
+// To the last entry with a key <= key
+void bpt_cursor_seek_last(BptCursor *cursor, uint32_t key);
+// 0 if the seek found no entry, the cursor moved past either end, or the
+// pool had no frame left for the leaf it moved to
+int bpt_cursor_valid(BptCursor *cursor);
+void bpt_cursor_next(BptCursor *cursor);
+void bpt_cursor_prev(BptCursor *cursor);
+uint32_t bpt_cursor_key(BptCursor *cursor);
+// The data stays pinned until the cursor moves (or is closed)
+void *bpt_cursor_value(BptCursor *cursor);
+// Reads the keys of up to n entries from the current one on, and their
+// data unless values is NULL, and moves past them. The data pages of the
+// entries of a leaf are read in one batch, the data stays pinned until the
+// cursor moves again. With values, the entries read stop short of n once
+// their data would pin more than an eighth of the pool's frames. Returns
+// how many entries were read, 0 past the last entry or if the pool has no
+// frame left for the next data page.
+uint32_t bpt_cursor_next_n(BptCursor *cursor, uint32_t n, uint32_t *keys, void **values);
+// As bpt_insert, -1 if the pool has no frames left for the merges it needs
+int bpt_delete(BPTree *bpt, uint32_t key);
 int bpt_empty(BPTree *bpt);
 // void bpt_print(BPTree *bpt);
 
@@ -1,183 +1,2132 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
 
 #include "buffer_manager.h"
 #include "util.h"
 #include "fpih.h"
+#include "page_table.h"
+#include "wal.h"
 
-#define MAX_CACHED_PAGES 4096
 #define MAX_ALLOWED_FRAGMENTATION 50 // 50%
+#define SLOT_ENTRY_SIZE 0x5
 #define MINIMUM_FREE_SPACE 0x4 + SLOT_ENTRY_SIZE
+#define FSM_CURSOR_DONE UINT32_MAX
+
+#define DEFAULT_POOL_SIZE ((size_t)16 << 20) // 16 MB
+// Room for the pages a single tree operation keeps pinned
+#define MIN_POOL_FRAMES 64
+// Address space reserved for the arena at init, the pool can grow up to
+// this size without frames moving
+#define POOL_RESERVE_SIZE ((size_t)1 << 38) // 256 GB
+// Frames emptied per page request while the pool is shrinking
+#define SHRINK_STEP_FRAMES 8
+// Upper bound on the victims evicted (and written) together when the pool
+// is full, the batch is also kept to a 64th of the pool
+#define MAX_EVICTION_BATCH 32
+
+// Share of the pool the pages of the log's current group may pin before
+// the group is written without waiting for it to fill
+#define MAX_UNLOGGED_PERCENT 25
+
+// Pages the checkpointer copies and writes at a time
+#define CHECKPOINT_BATCH 16
+// Wait before a checkpoint abandoned after a failed write is retried
+#define CHECKPOINT_RETRY_US 100000 // 100 ms
+// Speed recovery is assumed to replay the log at, turns checkpoint_replay_ms
+// into bytes of log. A checkpoint starts once half of them were written.
+#define REPLAY_BYTES_PER_SECOND ((uint64_t)100 << 20) // 100 MB/s
+
+// Remove comment to back the frame arena with transparent huge pages
+// #define BUFFER_POOL_HUGE_PAGES
+
+#define NO_FRAME UINT32_MAX
+
+// 2Q tuning from the original paper: A1in holds 25% of the frames and
+// A1out remembers as many page_ids as half the frames
+#define TWO_Q_KIN_PERCENT 25
+#define TWO_Q_KOUT_PERCENT 50
+
+// Frame lists used by the replacement policies
+#define LIST_NONE 0
+#define LIST_A1IN 1 // 2Q FIFO of pages seen once, also the FIFO policy queue
+#define LIST_AM 2   // 2Q LRU of pages seen again
+
+// Bookkeeping for one slot of the frame arena
+typedef struct Frame {
+    // 0 if the frame does not hold a page
+    uint32_t page_id;
+    // Set when the page differs from its copy on disk
+    uint8_t dirty;
+    // Pinned frames are never chosen for eviction
+    uint32_t pin_count;
+    // Changed since the log's current group started, pinned until the
+    // group is written
+    uint8_t unlogged;
+    // Dirty when the running checkpoint started, still to be written for it
+    uint8_t checkpoint;
+
+    // Replacement policy state
+    uint8_t referenced;
+    uint8_t list;
+    uint32_t prev;
+    uint32_t next;
+} Frame;
+
+// Intrusive doubly linked list over frame indices, head is the most recent
+typedef struct FrameList {
+    uint32_t head;
+    uint32_t tail;
+    uint32_t size;
+} FrameList;
+
+typedef struct ReplacementPolicy {
+    void (*init)(BufferManager *bm);
+    void (*free)(BufferManager *bm);
+    // A page was placed in frame, either read from db or newly created
+    void (*insert)(BufferManager *bm, uint32_t frame);
+    void (*hit)(BufferManager *bm, uint32_t frame);
+    // Frame is about to be released, evicted is 0 if the page was freed
+    void (*remove)(BufferManager *bm, uint32_t frame, uint8_t evicted);
+    // Frame that should be evicted next
+    uint32_t (*victim)(BufferManager *bm);
+    // The page in frame from was copied to the empty frame to
+    void (*move)(BufferManager *bm, uint32_t from, uint32_t to);
+    // Writes the frames holding a page to frames, the ones the policy
+    // would keep longest first. Number of frames written, the first
+    // num_hot of them were hit since they were inserted.
+    uint32_t (*order)(BufferManager *bm, uint32_t *frames, uint32_t *num_hot);
+    // Like insert, for a page that was among the num_hot pages of order
+    // before a restart
+    void (*insert_hot)(BufferManager *bm, uint32_t frame);
+    // target_frames changed, by buffer_manager_resize
+    void (*resize)(BufferManager *bm);
+} ReplacementPolicy;
+
+struct BufferManager {
+
+    // Page table of form (key; value): (uint32_t(page_id); uint32_t(frame index))
+    PageTable *cached_pages;
+
+    // Heap with elements of type uint32_t (lesser)
+    Heap *available_pages;
+
+    // Heap with elements of type FreeDataPage sorted on FreeDataPage.free_space (greater)
+    FreePageHeap *nonfull_data_pages;
+
+    // Free-space map pages read (or added) so far, fsm_pages[n] is the n:th
+    // page in the chain. They are kept outside the pool and written by
+    // buffer_manager_sync when dirty.
+    FsmPage **fsm_pages;
+    uint8_t *fsm_dirty;
+    // Changed since the log's current group started
+    uint8_t *fsm_unlogged;
+    uint32_t num_fsm_pages;
+    uint32_t fsm_pages_size;
+    // First page in the chain not read yet (0 at the end of the chain)
+    uint32_t fsm_next_page_id;
+    // Map entries of page_ids below fsm_cursor have been moved to
+    // nonfull_data_pages, FSM_CURSOR_DONE once every entry has
+    uint32_t fsm_cursor;
+
+    // Page aligned frames, frame i lives at frames + i * PAGE_SIZE. The
+    // address space (frames_reserved bytes) is reserved once at init and
+    // only the first num_frames frames are backed by memory.
+    uint8_t *frames;
+    size_t frames_reserved;
+    uint32_t num_frames;
+    // Frames above target_frames are emptied and given back gradually
+    uint32_t target_frames;
+    Frame *frame_table;
+    uint32_t frame_table_size;
+
+    // Stack with the indices of frames not holding a page, may contain
+    // frames that have since been given back (skipped when popped)
+    Stack *free_frames;
+
+    const ReplacementPolicy *policy;
+    // CLOCK
+    uint32_t clock_hand;
+    // 2Q (A1in doubles as the FIFO queue)
+    FrameList a1in;
+    FrameList am;
+    // A1out, ring of page_ids evicted from A1in and the page table
+    // (page_id; position in ring) to look them up
+    uint32_t *a1out;
+    uint32_t a1out_size;
+    uint32_t a1out_next;
+    PageTable *a1out_pages;
+
+    // Background cleaner, see BufferManagerOptions. The lock is recursive
+    // and only taken (locking is set) while the cleaner or the checkpointer
+    // runs, stopping is set to stop them.
+    uint8_t locking;
+    uint8_t stopping;
+    uint8_t cleaner_enabled;
+    uint32_t low_watermark;
+    uint32_t high_watermark;
+    // As given in the options, clamped to the pool size on every resize
+    uint32_t requested_low_watermark;
+    uint32_t requested_high_watermark;
+    pthread_t cleaner;
+    pthread_mutex_t lock;
+    pthread_cond_t cleaner_wake;
+    // Page the cleaner is writing after dropping lock (0 if none), io_lock
+    // is held by the cleaner until the write is done
+    uint32_t cleaning_page_id;
+    pthread_mutex_t io_lock;
+
+    // Background checkpointer, see BufferManagerOptions. A checkpoint starts
+    // once checkpoint_budget / 2 bytes were logged after the position
+    // recorded by the last one, and runs (checkpoint_running) until every
+    // frame flagged with checkpoint at checkpoint_start was written. Pages
+    // copied for it are listed in checkpoint_ios while they are written
+    // without holding lock, with checkpoint_io_lock held, their frames are
+    // pinned meanwhile. checkpoint_waiting asks the next commit to finish
+    // the pass, see finish_checkpoint_pass. A failed write sets
+    // checkpoint_failed, the checkpoint is then abandoned.
+    uint8_t checkpointer_enabled;
+    uint8_t checkpoint_running;
+    uint8_t checkpoint_waiting;
+    uint8_t checkpoint_failed;
+    uint64_t checkpoint_budget;
+    uint32_t checkpoint_rate;
+    WalPosition checkpoint_start;
+    uint32_t checkpoint_cursor;
+    uint8_t *checkpoint_buffer;
+    PageIO checkpoint_ios[CHECKPOINT_BATCH];
+    uint32_t num_checkpoint_ios;
+    Superblock checkpoint_superblock;
+    pthread_t checkpointer;
+    pthread_cond_t checkpoint_wake;
+    pthread_mutex_t checkpoint_io_lock;
+
+    // Writes the log's current group once wal_sync_interval_us passed
+    // without a commit that would have written it, see log_flusher_main
+    uint8_t log_flusher_enabled;
+    uint32_t log_flush_interval_us;
+    pthread_t log_flusher;
+    pthread_cond_t log_flush_wake;
+
+    // Warm restart, see BufferManagerOptions. warm_path is NULL when it is
+    // off. warm_pages holds the page_ids saved by the last run, the ones
+    // below warm_cursor were read back (by the preloader thread when
+    // preloader_enabled is set).
+    char *warm_path;
+    uint32_t *warm_pages;
+    uint32_t num_warm_pages;
+    uint32_t num_warm_hot;
+    uint32_t warm_cursor;
+    uint8_t preloader_enabled;
+    pthread_t preloader;
+
+    BufferManagerStats stats;
+    uint32_t io_queue_depth;
+    // See BufferManagerOptions, scans counts the running scans
+    uint8_t read_only;
+    uint32_t scans;
+
+    // Write-ahead log, NULL if not kept. updates is the nesting depth of
+    // buffer_manager_begin_update and changed is set by any change since
+    // the last commit. unlogged lists the frames changed since the current
+    // group started (frames released since then are skipped).
+    Wal *wal;
+    uint32_t updates;
+    uint8_t changed;
+    uint32_t *unlogged;
+    uint32_t num_unlogged;
+    uint32_t unlogged_size;
+    // Copy of page 0, written back by buffer_manager_sync. Freed
+    // page ids are kept in available_pages and only moved to free-list
+    // pages on disk when flushing, superblock.free_list_page_id is the
+    // part of the free list not yet read back.
+    Superblock superblock;
+    uint8_t superblock_dirty;
+    Pager *pager;
+};
+
+void *frame_data(BufferManager *bm, uint32_t frame) {
+    return bm->frames + (size_t)frame * PAGE_SIZE;
+}
+
+// Reserves address space only, frames are backed with commit_frames
+uint8_t *reserve_frames(size_t size) {
+    void *frames = mmap(NULL, size, PROT_NONE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (frames == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    return frames;
+}
+
+// Makes frames [from, to) usable
+int commit_frames(BufferManager *bm, uint32_t from, uint32_t to) {
+    uint8_t *start = frame_data(bm, from);
+    size_t size = (size_t)(to - from) * PAGE_SIZE;
+    if (mprotect(start, size, PROT_READ | PROT_WRITE) < 0) {
+        perror("mprotect");
+        return -1;
+    }
+#ifdef BUFFER_POOL_HUGE_PAGES
+    madvise(start, size, MADV_HUGEPAGE);
+#endif
+    return 0;
+}
+
+// Gives the memory of the empty frames [from, to) back to the system
+void decommit_frames(BufferManager *bm, uint32_t from, uint32_t to) {
+    uint8_t *start = frame_data(bm, from);
+    size_t size = (size_t)(to - from) * PAGE_SIZE;
+    madvise(start, size, MADV_DONTNEED);
+    mprotect(start, size, PROT_NONE);
+}
+
+uint32_t pool_size_to_frames(BufferManager *bm, size_t pool_size) {
+    size_t frames = pool_size / PAGE_SIZE;
+    if (frames < MIN_POOL_FRAMES) frames = MIN_POOL_FRAMES;
+    if (frames > bm->frames_reserved / PAGE_SIZE) {
+        frames = bm->frames_reserved / PAGE_SIZE;
+    }
+    return frames;
+}
+
+
+// Frame lists
+
+void frame_list_init(FrameList *list) {
+    list->head = NO_FRAME;
+    list->tail = NO_FRAME;
+    list->size = 0;
+}
+
+void frame_list_push_front(BufferManager *bm, FrameList *list, 
+    uint8_t list_id, uint32_t frame) {
+
+    Frame *f = &bm->frame_table[frame];
+    f->list = list_id;
+    f->prev = NO_FRAME;
+    f->next = list->head;
+    if (list->head != NO_FRAME) bm->frame_table[list->head].prev = frame;
+    else list->tail = frame;
+    list->head = frame;
+    list->size++;
+}
+
+void frame_list_remove(BufferManager *bm, FrameList *list, uint32_t frame) {
+    Frame *f = &bm->frame_table[frame];
+    if (f->prev != NO_FRAME) bm->frame_table[f->prev].next = f->next;
+    else list->head = f->next;
+    if (f->next != NO_FRAME) bm->frame_table[f->next].prev = f->prev;
+    else list->tail = f->prev;
+    f->list = LIST_NONE;
+    list->size--;
+}
+
+
+// Puts to in the place of from
+void frame_list_move(BufferManager *bm, FrameList *list, uint32_t from,
+    uint32_t to) {
+
+    Frame *src = &bm->frame_table[from];
+    Frame *dst = &bm->frame_table[to];
+    dst->list = src->list;
+    dst->prev = src->prev;
+    dst->next = src->next;
+    if (dst->prev != NO_FRAME) bm->frame_table[dst->prev].next = to;
+    else list->head = to;
+    if (dst->next != NO_FRAME) bm->frame_table[dst->next].prev = to;
+    else list->tail = to;
+    src->list = LIST_NONE;
+}
+
+// Oldest unpinned frame of list
+uint32_t frame_list_victim(BufferManager *bm, FrameList *list) {
+    uint32_t frame = list->tail;
+    while (frame != NO_FRAME && bm->frame_table[frame].pin_count) {
+        frame = bm->frame_table[frame].prev;
+    }
+    return frame;
+}
+
+
+// CLOCK (second chance): a hit sets the referenced bit, the hand sweeps
+// the frames clearing bits and evicts the first unreferenced page
+
+void clock_init(BufferManager *bm) {
+    bm->clock_hand = 0;
+}
+
+void clock_free(BufferManager *bm) {
+    (void)bm;
+}
+
+void clock_resize(BufferManager *bm) {
+    (void)bm;
+}
+
+void clock_touch(BufferManager *bm, uint32_t frame) {
+    bm->frame_table[frame].referenced = 1;
+}
+
+void clock_remove(BufferManager *bm, uint32_t frame, uint8_t evicted) {
+    (void)evicted;
+    bm->frame_table[frame].referenced = 0;
+}
+
+uint32_t clock_victim(BufferManager *bm) {
+    // Two full sweeps clear every bit, so this finds a page unless all
+    // are pinned
+    for (uint32_t i = 0; i < 2 * bm->num_frames; i++) {
+        // The pool may have shrunk below the hand
+        if (bm->clock_hand >= bm->num_frames) bm->clock_hand = 0;
+        uint32_t frame = bm->clock_hand;
+        bm->clock_hand = (bm->clock_hand + 1) % bm->num_frames;
+        Frame *f = &bm->frame_table[frame];
+        if (f->page_id == 0 || f->pin_count) continue;
+        if (f->referenced) {
+            f->referenced = 0;
+            continue;
+        }
+        return frame;
+    }
+    return NO_FRAME;
+}
+
+void clock_move(BufferManager *bm, uint32_t from, uint32_t to) {
+    bm->frame_table[to].referenced = bm->frame_table[from].referenced;
+    bm->frame_table[from].referenced = 0;
+}
+
+// Referenced pages first
+uint32_t clock_order(BufferManager *bm, uint32_t *frames, uint32_t *num_hot) {
+    uint32_t count = 0;
+    for (uint8_t referenced = 1; referenced <= 1; referenced--) {
+        for (uint32_t frame = 0; frame < bm->num_frames; frame++) {
+            Frame *f = &bm->frame_table[frame];
+            if (f->page_id && f->referenced == referenced) frames[count++] = frame;
+        }
+        if (referenced) *num_hot = count;
+    }
+    return count;
+}
+
+const ReplacementPolicy clock_policy = {
+    clock_init, clock_free, clock_touch, clock_touch, clock_remove, clock_victim,
+    clock_move, clock_order, clock_touch, clock_resize
+};
+
+
+// 2Q (Johnson and Shasha): pages seen once go through the FIFO A1in,
+// pages referenced again while remembered in A1out are promoted to the
+// LRU Am. A scan therefore only churns A1in and never flushes Am.
+
+// A1out remembers TWO_Q_KOUT_PERCENT of the pool's target frames
+uint32_t two_q_a1out_size(BufferManager *bm) {
+    uint32_t size = bm->target_frames * TWO_Q_KOUT_PERCENT / 100;
+    return size ? size : 1;
+}
+
+void two_q_init(BufferManager *bm) {
+    frame_list_init(&bm->a1in);
+    frame_list_init(&bm->am);
+    bm->a1out_size = two_q_a1out_size(bm);
+    bm->a1out = calloc(bm->a1out_size, sizeof(uint32_t));
+    bm->a1out_next = 0;
+    bm->a1out_pages = pt_init(bm->a1out_size);
+}
+
+// Rebuilds A1out for the new target, with the pages evicted last that fit
+void two_q_resize(BufferManager *bm) {
+    uint32_t size = two_q_a1out_size(bm);
+    if (size == bm->a1out_size) return;
+    uint32_t remembered = pt_size(bm->a1out_pages);
+    uint32_t skip = remembered > size ? remembered - size : 0;
+    uint32_t *a1out = calloc(size, sizeof(uint32_t));
+    PageTable *a1out_pages = pt_init(size);
+    uint32_t count = 0;
+    // Oldest first, from the slot overwritten next
+    for (uint32_t i = 0; i < bm->a1out_size; i++) {
+        uint32_t page_id = bm->a1out[(bm->a1out_next + i) % bm->a1out_size];
+        if (!page_id) continue;
+        if (skip) {
+            skip--;
+            continue;
+        }
+        a1out[count] = page_id;
+        pt_insert(a1out_pages, page_id, count++);
+    }
+    free(bm->a1out);
+    pt_free(bm->a1out_pages);
+    bm->a1out = a1out;
+    bm->a1out_pages = a1out_pages;
+    bm->a1out_size = size;
+    bm->a1out_next = count % size;
+}
+
+void two_q_free(BufferManager *bm) {
+    free(bm->a1out);
+    pt_free(bm->a1out_pages);
+}
+
+void two_q_insert(BufferManager *bm, uint32_t frame) {
+    uint32_t page_id = bm->frame_table[frame].page_id;
+    uint32_t pos = pt_get(bm->a1out_pages, page_id);
+    if (pos != PT_NOT_FOUND) {
+        // Referenced again after leaving A1in, the page is hot
+        pt_delete(bm->a1out_pages, page_id);
+        bm->a1out[pos] = 0;
+        frame_list_push_front(bm, &bm->am, LIST_AM, frame);
+    }
+    else {
+        frame_list_push_front(bm, &bm->a1in, LIST_A1IN, frame);
+    }
+}
+
+void two_q_hit(BufferManager *bm, uint32_t frame) {
+    // Hits in A1in are correlated references and do not promote
+    if (bm->frame_table[frame].list == LIST_AM) {
+        frame_list_remove(bm, &bm->am, frame);
+        frame_list_push_front(bm, &bm->am, LIST_AM, frame);
+    }
+}
+
+void two_q_remember(BufferManager *bm, uint32_t page_id) {
+    uint32_t pos = bm->a1out_next;
+    bm->a1out_next = (bm->a1out_next + 1) % bm->a1out_size;
+    if (bm->a1out[pos]) {
+        pt_delete(bm->a1out_pages, bm->a1out[pos]);
+    }
+    bm->a1out[pos] = page_id;
+    pt_insert(bm->a1out_pages, page_id, pos);
+}
+
+void two_q_remove(BufferManager *bm, uint32_t frame, uint8_t evicted) {
+    Frame *f = &bm->frame_table[frame];
+    if (f->list == LIST_A1IN) {
+        frame_list_remove(bm, &bm->a1in, frame);
+        if (evicted) two_q_remember(bm, f->page_id);
+    }
+    else if (f->list == LIST_AM) {
+        frame_list_remove(bm, &bm->am, frame);
+    }
+}
+
+uint32_t two_q_victim(BufferManager *bm) {
+    uint32_t kin = bm->num_frames * TWO_Q_KIN_PERCENT / 100;
+    uint32_t frame = NO_FRAME;
+    if (bm->a1in.size > kin || bm->am.size == 0) {
+        frame = frame_list_victim(bm, &bm->a1in);
+    }
+    // Either list will do when the preferred one is entirely pinned
+    if (frame == NO_FRAME) frame = frame_list_victim(bm, &bm->am);
+    if (frame == NO_FRAME) frame = frame_list_victim(bm, &bm->a1in);
+    return frame;
+}
+
+void two_q_move(BufferManager *bm, uint32_t from, uint32_t to) {
+    if (bm->frame_table[from].list == LIST_AM) {
+        frame_list_move(bm, &bm->am, from, to);
+    }
+    else {
+        frame_list_move(bm, &bm->a1in, from, to);
+    }
+}
+
+// Frames of list from the most recent on, appended to frames
+uint32_t frame_list_order(BufferManager *bm, FrameList *list, uint32_t *frames,
+    uint32_t count) {
+
+    for (uint32_t frame = list->head; frame != NO_FRAME; frame = bm->frame_table[frame].next) {
+        frames[count++] = frame;
+    }
+    return count;
+}
+
+void two_q_insert_hot(BufferManager *bm, uint32_t frame) {
+    frame_list_push_front(bm, &bm->am, LIST_AM, frame);
+}
+
+// Am (pages seen again) first
+uint32_t two_q_order(BufferManager *bm, uint32_t *frames, uint32_t *num_hot) {
+    *num_hot = frame_list_order(bm, &bm->am, frames, 0);
+    return frame_list_order(bm, &bm->a1in, frames, *num_hot);
+}
+
+const ReplacementPolicy two_q_policy = {
+    two_q_init, two_q_free, two_q_insert, two_q_hit, two_q_remove, two_q_victim,
+    two_q_move, two_q_order, two_q_insert_hot, two_q_resize
+};
+
+
+// FIFO: evicts in insertion order, hits are ignored
+
+void fifo_insert(BufferManager *bm, uint32_t frame) {
+    frame_list_push_front(bm, &bm->a1in, LIST_A1IN, frame);
+}
+
+void fifo_hit(BufferManager *bm, uint32_t frame) {
+    (void)bm;
+    (void)frame;
+}
+
+void fifo_remove(BufferManager *bm, uint32_t frame, uint8_t evicted) {
+    (void)evicted;
+    frame_list_remove(bm, &bm->a1in, frame);
+}
+
+uint32_t fifo_victim(BufferManager *bm) {
+    return frame_list_victim(bm, &bm->a1in);
+}
+
+void fifo_init(BufferManager *bm) {
+    frame_list_init(&bm->a1in);
+}
+
+void fifo_move(BufferManager *bm, uint32_t from, uint32_t to) {
+    frame_list_move(bm, &bm->a1in, from, to);
+}
+
+uint32_t fifo_order(BufferManager *bm, uint32_t *frames, uint32_t *num_hot) {
+    *num_hot = 0;
+    return frame_list_order(bm, &bm->a1in, frames, 0);
+}
+
+const ReplacementPolicy fifo_policy = {
+    fifo_init, clock_free, fifo_insert, fifo_hit, fifo_remove, fifo_victim,
+    fifo_move, fifo_order, fifo_insert, clock_resize
+};
+
+
+// Drops the page in frame from the cache and returns the frame to the
+// free-list, the page itself is not written
+void release_frame(BufferManager *bm, uint32_t frame, uint8_t evicted) {
+    bm->policy->remove(bm, frame, evicted);
+    pt_delete(bm->cached_pages, bm->frame_table[frame].page_id);
+    bm->frame_table[frame].page_id = 0;
+    bm->frame_table[frame].dirty = 0;
+    bm->frame_table[frame].pin_count = 0;
+    bm->frame_table[frame].unlogged = 0;
+    bm->frame_table[frame].checkpoint = 0;
+    stack_push(bm->free_frames, frame);
+}
+
+// Marks the page in frame as changed. With a log the frame is also pinned
+// until the log holds the change, pages never reach the file first.
+void set_dirty(BufferManager *bm, uint32_t frame) {
+    Frame *f = &bm->frame_table[frame];
+    f->dirty = 1;
+    if (!bm->wal) return;
+    bm->changed = 1;
+    if (f->unlogged) return;
+    f->unlogged = 1;
+    f->pin_count++;
+    if (bm->num_unlogged == bm->unlogged_size) {
+        bm->unlogged_size = bm->unlogged_size ? bm->unlogged_size * 2 : 64;
+        bm->unlogged = realloc(bm->unlogged, sizeof(uint32_t) * bm->unlogged_size);
+    }
+    bm->unlogged[bm->num_unlogged++] = frame;
+}
+
+// Log position the last checkpoint recorded, recovery starts there
+WalPosition recorded_checkpoint(BufferManager *bm) {
+    WalPosition position = {
+        bm->superblock.checkpoint_salt, bm->superblock.checkpoint_offset
+    };
+    return position;
+}
+
+// Writes the log's current group, the pages changed by its commits as
+// they are now (no update is running) and the superblock, then unpins them.
+// -1 if it could not be written, the pages then stay pinned and the
+// commits pending, for the next try.
+int write_log_group(BufferManager *bm) {
+    if (!wal_pending_commits(bm->wal)) return 0;
+    void **pages = malloc(sizeof(void*) * (bm->num_unlogged + bm->num_fsm_pages));
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < bm->num_unlogged; i++) {
+        if (bm->frame_table[bm->unlogged[i]].unlogged) {
+            pages[count++] = frame_data(bm, bm->unlogged[i]);
+        }
+    }
+    for (uint32_t n = 0; n < bm->num_fsm_pages; n++) {
+        if (bm->fsm_unlogged[n]) pages[count++] = bm->fsm_pages[n];
+    }
+    int result = wal_write_group(bm->wal, pages, count, &bm->superblock);
+    free(pages);
+    if (result < 0) return -1;
+    if (bm->checkpointer_enabled && !bm->checkpoint_running &&
+        wal_bytes_since(bm->wal, recorded_checkpoint(bm)) >= bm->checkpoint_budget / 2) {
+        pthread_cond_signal(&bm->checkpoint_wake);
+    }
+
+    for (uint32_t i = 0; i < bm->num_unlogged; i++) {
+        Frame *f = &bm->frame_table[bm->unlogged[i]];
+        if (!f->unlogged) continue;
+        f->unlogged = 0;
+        f->pin_count--;
+    }
+    bm->num_unlogged = 0;
+    for (uint32_t n = 0; n < bm->num_fsm_pages; n++) bm->fsm_unlogged[n] = 0;
+    return 0;
+}
+
+// Ends an update, writing the group when it is due. A group is also written
+// early once its pages take up MAX_UNLOGGED_PERCENT of the pool. -1 if the
+// group could not be written.
+int commit_update(BufferManager *bm) {
+    if (!bm->changed) return 0;
+    bm->changed = 0;
+    if (wal_commit(bm->wal) ||
+        bm->num_unlogged > (uint64_t)bm->target_frames * MAX_UNLOGGED_PERCENT / 100) {
+        return write_log_group(bm);
+    }
+    // The first commit of a group starts the flusher's interval
+    if (bm->log_flusher_enabled && wal_pending_commits(bm->wal) == 1) {
+        pthread_cond_signal(&bm->log_flush_wake);
+    }
+    return 0;
+}
+
+// Foreground I/O on a page the cleaner or the checkpointer is writing has
+// to wait for that write, it would otherwise read or be overwritten by the
+// older contents
+void wait_for_background_write(BufferManager *bm, uint32_t page_id) {
+    if (bm->cleaner_enabled && bm->cleaning_page_id == page_id) {
+        pthread_mutex_lock(&bm->io_lock);
+        pthread_mutex_unlock(&bm->io_lock);
+    }
+    for (uint32_t i = 0; i < bm->num_checkpoint_ios; i++) {
+        if (bm->checkpoint_ios[i].page_id == page_id) {
+            pthread_mutex_lock(&bm->checkpoint_io_lock);
+            pthread_mutex_unlock(&bm->checkpoint_io_lock);
+            break;
+        }
+    }
+}
+
+// -1 if the dirty page could not be written, it then stays cached
+int evict_frame(BufferManager *bm, uint32_t frame) {
+    // Clean pages are identical on disk and are dropped without a write
+    if (bm->frame_table[frame].dirty) {
+        wait_for_background_write(bm, bm->frame_table[frame].page_id);
+        if (write_page_to_db(bm->pager, frame_data(bm, frame)) < 0) return -1;
+        bm->stats.writes++;
+    }
+    else {
+        bm->stats.writes_avoided++;
+    }
+    release_frame(bm, frame, 1);
+    bm->stats.evictions++;
+    return 0;
+}
+
+// Batches go to the pager in page id order so runs of consecutive pages
+// are written with one call
+int compare_page_id(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+int compare_page_io(const void *a, const void *b) {
+    return compare_page_id(&((const PageIO*)a)->page_id, &((const PageIO*)b)->page_id);
+}
+
+// Evicts up to count policy victims and writes the dirty ones in one
+// batch. Returns how many frames were freed, victims that could not be
+// written go back into the pool, still dirty.
+uint32_t evict_frames(BufferManager *bm, uint32_t count) {
+    uint32_t victims[MAX_EVICTION_BATCH];
+    PageIO ios[MAX_EVICTION_BATCH];
+    uint32_t num_victims = 0;
+    uint32_t num_writes = 0;
+    if (count > MAX_EVICTION_BATCH) count = MAX_EVICTION_BATCH;
+    while (num_victims < count) {
+        uint32_t frame = bm->policy->victim(bm);
+        if (frame == NO_FRAME) break;
+        Frame *f = &bm->frame_table[frame];
+
+        // Out of the policy and the page table, and pinned so it is not
+        // picked again while its contents wait to be written
+        bm->policy->remove(bm, frame, 1);
+        pt_delete(bm->cached_pages, f->page_id);
+        f->pin_count = 1;
+        if (f->dirty) {
+            wait_for_background_write(bm, f->page_id);
+            PageIO io = { PAGE_IO_WRITE, f->page_id, frame_data(bm, frame), 0 };
+            ios[num_writes++] = io;
+        }
+        victims[num_victims++] = frame;
+    }
+
+    qsort(ios, num_writes, sizeof(PageIO), compare_page_io);
+    pager_run_batch(bm->pager, ios, num_writes);
+    uint32_t failed = 0;
+    for (uint32_t i = 0; i < num_writes; i++) {
+        if (ios[i].result >= 0) continue;
+        uint32_t frame = ((uint8_t*)ios[i].buffer - bm->frames) / PAGE_SIZE;
+        bm->frame_table[frame].pin_count = 0;
+        pt_insert(bm->cached_pages, ios[i].page_id, frame);
+        bm->policy->insert(bm, frame);
+        failed++;
+    }
+    for (uint32_t i = 0; i < num_victims; i++) {
+        Frame *f = &bm->frame_table[victims[i]];
+        if (!f->pin_count) continue;
+        f->page_id = 0;
+        f->dirty = 0;
+        f->checkpoint = 0;
+        f->pin_count = 0;
+        stack_push(bm->free_frames, victims[i]);
+    }
+    bm->stats.writes += num_writes - failed;
+    bm->stats.writes_avoided += num_victims - num_writes;
+    bm->stats.evictions += num_victims - failed;
+    return num_victims - failed;
+}
+
+uint32_t eviction_batch(BufferManager *bm) {
+    uint32_t batch = bm->io_queue_depth;
+    if (batch > bm->target_frames / 64) batch = bm->target_frames / 64;
+    return batch ? batch : 1;
+}
+
+// Free frame below target_frames, NO_FRAME if there is none
+uint32_t pop_free_frame(BufferManager *bm) {
+    while (!stack_is_empty(bm->free_frames)) {
+        uint32_t frame = stack_top(bm->free_frames);
+        stack_pop(bm->free_frames);
+        if (frame < bm->target_frames) return frame;
+    }
+    return NO_FRAME;
+}
+
+void rebuild_free_frames(BufferManager *bm) {
+    stack_clear(bm->free_frames);
+    // Pushed in reverse so frames are handed out from the front of the arena
+    for (uint32_t i = bm->target_frames; i > 0; i--) {
+        if (bm->frame_table[i - 1].page_id == 0) {
+            stack_push(bm->free_frames, i - 1);
+        }
+    }
+}
+
+// Copies the unpinned page in frame from to the free frame to
+void move_frame(BufferManager *bm, uint32_t from, uint32_t to) {
+    Frame *src = &bm->frame_table[from];
+    Frame *dst = &bm->frame_table[to];
+    memcpy(frame_data(bm, to), frame_data(bm, from), PAGE_SIZE);
+    dst->page_id = src->page_id;
+    dst->dirty = src->dirty;
+    dst->checkpoint = src->checkpoint;
+    dst->pin_count = 0;
+    bm->policy->move(bm, from, to);
+    pt_insert(bm->cached_pages, dst->page_id, to);
+    src->page_id = 0;
+    src->dirty = 0;
+    src->checkpoint = 0;
+}
+
+// Empties the frames above target_frames, highest first, and gives their
+// memory back. Pages are moved to free frames below the target, evicting
+// the coldest pages to make room. Stops at a pinned page, which is
+// retried on a later page request.
+void shrink_pool(BufferManager *bm, uint32_t steps) {
+    uint32_t old_num_frames = bm->num_frames;
+    while (steps > 0 && bm->num_frames > bm->target_frames) {
+        steps--;
+        uint32_t frame = bm->num_frames - 1;
+        Frame *f = &bm->frame_table[frame];
+        if (f->page_id) {
+            if (f->pin_count) break;
+            uint32_t to = pop_free_frame(bm);
+            if (to == NO_FRAME) {
+                uint32_t victim = bm->policy->victim(bm);
+                if (victim == NO_FRAME || evict_frame(bm, victim) < 0) break;
+                if (victim != frame) to = pop_free_frame(bm);
+            }
+            if (to != NO_FRAME) move_frame(bm, frame, to);
+            // The victim was another frame being given back
+            if (f->page_id) continue;
+        }
+        bm->num_frames--;
+    }
+
+    if (bm->num_frames < old_num_frames) {
+        decommit_frames(bm, bm->num_frames, old_num_frames);
+    }
+}
+
+// Returns the index of a free frame, evicting a batch of the policy's
+// victims when the pool is full. NO_FRAME if every frame is pinned or no
+// victim could be written.
+uint32_t find_frame(BufferManager *bm) {
+    if (bm->num_frames > bm->target_frames) {
+        shrink_pool(bm, SHRINK_STEP_FRAMES);
+    }
+
+    uint32_t frame = pop_free_frame(bm);
+    while (frame == NO_FRAME) {
+        if (!evict_frames(bm, eviction_batch(bm))) return NO_FRAME;
+        frame = pop_free_frame(bm);
+    }
+
+    if (bm->cleaner_enabled && stack_size(bm->free_frames) < bm->low_watermark) {
+        pthread_cond_signal(&bm->cleaner_wake);
+    }
+    return frame;
+}
+
+uint32_t take_frame(BufferManager *bm) {
+    uint32_t frame = find_frame(bm);
+    if (frame == NO_FRAME) {
+        fprintf(stderr, "Buffer pool exhausted, every frame is pinned or failed to write\n");
+    }
+    return frame;
+}
+
+void add_page_to_cache(BufferManager *bm, uint32_t frame, uint32_t page_id) {
+    // printf("Adding page (%d) to cache\n", page_id);
+    bm->frame_table[frame].page_id = page_id;
+    pt_insert(bm->cached_pages, page_id, frame);
+    bm->policy->insert(bm, frame);
+}
+
+// Evicts policy victims until high_watermark frames are free. Dirty pages
+// are copied and written without holding the lock so lookups continue
+// meanwhile, pinned so they stay in their frame. The page is then dropped
+// unless it was modified again. A failed write leaves it dirty and ends
+// the round.
+void clean_frames(BufferManager *bm, uint8_t *buffer) {
+    while (!bm->stopping &&
+            stack_size(bm->free_frames) < bm->high_watermark) {
+
+        uint32_t frame = bm->policy->victim(bm);
+        if (frame == NO_FRAME) return;
+        Frame *f = &bm->frame_table[frame];
+
+        if (f->dirty) {
+            uint32_t page_id = f->page_id;
+            memcpy(buffer, frame_data(bm, frame), PAGE_SIZE);
+            uint8_t checkpoint = f->checkpoint;
+            f->dirty = 0;
+            f->checkpoint = 0;
+            f->pin_count++;
+            bm->cleaning_page_id = page_id;
+            pthread_mutex_lock(&bm->io_lock);
+            pthread_mutex_unlock(&bm->lock);
+
+            int written = write_page_to_db(bm->pager, buffer);
+
+            pthread_mutex_unlock(&bm->io_lock);
+            pthread_mutex_lock(&bm->lock);
+            bm->cleaning_page_id = 0;
+            // The frame table may have been reallocated by a resize
+            f = &bm->frame_table[frame];
+            f->pin_count--;
+            if (written < 0) {
+                f->dirty = 1;
+                f->checkpoint |= checkpoint;
+                return;
+            }
+            bm->stats.writes++;
+            // Modified or pinned while it was being written
+            if (f->dirty || f->pin_count) continue;
+        }
+        else {
+            bm->stats.writes_avoided++;
+        }
+
+        release_frame(bm, frame, 1);
+        bm->stats.evictions++;
+        bm->stats.cleaner_evictions++;
+
+        // Let waiting lookups in between victims
+        pthread_mutex_unlock(&bm->lock);
+        pthread_mutex_lock(&bm->lock);
+    }
+}
+
+void *cleaner_main(void *arg) {
+    BufferManager *bm = arg;
+    uint8_t *buffer = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+
+    pthread_mutex_lock(&bm->lock);
+    while (!bm->stopping) {
+        if (stack_size(bm->free_frames) < bm->low_watermark) {
+            clean_frames(bm, buffer);
+        }
+        if (!bm->stopping) {
+            pthread_cond_wait(&bm->cleaner_wake, &bm->lock);
+        }
+    }
+    pthread_mutex_unlock(&bm->lock);
+
+    free(buffer);
+    return NULL;
+}
+
+// A checkpoint write of the page in frame failed, the frame is dirty again
+// and the checkpoint is abandoned
+void checkpoint_write_failed(BufferManager *bm, uint32_t frame) {
+    bm->frame_table[frame].dirty = 1;
+    bm->frame_table[frame].checkpoint = 1;
+    bm->checkpoint_failed = 1;
+}
+
+// Writes the pages copied for the checkpoint without holding lock, called
+// and returning with it held. Number of pages written.
+uint32_t write_checkpoint_pages(BufferManager *bm) {
+    uint32_t count = bm->num_checkpoint_ios;
+    if (!count) return 0;
+    qsort(bm->checkpoint_ios, count, sizeof(PageIO), compare_page_io);
+    pthread_mutex_lock(&bm->checkpoint_io_lock);
+    pthread_mutex_unlock(&bm->lock);
+
+    pager_run_batch(bm->pager, bm->checkpoint_ios, count);
+
+    pthread_mutex_unlock(&bm->checkpoint_io_lock);
+    pthread_mutex_lock(&bm->lock);
+    uint32_t written = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        // Pinned while it was written, the page is still in the same frame
+        uint32_t frame = pt_get(bm->cached_pages, bm->checkpoint_ios[i].page_id);
+        bm->frame_table[frame].pin_count--;
+        if (bm->checkpoint_ios[i].result < 0) checkpoint_write_failed(bm, frame);
+        else written++;
+    }
+    bm->num_checkpoint_ios = 0;
+    bm->stats.checkpoint_writes += written;
+    return written;
+}
+
+// Copies up to CHECKPOINT_BATCH of the pages the running checkpoint still
+// has to write, looking at the frames from checkpoint_cursor on. Pages of
+// the log's current group are left to finish_checkpoint_pass.
+void collect_checkpoint_pages(BufferManager *bm) {
+    while (bm->checkpoint_cursor < bm->num_frames &&
+        bm->num_checkpoint_ios < CHECKPOINT_BATCH) {
+
+        uint32_t frame = bm->checkpoint_cursor++;
+        Frame *f = &bm->frame_table[frame];
+        if (!f->checkpoint || f->unlogged) continue;
+        uint8_t *copy = bm->checkpoint_buffer + (size_t)bm->num_checkpoint_ios * PAGE_SIZE;
+        memcpy(copy, frame_data(bm, frame), PAGE_SIZE);
+        PageIO io = { PAGE_IO_WRITE, f->page_id, copy, 0 };
+        bm->checkpoint_ios[bm->num_checkpoint_ios++] = io;
+        f->dirty = 0;
+        f->checkpoint = 0;
+        f->pin_count++;
+    }
+}
+
+// Ends the pass of the running checkpoint at a commit boundary (no update
+// runs). The log is brought up to date, then the pages the pass left
+// because they were in the log's current group and the dirty free-space
+// map pages are written right away. The superblock of the log's last group
+// is the one the checkpoint records.
+void finish_checkpoint_pass(BufferManager *bm) {
+    // The superblock recorded has to be the one of a group in the log
+    if (commit_update(bm) < 0 || write_log_group(bm) < 0) {
+        bm->checkpoint_failed = 1;
+        bm->checkpoint_waiting = 0;
+        return;
+    }
+
+    uint32_t count = bm->num_fsm_pages;
+    for (uint32_t frame = 0; frame < bm->num_frames; frame++) {
+        if (bm->frame_table[frame].checkpoint) count++;
+    }
+    PageIO *ios = malloc(sizeof(PageIO) * count);
+    uint32_t num_writes = 0;
+    for (uint32_t frame = 0; frame < bm->num_frames; frame++) {
+        Frame *f = &bm->frame_table[frame];
+        if (!f->checkpoint || f->unlogged) continue;
+        wait_for_background_write(bm, f->page_id);
+        PageIO io = { PAGE_IO_WRITE, f->page_id, frame_data(bm, frame), 0 };
+        ios[num_writes++] = io;
+        f->dirty = 0;
+        f->checkpoint = 0;
+    }
+    for (uint32_t n = 0; n < bm->num_fsm_pages; n++) {
+        if (!bm->fsm_dirty[n] || bm->fsm_unlogged[n]) continue;
+        PageIO io = { PAGE_IO_WRITE, bm->fsm_pages[n]->page_id, (uint8_t*)bm->fsm_pages[n], 0 };
+        ios[num_writes++] = io;
+        bm->fsm_dirty[n] = 0;
+    }
+    qsort(ios, num_writes, sizeof(PageIO), compare_page_io);
+    pager_run_batch(bm->pager, ios, num_writes);
+    for (uint32_t i = 0; i < num_writes; i++) {
+        if (ios[i].result >= 0) {
+            bm->stats.checkpoint_writes++;
+            continue;
+        }
+        uint32_t n = 0;
+        while (n < bm->num_fsm_pages && (uint8_t*)bm->fsm_pages[n] != ios[i].buffer) n++;
+        if (n < bm->num_fsm_pages) {
+            bm->fsm_dirty[n] = 1;
+            bm->checkpoint_failed = 1;
+        }
+        else {
+            checkpoint_write_failed(bm, pt_get(bm->cached_pages, ios[i].page_id));
+        }
+    }
+    free(ios);
+
+    bm->checkpoint_superblock = bm->superblock;
+    bm->checkpoint_waiting = 0;
+}
+
+uint64_t monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Waits on wake (using CLOCK_MONOTONIC) until deadline_us (monotonic_us)
+// at the latest
+void wait_until(BufferManager *bm, pthread_cond_t *wake, uint64_t deadline_us) {
+    struct timespec ts = {
+        deadline_us / 1000000, (deadline_us % 1000000) * 1000
+    };
+    pthread_cond_timedwait(wake, &bm->lock, &ts);
+}
+
+void wait_for_checkpoint_wake(BufferManager *bm, uint64_t deadline_us) {
+    wait_until(bm, &bm->checkpoint_wake, deadline_us);
+}
+
+// One fuzzy checkpoint, called and returning with lock held. Every page
+// dirty at the start is written (or evicted) before the end while updates
+// continue, so the file then holds everything logged before
+// checkpoint_start and recovery can start there. Writes are paced to
+// checkpoint_rate while the log is within checkpoint_budget. -1 if a
+// write failed, the checkpoint is then not recorded and the log is kept.
+int run_checkpoint(BufferManager *bm) {
+    bm->checkpoint_running = 1;
+    bm->checkpoint_failed = 0;
+    bm->checkpoint_start = wal_position(bm->wal);
+    for (uint32_t frame = 0; frame < bm->num_frames; frame++) {
+        Frame *f = &bm->frame_table[frame];
+        f->checkpoint = f->page_id && f->dirty;
+    }
+
+    bm->checkpoint_cursor = 0;
+    uint64_t pace_start_us = monotonic_us();
+    uint64_t written = 0;
+    while (!bm->stopping && !bm->checkpoint_failed &&
+        bm->checkpoint_cursor < bm->num_frames) {
+
+        collect_checkpoint_pages(bm);
+        written += write_checkpoint_pages(bm);
+        if (!bm->checkpoint_rate ||
+            wal_bytes_since(bm->wal, recorded_checkpoint(bm)) > bm->checkpoint_budget) {
+
+            // Behind, catching up first
+            pace_start_us = monotonic_us();
+            written = 0;
+            continue;
+        }
+        uint64_t deadline_us = pace_start_us + written * 1000000 / bm->checkpoint_rate;
+        if (deadline_us > monotonic_us()) wait_for_checkpoint_wake(bm, deadline_us);
+    }
+
+    if (!bm->stopping && !bm->checkpoint_failed && bm->updates) {
+        bm->checkpoint_waiting = 1;
+        while (!bm->stopping && bm->checkpoint_waiting) {
+            pthread_cond_wait(&bm->checkpoint_wake, &bm->lock);
+        }
+    }
+    else if (!bm->stopping && !bm->checkpoint_failed) {
+        finish_checkpoint_pass(bm);
+    }
+    if (bm->stopping || bm->checkpoint_failed) {
+        bm->checkpoint_waiting = 0;
+        bm->checkpoint_running = 0;
+        return bm->checkpoint_failed ? -1 : 0;
+    }
+
+    // A page taken by the cleaner before the pass ended may still be on its
+    // way to the file
+    pthread_mutex_unlock(&bm->lock);
+    if (bm->cleaner_enabled) {
+        pthread_mutex_lock(&bm->io_lock);
+        pthread_mutex_unlock(&bm->io_lock);
+    }
+    int synced = pager_sync(bm->pager);
+    pthread_mutex_lock(&bm->lock);
+
+    // Not recorded when buffer_manager_sync emptied the log meanwhile,
+    // that checkpoint covers this one
+    WalPosition start = bm->checkpoint_start;
+    if (synced == 0 && wal_position(bm->wal).salt == start.salt) {
+        bm->checkpoint_superblock.checkpoint_salt = start.salt;
+        bm->checkpoint_superblock.checkpoint_offset = start.offset;
+        uint8_t buffer[PAGE_SIZE] = {0};
+        memcpy(buffer, &bm->checkpoint_superblock, sizeof(Superblock));
+        synced = write_page_to_db(bm->pager, buffer);
+        if (synced == 0) {
+            bm->superblock.checkpoint_salt = start.salt;
+            bm->superblock.checkpoint_offset = start.offset;
+            pthread_mutex_unlock(&bm->lock);
+            synced = pager_sync(bm->pager);
+            pthread_mutex_lock(&bm->lock);
+        }
+        if (synced == 0) {
+            wal_discard(bm->wal, start);
+            bm->stats.checkpoints++;
+        }
+    }
+    bm->checkpoint_running = 0;
+    return synced;
+}
+
+void *checkpointer_main(void *arg) {
+    BufferManager *bm = arg;
+    bm->checkpoint_buffer = aligned_alloc(PAGE_SIZE, CHECKPOINT_BATCH * PAGE_SIZE);
+
+    pthread_mutex_lock(&bm->lock);
+    while (!bm->stopping) {
+        if (wal_bytes_since(bm->wal, recorded_checkpoint(bm)) >= bm->checkpoint_budget / 2) {
+            if (run_checkpoint(bm) < 0) {
+                uint64_t retry_us = monotonic_us() + CHECKPOINT_RETRY_US;
+                while (!bm->stopping && monotonic_us() < retry_us) {
+                    wait_for_checkpoint_wake(bm, retry_us);
+                }
+            }
+        }
+        else {
+            pthread_cond_wait(&bm->checkpoint_wake, &bm->lock);
+        }
+    }
+    pthread_mutex_unlock(&bm->lock);
+
+    free(bm->checkpoint_buffer);
+    return NULL;
+}
+
+// Commits only write the group when one comes after wal_sync_interval_us,
+// this writes it once the interval is over when none does. Retried an
+// interval later while an update runs or the write failed.
+void *log_flusher_main(void *arg) {
+    BufferManager *bm = arg;
+    pthread_mutex_lock(&bm->lock);
+    uint64_t retry_us = 0;
+    while (!bm->stopping) {
+        uint64_t deadline_us = wal_group_deadline(bm->wal);
+        if (deadline_us && deadline_us < retry_us) deadline_us = retry_us;
+        if (!deadline_us) {
+            pthread_cond_wait(&bm->log_flush_wake, &bm->lock);
+        }
+        else if (monotonic_us() < deadline_us) {
+            wait_until(bm, &bm->log_flush_wake, deadline_us);
+        }
+        else if (bm->updates || write_log_group(bm) < 0) {
+            retry_us = monotonic_us() + bm->log_flush_interval_us;
+        }
+    }
+    pthread_mutex_unlock(&bm->lock);
+    return NULL;
+}
+
+void set_watermarks(BufferManager *bm) {
+    bm->high_watermark = bm->requested_high_watermark;
+    if (bm->high_watermark > bm->target_frames / 2) {
+        bm->high_watermark = bm->target_frames / 2;
+    }
+    bm->low_watermark = bm->requested_low_watermark;
+    if (bm->low_watermark > bm->high_watermark) {
+        bm->low_watermark = bm->high_watermark;
+    }
+}
+
+void buffer_manager_lock(BufferManager *bm) {
+    if (bm->locking) pthread_mutex_lock(&bm->lock);
+}
+
+void buffer_manager_unlock(BufferManager *bm) {
+    if (bm->locking) pthread_mutex_unlock(&bm->lock);
+}
+
+// Moves the first free-list page on disk into available_pages, the
+// free-list page itself is free as well
+void load_free_list_page(BufferManager *bm) {
+    uint32_t page_id = bm->superblock.free_list_page_id;
+    FreeListPage page;
+    bm->superblock.free_list_page_id = 0;
+    bm->superblock_dirty = 1;
+    if (pager_read(bm->pager, page_id, (uint8_t*)&page) < 0) return;
+    if (page.page_type != FREE_LIST_PAGE || page.page_id != page_id ||
+        page.num_page_ids > FREE_LIST_CAPACITY) {
+        fprintf(stderr, "Invalid free-list page(%u), rest of the free list is lost\n", page_id);
+        return;
+    }
+
+    for (uint32_t i = 0; i < page.num_page_ids; i++) {
+        heap_insert(bm->available_pages, &page.page_ids[i]);
+    }
+    heap_insert(bm->available_pages, &page_id);
+    bm->superblock.free_list_page_id = page.next_page_id;
+}
+
+// Writes available_pages to free-list pages (taken from available_pages)
+// in front of the free list on disk. -1 if a page could not be written,
+// its page ids are then back in available_pages.
+int store_free_list(BufferManager *bm) {
+    FreeListPage page;
+    while (!heap_is_empty(bm->available_pages)) {
+        memset(&page, 0, sizeof(FreeListPage));
+        page.page_type = FREE_LIST_PAGE;
+        page.page_id = *(uint32_t*)heap_top(bm->available_pages);
+        heap_pop(bm->available_pages);
+        page.next_page_id = bm->superblock.free_list_page_id;
+        while (page.num_page_ids < FREE_LIST_CAPACITY &&
+            !heap_is_empty(bm->available_pages)) {
+
+            page.page_ids[page.num_page_ids++] = *(uint32_t*)heap_top(bm->available_pages);
+            heap_pop(bm->available_pages);
+        }
+        if (write_page_to_db(bm->pager, &page) < 0) {
+            for (uint32_t i = 0; i < page.num_page_ids; i++) {
+                heap_insert(bm->available_pages, &page.page_ids[i]);
+            }
+            heap_insert(bm->available_pages, &page.page_id);
+            return -1;
+        }
+        bm->superblock.free_list_page_id = page.page_id;
+        bm->superblock_dirty = 1;
+    }
+    return 0;
+}
+
+int write_superblock(BufferManager *bm) {
+    uint8_t buffer[PAGE_SIZE] = {0};
+    memcpy(buffer, &bm->superblock, sizeof(Superblock));
+    if (write_page_to_db(bm->pager, buffer) < 0) return -1;
+    bm->superblock_dirty = 0;
+    return 0;
+}
+
+// Page 0 of an existing database, or a new superblock for an empty file or
+// a file written before page 0 was used (every page in it is kept)
+// -1 if the file was created with another page size or superblock
+// version. The superblock is at offset 0 with the same layout for every
+// page size, so it can be read either way.
+int read_superblock(BufferManager *bm) {
+    uint8_t buffer[PAGE_SIZE];
+    Superblock *superblock = (Superblock*)buffer;
+    if (pager_read(bm->pager, SUPERBLOCK_PAGE_ID, buffer) == 0 &&
+        superblock->page_type == SUPERBLOCK_PAGE &&
+        superblock->magic == SUPERBLOCK_MAGIC) {
+
+        // Leaves of other versions are laid out differently
+        if (superblock->version != SUPERBLOCK_VERSION) {
+            fprintf(stderr, "Unknown superblock version %u\n", superblock->version);
+            return -1;
+        }
+        bm->superblock = *superblock;
+        bm->superblock_dirty = 0;
+        if (!bm->superblock.page_size) {
+            bm->superblock.page_size = 4096;
+            bm->superblock_dirty = 1;
+        }
+        if (bm->superblock.page_size != PAGE_SIZE) {
+            fprintf(stderr, "Database file has %u byte pages, built for %u\n",
+                bm->superblock.page_size, (uint32_t)PAGE_SIZE);
+            return -1;
+        }
+        return 0;
+    }
 
-typedef struct CachedPage {
-    uint32_t order;
-    uint32_t page_id;
-} CachedPage;
+    memset(&bm->superblock, 0, sizeof(Superblock));
+    bm->superblock.page_type = SUPERBLOCK_PAGE;
+    bm->superblock.version = SUPERBLOCK_VERSION;
+    bm->superblock.page_id = SUPERBLOCK_PAGE_ID;
+    bm->superblock.magic = SUPERBLOCK_MAGIC;
+    bm->superblock.page_size = PAGE_SIZE;
+    uint32_t num_pages = pager_num_pages(bm->pager);
+    bm->superblock.page_count = num_pages > 1 ? num_pages : 1;
+    bm->superblock_dirty = 1;
+    return 0;
+}
 
-uint8_t cached_page_lesser(void *a, void *b) {
-    return ((CachedPage*)a)->page_id > ((CachedPage*)b)->page_id;
+uint32_t allocate_page_id(BufferManager *bm) {
+    if (heap_is_empty(bm->available_pages) && bm->superblock.free_list_page_id) {
+        load_free_list_page(bm);
+    }
+    if (!heap_is_empty(bm->available_pages)) {
+        uint32_t page_id = *(uint32_t*)heap_top(bm->available_pages);
+        heap_pop(bm->available_pages);
+        return page_id;
+    }
+    bm->superblock_dirty = 1;
+    return bm->superblock.page_count++;
 }
 
-struct BufferManager {
+// Free-space map page covering page_id, reading the chain up to it. Pages
+// past the end of the chain are added when create is set, NULL otherwise.
+FsmPage *fsm_page(BufferManager *bm, uint32_t page_id, uint8_t create) {
+    uint32_t n = page_id / FSM_CAPACITY;
+    while (bm->num_fsm_pages <= n) {
+        if (!bm->fsm_next_page_id && !create) return NULL;
 
-    // Map of form (key; value): (uint32_t(page_id); **Page(page))
-    Map *cached_pages;
+        FsmPage *page = malloc(sizeof(FsmPage));
+        uint8_t dirty = 0;
+        if (bm->fsm_next_page_id) {
+            uint32_t next_page_id = bm->fsm_next_page_id;
+            bm->fsm_next_page_id = 0;
+            if (pager_read(bm->pager, next_page_id, (uint8_t*)page) < 0 ||
+                page->page_type != FSM_PAGE || page->page_id != next_page_id) {
 
-    // Very dumb solution because cannot be bothered right now to
-    // implement general use IndexedHeap even though it wouldnt be 
-    // too difficult, using FreePageHeap with the element FreeDataPage.free_space
-    // as the ordering of the heap, inserting elements as {page_id, INTMAX-cur_order}
-    FreePageHeap *cached_pages_queue;
+                fprintf(stderr, "Invalid free-space map page(%u), rest of the map is lost\n",
+                    next_page_id);
+                free(page);
+                continue;
+            }
+            bm->fsm_next_page_id = page->next_page_id;
+        }
+        else {
+            memset(page, 0, sizeof(FsmPage));
+            page->page_type = FSM_PAGE;
+            page->page_id = allocate_page_id(bm);
+            if (bm->num_fsm_pages) {
+                bm->fsm_pages[bm->num_fsm_pages - 1]->next_page_id = page->page_id;
+                bm->fsm_dirty[bm->num_fsm_pages - 1] = 1;
+                bm->fsm_unlogged[bm->num_fsm_pages - 1] = 1;
+            }
+            else {
+                bm->superblock.fsm_page_id = page->page_id;
+                bm->superblock_dirty = 1;
+            }
+            dirty = 1;
+        }
 
-    // Heap with elements of type uint32_t (lesser)
-    Heap *available_pages;
+        if (bm->num_fsm_pages == bm->fsm_pages_size) {
+            bm->fsm_pages_size = bm->fsm_pages_size ? bm->fsm_pages_size * 2 : 8;
+            bm->fsm_pages = realloc(bm->fsm_pages, bm->fsm_pages_size * sizeof(FsmPage*));
+            bm->fsm_dirty = realloc(bm->fsm_dirty, bm->fsm_pages_size);
+            bm->fsm_unlogged = realloc(bm->fsm_unlogged, bm->fsm_pages_size);
+        }
+        bm->fsm_pages[bm->num_fsm_pages] = page;
+        bm->fsm_dirty[bm->num_fsm_pages] = dirty;
+        bm->fsm_unlogged[bm->num_fsm_pages] = dirty;
+        bm->num_fsm_pages++;
+    }
+    return bm->fsm_pages[n];
+}
 
-    // Heap with elements of type FreeDataPage sorted on FreeDataPage.free_space (greater)
-    FreePageHeap *nonfull_data_pages;
+// Reads the pages of sorted (ascending page_ids) not cached yet in one
+// batch, into free frames only unless evict is set. page_ids that do not
+// hold a page are skipped. Number of pages read, frames lists the frames
+// now holding them, unpinned but not inserted into the policy yet.
+uint32_t read_pages(BufferManager *bm, uint32_t *sorted, uint32_t count, uint8_t evict,
+    uint32_t *frames) {
 
-    uint32_t used_space;
-    uint32_t max_order_page_queue;
-    char *db_file_path;
-};
+    PageIO *ios = malloc(sizeof(PageIO) * count);
+    uint32_t num_reads = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t page_id = sorted[i];
+        if (!page_id || pt_get(bm->cached_pages, page_id) != PT_NOT_FOUND) continue;
+        uint32_t frame = evict ? find_frame(bm) : pop_free_frame(bm);
+        if (frame == NO_FRAME) break;
 
-void add_page_to_cache(BufferManager *bm, void *page, uint32_t page_id) {
+        // In the page table so duplicates are skipped, pinned so the frame
+        // is not taken by a victim search until the read is done
+        Frame *f = &bm->frame_table[frame];
+        f->page_id = page_id;
+        f->pin_count = 1;
+        pt_insert(bm->cached_pages, page_id, frame);
+        wait_for_background_write(bm, page_id);
+        PageIO io = { PAGE_IO_READ, page_id, frame_data(bm, frame), 0 };
+        ios[num_reads] = io;
+        frames[num_reads++] = frame;
+    }
+    pager_run_batch(bm->pager, ios, num_reads);
+
+    uint32_t num_read = 0;
+    for (uint32_t i = 0; i < num_reads; i++) {
+        Frame *f = &bm->frame_table[frames[i]];
+        uint8_t page_type = ios[i].buffer[0];
+        f->pin_count = 0;
+        if (ios[i].result < 0 || page_get_id(ios[i].buffer) != ios[i].page_id ||
+            (page_type != BPT_PAGE && page_type != DATA_PAGE)) {
 
-    if (rbt_size(bm->cached_pages) >= MAX_CACHED_PAGES) {
-        printf("Writeback!\n");
-        // When cache overflows, write back 30%ish to db
-        uint32_t cnt = MAX_CACHED_PAGES * (uint32_t)30 / (uint32_t)100;
-        for (int i = 0; i < cnt; i++) {
-            CachedPage cached_page = *(CachedPage*)fph_top(bm->cached_pages_queue);
-            fph_pop(bm->cached_pages_queue);
-            Page *page = buffer_manager_get_page(bm, cached_page.page_id);
-            write_page_to_db(bm->db_file_path, (void*)page);
-            buffer_manager_free_page(bm, cached_page.page_id);
+            // Not a page, page_ids passed here are only hints
+            pt_delete(bm->cached_pages, f->page_id);
+            f->page_id = 0;
+            stack_push(bm->free_frames, frames[i]);
+            continue;
         }
+        frames[num_read++] = frames[i];
     }
-    // printf("Adding page (%d) to cache\n", page_id);
+    free(ios);
+    return num_read;
+}
 
-    
-    CachedPage p = {
-        INT32_MAX - (bm->max_order_page_queue++),
-        page_id
-    };
-    fph_insert(bm->cached_pages_queue, (FreeDataPage*)&p);
+// Sidecar file of a warm restart, the page_ids follow the header
+typedef struct WarmFileHeader {
+    uint32_t magic;
+    uint32_t page_size;
+    uint32_t count;
+    // The first num_hot page_ids were hot for the policy, see order
+    uint32_t num_hot;
+} WarmFileHeader;
+
+#define WARM_FILE_MAGIC (uint32_t)0x4D524157 // "WARM"
+// Pages read back per batch, the background preload takes lock per batch
+#define PRELOAD_BATCH 128
+
+// Writes the page_ids of the cached pages to warm_path, replacing the file
+// only once the new one was written completely
+void save_warm_pages(BufferManager *bm) {
+    uint32_t *page_ids = malloc(sizeof(uint32_t) * (bm->num_frames + 1));
+    WarmFileHeader header = { WARM_FILE_MAGIC, PAGE_SIZE, 0, 0 };
+    header.count = bm->policy->order(bm, page_ids, &header.num_hot);
+    for (uint32_t i = 0; i < header.count; i++) {
+        page_ids[i] = bm->frame_table[page_ids[i]].page_id;
+    }
+
+    char *tmp_path = malloc(strlen(bm->warm_path) + sizeof(".tmp"));
+    sprintf(tmp_path, "%s.tmp", bm->warm_path);
+    FILE *f = fopen(tmp_path, "w");
+    uint8_t written = f && fwrite(&header, sizeof(header), 1, f) == 1 &&
+        fwrite(page_ids, sizeof(uint32_t), header.count, f) == header.count;
+    if (f && fclose(f) != 0) written = 0;
+    if (!written || rename(tmp_path, bm->warm_path) < 0) {
+        perror("warm restart save");
+        remove(tmp_path);
+    }
+    free(tmp_path);
+    free(page_ids);
+}
 
-    // Inserts a pointer to the page- as the value
-    rbt_insert(bm->cached_pages, page_id, &page, sizeof(void*));
+// Reads the page_ids saved by the last save_warm_pages into warm_pages, at
+// most as many as fit in the pool. Nothing is read back from a missing or
+// damaged file.
+void load_warm_pages(BufferManager *bm) {
+    FILE *f = fopen(bm->warm_path, "r");
+    if (!f) return;
+    WarmFileHeader header;
+    if (fread(&header, sizeof(header), 1, f) == 1 && header.magic == WARM_FILE_MAGIC &&
+        header.page_size == PAGE_SIZE && header.num_hot <= header.count) {
+
+        uint32_t count = header.count < bm->target_frames ? header.count : bm->target_frames;
+        bm->warm_pages = malloc(sizeof(uint32_t) * (count + 1));
+        if (fread(bm->warm_pages, sizeof(uint32_t), count, f) == count) {
+            bm->num_warm_pages = count;
+            bm->num_warm_hot = header.num_hot < count ? header.num_hot : count;
+        }
+    }
+    fclose(f);
+}
+
+// Reads the next batch of warm_pages, hottest first, into free frames.
+// A batch holds only hot or only other pages. 0 once every page was read
+// or the pool has no free frame left.
+uint8_t preload_batch(BufferManager *bm) {
+    uint32_t start = bm->warm_cursor;
+    uint32_t end = bm->num_warm_pages;
+    if (start < bm->num_warm_hot) end = bm->num_warm_hot;
+    if (end - start > PRELOAD_BATCH) end = start + PRELOAD_BATCH;
+    if (start == end || stack_is_empty(bm->free_frames)) return 0;
+
+    uint32_t sorted[PRELOAD_BATCH];
+    uint32_t frames[PRELOAD_BATCH];
+    memcpy(sorted, &bm->warm_pages[start], sizeof(uint32_t) * (end - start));
+    qsort(sorted, end - start, sizeof(uint32_t), compare_page_id);
+    uint32_t num_read = read_pages(bm, sorted, end - start, 0, frames);
+    for (uint32_t i = 0; i < num_read; i++) {
+        if (start < bm->num_warm_hot) bm->policy->insert_hot(bm, frames[i]);
+        else bm->policy->insert(bm, frames[i]);
+    }
+    bm->stats.preloads += num_read;
+    bm->warm_cursor = end;
+    return 1;
+}
+
+void *preloader_main(void *arg) {
+    BufferManager *bm = arg;
+    uint8_t more = 1;
+    while (more) {
+        pthread_mutex_lock(&bm->lock);
+        more = !bm->stopping && preload_batch(bm);
+        pthread_mutex_unlock(&bm->lock);
+    }
+    return NULL;
 }
 
-BufferManager *buffer_manager_init(char *db_file_path) {
+BufferManager *buffer_manager_init(char *db_file_path, BufferManagerOptions *options) {
+    BufferManagerOptions defaults = {
+        REPLACEMENT_CLOCK, 0, 0, DEFAULT_POOL_SIZE, PAGER_IO_SYNC, PAGER_DEFAULT_QUEUE_DEPTH,
+        PAGER_DEFAULT_MAX_COALESCE, PAGER_OS_CACHE_KEEP, 0, 0, 0, 0, 0, 0, WARM_RESTART_OFF
+    };
+    if (!options) options = &defaults;
+    size_t pool_size = options->pool_size ? options->pool_size : DEFAULT_POOL_SIZE;
+
     BufferManager *bm = malloc(sizeof(BufferManager));
-    bm->cached_pages = rbt_init();
-    bm->cached_pages_queue = new_fph();
     bm->available_pages = new_minheap();
     bm->nonfull_data_pages = new_fph();
-    bm->used_space = 1;
-    bm->max_order_page_queue = 0;
-    bm->db_file_path = db_file_path;
+    memset(&bm->stats, 0, sizeof(BufferManagerStats));
+    bm->io_queue_depth = options->io_queue_depth ?
+        options->io_queue_depth : PAGER_DEFAULT_QUEUE_DEPTH;
+    bm->read_only = options->read_only;
+    bm->scans = 0;
+    PagerOptions pager_options = {
+        options->io_backend, bm->io_queue_depth, options->io_max_coalesce, options->os_cache,
+        options->read_only
+    };
+    bm->pager = pager_open(db_file_path, &pager_options);
+    if (!bm->pager) {
+        heap_free(bm->available_pages);
+        fph_free(bm->nonfull_data_pages);
+        free(bm);
+        return NULL;
+    }
+
+    // Commits logged after the last checkpoint are brought into the file
+    // before anything is read from it
+    bm->wal = NULL;
+    bm->updates = 0;
+    bm->changed = 0;
+    bm->unlogged = NULL;
+    bm->num_unlogged = 0;
+    bm->unlogged_size = 0;
+    uint8_t failed = 0;
+    if (options->wal && !options->read_only) {
+        char *wal_path = malloc(strlen(db_file_path) + sizeof("-wal"));
+        sprintf(wal_path, "%s-wal", db_file_path);
+        bm->wal = wal_open(wal_path, options->wal_commits_per_sync,
+            options->wal_sync_interval_us);
+        free(wal_path);
+
+        // From the position the last checkpoint recorded in the file
+        uint8_t buffer[PAGE_SIZE];
+        Superblock *superblock = (Superblock*)buffer;
+        WalPosition from = { 0, 0 };
+        if (pager_read(bm->pager, SUPERBLOCK_PAGE_ID, buffer) == 0 &&
+            superblock->page_type == SUPERBLOCK_PAGE &&
+            superblock->magic == SUPERBLOCK_MAGIC) {
+
+            from.salt = superblock->checkpoint_salt;
+            from.offset = superblock->checkpoint_offset;
+        }
+        if (bm->wal) wal_recover(bm->wal, bm->pager, from);
+        else failed = 1;
+    }
+    if (failed || read_superblock(bm) < 0) {
+        wal_close(bm->wal);
+        pager_close(bm->pager);
+        heap_free(bm->available_pages);
+        fph_free(bm->nonfull_data_pages);
+        free(bm);
+        return NULL;
+    }
+    if (bm->wal) wal_reset(bm->wal);
+    bm->fsm_pages = NULL;
+    bm->fsm_dirty = NULL;
+    bm->fsm_unlogged = NULL;
+    bm->num_fsm_pages = 0;
+    bm->fsm_pages_size = 0;
+    bm->fsm_next_page_id = bm->superblock.fsm_page_id;
+    bm->fsm_cursor = bm->superblock.fsm_page_id ? 0 : FSM_CURSOR_DONE;
+
+    // Without room to grow if the large reservation is refused
+    bm->frames_reserved = pool_size > POOL_RESERVE_SIZE ? pool_size : POOL_RESERVE_SIZE;
+    bm->frames = reserve_frames(bm->frames_reserved);
+    if (!bm->frames) {
+        bm->frames_reserved = pool_size;
+        bm->frames = reserve_frames(bm->frames_reserved);
+    }
+    bm->num_frames = pool_size_to_frames(bm, pool_size);
+    bm->target_frames = bm->num_frames;
+    commit_frames(bm, 0, bm->num_frames);
+    bm->frame_table_size = bm->num_frames;
+    bm->frame_table = calloc(bm->frame_table_size, sizeof(Frame));
+    bm->cached_pages = pt_init(bm->num_frames);
+    bm->free_frames = stack_init();
+    rebuild_free_frames(bm);
+
+    switch (options->policy) {
+        case REPLACEMENT_2Q: bm->policy = &two_q_policy; break;
+        case REPLACEMENT_FIFO: bm->policy = &fifo_policy; break;
+        default: bm->policy = &clock_policy; break;
+    }
+    bm->policy->init(bm);
+
+    bm->cleaner_enabled = options->high_watermark > 0;
+    bm->checkpointer_enabled = bm->wal && options->checkpoint_replay_ms > 0;
+    bm->warm_path = NULL;
+    bm->warm_pages = NULL;
+    bm->num_warm_pages = 0;
+    bm->num_warm_hot = 0;
+    bm->warm_cursor = 0;
+    bm->preloader_enabled = 0;
+    if (options->warm_restart && !options->read_only) {
+        bm->warm_path = malloc(strlen(db_file_path) + sizeof("-warm"));
+        sprintf(bm->warm_path, "%s-warm", db_file_path);
+        load_warm_pages(bm);
+        bm->preloader_enabled = bm->num_warm_pages > 0 &&
+            options->warm_restart == WARM_RESTART_BACKGROUND;
+    }
+    // Only groups of several commits can be left pending
+    bm->log_flusher_enabled = bm->wal && options->wal_commits_per_sync > 1 &&
+        options->wal_sync_interval_us > 0;
+    bm->log_flush_interval_us = options->wal_sync_interval_us;
+    bm->locking = bm->cleaner_enabled || bm->checkpointer_enabled ||
+        bm->preloader_enabled || bm->log_flusher_enabled;
+    bm->stopping = 0;
+    bm->cleaning_page_id = 0;
+    bm->requested_high_watermark = options->high_watermark;
+    bm->requested_low_watermark = options->low_watermark;
+    set_watermarks(bm);
+    bm->checkpoint_running = 0;
+    bm->checkpoint_waiting = 0;
+    bm->checkpoint_failed = 0;
+    bm->checkpoint_budget =
+        (uint64_t)options->checkpoint_replay_ms * REPLAY_BYTES_PER_SECOND / 1000;
+    bm->checkpoint_rate = options->checkpoint_pages_per_second;
+    bm->checkpoint_buffer = NULL;
+    bm->num_checkpoint_ios = 0;
+    if (bm->locking) {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init(&bm->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+    }
+    if (bm->cleaner_enabled) {
+        pthread_mutex_init(&bm->io_lock, NULL);
+        pthread_cond_init(&bm->cleaner_wake, NULL);
+        pthread_create(&bm->cleaner, NULL, cleaner_main, bm);
+    }
+    if (bm->checkpointer_enabled) {
+        // Paced with deadlines from monotonic_us
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&bm->checkpoint_wake, &attr);
+        pthread_condattr_destroy(&attr);
+        pthread_mutex_init(&bm->checkpoint_io_lock, NULL);
+        pthread_create(&bm->checkpointer, NULL, checkpointer_main, bm);
+    }
+    if (bm->log_flusher_enabled) {
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&bm->log_flush_wake, &attr);
+        pthread_condattr_destroy(&attr);
+        pthread_create(&bm->log_flusher, NULL, log_flusher_main, bm);
+    }
+    if (bm->preloader_enabled) {
+        pthread_create(&bm->preloader, NULL, preloader_main, bm);
+    }
+    else {
+        buffer_manager_lock(bm);
+        while (preload_batch(bm));
+        buffer_manager_unlock(bm);
+    }
     return bm;
 }
 
 void buffer_manager_free(BufferManager *bm) {
-    while (!fph_empty(bm->cached_pages_queue)) {
-        CachedPage page = *(CachedPage*)fph_top(bm->cached_pages_queue);
-        fph_pop(bm->cached_pages_queue);
-        buffer_manager_free_page(bm, page.page_id);
+    // Committed updates are durable once this returns
+    buffer_manager_flush_log(bm);
+    if (bm->locking) {
+        pthread_mutex_lock(&bm->lock);
+        bm->stopping = 1;
+        if (bm->cleaner_enabled) pthread_cond_signal(&bm->cleaner_wake);
+        if (bm->checkpointer_enabled) pthread_cond_signal(&bm->checkpoint_wake);
+        if (bm->log_flusher_enabled) pthread_cond_signal(&bm->log_flush_wake);
+        pthread_mutex_unlock(&bm->lock);
+    }
+    // The checkpointer waits for writes of the cleaner
+    if (bm->cleaner_enabled) pthread_join(bm->cleaner, NULL);
+    if (bm->checkpointer_enabled) pthread_join(bm->checkpointer, NULL);
+    if (bm->log_flusher_enabled) pthread_join(bm->log_flusher, NULL);
+    if (bm->preloader_enabled) pthread_join(bm->preloader, NULL);
+    if (bm->warm_path) save_warm_pages(bm);
+    if (bm->cleaner_enabled) {
+        pthread_cond_destroy(&bm->cleaner_wake);
+        pthread_mutex_destroy(&bm->io_lock);
     }
-    rbt_free(bm->cached_pages);
-    fph_free(bm->cached_pages_queue);
+    if (bm->checkpointer_enabled) {
+        pthread_cond_destroy(&bm->checkpoint_wake);
+        pthread_mutex_destroy(&bm->checkpoint_io_lock);
+    }
+    if (bm->log_flusher_enabled) pthread_cond_destroy(&bm->log_flush_wake);
+    if (bm->locking) pthread_mutex_destroy(&bm->lock);
+
+    bm->policy->free(bm);
+    pt_free(bm->cached_pages);
     heap_free(bm->available_pages);
     fph_free(bm->nonfull_data_pages);
-    // free(bm->db_file_path); Passer should handle this
+    for (uint32_t n = 0; n < bm->num_fsm_pages; n++) {
+        free(bm->fsm_pages[n]);
+    }
+    free(bm->fsm_pages);
+    free(bm->fsm_dirty);
+    free(bm->fsm_unlogged);
+    wal_close(bm->wal);
+    free(bm->unlogged);
+    free(bm->warm_path);
+    free(bm->warm_pages);
+    munmap(bm->frames, bm->frames_reserved);
+    free(bm->frame_table);
+    stack_free(bm->free_frames);
+    pager_close(bm->pager);
     free(bm);
 }
 
+int buffer_manager_resize(BufferManager *bm, size_t pool_size) {
+    buffer_manager_lock(bm);
+    uint32_t frames = pool_size_to_frames(bm, pool_size);
+
+    if (frames > bm->num_frames) {
+        if (commit_frames(bm, bm->num_frames, frames) < 0) {
+            buffer_manager_unlock(bm);
+            return -1;
+        }
+        if (frames > bm->frame_table_size) {
+            bm->frame_table = realloc(bm->frame_table, sizeof(Frame) * frames);
+            memset(&bm->frame_table[bm->frame_table_size], 0,
+                sizeof(Frame) * (frames - bm->frame_table_size));
+            bm->frame_table_size = frames;
+        }
+        bm->num_frames = frames;
+    }
+
+    uint32_t old_target_frames = bm->target_frames;
+    bm->target_frames = frames;
+    if (frames > old_target_frames) {
+        // Free frames above the old target were dropped from the stack
+        rebuild_free_frames(bm);
+    }
+    else if (frames < bm->num_frames) {
+        shrink_pool(bm, SHRINK_STEP_FRAMES);
+    }
+    bm->policy->resize(bm);
+    set_watermarks(bm);
+
+    buffer_manager_unlock(bm);
+    return 0;
+}
+
+uint32_t buffer_manager_get_root(BufferManager *bm, uint32_t slot) {
+    if (slot >= MAX_ROOTS) return 0;
+    buffer_manager_lock(bm);
+    uint32_t page_id = bm->superblock.roots[slot];
+    buffer_manager_unlock(bm);
+    return page_id;
+}
+
+void buffer_manager_set_root(BufferManager *bm, uint32_t slot, uint32_t page_id) {
+    if (slot >= MAX_ROOTS || bm->read_only) return;
+    buffer_manager_begin_update(bm);
+    buffer_manager_lock(bm);
+    if (bm->superblock.roots[slot] != page_id) {
+        bm->superblock.roots[slot] = page_id;
+        bm->superblock_dirty = 1;
+        bm->changed = 1;
+    }
+    buffer_manager_unlock(bm);
+    buffer_manager_end_update(bm);
+}
+
+void buffer_manager_begin_update(BufferManager *bm) {
+    if (!bm->wal) return;
+    buffer_manager_lock(bm);
+    bm->updates++;
+    buffer_manager_unlock(bm);
+}
+
+int buffer_manager_end_update(BufferManager *bm) {
+    if (!bm->wal) return 0;
+    buffer_manager_lock(bm);
+    int result = 0;
+    if (bm->updates && --bm->updates == 0) {
+        result = commit_update(bm);
+        if (bm->checkpoint_waiting) {
+            finish_checkpoint_pass(bm);
+            pthread_cond_signal(&bm->checkpoint_wake);
+        }
+    }
+    buffer_manager_unlock(bm);
+    return result;
+}
+
+int buffer_manager_flush_log(BufferManager *bm) {
+    if (!bm->wal) return 0;
+    buffer_manager_lock(bm);
+    int result = 0;
+    // Pages of a running update are in the middle of being changed
+    if (!bm->updates) {
+        result = commit_update(bm);
+        if (result == 0) result = write_log_group(bm);
+    }
+    buffer_manager_unlock(bm);
+    return result;
+}
+
+void buffer_manager_begin_scan(BufferManager *bm) {
+    if (bm->read_only && bm->scans++ == 0) {
+        pager_advise(bm->pager, 0, UINT32_MAX, MADV_SEQUENTIAL);
+    }
+}
+
+void buffer_manager_end_scan(BufferManager *bm) {
+    if (bm->read_only && bm->scans && --bm->scans == 0) {
+        pager_advise(bm->pager, 0, UINT32_MAX, MADV_NORMAL);
+    }
+}
+
+size_t buffer_manager_get_pool_size(BufferManager *bm) {
+    buffer_manager_lock(bm);
+    size_t pool_size = (size_t)bm->num_frames * PAGE_SIZE;
+    buffer_manager_unlock(bm);
+    return pool_size;
+}
+
+uint32_t buffer_manager_unpinned_frames(BufferManager *bm) {
+    if (bm->read_only) return UINT32_MAX;
+    buffer_manager_lock(bm);
+    uint32_t unpinned = 0;
+    for (uint32_t frame = 0; frame < bm->num_frames; frame++) {
+        unpinned += bm->frame_table[frame].pin_count == 0;
+    }
+    buffer_manager_unlock(bm);
+    return unpinned;
+}
+
+BufferManagerStats buffer_manager_get_stats(BufferManager *bm) {
+    buffer_manager_lock(bm);
+    BufferManagerStats stats = bm->stats;
+    stats.syscalls = pager_get_stats(bm->pager).syscalls;
+    if (bm->wal) {
+        WalStats wal_stats = wal_get_stats(bm->wal);
+        stats.commits = wal_stats.commits;
+        stats.log_flushes = wal_stats.groups;
+    }
+    buffer_manager_unlock(bm);
+    return stats;
+}
+
+void buffer_manager_mark_dirty(BufferManager *bm, void *page) {
+    if (bm->read_only) return;
+    size_t frame = ((uint8_t*)page - bm->frames) / PAGE_SIZE;
+    buffer_manager_lock(bm);
+    set_dirty(bm, frame);
+    buffer_manager_unlock(bm);
+}
+
+void buffer_manager_unpin_page(BufferManager *bm, void *page) {
+    if (bm->read_only) return;
+    size_t frame = ((uint8_t*)page - bm->frames) / PAGE_SIZE;
+    buffer_manager_lock(bm);
+    // Freeing a page drops its pins, later unpins of it are ignored
+    if (bm->frame_table[frame].pin_count > 0) {
+        bm->frame_table[frame].pin_count--;
+    }
+    buffer_manager_unlock(bm);
+}
+
 Page *buffer_manager_new_bpt_page(BufferManager *bm, uint8_t is_leaf) {
-    // printf("New bpt-page(%d)\n", bm->used_space);
-    Page *page = malloc(sizeof(Page));
+    // printf("New bpt-page(%d)\n", bm->superblock.page_count);
+    if (bm->read_only) return NULL;
+    buffer_manager_lock(bm);
+    uint32_t frame = take_frame(bm);
+    if (frame == NO_FRAME) {
+        buffer_manager_unlock(bm);
+        return NULL;
+    }
+    Page *page = frame_data(bm, frame);
+    memset(page, 0, PAGE_SIZE);
+
     PageHeader header;
     header.is_leaf = is_leaf;
     header.num_keys = 0;
     header.page_type = BPT_PAGE;
-
-    if (!heap_is_empty(bm->available_pages)) {
-        header.page_id = *(uint32_t*)heap_top(bm->available_pages);
-        heap_pop(bm->available_pages);
-
-        // Update the info of freed pages in root (might be done when writing back to db)
-    }
-    else {
-        header.page_id = bm->used_space++;
-    }
+    header.page_id = allocate_page_id(bm);
 
     if (is_leaf) {
-        page->leaf = malloc(sizeof(LeafPage));
-        page->leaf->next_page_id = 0;
-    }
-    else {
-        page->internal = malloc(sizeof(InternalPage));
+        page->leaf.next_page_id = 0;
+        page->leaf.prev_page_id = 0;
     }
 
     page->header = header;
 
-    add_page_to_cache(bm, page, page->header.page_id);
+    add_page_to_cache(bm, frame, page->header.page_id);
+    bm->frame_table[frame].pin_count = 1;
+    set_dirty(bm, frame);
+    buffer_manager_unlock(bm);
     return page;
 }
 
-void *buffer_manager_get_page(BufferManager *bm, uint32_t page_id) {
+// Page of a read-only buffer manager, checked like read_page_from_db
+void *mapped_page(BufferManager *bm, uint32_t page_id) {
+    if (page_id == 0) return NULL;
+    uint8_t *page = pager_mapped_page(bm->pager, page_id);
+    if (!page || page_get_id(page) != page_id ||
+        (page[0] != BPT_PAGE && page[0] != DATA_PAGE)) {
+        printf("Invalid page-id: %u\n", page_id);
+        return NULL;
+    }
+    return page;
+}
+
+void *fetch_page(BufferManager *bm, uint32_t page_id) {
+    // Keeps a shrink going when every request hits
+    if (bm->num_frames > bm->target_frames) {
+        shrink_pool(bm, SHRINK_STEP_FRAMES);
+    }
+
     if (page_id == 0) {
         // Page-id 0 indicates NULL-page, page 0 is read with special function
         return NULL;
     }
     
-    void **page_ptr = rbt_get(bm->cached_pages, page_id);
-    // printf("DEBUG: %d, %p\n", page_id, page_ptr);
-    if (page_ptr) {
+    uint32_t frame = pt_get(bm->cached_pages, page_id);
+    // printf("DEBUG: %d, %u\n", page_id, frame);
+    if (frame != PT_NOT_FOUND) {
         // printf("Found cached page (%d)\n", page_id);
-        return *page_ptr;
+        bm->stats.hits++;
+        bm->policy->hit(bm, frame);
+        bm->frame_table[frame].pin_count++;
+        return frame_data(bm, frame);
     }
 
-    void *page = read_page_from_db(bm->db_file_path, page_id);
-    if (!page) {
+    bm->stats.misses++;
+    frame = take_frame(bm);
+    if (frame == NO_FRAME) return NULL;
+    void *page = frame_data(bm, frame);
+    wait_for_background_write(bm, page_id);
+    if (read_page_from_db(bm->pager, page_id, page) < 0) {
         printf("Invalid page-id: %u\n", page_id);
+        stack_push(bm->free_frames, frame);
         return NULL;
     }
 
-    add_page_to_cache(bm, page, page_id);
+    add_page_to_cache(bm, frame, page_id);
+    bm->frame_table[frame].pin_count = 1;
     return page;
 }
 
-void buffer_manager_free_page(BufferManager *bm, uint32_t page_id) {
-    void *page = buffer_manager_get_page(bm, page_id);
-    uint8_t page_type = *(uint8_t*)page;
-    if (page_type == DATA_PAGE) {
-        DataPage *data_page = page;
-        free(data_page->data);
-        free(data_page);
-        
+// Read-only prefetch, the kernel is asked to read each run of consecutive
+// pages into the mapping
+void advise_pages(BufferManager *bm, uint32_t *page_ids, uint32_t count) {
+    uint32_t *sorted = malloc(sizeof(uint32_t) * count);
+    memcpy(sorted, page_ids, sizeof(uint32_t) * count);
+    qsort(sorted, count, sizeof(uint32_t), compare_page_id);
+    uint32_t i = 0;
+    while (i < count) {
+        uint32_t n = 1;
+        while (i + n < count && sorted[i + n] <= sorted[i] + n) n++;
+        pager_advise(bm->pager, sorted[i], sorted[i + n - 1] - sorted[i] + 1, MADV_WILLNEED);
+        i += n;
+    }
+    free(sorted);
+}
+
+void buffer_manager_prefetch(BufferManager *bm, uint32_t *page_ids, uint32_t count) {
+    if (bm->read_only) {
+        advise_pages(bm, page_ids, count);
+        return;
+    }
+    buffer_manager_lock(bm);
+    uint32_t limit = bm->target_frames / 8;
+    if (count > limit) count = limit;
+    uint32_t *frames = malloc(sizeof(uint32_t) * count);
+    uint32_t *sorted = malloc(sizeof(uint32_t) * count);
+    memcpy(sorted, page_ids, sizeof(uint32_t) * count);
+    qsort(sorted, count, sizeof(uint32_t), compare_page_id);
+
+    uint32_t num_read = read_pages(bm, sorted, count, 1, frames);
+    for (uint32_t i = 0; i < num_read; i++) {
+        bm->policy->insert(bm, frames[i]);
+    }
+    bm->stats.prefetches += num_read;
+    free(sorted);
+    free(frames);
+    buffer_manager_unlock(bm);
+}
+
+void *buffer_manager_get_page(BufferManager *bm, uint32_t page_id) {
+    if (bm->read_only) return mapped_page(bm, page_id);
+    buffer_manager_lock(bm);
+    void *page = fetch_page(bm, page_id);
+    buffer_manager_unlock(bm);
+    return page;
+}
+
+// Updates nonfull_data_pages and the free-space map for a data page, pages
+// with less than MINIMUM_FREE_SPACE left are dropped from both
+void set_free_space(BufferManager *bm, uint32_t page_id, uint32_t free_space) {
+    uint8_t class = 0;
+    if (free_space >= MINIMUM_FREE_SPACE) {
+        fph_update(bm->nonfull_data_pages, page_id, free_space);
+        class = free_space / FSM_CLASS_SIZE;
+    }
+    else {
         fph_remove_by_pageid(bm->nonfull_data_pages, page_id);
-        rbt_delete(bm->cached_pages, page_id, sizeof(void*));
-        fph_remove_by_pageid(bm->cached_pages_queue, page_id);
-        
-        heap_insert(bm->available_pages, (void*)&page_id);
     }
-    else if (page_type == BPT_PAGE) {
-        Page *bpt_page = page;
-        if (bpt_page->header.is_leaf) free(bpt_page->leaf);
-        else free(bpt_page->internal);
-        free(bpt_page);
 
-        rbt_delete(bm->cached_pages, page_id, sizeof(void*));
-        fph_remove_by_pageid(bm->cached_pages_queue, page_id);
+    FsmPage *page = fsm_page(bm, page_id, class > 0);
+    if (page && page->free_space_classes[page_id % FSM_CAPACITY] != class) {
+        page->free_space_classes[page_id % FSM_CAPACITY] = class;
+        bm->fsm_dirty[page_id / FSM_CAPACITY] = 1;
+        bm->fsm_unlogged[page_id / FSM_CAPACITY] = 1;
+    }
+}
 
-        heap_insert(bm->available_pages, (void*)&page_id);
+// Moves free-space map entries from fsm_cursor on to nonfull_data_pages
+// until a page with at least size bytes free is found. Every entry is
+// looked at once, after reopening only as much of the map as needed is read.
+void load_free_space(BufferManager *bm, uint32_t size) {
+    while (bm->fsm_cursor != FSM_CURSOR_DONE) {
+        FsmPage *page = fsm_page(bm, bm->fsm_cursor, 0);
+        if (!page) {
+            bm->fsm_cursor = FSM_CURSOR_DONE;
+            return;
+        }
+
+        uint32_t page_id = bm->fsm_cursor++;
+        uint8_t class = page->free_space_classes[page_id % FSM_CAPACITY];
+        if (!class || fph_get_by_pageid(bm->nonfull_data_pages, page_id)) continue;
+
+        // Lower bound, the exact free space is known once the page is read
+        FreeDataPage free_page = { class * FSM_CLASS_SIZE, page_id };
+        fph_insert(bm->nonfull_data_pages, &free_page);
+        if (free_page.free_space >= size) return;
     }
 }
 
+void buffer_manager_free_page(BufferManager *bm, uint32_t page_id) {
+    if (bm->read_only) return;
+    buffer_manager_begin_update(bm);
+    buffer_manager_lock(bm);
+    uint32_t frame = pt_get(bm->cached_pages, page_id);
+    if (frame == PT_NOT_FOUND && fetch_page(bm, page_id)) {
+        // Brought in to check the page type
+        frame = pt_get(bm->cached_pages, page_id);
+    }
+
+    if (frame != PT_NOT_FOUND) {
+        uint8_t page_type = *(uint8_t*)frame_data(bm, frame);
+        if (page_type == DATA_PAGE) {
+            set_free_space(bm, page_id, 0);
+        }
+        release_frame(bm, frame, 0);
+        heap_insert(bm->available_pages, (void*)&page_id);
+        bm->superblock_dirty = 1;
+        bm->changed = 1;
+    }
+    buffer_manager_unlock(bm);
+    buffer_manager_end_update(bm);
+}
 
-#define SLOT_ENTRY_SIZE 0x5
 
 typedef struct SlotEntry {
     uint16_t offset;
@@ -207,15 +2156,63 @@ void write_slot_entryi(uint8_t *slot_directory, SlotEntry slot_entry, uint32_t i
 }
 
 // Does not yet handle overflow pages
-RID buffer_manager_request_slot(BufferManager *bm, size_t size, void *data) {
+// Stores a record in a new slot taken from the free space of page, which
+// must have room for it and be marked dirty. Returns the slot_id.
+uint16_t append_record(BufferManager *bm, DataPage *page, size_t size, void *data) {
+    SlotEntry s;
+    s.offset = page->free_space_end - size;
+    s.length = size;
+    s.flags = SLOT_FLAG_NONE;
+    uint16_t slot_id = page->free_space_start / SLOT_ENTRY_SIZE;
+    write_slot_entryi(page->data, s, slot_id);
+    page->free_space_start += SLOT_ENTRY_SIZE;
+    memcpy((page->data + s.offset), data, size);
+    page->free_space_end -= size;
+    page->occupied_slots += 1;
+
+    set_free_space(bm, page->page_id, page->free_space_end - page->free_space_start);
+    return slot_id;
+}
+
+// Empty data page, cached and dirty but not pinned. NULL if every frame
+// is pinned.
+DataPage *new_data_page(BufferManager *bm) {
+    // printf("New data page (%d)\n", bm->superblock.page_count);
+    uint32_t frame = take_frame(bm);
+    if (frame == NO_FRAME) return NULL;
+    DataPage *page = frame_data(bm, frame);
+    page->reserved = 0;
+    page->page_id = allocate_page_id(bm);
+
+    page->page_type = DATA_PAGE;
+    page->occupied_slots = 0;
+    page->free_space_start = 0x0;
+    page->free_space_end = PAGE_SIZE - DATA_PAGE_HEADER_SIZE;
+
+    add_page_to_cache(bm, frame, page->page_id);
+    set_dirty(bm, frame);
+    return page;
+}
+
+RID allocate_slot(BufferManager *bm, size_t size, void *data) {
+    if (fph_empty(bm->nonfull_data_pages) ||
+        fph_top(bm->nonfull_data_pages)->free_space < size + SLOT_ENTRY_SIZE) {
+        load_free_space(bm, size + SLOT_ENTRY_SIZE);
+    }
+
     if (!fph_empty(bm->nonfull_data_pages)) {
         FreeDataPage free_page = *fph_top(bm->nonfull_data_pages);
         // printf("Found free page(%d)\n", free_page.page_id);
         fflush(stdout);
         if (free_page.free_space >= size + SLOT_ENTRY_SIZE) {
 
-            fph_pop(bm->nonfull_data_pages);
             DataPage *page = buffer_manager_get_page(bm, free_page.page_id);
+            if (!page) {
+                RID none = { 0, 0 };
+                return none;
+            }
+            fph_pop(bm->nonfull_data_pages);
+            buffer_manager_mark_dirty(bm, page);
 
             for (int i = 0;; i++) {
                 uint8_t *slot_directory = page->data;
@@ -233,7 +2230,8 @@ RID buffer_manager_request_slot(BufferManager *bm, size_t size, void *data) {
                     page->occupied_slots++;
 
                     // Size of free-space kept consistent as a slot was reused
-                    fph_insert(bm->nonfull_data_pages, &free_page);
+                    set_free_space(bm, free_page.page_id, free_page.free_space);
+                    buffer_manager_unpin_page(bm, page);
 
                     RID rid;
                     rid.page_id = free_page.page_id;
@@ -243,25 +2241,8 @@ RID buffer_manager_request_slot(BufferManager *bm, size_t size, void *data) {
             }
 
             // Did not find a free slot, initialize new in free-space instead
-            SlotEntry s;
-            s.offset = page->free_space_end - size;
-            s.length = size;
-            s.flags = SLOT_FLAG_NONE;
-            uint16_t slot_id = page->free_space_start / SLOT_ENTRY_SIZE;
-            write_slot_entryi(page->data, s, slot_id);
-            page->free_space_start += SLOT_ENTRY_SIZE;
-            memcpy((page->data + s.offset), data, size);
-            page->free_space_end -= size;
-            page->occupied_slots += 1;
-
-            // If page is still non-full
-            uint32_t free_space = page->free_space_end - page->free_space_start;
-            if (free_space >= MINIMUM_FREE_SPACE) {
-                FreeDataPage free_page;
-                free_page.page_id = page->page_id;
-                free_page.free_space = free_space;
-                fph_insert(bm->nonfull_data_pages, &free_page);
-            }
+            uint16_t slot_id = append_record(bm, page, size, data);
+            buffer_manager_unpin_page(bm, page);
 
             RID rid;
             rid.page_id = free_page.page_id;
@@ -271,58 +2252,117 @@ RID buffer_manager_request_slot(BufferManager *bm, size_t size, void *data) {
     }
 
     // Else: Allocate new page
-    // printf("New data page (%d)\n", bm->used_space);
-    DataPage *page = malloc(sizeof(DataPage));
-    if (!heap_is_empty(bm->available_pages)) {
-        page->page_id = *(uint32_t*)heap_top(bm->available_pages);
-        heap_pop(bm->available_pages);
-    }
-    else {
-        page->page_id = bm->used_space++;
+    RID rid = { 0, 0 };
+    DataPage *page = new_data_page(bm);
+    if (page) {
+        rid.page_id = page->page_id;
+        rid.slot_id = append_record(bm, page, size, data);
     }
+    return rid;
+}
 
-    page->page_type = DATA_PAGE;
-    page->occupied_slots = 1;
-    page->free_space_start = 0x0;
-    page->free_space_end = PAGE_SIZE - DATA_PAGE_HEADER_SIZE;
-    // Allocate full free-space area for the data region (not sizeof of the integer expression)
-    page->data = malloc(PAGE_SIZE - DATA_PAGE_HEADER_SIZE);
-    SlotEntry s;
-    s.offset = page->free_space_end - size;
-    s.length = size;
-    s.flags = SLOT_FLAG_NONE;
-    write_slot_entryi(page->data, s, 0);
-    page->free_space_start += SLOT_ENTRY_SIZE;
-    memcpy((page->data + s.offset), data, size);
-    page->free_space_end -= size;
+RID buffer_manager_append_data(BufferManager *bm, uint32_t after, size_t size, void *data,
+    uint8_t fill_percent) {
 
-    // If page is non-full
-    uint32_t free_space = page->free_space_end - page->free_space_start;
-    if (free_space >= MINIMUM_FREE_SPACE) {
-        FreeDataPage free_page;
-        free_page.page_id = page->page_id;
-        free_page.free_space = free_space;
-        fph_insert(bm->nonfull_data_pages, &free_page);
-    }
+    RID rid = { 0, 0 };
+    if (bm->read_only) return rid;
+    if (!fill_percent || fill_percent > 100) fill_percent = 100;
+    uint32_t reserved = (PAGE_SIZE - DATA_PAGE_HEADER_SIZE) * (100 - fill_percent) / 100;
+    buffer_manager_begin_update(bm);
+    buffer_manager_lock(bm);
+    DataPage *page = after ? fetch_page(bm, after) : NULL;
+    if (page) {
+        if (page->page_type == DATA_PAGE &&
+            (size_t)(page->free_space_end - page->free_space_start) >=
+                size + SLOT_ENTRY_SIZE + reserved) {
 
-    add_page_to_cache(bm, page, page->page_id);
+            buffer_manager_mark_dirty(bm, page);
+            rid.page_id = after;
+            rid.slot_id = append_record(bm, page, size, data);
+        }
+        buffer_manager_unpin_page(bm, page);
+    }
+    if (!rid.page_id) {
+        page = new_data_page(bm);
+        if (page) {
+            rid.page_id = page->page_id;
+            rid.slot_id = append_record(bm, page, size, data);
+        }
+    }
+    buffer_manager_unlock(bm);
+    buffer_manager_end_update(bm);
+    return rid;
+}
 
-    RID rid;
-    rid.page_id = page->page_id;
-    rid.slot_id = 0;
+RID buffer_manager_request_slot(BufferManager *bm, size_t size, void *data) {
+    if (bm->read_only) {
+        RID none = { 0, 0 };
+        return none;
+    }
+    buffer_manager_begin_update(bm);
+    buffer_manager_lock(bm);
+    RID rid = allocate_slot(bm, size, data);
+    buffer_manager_unlock(bm);
+    buffer_manager_end_update(bm);
     return rid;
 }
 
-void buffer_manager_free_data(BufferManager *bm, RID rid) {
+void buffer_manager_request_slots(BufferManager *bm, uint32_t count, size_t *sizes,
+    void **data, RID *rids) {
+
+    memset(rids, 0, sizeof(RID) * count);
+    if (bm->read_only) return;
+    buffer_manager_begin_update(bm);
+    buffer_manager_lock(bm);
+    DataPage *page = NULL;
+    for (uint32_t i = 0; i < count; i++) {
+        size_t needed = sizes[i] + SLOT_ENTRY_SIZE;
+        if (page && (size_t)(page->free_space_end - page->free_space_start) < needed) {
+            buffer_manager_unpin_page(bm, page);
+            page = NULL;
+        }
+        if (!page) {
+            if (fph_empty(bm->nonfull_data_pages) ||
+                fph_top(bm->nonfull_data_pages)->free_space < needed) {
+                load_free_space(bm, needed);
+            }
+            // The page with the most free space if the record fits, a new
+            // one otherwise, pinned while it takes records
+            uint32_t page_id = 0;
+            if (!fph_empty(bm->nonfull_data_pages) &&
+                fph_top(bm->nonfull_data_pages)->free_space >= needed) {
+                page_id = fph_top(bm->nonfull_data_pages)->page_id;
+            }
+            else {
+                DataPage *new_page = new_data_page(bm);
+                if (new_page) page_id = new_page->page_id;
+            }
+            page = page_id ? fetch_page(bm, page_id) : NULL;
+            if (!page) continue;
+            buffer_manager_mark_dirty(bm, page);
+        }
+        rids[i].page_id = page->page_id;
+        rids[i].slot_id = append_record(bm, page, sizes[i], data[i]);
+    }
+    if (page) buffer_manager_unpin_page(bm, page);
+    buffer_manager_unlock(bm);
+    buffer_manager_end_update(bm);
+}
+
+void release_slot(BufferManager *bm, RID rid) {
     DataPage *page = buffer_manager_get_page(bm, rid.page_id);
     if (!page) return;
+    buffer_manager_mark_dirty(bm, page);
     page->occupied_slots--;
     if (page->occupied_slots == 0) {
         buffer_manager_free_page(bm, rid.page_id);
     }
     else {
         SlotEntry slot_entry = get_slot_entryi(page, rid.slot_id);
-        if (slot_entry.flags == SLOT_FLAG_INVALID) return;
+        if (slot_entry.flags == SLOT_FLAG_INVALID) {
+            buffer_manager_unpin_page(bm, page);
+            return;
+        }
         slot_entry.flags = SLOT_FLAG_FREE;
         write_slot_entryi(page->data, slot_entry, rid.slot_id);
 
@@ -342,11 +2382,16 @@ void buffer_manager_free_data(BufferManager *bm, RID rid) {
         uint32_t memory_framentation = 100 - (100 * nonused_memory) / allocated_memory;
         if (memory_framentation > MAX_ALLOWED_FRAGMENTATION) {
             int current_memory_offset = PAGE_SIZE - DATA_PAGE_HEADER_SIZE;
-            uint8_t *new_data = malloc(PAGE_SIZE - DATA_PAGE_HEADER_SIZE);
+            uint8_t new_data[PAGE_SIZE - DATA_PAGE_HEADER_SIZE];
             for (int i = 0;; i++) {
                 SlotEntry slot = get_slot_entryi(page, i);
                 if (slot.flags == SLOT_FLAG_INVALID) break;
-                if (slot.flags & SLOT_FLAG_FREE) continue;
+                if (slot.flags & SLOT_FLAG_FREE) {
+                    // The old offset now belongs to a moved record
+                    slot.length = 0;
+                    write_slot_entryi(page->data, slot, i);
+                    continue;
+                }
 
                 current_memory_offset -= slot.length;
                 memcpy(new_data + current_memory_offset, page->data + slot.offset,
@@ -358,34 +2403,125 @@ void buffer_manager_free_data(BufferManager *bm, RID rid) {
             page->free_space_end = current_memory_offset;
 
             memcpy(page->data + page->free_space_end, new_data + page->free_space_end,
-                PAGE_SIZE - page->free_space_end);
-            free(new_data);
+                PAGE_SIZE - DATA_PAGE_HEADER_SIZE - page->free_space_end);
 
             // Update free-pages
-            fph_remove_by_pageid(bm->nonfull_data_pages, page->page_id);
-            FreeDataPage new_free_page = {
-                page->free_space_end - page->free_space_start,
-                page->page_id
-            };
-            fph_insert(bm->nonfull_data_pages, &new_free_page);
+            set_free_space(bm, page->page_id, page->free_space_end - page->free_space_start);
         }
+        buffer_manager_unpin_page(bm, page);
     }
 }
 
+void buffer_manager_free_data(BufferManager *bm, RID rid) {
+    if (bm->read_only) return;
+    buffer_manager_begin_update(bm);
+    buffer_manager_lock(bm);
+    release_slot(bm, rid);
+    buffer_manager_unlock(bm);
+    buffer_manager_end_update(bm);
+}
+
 // Does not yet handle overflow pages
 void *buffer_manager_get_data(BufferManager *bm, RID rid) {
-    DataPage *page = buffer_manager_get_page(bm, rid.page_id);
-    SlotEntry s = get_slot_entryi(page, rid.slot_id);
-    void *data = (page->data + s.offset);
+    if (bm->read_only) {
+        DataPage *page = mapped_page(bm, rid.page_id);
+        if (!page) return NULL;
+        return page->data + get_slot_entryi(page, rid.slot_id).offset;
+    }
+    buffer_manager_lock(bm);
+    DataPage *page = fetch_page(bm, rid.page_id);
+    void *data = NULL;
+    if (page) data = page->data + get_slot_entryi(page, rid.slot_id).offset;
+    buffer_manager_unlock(bm);
     return data;
 }
 
-void buffer_manager_flush_cache(BufferManager *bm) {
-    while (!fph_empty(bm->cached_pages_queue)) {
-        CachedPage cached_page = *(CachedPage*)fph_top(bm->cached_pages_queue);
-        fph_pop(bm->cached_pages_queue);
-        void **page = rbt_get(bm->cached_pages, cached_page.page_id);
-        write_page_to_db(bm->db_file_path, *page);
-        rbt_delete(bm->cached_pages, cached_page.page_id, sizeof(void*));
+// Writes every dirty page in one batch, the pages stay cached and clean.
+// Pages changed by a running update are not in the log yet and stay dirty,
+// so do pages that could not be written, -1 then.
+int write_dirty_frames(BufferManager *bm) {
+    PageIO *ios = malloc(sizeof(PageIO) * bm->num_frames);
+    uint32_t num_writes = 0;
+    for (uint32_t frame = 0; frame < bm->num_frames; frame++) {
+        Frame *f = &bm->frame_table[frame];
+        if (!f->page_id || !f->dirty || f->unlogged) continue;
+        wait_for_background_write(bm, f->page_id);
+        PageIO io = { PAGE_IO_WRITE, f->page_id, frame_data(bm, frame), 0 };
+        ios[num_writes++] = io;
+        f->dirty = 0;
+        f->checkpoint = 0;
+    }
+    qsort(ios, num_writes, sizeof(PageIO), compare_page_io);
+    int result = pager_run_batch(bm->pager, ios, num_writes);
+    for (uint32_t i = 0; i < num_writes; i++) {
+        if (ios[i].result < 0) {
+            Frame *f = &bm->frame_table[pt_get(bm->cached_pages, ios[i].page_id)];
+            f->dirty = 1;
+            f->checkpoint = bm->checkpoint_running;
+        }
+        else {
+            bm->stats.writes++;
+        }
     }
+    free(ios);
+    return result;
+}
+
+int buffer_manager_sync(BufferManager *bm) {
+    if (bm->read_only) return 0;
+    buffer_manager_lock(bm);
+    // The log first holds everything committed, the file then catches up
+    // and the log is emptied once the file is on disk. Until then recovery
+    // rewrites pages with the contents they are given here.
+    int result = buffer_manager_flush_log(bm);
+    if (write_dirty_frames(bm) < 0) result = -1;
+
+    // After the pages, so the superblock never refers to pages not written
+    for (uint32_t n = 0; n < bm->num_fsm_pages; n++) {
+        if (bm->fsm_dirty[n]) {
+            if (write_page_to_db(bm->pager, bm->fsm_pages[n]) < 0) result = -1;
+            else bm->fsm_dirty[n] = 0;
+        }
+    }
+    if (result == 0 && !heap_is_empty(bm->available_pages)) result = store_free_list(bm);
+    // Without a log only the order they reach the disk in keeps the file
+    // consistent, the pages are synced before the superblock is written
+    if (result == 0 && !bm->wal) result = pager_sync(bm->pager);
+    if (result == 0 && bm->superblock_dirty) {
+        result = write_superblock(bm);
+        if (result == 0 && !bm->wal) result = pager_sync(bm->pager);
+    }
+    // A failed write leaves the log as it is, recovery still needs it
+    if (result == 0 && bm->wal && !bm->updates) {
+        result = pager_sync(bm->pager);
+        if (result == 0) wal_reset(bm->wal);
+    }
+    buffer_manager_unlock(bm);
+    return result;
+}
+
+void buffer_manager_drop_cache(BufferManager *bm) {
+    if (bm->read_only) return;
+    buffer_manager_lock(bm);
+    for (uint32_t frame = 0; frame < bm->num_frames; frame++) {
+        Frame *f = &bm->frame_table[frame];
+        if (f->page_id && !f->dirty && !f->pin_count) bm->stats.writes_avoided++;
+    }
+    write_dirty_frames(bm);
+
+    // Pinned pages are still in use and stay cached, so do pages that could
+    // not be written
+    for (uint32_t frame = 0; frame < bm->num_frames; frame++) {
+        Frame *f = &bm->frame_table[frame];
+        if (f->page_id && !f->pin_count && !f->dirty) {
+            release_frame(bm, frame, 1);
+            bm->stats.evictions++;
+        }
+    }
+    buffer_manager_unlock(bm);
+}
+
+void buffer_manager_flush_cache(BufferManager *bm) {
+    buffer_manager_sync(bm);
+    buffer_manager_drop_cache(bm);
 }
\ No newline at end of file
@@ -1,3 +1,4 @@
+#pragma once
 #include <stdint.h>
 #include <stddef.h>
 #include "pager.h"
@@ -7,13 +8,183 @@ typedef struct RID {
     uint16_t slot_id;
 } RID;
 
+// Replacement policies, selected with BufferManagerOptions.policy
+#define REPLACEMENT_CLOCK (uint8_t)0x0
+#define REPLACEMENT_2Q (uint8_t)0x1
+#define REPLACEMENT_FIFO (uint8_t)0x2
+
+// Warm restart modes, selected with BufferManagerOptions.warm_restart
+#define WARM_RESTART_OFF (uint8_t)0x0
+#define WARM_RESTART_PRELOAD (uint8_t)0x1
+#define WARM_RESTART_BACKGROUND (uint8_t)0x2
+
+// Passing NULL to buffer_manager_init uses the defaults
+typedef struct BufferManagerOptions {
+    uint8_t policy;
+
+    // Background cleaner, woken when fewer than low_watermark frames are
+    // free and evicting (writing dirty pages) until high_watermark frames
+    // are free. Leaving high_watermark at 0 disables the cleaner.
+    uint32_t low_watermark;
+    uint32_t high_watermark;
+
+    // Memory for cached pages in bytes, 0 for the default of 16 MB
+    size_t pool_size;
+
+    // Backend for batched I/O (flushes, eviction batches and prefetches),
+    // the transfers it keeps in flight and the most pages with consecutive
+    // ids written (or read) in one call, see PagerOptions
+    uint8_t io_backend;
+    uint32_t io_queue_depth;
+    uint32_t io_max_coalesce;
+
+    // PAGER_OS_CACHE_DIRECT keeps pages out of the OS page cache so the
+    // pool can be given most of the memory, see PagerOptions
+    uint8_t os_cache;
+
+    // Serves pages straight from a read-only mapping of the file, for scans
+    // of snapshots. The pool is not used, pages handed out need no unpin
+    // and every call that would modify the file is ignored (or fails).
+    uint8_t read_only;
+
+    // Keeps a write-ahead log in db_file_path + "-wal" so committed updates
+    // survive a crash, see buffer_manager_begin_update. With
+    // wal_commits_per_sync 0 or 1 each commit is written and made durable
+    // with an fdatasync before it returns. Above 1, commits return before
+    // they are durable: they are written together with one fdatasync once
+    // wal_commits_per_sync are pending, or wal_sync_interval_us after the
+    // first pending one (0 for no limit), by a commit or else by a
+    // background thread. A crash loses the pending commits, up to
+    // wal_commits_per_sync - 1 of them, and with an interval the ones made
+    // within it. buffer_manager_flush_log makes them durable. Ignored when
+    // read_only (open the file writable once after a crash to recover it).
+    uint8_t wal;
+    uint32_t wal_commits_per_sync;
+    uint32_t wal_sync_interval_us;
+
+    // Background checkpointer (needs wal), writing the pages changed since
+    // the last checkpoint while updates continue, so recovery replays at
+    // most about checkpoint_replay_ms of log. It writes at most
+    // checkpoint_pages_per_second pages (0 for no limit) unless the log has
+    // already outgrown the bound. 0 disables the checkpointer.
+    uint32_t checkpoint_replay_ms;
+    uint32_t checkpoint_pages_per_second;
+
+    // Saves the page_ids of the cached pages, the ones the replacement
+    // policy would keep longest first, to db_file_path + "-warm" when the
+    // buffer manager is freed, and reads the pages back when it is opened
+    // again (as many as fit in the pool, in sorted batches). PRELOAD reads
+    // them before buffer_manager_init returns, BACKGROUND in a thread while
+    // pages are requested, without evicting any. Ignored when read_only.
+    uint8_t warm_restart;
+} BufferManagerOptions;
+
+typedef struct BufferManagerStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    // Dirty pages written back and clean pages dropped without a write
+    uint64_t writes;
+    uint64_t writes_avoided;
+    // Evictions done by the background cleaner, included in evictions
+    uint64_t cleaner_evictions;
+    // Pages read by buffer_manager_prefetch
+    uint64_t prefetches;
+    // Pages read back for a warm restart
+    uint64_t preloads;
+    // System calls made by the pager, a vectored write of several pages
+    // counts once
+    uint64_t syscalls;
+    // Commits logged and the groups of them written to the log, one
+    // fdatasync each
+    uint64_t commits;
+    uint64_t log_flushes;
+    // Checkpoints completed by the background checkpointer and the pages
+    // it wrote for them
+    uint64_t checkpoints;
+    uint64_t checkpoint_writes;
+} BufferManagerStats;
+
+// Pages (and data) handed out are pinned and stay in their frame until
+// released with buffer_manager_unpin_page, once per time they were handed
+// out. NULL is returned when every frame is pinned.
 typedef struct BufferManager BufferManager;
-BufferManager *buffer_manager_init(char *db_file_path);
+// NULL if the file cannot be opened (or does not exist, when read_only), or
+// was created by a build with another PAGE_SIZE or superblock version
+BufferManager *buffer_manager_init(char *db_file_path, BufferManagerOptions *options);
+BufferManagerStats buffer_manager_get_stats(BufferManager *bm);
+// Growing takes effect at once. When shrinking, pages are moved out of the
+// frames being given back (evicting the coldest pages when the smaller
+// pool is full) a few frames per page request, a frame pinned at the
+// time holds the shrink back until it is unpinned. -1 if the memory could
+// not be mapped.
+int buffer_manager_resize(BufferManager *bm, size_t pool_size);
+size_t buffer_manager_get_pool_size(BufferManager *bm);
+// Frames a page request can still take, free or holding a page no one has
+// pinned (UINT32_MAX when read_only). Scans every frame.
+uint32_t buffer_manager_unpinned_frames(BufferManager *bm);
 Page *buffer_manager_new_bpt_page(BufferManager *bm, uint8_t is_leaf);
 void *buffer_manager_get_page(BufferManager *bm, uint32_t page_id);
+// Reads the pages not cached yet in one batch and caches them unpinned.
+// Only a hint, invalid page_ids are skipped and at most an eighth of the
+// pool is filled.
+void buffer_manager_prefetch(BufferManager *bm, uint32_t *page_ids, uint32_t count);
 void buffer_manager_free(BufferManager *bm);
+// page may point anywhere inside the page (e.g. data returned by
+// buffer_manager_get_data)
+void buffer_manager_unpin_page(BufferManager *bm, void *page);
+// Must be called before modifying a pinned page
+void buffer_manager_mark_dirty(BufferManager *bm, void *page);
+// Page 0 in the RID if no frame could be taken for the data page
 RID buffer_manager_request_slot(BufferManager *bm, size_t size, void *data);
+// Stores count records, the rid of each in rids. The page with the most
+// free space takes records in order until the next does not fit, then the
+// next page is chosen, each pinned once for all the records it takes. Page
+// 0 in the RIDs of records no frame could be taken for.
+void buffer_manager_request_slots(BufferManager *bm, uint32_t count, size_t *sizes,
+    void **data, RID *rids);
+// Stores data like buffer_manager_request_slot, but in the data page after
+// (the page_id of the last record appended, 0 to start a new page) as long
+// as that page stays at most fill_percent full (0 for 100), in a new page
+// otherwise. Records appended one after the other fill consecutive pages
+// in order, for loading many records at once. Page 0 in the RID if no
+// frame could be taken.
+RID buffer_manager_append_data(BufferManager *bm, uint32_t after, size_t size, void *data,
+    uint8_t fill_percent);
+// NULL if no frame could be taken for the data page
 void *buffer_manager_get_data(BufferManager *bm, RID rid);
 void buffer_manager_free_page(BufferManager *bm, uint32_t page_id);
 void buffer_manager_free_data(BufferManager *bm, RID rid);
-void buffer_manager_flush_cache(BufferManager *bm);
\ No newline at end of file
+// Writes every dirty page, then the free list and the superblock (page 0).
+// The pages stay cached, clean. Without a log, changes made after the last
+// sync are lost when the file is reopened, and the pages are made durable
+// before the superblock is written, and it before this returns. With one
+// this is a checkpoint, the log is emptied once the file holds everything
+// in it. -1 if a write failed, the pages not written stay dirty and neither
+// the superblock nor the log is touched.
+int buffer_manager_sync(BufferManager *bm);
+// Drops every unpinned page from the pool, dirty ones are written first.
+// Only the pages are written, see buffer_manager_sync. Pages that could not
+// be written stay cached.
+void buffer_manager_drop_cache(BufferManager *bm);
+// buffer_manager_sync, then buffer_manager_drop_cache
+void buffer_manager_flush_cache(BufferManager *bm);
+// Brackets an update of several pages (bpt_insert, bpt_delete) so that it
+// is logged as one commit. Brackets nest and the outermost end commits,
+// pages changed outside any bracket are committed with the next update.
+// Changed pages stay pinned until their group is in the log. No-op without
+// a log. end returns -1 if the group was due and could not be written, its
+// commits stay pending and are written with a later one.
+void buffer_manager_begin_update(BufferManager *bm);
+int buffer_manager_end_update(BufferManager *bm);
+// Writes the commits not yet in the log and waits until they are durable,
+// no-op without a log. -1 if the log could not be written.
+int buffer_manager_flush_log(BufferManager *bm);
+// Root page_id of tree slot (< MAX_ROOTS) kept in the superblock, 0 if the
+// slot is unused
+uint32_t buffer_manager_get_root(BufferManager *bm, uint32_t slot);
+void buffer_manager_set_root(BufferManager *bm, uint32_t slot, uint32_t page_id);
+// Brackets a scan, while one runs a read-only buffer manager lets the kernel
+// read ahead aggressively (MADV_SEQUENTIAL). No-op otherwise.
+void buffer_manager_begin_scan(BufferManager *bm);
+void buffer_manager_end_scan(BufferManager *bm);
\ No newline at end of file
@@ -1,8 +1,22 @@
-#define MAX_CHILDREN 512
+#pragma once
+// Bytes per on-disk page, chosen when building (make PAGE_SIZE=16384). A
+// power of two from 4 KB to 64 KB, data pages address their bytes with
+// 16-bit offsets. Recorded in the superblock, a file is only opened by a
+// build with the same page size.
+#ifndef DB_PAGE_SIZE
+#define DB_PAGE_SIZE 4096
+#endif
+_Static_assert(DB_PAGE_SIZE >= 4096 && DB_PAGE_SIZE <= 65536 &&
+    (DB_PAGE_SIZE & (DB_PAGE_SIZE - 1)) == 0, "page size must be 4, 8, 16, 32 or 64 KB");
+
+// Sized so that a node fills one on-disk page, see pager.h. An internal
+// node is an 8 byte header, MAX_KEYS keys and MAX_CHILDREN children, a
+// leaf a 16 byte header and 10 bytes per entry (511 and 408 for 4 KB).
+#define MAX_CHILDREN ((DB_PAGE_SIZE - 4) / 8)
 #define MIN_CHILDREN (MAX_CHILDREN + 1) / 2
 #define MAX_KEYS MAX_CHILDREN - 1
 
-#define MAX_ENTRIES_LEAF 408
+#define MAX_ENTRIES_LEAF ((DB_PAGE_SIZE - 16) / 10)
 #define MIN_ENTRIES_LEAF (MAX_ENTRIES_LEAF + 1) / 2
 
 #define INTERNAL 0
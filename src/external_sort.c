@@ -0,0 +1,521 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "external_sort.h"
+#include "util.h"
+
+// Blocks larger than this read no faster, passes with few runs and the
+// final merge of a few runs stop here instead of using the whole limit
+#define MAX_MERGE_BLOCK_SIZE ((size_t)4 << 20) // 4 MB
+
+// Entry of a record in a sort buffer. key and size are written to the run
+// as they are, as the header of the record.
+typedef struct SortEntry {
+    uint32_t key;
+    uint32_t size;
+    // Of the data in the buffer, orders the records with the same key
+    uint64_t offset;
+} SortEntry;
+
+#define RECORD_HEADER_SIZE 8
+
+typedef struct SortBuffer {
+    ExternalSort *sort;
+    uint8_t *data;
+    size_t capacity;
+    // Record data grows from the front, the entries down from the back
+    size_t used;
+    uint32_t count;
+    // Set while the thread sorts and writes the buffer
+    uint8_t writing;
+    pthread_t thread;
+    // The run it is written to and what the thread left
+    uint32_t run;
+    int fd;
+    uint64_t run_size;
+    int result;
+} SortBuffer;
+
+// A run in a file, or the sorted entries of a sort buffer that was never
+// written (fd -1)
+typedef struct Run {
+    int fd;
+    uint64_t size;
+    // File offset of the first byte not in the block yet
+    uint64_t read_offset;
+    uint8_t *block;
+    size_t block_size;
+    // Bytes in the block not consumed yet
+    size_t start;
+    size_t end;
+    SortBuffer *buffer;
+    uint32_t next;
+} Run;
+
+typedef struct MergeHead {
+    uint32_t key;
+    uint32_t run;
+} MergeHead;
+
+typedef struct Merge {
+    Run *runs;
+    uint32_t count;
+    Heap *heap;
+    // The run the last record came from, moves on at the next call
+    Run *last;
+} Merge;
+
+struct ExternalSort {
+    char *temp_dir;
+    size_t memory_limit;
+    SortBuffer *buffers;
+    uint32_t num_buffers;
+    uint32_t current;
+    Run *runs;
+    uint32_t num_runs;
+    Merge *merge;
+    uint8_t failed;
+    ExternalSortStats stats;
+};
+
+SortEntry *buffer_entries(SortBuffer *buffer) {
+    return (SortEntry*)(buffer->data + buffer->capacity) - buffer->count;
+}
+
+int sort_entry_cmp(const void *a, const void *b) {
+    const SortEntry *x = a;
+    const SortEntry *y = b;
+    if (x->key != y->key) return x->key < y->key ? -1 : 1;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+// Unlinked right away, the file lives as long as the descriptor
+int create_run_file(ExternalSort *sort) {
+    size_t length = strlen(sort->temp_dir) + sizeof("/sort-XXXXXX");
+    char *path = malloc(length);
+    snprintf(path, length, "%s/sort-XXXXXX", sort->temp_dir);
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("external sort run");
+    }
+    else {
+        unlink(path);
+    }
+    free(path);
+    return fd;
+}
+
+// pwritev of every iovec, continuing after short writes
+int write_iovecs(int fd, struct iovec *iov, uint32_t iovcnt, uint64_t offset) {
+    while (iovcnt > 0) {
+        int n = iovcnt < UIO_MAXIOV ? iovcnt : UIO_MAXIOV;
+        ssize_t written = pwritev(fd, iov, n, offset);
+        if (written <= 0) return -1;
+        offset += written;
+        while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (written > 0) {
+            iov->iov_base = (uint8_t*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+// Writes the sorted records straight from the buffer, the header of each
+// from its entry
+int write_sorted_buffer(SortBuffer *buffer) {
+    SortEntry *entries = buffer_entries(buffer);
+    struct iovec iov[UIO_MAXIOV];
+    buffer->run_size = 0;
+    for (uint32_t i = 0; i < buffer->count; ) {
+        uint32_t n = 0;
+        uint64_t bytes = 0;
+        for (; i < buffer->count && n < UIO_MAXIOV; i++) {
+            iov[n].iov_base = &entries[i];
+            iov[n++].iov_len = RECORD_HEADER_SIZE;
+            iov[n].iov_base = buffer->data + entries[i].offset;
+            iov[n++].iov_len = entries[i].size;
+            bytes += RECORD_HEADER_SIZE + entries[i].size;
+        }
+        if (write_iovecs(buffer->fd, iov, n, buffer->run_size) < 0) {
+            perror("external sort write");
+            return -1;
+        }
+        buffer->run_size += bytes;
+    }
+    return 0;
+}
+
+void *sort_buffer_main(void *arg) {
+    SortBuffer *buffer = arg;
+    qsort(buffer_entries(buffer), buffer->count, sizeof(SortEntry), sort_entry_cmp);
+    buffer->fd = create_run_file(buffer->sort);
+    buffer->result = buffer->fd < 0 ? -1 : write_sorted_buffer(buffer);
+    return NULL;
+}
+
+// Hands the buffer to a thread that writes it as the next run
+void submit_buffer(ExternalSort *sort, SortBuffer *buffer) {
+    sort->runs = realloc(sort->runs, sizeof(Run) * (sort->num_runs + 1));
+    memset(&sort->runs[sort->num_runs], 0, sizeof(Run));
+    sort->runs[sort->num_runs].fd = -1;
+    buffer->run = sort->num_runs++;
+    buffer->fd = -1;
+    buffer->writing = 1;
+    sort->stats.runs++;
+    if (pthread_create(&buffer->thread, NULL, sort_buffer_main, buffer) != 0) {
+        sort_buffer_main(buffer);
+        buffer->writing = 2;
+    }
+}
+
+// Waits until the buffer is written and empties it
+void wait_buffer(ExternalSort *sort, SortBuffer *buffer) {
+    if (buffer->writing) {
+        if (buffer->writing == 1) pthread_join(buffer->thread, NULL);
+        buffer->writing = 0;
+        Run *run = &sort->runs[buffer->run];
+        run->fd = buffer->fd;
+        run->size = buffer->run_size;
+        sort->stats.bytes_written += buffer->run_size;
+        if (buffer->result < 0) sort->failed = 1;
+    }
+    buffer->used = 0;
+    buffer->count = 0;
+}
+
+ExternalSort *external_sort_init(const char *temp_dir, size_t memory_limit,
+    uint32_t num_threads) {
+
+    if (memory_limit < 4 * EXTERNAL_SORT_BLOCK_SIZE) return NULL;
+    if (num_threads == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = cores > 0 ? cores : 1;
+    }
+    // Every buffer holds at least a block
+    if (num_threads > memory_limit / EXTERNAL_SORT_BLOCK_SIZE - 1) {
+        num_threads = memory_limit / EXTERNAL_SORT_BLOCK_SIZE - 1;
+    }
+
+    ExternalSort *sort = calloc(1, sizeof(ExternalSort));
+    sort->temp_dir = strdup(temp_dir);
+    sort->memory_limit = memory_limit;
+    sort->num_buffers = num_threads + 1;
+    sort->buffers = calloc(sort->num_buffers, sizeof(SortBuffer));
+    for (uint32_t i = 0; i < sort->num_buffers; i++) {
+        sort->buffers[i].sort = sort;
+        sort->buffers[i].capacity = memory_limit / sort->num_buffers / sizeof(SortEntry) *
+            sizeof(SortEntry);
+    }
+    return sort;
+}
+
+void merge_free(Merge *merge) {
+    for (uint32_t i = 0; i < merge->count; i++) {
+        free(merge->runs[i].block);
+        merge->runs[i].block = NULL;
+    }
+    heap_free(merge->heap);
+    free(merge);
+}
+
+void external_sort_free(ExternalSort *sort) {
+    if (!sort) return;
+    if (sort->merge) merge_free(sort->merge);
+    for (uint32_t i = 0; i < sort->num_buffers; i++) {
+        wait_buffer(sort, &sort->buffers[i]);
+        free(sort->buffers[i].data);
+    }
+    for (uint32_t i = 0; i < sort->num_runs; i++) {
+        if (sort->runs[i].fd >= 0) close(sort->runs[i].fd);
+    }
+    free(sort->runs);
+    free(sort->buffers);
+    free(sort->temp_dir);
+    free(sort);
+}
+
+int external_sort_add(ExternalSort *sort, uint32_t key, const void *data, size_t size) {
+    if (size > EXTERNAL_SORT_MAX_RECORD || sort->merge || sort->failed) return -1;
+
+    SortBuffer *buffer = &sort->buffers[sort->current];
+    if (buffer->used + size + (buffer->count + 1) * sizeof(SortEntry) > buffer->capacity) {
+        submit_buffer(sort, buffer);
+        sort->current = (sort->current + 1) % sort->num_buffers;
+        buffer = &sort->buffers[sort->current];
+        wait_buffer(sort, buffer);
+        if (sort->failed) return -1;
+    }
+    if (!buffer->data) buffer->data = malloc(buffer->capacity);
+
+    buffer->count++;
+    SortEntry *entry = buffer_entries(buffer);
+    entry->key = key;
+    entry->size = size;
+    entry->offset = buffer->used;
+    memcpy(buffer->data + buffer->used, data, size);
+    buffer->used += size;
+    sort->stats.records++;
+    return 0;
+}
+
+// Size of the record whose header starts at p, which is not aligned
+uint32_t record_size_at(const uint8_t *p) {
+    uint32_t size;
+    memcpy(&size, p + 4, sizeof(uint32_t));
+    return RECORD_HEADER_SIZE + size;
+}
+
+// Makes sure the next record of the run is whole in its block. 1 if there
+// is one, 0 at the end of the run, -1 if it could not be read.
+int run_load(ExternalSort *sort, Run *run) {
+    if (run->buffer) return run->next < run->buffer->count;
+
+    while (1) {
+        size_t left = run->end - run->start;
+        if (left >= RECORD_HEADER_SIZE && left >= record_size_at(run->block + run->start)) {
+            return 1;
+        }
+        if (run->read_offset == run->size) {
+            return left ? -1 : 0;
+        }
+        // Moves what is left of the block to its front and reads behind it
+        memmove(run->block, run->block + run->start, left);
+        run->start = 0;
+        run->end = left;
+        size_t length = run->block_size - left;
+        if (length > run->size - run->read_offset) length = run->size - run->read_offset;
+        ssize_t n = pread(run->fd, run->block + left, length, run->read_offset);
+        if (n <= 0) {
+            perror("external sort read");
+            return -1;
+        }
+        run->end += n;
+        run->read_offset += n;
+        sort->stats.bytes_read += n;
+    }
+}
+
+// The record run_load made sure of
+void run_record(Run *run, uint32_t *key, void **data, size_t *size) {
+    if (run->buffer) {
+        SortEntry *entry = buffer_entries(run->buffer) + run->next;
+        *key = entry->key;
+        *data = run->buffer->data + entry->offset;
+        *size = entry->size;
+        return;
+    }
+    uint8_t *header = run->block + run->start;
+    memcpy(key, header, sizeof(uint32_t));
+    *data = header + RECORD_HEADER_SIZE;
+    *size = record_size_at(header) - RECORD_HEADER_SIZE;
+}
+
+void run_skip(Run *run) {
+    if (run->buffer) {
+        run->next++;
+        return;
+    }
+    run->start += record_size_at(run->block + run->start);
+}
+
+// Lower keys first, then the older run
+uint8_t merge_head_below(void *a, void *b) {
+    MergeHead *x = a;
+    MergeHead *y = b;
+    return x->key > y->key || (x->key == y->key && x->run > y->run);
+}
+
+// Pushes the next record of run i onto the heap, if it has one
+void merge_push(ExternalSort *sort, Merge *merge, uint32_t i) {
+    int loaded = run_load(sort, &merge->runs[i]);
+    if (loaded < 0) sort->failed = 1;
+    if (loaded <= 0) return;
+    uint32_t key;
+    void *data;
+    size_t size;
+    run_record(&merge->runs[i], &key, &data, &size);
+    MergeHead head = { key, i };
+    heap_insert(merge->heap, &head);
+}
+
+Merge *merge_init(ExternalSort *sort, Run *runs, uint32_t count, size_t block_size) {
+    Merge *merge = malloc(sizeof(Merge));
+    merge->runs = runs;
+    merge->count = count;
+    merge->heap = new_heap(merge_head_below, sizeof(MergeHead));
+    merge->last = NULL;
+    for (uint32_t i = 0; i < count; i++) {
+        Run *run = &runs[i];
+        if (!run->buffer) {
+            run->block = malloc(block_size);
+            run->block_size = block_size;
+            run->read_offset = 0;
+            run->start = 0;
+            run->end = 0;
+        }
+        merge_push(sort, merge, i);
+    }
+    return merge;
+}
+
+int merge_next(ExternalSort *sort, Merge *merge, uint32_t *key, void **data, size_t *size) {
+    if (merge->last) {
+        run_skip(merge->last);
+        merge_push(sort, merge, merge->last - merge->runs);
+        merge->last = NULL;
+    }
+    if (sort->failed || heap_is_empty(merge->heap)) return 0;
+
+    MergeHead head = *(MergeHead*)heap_top(merge->heap);
+    heap_pop(merge->heap);
+    merge->last = &merge->runs[head.run];
+    run_record(merge->last, key, data, size);
+    return 1;
+}
+
+size_t merge_block_size(ExternalSort *sort, uint32_t blocks) {
+    size_t block_size = sort->memory_limit / blocks;
+    return block_size < MAX_MERGE_BLOCK_SIZE ? block_size : MAX_MERGE_BLOCK_SIZE;
+}
+
+// Merges runs into one new run through a block of its own
+int merge_runs(ExternalSort *sort, Run *runs, uint32_t count, Run *merged) {
+    size_t block_size = merge_block_size(sort, count + 1);
+    memset(merged, 0, sizeof(Run));
+    merged->fd = create_run_file(sort);
+    if (merged->fd < 0) {
+        sort->failed = 1;
+        return -1;
+    }
+
+    Merge *merge = merge_init(sort, runs, count, block_size);
+    uint8_t *block = malloc(block_size);
+    size_t used = 0;
+    uint32_t key;
+    void *data;
+    size_t size;
+    int more;
+    do {
+        more = merge_next(sort, merge, &key, &data, &size);
+        if (used && (!more || used + RECORD_HEADER_SIZE + size > block_size)) {
+            if (pwrite(merged->fd, block, used, merged->size) != (ssize_t)used) {
+                perror("external sort write");
+                sort->failed = 1;
+                break;
+            }
+            merged->size += used;
+            used = 0;
+        }
+        if (more) {
+            SortEntry header = { key, size, 0 };
+            memcpy(block + used, &header, RECORD_HEADER_SIZE);
+            memcpy(block + used + RECORD_HEADER_SIZE, data, size);
+            used += RECORD_HEADER_SIZE + size;
+        }
+    } while (more);
+    free(block);
+    merge_free(merge);
+    sort->stats.bytes_written += merged->size;
+    return sort->failed ? -1 : 0;
+}
+
+// Merges consecutive groups of fan_in runs, which keeps records with the
+// same key in the order they were added
+int merge_pass(ExternalSort *sort, uint32_t fan_in) {
+    uint32_t num_merged = (sort->num_runs + fan_in - 1) / fan_in;
+    Run *merged = calloc(num_merged, sizeof(Run));
+    for (uint32_t i = 0; i < num_merged; i++) {
+        merged[i].fd = -1;
+    }
+    for (uint32_t i = 0; i < num_merged && !sort->failed; i++) {
+        uint32_t first = i * fan_in;
+        uint32_t count = sort->num_runs - first < fan_in ? sort->num_runs - first : fan_in;
+        if (count == 1) {
+            merged[i] = sort->runs[first];
+            sort->runs[first].fd = -1;
+            continue;
+        }
+        // The runs of a merge that did not complete are kept (and closed)
+        // with the ones not merged yet
+        if (merge_runs(sort, &sort->runs[first], count, &merged[i]) < 0) break;
+        for (uint32_t r = first; r < first + count; r++) {
+            close(sort->runs[r].fd);
+            sort->runs[r].fd = -1;
+        }
+        sort->stats.runs++;
+    }
+
+    // On failure the runs not merged yet are closed when the sort is freed
+    Run *closed = sort->failed ? merged : sort->runs;
+    uint32_t num_closed = sort->failed ? num_merged : sort->num_runs;
+    for (uint32_t i = 0; i < num_closed; i++) {
+        if (closed[i].fd >= 0) close(closed[i].fd);
+    }
+    if (sort->failed) {
+        free(merged);
+        return -1;
+    }
+    free(sort->runs);
+    sort->runs = merged;
+    sort->num_runs = num_merged;
+    sort->stats.merge_passes++;
+    return 0;
+}
+
+int external_sort_finish(ExternalSort *sort) {
+    if (sort->merge || sort->failed) return -1;
+
+    SortBuffer *buffer = &sort->buffers[sort->current];
+    if (sort->num_runs == 0) {
+        // Everything fit in one buffer, merged from memory as the only run
+        if (buffer->count) {
+            qsort(buffer_entries(buffer), buffer->count, sizeof(SortEntry), sort_entry_cmp);
+        }
+        sort->runs = calloc(1, sizeof(Run));
+        sort->runs[0].fd = -1;
+        sort->runs[0].buffer = buffer;
+        sort->num_runs = 1;
+        sort->merge = merge_init(sort, sort->runs, 1, 0);
+        return 0;
+    }
+
+    if (buffer->count) submit_buffer(sort, buffer);
+    for (uint32_t i = 0; i < sort->num_buffers; i++) {
+        wait_buffer(sort, &sort->buffers[i]);
+        free(sort->buffers[i].data);
+        sort->buffers[i].data = NULL;
+    }
+    if (sort->failed) return -1;
+
+    // A pass writes through a block besides the ones it reads
+    uint32_t max_runs = sort->memory_limit / EXTERNAL_SORT_BLOCK_SIZE;
+    while (sort->num_runs > max_runs) {
+        if (merge_pass(sort, max_runs - 1) < 0) return -1;
+    }
+    sort->merge = merge_init(sort, sort->runs, sort->num_runs,
+        merge_block_size(sort, sort->num_runs));
+    return sort->failed ? -1 : 0;
+}
+
+int external_sort_next(void *context, uint32_t *key, void **data, size_t *size) {
+    ExternalSort *sort = context;
+    if (!sort->merge) return 0;
+    return merge_next(sort, sort->merge, key, data, size);
+}
+
+uint8_t external_sort_failed(ExternalSort *sort) {
+    return sort->failed;
+}
+
+ExternalSortStats external_sort_get_stats(ExternalSort *sort) {
+    return sort->stats;
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+// Sorts records by key in bounded memory, for input that is neither sorted
+// nor fits in memory. Records are collected into sort buffers, each full
+// buffer is sorted and written out as a run by a thread of its own while
+// the next one fills. At the end the runs are merged through a heap, in
+// passes over groups of them while there are too many to read at once.
+// Records with the same key come out in the order they were added.
+//
+// Runs go to unlinked temporary files in temp_dir, so they are gone once
+// the sort is freed (or the process dies). Input that fits in one buffer
+// is never written.
+//
+// The merge output is a BptRecordSource, the sorted records stream
+// straight into a new tree:
+//
+//   bpt_bulk_load(bpt, fill_percent, external_sort_next, sort);
+typedef struct ExternalSort ExternalSort;
+
+// Largest record external_sort_add takes
+#define EXTERNAL_SORT_MAX_RECORD (64 << 10) // 64 KB
+// Bytes runs are read and written in at least, per run being merged
+#define EXTERNAL_SORT_BLOCK_SIZE (256 << 10) // 256 KB
+
+typedef struct ExternalSortStats {
+    uint64_t records;
+    // Runs written while records were added, and by merge passes
+    uint64_t runs;
+    uint64_t merge_passes;
+    uint64_t bytes_written;
+    uint64_t bytes_read;
+} ExternalSortStats;
+
+// memory_limit bounds the sort buffers and the blocks runs are merged
+// through (not the few bytes kept per run), at least 4 blocks. It is
+// shared by num_threads + 1 sort buffers, num_threads of them sorted and
+// written while one fills, num_threads of 0 for one per core. NULL if the
+// limit is too low.
+ExternalSort *external_sort_init(const char *temp_dir, size_t memory_limit,
+    uint32_t num_threads);
+void external_sort_free(ExternalSort *sort);
+// Copies the record, blocks while every other sort buffer is still being
+// written. -1 if it is larger than EXTERNAL_SORT_MAX_RECORD, a run could
+// not be written, or the merge has started.
+int external_sort_add(ExternalSort *sort, uint32_t key, const void *data, size_t size);
+// Waits for the runs, merges them down to as many as can be read at once
+// and starts the merge. -1 if a run could not be written or read.
+int external_sort_finish(ExternalSort *sort);
+// BptRecordSource over the sorted records, context is the ExternalSort
+// after external_sort_finish. data is valid until the next call. Returns
+// 0 at the end, or if a run could not be read (see external_sort_failed).
+int external_sort_next(void *context, uint32_t *key, void **data, size_t *size);
+// 1 if writing or reading a run failed
+uint8_t external_sort_failed(ExternalSort *sort);
+ExternalSortStats external_sort_get_stats(ExternalSort *sort);
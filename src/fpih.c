@@ -306,4 +306,22 @@ void fph_remove_by_pageid(FreePageHeap *fph, uint32_t page_id) {
     fph->heap_size--;
     map_delete(fph, page_id);
     fph_sift_down(fph, idx, fph->heap_size);
-}
\ No newline at end of file
+}
+
+void fph_update(FreePageHeap *fph, uint32_t page_id, uint16_t free_space) {
+    FreeDataPage *entry = fph_get_by_pageid(fph, page_id);
+    if (!entry) {
+        FreeDataPage value = { free_space, page_id };
+        fph_insert(fph, &value);
+        return;
+    }
+    uint32_t idx = entry - (FreeDataPage*)fph->data;
+    uint16_t old_free_space = entry->free_space;
+    entry->free_space = free_space;
+    if (free_space > old_free_space) {
+        fph_sift_up(fph, idx);
+    }
+    else {
+        fph_sift_down(fph, idx, fph->heap_size);
+    }
+}
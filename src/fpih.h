@@ -1,3 +1,5 @@
+#pragma once
+#include <stdint.h>
 #include <stdlib.h>
 
 typedef struct FreeDataPage {
@@ -15,4 +17,7 @@ void fph_pop(FreePageHeap *fph);
 uint32_t fph_size(FreePageHeap *fph);
 uint8_t fph_empty(FreePageHeap *fph);
 FreeDataPage *fph_get_by_pageid(FreePageHeap *fph, uint32_t page_id);
-void fph_remove_by_pageid(FreePageHeap *fph, uint32_t page_id);
\ No newline at end of file
+void fph_remove_by_pageid(FreePageHeap *fph, uint32_t page_id);
+// Sets the free space of page_id in place, inserts it if it is not in the
+// heap yet
+void fph_update(FreePageHeap *fph, uint32_t page_id, uint16_t free_space);
@@ -0,0 +1,388 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "io_queue.h"
+
+// Upper bound on the threads of the thread pool backend
+#define MAX_IO_THREADS 16
+
+typedef struct Uring {
+    int ring_fd;
+    uint32_t entries;
+
+    // Submission ring, the kernel consumes entries from head to tail
+    uint32_t *sq_head;
+    uint32_t *sq_tail;
+    uint32_t *sq_mask;
+    uint32_t *sq_array;
+    struct io_uring_sqe *sqes;
+
+    // Completion ring, filled by the kernel from head to tail
+    uint32_t *cq_head;
+    uint32_t *cq_tail;
+    uint32_t *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} Uring;
+
+typedef struct ThreadPool {
+    pthread_t threads[MAX_IO_THREADS];
+    uint32_t num_threads;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    // The running batch, runs from next on are not taken yet
+    PageIO *ios;
+    uint32_t count;
+    uint32_t next;
+    uint32_t finished;
+    PagerStats *stats;
+    uint8_t stop;
+} ThreadPool;
+
+struct IoQueue {
+    uint8_t backend;
+    int fd;
+    uint32_t max_coalesce;
+    // One per transfer of the running batch, a run of consecutive pages
+    // goes out as one vectored call over its entries
+    struct iovec *iovecs;
+    uint32_t iovecs_size;
+    Uring uring;
+    ThreadPool pool;
+};
+
+int uring_setup(Uring *ring, uint32_t entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->ring_fd < 0) return -1;
+    ring->entries = params.sq_entries;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    ring->cq_ring_size = params.cq_off.cqes +
+        params.cq_entries * sizeof(struct io_uring_cqe);
+    // Both rings share one mapping on kernels since 5.4
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        close(ring->ring_fd);
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    }
+    else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+            close(ring->ring_fd);
+            return -1;
+        }
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->ring_fd);
+        return -1;
+    }
+
+    uint8_t *sq = ring->sq_ring;
+    ring->sq_head = (uint32_t*)(sq + params.sq_off.head);
+    ring->sq_tail = (uint32_t*)(sq + params.sq_off.tail);
+    ring->sq_mask = (uint32_t*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (uint32_t*)(sq + params.sq_off.array);
+    uint8_t *cq = ring->cq_ring;
+    ring->cq_head = (uint32_t*)(cq + params.cq_off.head);
+    ring->cq_tail = (uint32_t*)(cq + params.cq_off.tail);
+    ring->cq_mask = (uint32_t*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+void uring_free(Uring *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->ring_fd);
+}
+
+// Transfers from first on that can go in one vectored call: same
+// direction, consecutive page ids, at most max_coalesce of them
+uint32_t run_length(IoQueue *queue, PageIO *ios, uint32_t first, uint32_t count) {
+    uint32_t n = 1;
+    while (first + n < count && n < queue->max_coalesce &&
+           ios[first + n].op == ios[first].op &&
+           ios[first + n].page_id == ios[first].page_id + n) {
+        n++;
+    }
+    return n;
+}
+
+// Hands the bytes a run transferred (or -errno) out to its pages in order,
+// pages past a short transfer are left short or empty
+void finish_run(PageIO *ios, uint32_t first, uint32_t n, ssize_t r, PagerStats *stats) {
+    for (uint32_t i = 0; i < n; i++) {
+        ssize_t left = r - (ssize_t)i * PAGE_SIZE;
+        if (r < 0) ios[first + i].result = (int)r;
+        else ios[first + i].result = left >= PAGE_SIZE ? PAGE_SIZE : left > 0 ? (int)left : 0;
+    }
+    if (ios[first].op == PAGE_IO_WRITE) {
+        __atomic_fetch_add(&stats->writes, n, __ATOMIC_RELAXED);
+    }
+    else {
+        __atomic_fetch_add(&stats->reads, n, __ATOMIC_RELAXED);
+    }
+}
+
+// Hands out the completions in the ring, returns the transfers of the runs
+// they finished and takes those runs off in_flight
+uint32_t uring_reap(Uring *ring, PageIO *ios, uint32_t *in_flight, PagerStats *stats) {
+    uint32_t completed = 0;
+    uint32_t head = *ring->cq_head;
+    uint32_t cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != cq_tail) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        uint32_t first = (uint32_t)cqe->user_data;
+        uint32_t n = (uint32_t)(cqe->user_data >> 32);
+        finish_run(ios, first, n, cqe->res, stats);
+        head++;
+        completed += n;
+        (*in_flight)--;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return completed;
+}
+
+// After io_uring_enter failed, takes back the runs the kernel has not
+// consumed (they stay -EINPROGRESS) and waits for the others, so no
+// transfer still uses the buffers or the iovecs once the batch has failed
+// and the queue is freed
+void uring_drain(Uring *ring, PageIO *ios, uint32_t in_flight, PagerStats *stats) {
+    // Without SQPOLL the kernel only consumes entries in io_uring_enter
+    uint32_t sq_head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    in_flight -= *ring->sq_tail - sq_head;
+    __atomic_store_n(ring->sq_tail, sq_head, __ATOMIC_RELEASE);
+
+    uring_reap(ring, ios, &in_flight, stats);
+    while (in_flight > 0) {
+        int r = syscall(__NR_io_uring_enter, ring->ring_fd, 0, in_flight,
+            IORING_ENTER_GETEVENTS, NULL, 0);
+        __atomic_fetch_add(&stats->syscalls, 1, __ATOMIC_RELAXED);
+        if (r < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            // Closing the ring cancels what is left
+            perror("io_uring_enter");
+            return;
+        }
+        uring_reap(ring, ios, &in_flight, stats);
+    }
+}
+
+int uring_run(IoQueue *queue, PageIO *ios, uint32_t count, PagerStats *stats) {
+    Uring *ring = &queue->uring;
+    uint32_t submitted = 0;
+    uint32_t completed = 0;
+    uint32_t in_flight = 0;
+    while (completed < count) {
+        // Queue as many runs as there is room for, the completion ring is
+        // twice the size so it cannot overflow
+        uint32_t tail = *ring->sq_tail;
+        while (submitted < count && in_flight < ring->entries) {
+            uint32_t idx = tail & *ring->sq_mask;
+            struct io_uring_sqe *sqe = &ring->sqes[idx];
+            PageIO *io = &ios[submitted];
+            uint32_t n = run_length(queue, ios, submitted, count);
+            memset(sqe, 0, sizeof(struct io_uring_sqe));
+            sqe->opcode = io->op == PAGE_IO_WRITE ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe->fd = queue->fd;
+            sqe->addr = (uint64_t)(uintptr_t)&queue->iovecs[submitted];
+            sqe->len = n;
+            sqe->off = (uint64_t)io->page_id * PAGE_SIZE;
+            // The run's first transfer and its length
+            sqe->user_data = (uint64_t)n << 32 | submitted;
+            ring->sq_array[idx] = idx;
+            tail++;
+            submitted += n;
+            in_flight++;
+        }
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+        // Waits for the whole window, one syscall per queue_depth runs
+        uint32_t to_submit = tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        int r = syscall(__NR_io_uring_enter, ring->ring_fd, to_submit, in_flight,
+            IORING_ENTER_GETEVENTS, NULL, 0);
+        __atomic_fetch_add(&stats->syscalls, 1, __ATOMIC_RELAXED);
+        if (r < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            perror("io_uring_enter");
+            uring_drain(ring, ios, in_flight, stats);
+            return -1;
+        }
+        completed += uring_reap(ring, ios, &in_flight, stats);
+    }
+    return 0;
+}
+
+void run_transfer(IoQueue *queue, PageIO *ios, uint32_t first, uint32_t n,
+                  PagerStats *stats) {
+    struct iovec *iov = &queue->iovecs[first];
+    off_t offset = (off_t)ios[first].page_id * PAGE_SIZE;
+    ssize_t r = ios[first].op == PAGE_IO_WRITE ?
+        pwritev(queue->fd, iov, n, offset) : preadv(queue->fd, iov, n, offset);
+    __atomic_fetch_add(&stats->syscalls, 1, __ATOMIC_RELAXED);
+    finish_run(ios, first, n, r < 0 ? -errno : r, stats);
+}
+
+void sync_run(IoQueue *queue, PageIO *ios, uint32_t count, PagerStats *stats) {
+    uint32_t i = 0;
+    while (i < count) {
+        uint32_t n = run_length(queue, ios, i, count);
+        run_transfer(queue, ios, i, n, stats);
+        i += n;
+    }
+}
+
+void *pool_main(void *arg) {
+    IoQueue *queue = arg;
+    ThreadPool *pool = &queue->pool;
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (!pool->stop && pool->next >= pool->count) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (pool->stop) break;
+
+        uint32_t first = pool->next;
+        uint32_t n = run_length(queue, pool->ios, first, pool->count);
+        pool->next += n;
+        pthread_mutex_unlock(&pool->lock);
+        run_transfer(queue, pool->ios, first, n, pool->stats);
+        pthread_mutex_lock(&pool->lock);
+        pool->finished += n;
+        if (pool->finished == pool->count) {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+int pool_setup(IoQueue *queue, uint32_t queue_depth) {
+    ThreadPool *pool = &queue->pool;
+    pool->num_threads = queue_depth < MAX_IO_THREADS ? queue_depth : MAX_IO_THREADS;
+    pool->ios = NULL;
+    pool->count = 0;
+    pool->next = 0;
+    pool->finished = 0;
+    pool->stop = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for (uint32_t i = 0; i < pool->num_threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, pool_main, queue) != 0) {
+            pool->num_threads = i;
+            break;
+        }
+    }
+    return pool->num_threads ? 0 : -1;
+}
+
+void pool_free(ThreadPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (uint32_t i = 0; i < pool->num_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+void pool_run(IoQueue *queue, PageIO *ios, uint32_t count, PagerStats *stats) {
+    ThreadPool *pool = &queue->pool;
+    pthread_mutex_lock(&pool->lock);
+    pool->ios = ios;
+    pool->stats = stats;
+    pool->next = 0;
+    pool->finished = 0;
+    pool->count = count;
+    pthread_cond_broadcast(&pool->work);
+    while (pool->finished < count) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pool->ios = NULL;
+    pool->count = 0;
+    pool->next = 0;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+IoQueue *io_queue_init(int fd, uint8_t backend, uint32_t queue_depth,
+                       uint32_t max_coalesce) {
+    IoQueue *queue = malloc(sizeof(IoQueue));
+    queue->backend = backend;
+    queue->fd = fd;
+    queue->max_coalesce = max_coalesce ? max_coalesce : 1;
+    queue->iovecs = NULL;
+    queue->iovecs_size = 0;
+    int r = 0;
+    if (backend == PAGER_IO_URING) r = uring_setup(&queue->uring, queue_depth);
+    else if (backend == PAGER_IO_THREADS) r = pool_setup(queue, queue_depth);
+    if (r < 0) {
+        free(queue);
+        return NULL;
+    }
+    return queue;
+}
+
+void io_queue_free(IoQueue *queue) {
+    if (!queue) return;
+    if (queue->backend == PAGER_IO_URING) uring_free(&queue->uring);
+    else if (queue->backend == PAGER_IO_THREADS) pool_free(&queue->pool);
+    free(queue->iovecs);
+    free(queue);
+}
+
+int io_queue_run(IoQueue *queue, PageIO *ios, uint32_t count, PagerStats *stats) {
+    for (uint32_t i = 0; i < count; i++) ios[i].result = -EINPROGRESS;
+    if (count == 0) return 0;
+    if (count > queue->iovecs_size) {
+        free(queue->iovecs);
+        queue->iovecs = malloc(sizeof(struct iovec) * count);
+        queue->iovecs_size = count;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        queue->iovecs[i].iov_base = ios[i].buffer;
+        queue->iovecs[i].iov_len = PAGE_SIZE;
+    }
+
+    if (queue->backend == PAGER_IO_URING) return uring_run(queue, ios, count, stats);
+    if (queue->backend == PAGER_IO_THREADS) pool_run(queue, ios, count, stats);
+    else sync_run(queue, ios, count, stats);
+    return 0;
+}
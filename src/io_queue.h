@@ -0,0 +1,21 @@
+#pragma once
+#include <stdint.h>
+#include "pager.h"
+
+// Runs batches of page transfers for the pager, either in the calling
+// thread, through an io_uring instance (raw syscalls, no liburing) or a
+// pool of threads. Transfers next to each other in a batch that touch
+// consecutive pages in the same direction are merged into one
+// preadv/pwritev of up to max_coalesce pages. Not thread-safe, the pager
+// runs one batch at a time.
+typedef struct IoQueue IoQueue;
+
+// backend is PAGER_IO_SYNC, PAGER_IO_URING or PAGER_IO_THREADS. NULL if it
+// cannot be set up, e.g. io_uring is missing or refused by the kernel.
+IoQueue *io_queue_init(int fd, uint8_t backend, uint32_t queue_depth,
+                       uint32_t max_coalesce);
+void io_queue_free(IoQueue *queue);
+// Leaves the bytes transferred (or -errno) in each PageIO.result. -1 if the
+// queue failed and cannot be used again, no transfer is running any more
+// then and the ones that never ran are left negative.
+int io_queue_run(IoQueue *queue, PageIO *ios, uint32_t count, PagerStats *stats);
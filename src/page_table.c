@@ -0,0 +1,127 @@
+#include "page_table.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Keeps the table at most half full so probe sequences stay within
+// one or two cache lines (8 entries per line)
+#define PT_MAX_LOAD_PERCENT 50
+#define PT_MIN_SLOTS 16
+
+typedef struct PageTableEntry {
+    uint32_t page_id;
+    uint32_t value;
+} PageTableEntry;
+
+struct PageTable {
+    PageTableEntry *entries;
+    uint32_t mask;
+    uint32_t shift;
+    uint32_t size;
+};
+
+// Fibonacci hashing, takes the top bits of the product
+uint32_t pt_slot(PageTable *pt, uint32_t page_id) {
+    return (uint32_t)(page_id * 2654435769u) >> pt->shift;
+}
+
+void pt_allocate(PageTable *pt, uint32_t slots) {
+    uint32_t bits = 0;
+    while ((1u << bits) < slots) bits++;
+    pt->entries = calloc((size_t)1 << bits, sizeof(PageTableEntry));
+    pt->mask = (1u << bits) - 1;
+    pt->shift = 32 - bits;
+    pt->size = 0;
+}
+
+PageTable *pt_init(uint32_t capacity) {
+    PageTable *pt = malloc(sizeof(PageTable));
+    uint32_t slots = (uint32_t)((uint64_t)capacity * 100 / PT_MAX_LOAD_PERCENT);
+    pt_allocate(pt, slots < PT_MIN_SLOTS ? PT_MIN_SLOTS : slots);
+    return pt;
+}
+
+void pt_free(PageTable *pt) {
+    free(pt->entries);
+    free(pt);
+}
+
+uint32_t pt_get(PageTable *pt, uint32_t page_id) {
+    uint32_t i = pt_slot(pt, page_id);
+    while (1) {
+        PageTableEntry *e = &pt->entries[i];
+        if (e->page_id == page_id) return e->value;
+        if (e->page_id == 0) return PT_NOT_FOUND;
+        i = (i + 1) & pt->mask;
+    }
+}
+
+void pt_grow(PageTable *pt) {
+    PageTableEntry *old = pt->entries;
+    uint32_t old_slots = pt->mask + 1;
+    pt_allocate(pt, old_slots * 2);
+    for (uint32_t i = 0; i < old_slots; i++) {
+        if (old[i].page_id) pt_insert(pt, old[i].page_id, old[i].value);
+    }
+    free(old);
+}
+
+void pt_insert(PageTable *pt, uint32_t page_id, uint32_t value) {
+    if ((uint64_t)(pt->size + 1) * 100 > (uint64_t)(pt->mask + 1) * PT_MAX_LOAD_PERCENT) {
+        pt_grow(pt);
+    }
+
+    uint32_t i = pt_slot(pt, page_id);
+    while (1) {
+        PageTableEntry *e = &pt->entries[i];
+        if (e->page_id == page_id) {
+            // If key already exists, update value
+            e->value = value;
+            return;
+        }
+        if (e->page_id == 0) {
+            e->page_id = page_id;
+            e->value = value;
+            pt->size++;
+            return;
+        }
+        i = (i + 1) & pt->mask;
+    }
+}
+
+// Backward-shift deletion, no tombstones so lookups never get longer
+// than the probe sequences of the entries actually present
+void pt_delete(PageTable *pt, uint32_t page_id) {
+    uint32_t i = pt_slot(pt, page_id);
+    while (1) {
+        if (pt->entries[i].page_id == page_id) break;
+        if (pt->entries[i].page_id == 0) return;
+        i = (i + 1) & pt->mask;
+    }
+
+    uint32_t j = i;
+    while (1) {
+        j = (j + 1) & pt->mask;
+        if (pt->entries[j].page_id == 0) break;
+
+        // Entry at j may move into the hole at i only if its home slot
+        // does not lie cyclically in (i, j]
+        uint32_t home = pt_slot(pt, pt->entries[j].page_id);
+        if (((j - home) & pt->mask) >= ((j - i) & pt->mask)) {
+            pt->entries[i] = pt->entries[j];
+            i = j;
+        }
+    }
+
+    pt->entries[i].page_id = 0;
+    pt->size--;
+}
+
+uint32_t pt_size(PageTable *pt) {
+    return pt->size;
+}
+
+void pt_clear(PageTable *pt) {
+    memset(pt->entries, 0, sizeof(PageTableEntry) * ((size_t)pt->mask + 1));
+    pt->size = 0;
+}
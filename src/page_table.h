@@ -0,0 +1,16 @@
+#pragma once
+#include <stdint.h>
+
+// Open-addressing (linear probing) hash table from page_id to a uint32_t,
+// used as the buffer pool page table (page_id -> frame index).
+// page_id 0 is the NULL page and is used to mark empty slots.
+#define PT_NOT_FOUND UINT32_MAX
+
+typedef struct PageTable PageTable;
+PageTable *pt_init(uint32_t capacity);
+void pt_free(PageTable *pt);
+uint32_t pt_get(PageTable *pt, uint32_t page_id);
+void pt_insert(PageTable *pt, uint32_t page_id, uint32_t value);
+void pt_delete(PageTable *pt, uint32_t page_id);
+uint32_t pt_size(PageTable *pt);
+void pt_clear(PageTable *pt);
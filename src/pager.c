@@ -1,9 +1,16 @@
+// O_DIRECT, statx and sync_file_range
+#define _GNU_SOURCE
 #include "pager.h"
+#include "io_queue.h"
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <pthread.h>
 
 uint16_t bytes_to_u16_be(uint8_t b[2]) {
     return ((uint16_t)b[0] << 8) |
@@ -51,189 +58,352 @@ void u64_to_bytes_be(uint8_t b[8], uint64_t v) {
     b[7] = (uint8_t)(v & 0xFF);
 }
 
-void bpt_page_to_db(Page *page, uint8_t buffer[PAGE_SIZE]) {
-    buffer[0x1] = page->header.is_leaf;
-    u16_to_bytes_be(&buffer[0x2], page->header.num_keys);
-
-    if (page->header.is_leaf) {
-        off_t offset = 0x4;
-        memcpy(&buffer[offset], page->leaf->keys,
-            sizeof(uint32_t) * page->header.num_keys);
-        offset += sizeof(uint32_t) * page->header.num_keys;
-        for (int i = 0; i < page->header.num_keys; i++) {
-            u32_to_bytes_be(&buffer[offset], page->leaf->page_ids[i]);
-            offset += sizeof(uint32_t);
-            u16_to_bytes_be(&buffer[offset], page->leaf->slot_ids[i]);
-            offset += sizeof(uint16_t);
-        }
-        u32_to_bytes_be(&buffer[offset], page->leaf->next_page_id);
-    }
-    else {
-        off_t offset = 0x4;
-        memcpy(&buffer[offset], page->internal->keys,
-            sizeof(uint32_t) * page->header.num_keys);
-        offset += sizeof(uint32_t) * page->header.num_keys;
-        memcpy(&buffer[offset], page->internal->children,
-            sizeof(uint32_t) * (page->header.num_keys + 1));
+struct Pager {
+    int fd;
+    // Updated atomically, the buffer manager's cleaner writes from its
+    // own thread
+    PagerStats stats;
+
+    // Runs pager_run_batch, NULL once it failed and batches fall back to
+    // pager_read/pager_write
+    uint8_t io_backend;
+    IoQueue *io_queue;
+    pthread_mutex_t batch_lock;
+
+    uint8_t os_cache;
+
+    // Whole file mapped by read-only pagers, NULL otherwise
+    uint8_t *map;
+    uint32_t map_pages;
+};
+
+// Whether O_DIRECT transfers of whole pages from PAGER_IO_ALIGNMENT aligned
+// buffers work on the file. Kernels before 6.1 do not tell, O_DIRECT there
+// needs the logical block size which divides PAGE_SIZE on common devices.
+int direct_io_supported(int fd) {
+    struct statx stx;
+    if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) < 0 ||
+        !(stx.stx_mask & STATX_DIOALIGN)) {
+        return 1;
     }
-
-    return;
+    return stx.stx_dio_offset_align && PAGE_SIZE % stx.stx_dio_offset_align == 0 &&
+        PAGER_IO_ALIGNMENT % stx.stx_dio_mem_align == 0;
 }
 
-void data_page_to_db(DataPage *page, uint8_t buffer[PAGE_SIZE]) {
-    u16_to_bytes_be(&buffer[0x1], page->occupied_slots);
-    u16_to_bytes_be(&buffer[0x3], page->free_space_start);
-    u16_to_bytes_be(&buffer[0x5], page->free_space_end);
-    memcpy(&buffer[0x7], page->data, PAGE_SIZE - DATA_PAGE_HEADER_SIZE);
-    return;
+// Asks the kernel to drop pages [page_id, page_id + count) from its cache.
+// Dirty pages are not dropped, so written pages are written back first,
+// which is what an O_DIRECT write would have waited for as well.
+void drop_cached_pages(Pager *pager, uint32_t page_id, uint32_t count, uint8_t written) {
+    off_t offset = (off_t)page_id * PAGE_SIZE;
+    off_t size = (off_t)count * PAGE_SIZE;
+    if (written) {
+        sync_file_range(pager->fd, offset, size, SYNC_FILE_RANGE_WAIT_BEFORE |
+            SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        __atomic_fetch_add(&pager->stats.syscalls, 1, __ATOMIC_RELAXED);
+    }
+    posix_fadvise(pager->fd, offset, size, POSIX_FADV_DONTNEED);
+    __atomic_fetch_add(&pager->stats.syscalls, 1, __ATOMIC_RELAXED);
 }
 
-void write_page_to_db(char *db_file_path, void *page) {
+// Buffer for a transfer, an aligned copy when O_DIRECT needs one
+uint8_t *direct_io_buffer(Pager *pager, uint8_t *buffer, uint8_t *bounce) {
+    if (pager->os_cache != PAGER_OS_CACHE_DIRECT) return buffer;
+    if ((uintptr_t)buffer % PAGER_IO_ALIGNMENT == 0) return buffer;
+    return bounce;
+}
 
-    uint8_t buffer[PAGE_SIZE];
-    // First byte is always the page_type
-    uint32_t page_type = *(uint8_t*)page;
-    buffer[0] = page_type;
-    uint32_t page_id;
-    switch (buffer[0]) {
-        case BPT_PAGE:
-            Page *bpt_page = page;
-            page_id = bpt_page->header.page_id;
-            printf("Writing bpt-page(%u) to db\n", page_id);
-            bpt_page_to_db(bpt_page, buffer);
-            break;
-        
-        case DATA_PAGE:
-            DataPage *data_page = page;
-            page_id = data_page->page_id;
-            printf("Writing data-page(%u) to db\n", page_id);
-            data_page_to_db(data_page, buffer);
-            break;
-        
-        default:
-            printf("Invalid page: %p\n", page);
-            return;
+Pager *pager_open(char *db_file_path, PagerOptions *options) {
+    PagerOptions defaults = {
+        PAGER_IO_SYNC, PAGER_DEFAULT_QUEUE_DEPTH, PAGER_DEFAULT_MAX_COALESCE,
+        PAGER_OS_CACHE_KEEP, 0
+    };
+    if (!options) options = &defaults;
+    uint32_t queue_depth = options->queue_depth ?
+        options->queue_depth : PAGER_DEFAULT_QUEUE_DEPTH;
+    uint32_t max_coalesce = options->max_coalesce ?
+        options->max_coalesce : PAGER_DEFAULT_MAX_COALESCE;
+    if (max_coalesce > UIO_MAXIOV) max_coalesce = UIO_MAXIOV;
+
+    uint8_t os_cache = options->read_only ? PAGER_OS_CACHE_KEEP : options->os_cache;
+    int fd = -1;
+    if (options->read_only) fd = open(db_file_path, O_RDONLY);
+    if (os_cache == PAGER_OS_CACHE_DIRECT) {
+        fd = open(db_file_path, O_RDWR | O_CREAT | O_DIRECT, 0644);
+        if (fd >= 0 && !direct_io_supported(fd)) {
+            close(fd);
+            fd = -1;
+        }
+        if (fd < 0) {
+            fprintf(stderr, "O_DIRECT is not supported, dropping pages from the OS cache\n");
+            os_cache = PAGER_OS_CACHE_DROP;
+        }
     }
-    
-    int fd = open(db_file_path, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0 && !options->read_only) fd = open(db_file_path, O_RDWR | O_CREAT, 0644);
     if (fd < 0) {
         perror("open");
-        return;
+        return NULL;
     }
 
-    off_t offset = (off_t)page_id * PAGE_SIZE;
-    if (lseek(fd, offset, SEEK_SET) == (off_t)-1) {
-        perror("lseek");
-        close(fd);
-        return;
+    Pager *pager = malloc(sizeof(Pager));
+    pager->fd = fd;
+    memset(&pager->stats, 0, sizeof(PagerStats));
+    pager->stats.syscalls = 1;
+    pthread_mutex_init(&pager->batch_lock, NULL);
+    pager->os_cache = os_cache;
+    pager->map = NULL;
+    pager->map_pages = 0;
+    struct stat st;
+    if (options->read_only && fstat(fd, &st) == 0 && st.st_size >= PAGE_SIZE) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            perror("mmap");
+        }
+        else {
+            pager->map = map;
+            pager->map_pages = st.st_size / PAGE_SIZE;
+        }
+    }
+    if (os_cache == PAGER_OS_CACHE_DROP) {
+        // Readahead would fill the cache with pages never asked for
+        posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+        pager->stats.syscalls++;
     }
 
-    ssize_t written = write(fd, buffer, PAGE_SIZE);
-    if (written != PAGE_SIZE) {
-        perror("write");
+    pager->io_backend = options->io_backend;
+    pager->io_queue = NULL;
+    if (pager->io_backend == PAGER_IO_AUTO || pager->io_backend == PAGER_IO_URING) {
+        pager->io_queue = io_queue_init(fd, PAGER_IO_URING, queue_depth, max_coalesce);
+        pager->io_backend = PAGER_IO_URING;
+        if (!pager->io_queue) {
+            if (options->io_backend == PAGER_IO_URING) {
+                fprintf(stderr, "io_uring is not available, using threads\n");
+            }
+            pager->io_backend = PAGER_IO_THREADS;
+        }
+    }
+    if (pager->io_backend == PAGER_IO_THREADS) {
+        pager->io_queue = io_queue_init(fd, PAGER_IO_THREADS, queue_depth, max_coalesce);
+        if (!pager->io_queue) pager->io_backend = PAGER_IO_SYNC;
+    }
+    if (pager->io_backend == PAGER_IO_SYNC) {
+        pager->io_queue = io_queue_init(fd, PAGER_IO_SYNC, queue_depth, max_coalesce);
     }
+    return pager;
+}
 
-    close(fd);
-    return;
+void pager_close(Pager *pager) {
+    if (!pager) return;
+    io_queue_free(pager->io_queue);
+    if (pager->map) munmap(pager->map, (size_t)pager->map_pages * PAGE_SIZE);
+    pthread_mutex_destroy(&pager->batch_lock);
+    close(pager->fd);
+    free(pager);
 }
 
-Page *get_bpt_page(uint8_t raw_page[PAGE_SIZE], uint32_t page_id) {
-    PageHeader header;
-    header.page_type = raw_page[0x0];
-    header.is_leaf = raw_page[0x1];
-    header.num_keys = bytes_to_u16_be(&raw_page[0x2]);
-    header.page_id = page_id;
+// Pages past the end of the file (allocated but never written) read as zeroes
+int pager_read(Pager *pager, uint32_t page_id, uint8_t buffer[PAGE_SIZE]) {
+    _Alignas(PAGER_IO_ALIGNMENT) uint8_t bounce[PAGE_SIZE];
+    uint8_t *target = direct_io_buffer(pager, buffer, bounce);
+    off_t offset = (off_t)page_id * PAGE_SIZE;
+    ssize_t r = pread(pager->fd, target, PAGE_SIZE, offset);
+    __atomic_fetch_add(&pager->stats.syscalls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&pager->stats.reads, 1, __ATOMIC_RELAXED);
+    if (r < 0) {
+        perror("pread");
+        return -1;
+    }
+
+    if (r < PAGE_SIZE) {
+        memset(target + r, 0, PAGE_SIZE - r);
+    }
+    if (target != buffer) memcpy(buffer, target, PAGE_SIZE);
+    if (pager->os_cache == PAGER_OS_CACHE_DROP) drop_cached_pages(pager, page_id, 1, 0);
+    return 0;
+}
 
-    Page *page = malloc(sizeof(Page));
-    page->header = header;
-    
-    if (page->header.is_leaf) {
-        LeafPage *leaf = malloc(sizeof(LeafPage));
-        off_t offset = 0x4;
+int pager_write(Pager *pager, uint32_t page_id, uint8_t buffer[PAGE_SIZE]) {
+    _Alignas(PAGER_IO_ALIGNMENT) uint8_t bounce[PAGE_SIZE];
+    uint8_t *source = direct_io_buffer(pager, buffer, bounce);
+    if (source != buffer) memcpy(source, buffer, PAGE_SIZE);
+    off_t offset = (off_t)page_id * PAGE_SIZE;
+    ssize_t written = pwrite(pager->fd, source, PAGE_SIZE, offset);
+    __atomic_fetch_add(&pager->stats.syscalls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&pager->stats.writes, 1, __ATOMIC_RELAXED);
+    if (written != PAGE_SIZE) {
+        perror("pwrite");
+        return -1;
+    }
+    if (pager->os_cache == PAGER_OS_CACHE_DROP) drop_cached_pages(pager, page_id, 1, 1);
+    return 0;
+}
 
-        memcpy(leaf->keys, &raw_page[offset], 
-            sizeof(uint32_t) * header.num_keys);
-        offset += sizeof(uint32_t) * header.num_keys;
+int pager_run_batch(Pager *pager, PageIO *ios, uint32_t count) {
+    pthread_mutex_lock(&pager->batch_lock);
+    if (pager->io_queue &&
+        io_queue_run(pager->io_queue, ios, count, &pager->stats) < 0) {
 
-        for (int i = 0; i < header.num_keys; i++) {
-            uint32_t pid = bytes_to_u32_be(&raw_page[offset]);
-            uint16_t sid = bytes_to_u16_be(&raw_page[offset + sizeof(uint32_t)]);
-            leaf->page_ids[i] = pid;
-            leaf->slot_ids[i] = sid;
-            offset += sizeof(uint32_t) + sizeof(uint16_t);
+        fprintf(stderr, "Batched I/O failed, falling back to pread/pwrite\n");
+        io_queue_free(pager->io_queue);
+        pager->io_queue = NULL;
+        pager->io_backend = PAGER_IO_SYNC;
+    }
+
+    int result = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        PageIO *io = &ios[i];
+        if (pager->io_queue && io->result == PAGE_SIZE) {
+            io->result = 0;
+        }
+        else if (pager->io_queue && io->op == PAGE_IO_READ && io->result >= 0) {
+            // Past the end of the file
+            memset(io->buffer + io->result, 0, PAGE_SIZE - io->result);
+            io->result = 0;
         }
+        else {
+            // No queue left, or a failed or short transfer redone
+            io->result = io->op == PAGE_IO_WRITE ?
+                pager_write(pager, io->page_id, io->buffer) :
+                pager_read(pager, io->page_id, io->buffer);
+        }
+        if (io->result < 0) result = -1;
+    }
 
-        leaf->next_page_id = bytes_to_u32_be(&raw_page[offset]);
+    // One call per run of consecutive pages
+    uint32_t i = 0;
+    while (pager->os_cache == PAGER_OS_CACHE_DROP && i < count) {
+        uint32_t n = 1;
+        while (i + n < count && ios[i + n].op == ios[i].op &&
+               ios[i + n].page_id == ios[i].page_id + n) {
+            n++;
+        }
+        drop_cached_pages(pager, ios[i].page_id, n, ios[i].op == PAGE_IO_WRITE);
+        i += n;
+    }
+    pthread_mutex_unlock(&pager->batch_lock);
+    return result;
+}
 
-        page->leaf = leaf;
+int pager_sync(Pager *pager) {
+    __atomic_fetch_add(&pager->stats.syscalls, 1, __ATOMIC_RELAXED);
+    if (fdatasync(pager->fd) < 0) {
+        perror("fdatasync");
+        return -1;
     }
-    else {
-        InternalPage *internal = malloc(sizeof(InternalPage));
-        off_t offset = 0x4;
+    return 0;
+}
 
-        memcpy(internal->keys, &raw_page[offset],
-            sizeof(uint32_t) * header.num_keys);
-        offset += sizeof(uint32_t) * header.num_keys;
+uint8_t pager_io_backend(Pager *pager) {
+    return pager->io_backend;
+}
 
-        memcpy(internal->children, &raw_page[offset],
-            sizeof(uint32_t) * (header.num_keys + 1));
+uint8_t pager_os_cache(Pager *pager) {
+    return pager->os_cache;
+}
 
-        page->internal = internal;
+uint32_t pager_num_pages(Pager *pager) {
+    struct stat st;
+    __atomic_fetch_add(&pager->stats.syscalls, 1, __ATOMIC_RELAXED);
+    if (fstat(pager->fd, &st) < 0) {
+        perror("fstat");
+        return 0;
     }
+    return (uint32_t)((st.st_size + PAGE_SIZE - 1) / PAGE_SIZE);
+}
 
-    return page;
+PagerStats pager_get_stats(Pager *pager) {
+    // Counted by background threads of the buffer manager as well
+    PagerStats stats = {
+        __atomic_load_n(&pager->stats.reads, __ATOMIC_RELAXED),
+        __atomic_load_n(&pager->stats.writes, __ATOMIC_RELAXED),
+        __atomic_load_n(&pager->stats.syscalls, __ATOMIC_RELAXED)
+    };
+    return stats;
 }
 
-DataPage *get_data_page(uint8_t raw_page[PAGE_SIZE], uint32_t page_id) {
-    DataPage *page = malloc(sizeof(DataPage));
-    page->page_id = page_id;
-    page->page_type = raw_page[0x0];
-    page->occupied_slots = bytes_to_u16_be(&raw_page[0x1]);
-    page->free_space_start = bytes_to_u16_be(&raw_page[0x3]);
-    page->free_space_end = bytes_to_u16_be(&raw_page[0x5]);
+void *pager_mapped_page(Pager *pager, uint32_t page_id) {
+    if (page_id >= pager->map_pages) return NULL;
+    return pager->map + (size_t)page_id * PAGE_SIZE;
+}
 
-    page->data = malloc(PAGE_SIZE - DATA_PAGE_HEADER_SIZE);
-    memcpy(page->data, &raw_page[0x7], PAGE_SIZE - DATA_PAGE_HEADER_SIZE);
-    return page;
+void pager_advise(Pager *pager, uint32_t page_id, uint32_t count, int advice) {
+    if (page_id >= pager->map_pages) return;
+    if (count > pager->map_pages - page_id) count = pager->map_pages - page_id;
+    // madvise wants the start aligned to the OS page size, which may be
+    // larger than PAGE_SIZE
+    uintptr_t os_page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)pager->map + (size_t)page_id * PAGE_SIZE;
+    uintptr_t end = start + (size_t)count * PAGE_SIZE;
+    start &= ~(os_page - 1);
+    madvise((void*)start, end - start, advice);
+    __atomic_fetch_add(&pager->stats.syscalls, 1, __ATOMIC_RELAXED);
 }
 
-void *read_page_from_db(char *db_file_path, uint32_t page_id) {
-    int fd = open(db_file_path, O_RDONLY);
-    if (fd < 0) {
-        perror("open");
-        return NULL;
-    }
+uint32_t page_get_id(void *page) {
+    return ((PageHeader*)page)->page_id;
+}
 
-    off_t offset = (off_t)page_id * PAGE_SIZE;
-    if (lseek(fd, offset, SEEK_SET) == (off_t)-1) {
-        perror("lseek");
-        close(fd);
-        return NULL;
+int write_page_to_db(Pager *pager, void *page) {
+    uint8_t page_type = *(uint8_t*)page;
+    uint32_t page_id = page_get_id(page);
+    switch (page_type) {
+        case BPT_PAGE:
+#ifdef PAGER_DEBUG
+            printf("Writing bpt-page(%u) to db\n", page_id);
+#endif
+            break;
+        
+        case DATA_PAGE:
+#ifdef PAGER_DEBUG
+            printf("Writing data-page(%u) to db\n", page_id);
+#endif
+            break;
+
+        case SUPERBLOCK_PAGE:
+        case FREE_LIST_PAGE:
+        case FSM_PAGE:
+#ifdef PAGER_DEBUG
+            printf("Writing page(%u) of type %u to db\n", page_id, page_type);
+#endif
+            break;
+        
+        default:
+            printf("Invalid page: %p\n", page);
+            return -1;
     }
 
-    uint8_t buffer[PAGE_SIZE];
-    ssize_t r = read(fd, buffer, PAGE_SIZE);
-    if (r < 0) {
-        perror("read");
-        close(fd);
-        return NULL;
+    return pager_write(pager, page_id, page);
+}
+
+// Reads the page straight into page (PAGE_SIZE bytes), returns -1 if the
+// stored page is not a valid page with that page_id
+int read_page_from_db(Pager *pager, uint32_t page_id, void *page) {
+    uint8_t *raw_page = page;
+    if (pager_read(pager, page_id, raw_page) < 0) {
+        return -1;
     }
 
-    close(fd);
+    if (page_get_id(page) != page_id) {
+        printf("Invalid page with id: %u\n", page_id);
+        return -1;
+    }
 
-    switch (buffer[0]) {
+    switch (raw_page[0]) {
         case BPT_PAGE:
+#ifdef PAGER_DEBUG
             printf("Reading bpt-page(%u) from db\n", page_id);
-            return (void*)get_bpt_page(buffer, page_id);
+#endif
+            return 0;
         
         case DATA_PAGE:
+#ifdef PAGER_DEBUG
             printf("Reading data-page(%u) from db\n", page_id);
-            return (void*)get_data_page(buffer, page_id);
+#endif
+            return 0;
         
         default:
             printf("Invalid page with id: %u\n", page_id);
             break;
     }
 
-    return NULL;
+    return -1;
 }
\ No newline at end of file
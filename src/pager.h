@@ -1,38 +1,70 @@
+#pragma once
 #include <stdint.h>
+#include <sys/types.h>
 #include "consts.h"
 
-#define PAGE_SIZE (off_t)4096
+#define PAGE_SIZE (off_t)DB_PAGE_SIZE
 
 #define BPT_PAGE (uint8_t)0x0
 #define DATA_PAGE (uint8_t)0x1
 #define OVERFLOW_PAGE (uint8_t)0x2
+#define SUPERBLOCK_PAGE (uint8_t)0x3
+#define FREE_LIST_PAGE (uint8_t)0x4
+#define FSM_PAGE (uint8_t)0x5
 
-#define DATA_PAGE_HEADER_SIZE 0x7
+// Page 0 of every database file
+#define SUPERBLOCK_PAGE_ID 0
+#define SUPERBLOCK_MAGIC 0x42505444 // "DTPB"
+// 2 since leaves link back to the previous leaf
+#define SUPERBLOCK_VERSION 2
+// Number of trees whose roots the superblock records
+#define MAX_ROOTS 64
+
+#define FREE_LIST_HEADER_SIZE 0xC
+#define FREE_LIST_CAPACITY ((PAGE_SIZE - FREE_LIST_HEADER_SIZE) / 4)
+
+#define FSM_HEADER_SIZE 0xC
+#define FSM_CAPACITY (PAGE_SIZE - FSM_HEADER_SIZE)
+// Free space of a data page is stored as free_space / FSM_CLASS_SIZE
+#define FSM_CLASS_SIZE (PAGE_SIZE / 256)
+
+#define DATA_PAGE_HEADER_SIZE 0xC
 #define SLOT_FLAG_NONE (uint8_t)0x0
 #define SLOT_FLAG_FREE (uint8_t)0x1
 #define SLOT_FLAG_OVERFLOW (uint8_t)0x2
 #define SLOT_FLAG_INVALID (uint8_t)0x80
 
 // Page structure:
+// A page is stored on disk exactly as the structs below lay it out in
+// memory (host byte order, fixed offsets), so a cached page is the same
+// PAGE_SIZE bytes that are read from and written to the file, with no
+// decode or encode step in between.
+//
 // bpt page
 // 0x0: 1 byte for type: 0x0 for non-data page
 // 0x1: 1 byte for is_leaf: 0x0 or 0x1
 // 0x2: 2 bytes for num_keys
-// (page_id is not stored on disk as it is implied by its location)
-// 0x4 4 * num_keys bytes for keys[]
-// 0x(4 + 4 * num_keys) (
-//  4 * (num_keys + 1) for pointers[], if internal
-//  6 * num_keys for pointers[] + slot, if leaf
-// )
-// (?) 4 bytes for next_page_id, leafs only
+// 0x4: 4 bytes for page_id
+// internal:
+//  0x8 4 * MAX_KEYS bytes for keys[]
+//  4 * MAX_CHILDREN bytes for children[]
+// leaf:
+//  0x8 4 bytes for next_page_id
+//  0xC 4 bytes for prev_page_id, the leaves are linked both ways in key
+//      order (0 past either end)
+//  0x10 4 * MAX_ENTRIES_LEAF bytes for keys[]
+//  4 * MAX_ENTRIES_LEAF bytes for page_ids[]
+//  2 * MAX_ENTRIES_LEAF bytes for slot_ids[]
 // 
 // 
 // Data page
 // 0x0: 1 byte for type: 0x1 for data page
-// 0x1: 2 bytes for occupied_slots
-// 0x3: 2 bytes for free_space_start
-// 0x5: 2 bytes for free_space_end
-// 0x7: 5 * occupied_slots bytes for slot_directory
+// 0x1: 1 byte reserved
+// 0x2: 2 bytes for occupied_slots
+// 0x4: 4 bytes for page_id
+// 0x8: 2 bytes for free_space_start
+// 0xA: 2 bytes for free_space_end
+// 0xC: 5 * occupied_slots bytes for slot_directory
 // (
 //      Each slot-entry is of the form:
 //      2 bytes for offset
@@ -40,7 +72,7 @@
 //      1 byte for flags (FREE, OVERFLOWS and so on)
 // )
 // free_space_end - free_space_start bytes of free space
-// 4096 - free_space_end for records
+// PAGE_SIZE - free_space_end for records
 // (
 //      Each slot is: type, value
 //      1 byte for type except for varchar, then 2 bytes
@@ -71,34 +103,70 @@
 //      4 bytes for page_id referencing the overflow-page
 //
 // )
+//
+//
+// Superblock (page 0)
+// 0x0: 1 byte for type: 0x3
+// 0x1: 1 byte reserved
+// 0x2: 2 bytes for version
+// 0x4: 4 bytes for page_id (always 0)
+// 0x8: 4 bytes for magic
+// 0xC: 4 bytes for page_count, pages in use or on the free list
+// 0x10: 4 bytes for free_list_page_id, first free-list page (0 if none)
+// 0x14: 4 * MAX_ROOTS bytes for roots[], root page_id per tree (0 if unused)
+// 0x114: 4 bytes for fsm_page_id, first free-space map page (0 if none)
+// 0x118: 4 bytes for page_size, PAGE_SIZE of the build that created the
+//        file (0 in files from before it was recorded, which use 4096)
+// 0x11C: 4 bytes for checkpoint_salt, and
+// 0x120: 8 bytes for checkpoint_offset, the log position recovery starts
+//        from (see wal.h), both 0 until a checkpoint recorded one
+//
+//
+// Free-list page, a free page used to remember other free pages
+// 0x0: 1 byte for type: 0x4
+// 0x1: 1 byte reserved
+// 0x2: 2 bytes for num_page_ids
+// 0x4: 4 bytes for page_id
+// 0x8: 4 bytes for next_page_id, next free-list page (0 if last)
+// 0xC: 4 * num_page_ids bytes for page_ids[]
+//
+//
+// Free-space map page, the n:th page in the chain covers the page_ids
+// n * FSM_CAPACITY to (n + 1) * FSM_CAPACITY - 1
+// 0x0: 1 byte for type: 0x5
+// 0x1: 3 bytes reserved
+// 0x4: 4 bytes for page_id
+// 0x8: 4 bytes for next_page_id, next free-space map page (0 if last)
+// 0xC: FSM_CAPACITY bytes for free_space_classes[], free space of every
+//      covered data page in units of FSM_CLASS_SIZE (0 if full or not a
+//      data page)
 // 
 
 typedef struct PageHeader {
     uint8_t page_type;
-    uint32_t page_id;
-    uint16_t num_keys;
     uint8_t is_leaf;
+    uint16_t num_keys;
+    uint32_t page_id;
 } PageHeader;
 
 typedef struct InternalPage {
-    uint32_t keys[MAX_KEYS + 1];
-    uint32_t children[MAX_CHILDREN + 1];
+    uint32_t keys[MAX_KEYS];
+    uint32_t children[MAX_CHILDREN];
 } InternalPage;
 
 typedef struct LeafPage {
-    uint32_t keys[MAX_ENTRIES_LEAF + 1];
+    uint32_t next_page_id;
+    uint32_t prev_page_id;
+    uint32_t keys[MAX_ENTRIES_LEAF];
 
     // RID = (page_id, slot_id)
-    uint32_t page_ids[MAX_ENTRIES_LEAF + 1];
-    uint16_t slot_ids[MAX_ENTRIES_LEAF + 1];
-    uint32_t next_page_id;
+    uint32_t page_ids[MAX_ENTRIES_LEAF];
+    uint16_t slot_ids[MAX_ENTRIES_LEAF];
 } LeafPage;
 
-// Check how pages are freed, might not free the actual internal/leaf
-// Can be solved by passing specific item-freefunction
 typedef struct Page {
     PageHeader header;
-    union {InternalPage *internal; LeafPage *leaf;};
+    union {InternalPage internal; LeafPage leaf;};
 } Page;
 
 
@@ -109,13 +177,52 @@ typedef struct Page {
 // (data)
 typedef struct DataPage {
     uint8_t page_type;
-    uint32_t page_id;
+    uint8_t reserved;
     uint16_t occupied_slots;
+    uint32_t page_id;
     uint16_t free_space_start;
     uint16_t free_space_end;
-    uint8_t *data;
+    uint8_t data[PAGE_SIZE - DATA_PAGE_HEADER_SIZE];
 } DataPage;
 
+typedef struct Superblock {
+    uint8_t page_type;
+    uint8_t reserved;
+    uint16_t version;
+    uint32_t page_id;
+    uint32_t magic;
+    uint32_t page_count;
+    uint32_t free_list_page_id;
+    uint32_t roots[MAX_ROOTS];
+    uint32_t fsm_page_id;
+    uint32_t page_size;
+    uint32_t checkpoint_salt;
+    uint64_t checkpoint_offset;
+} Superblock;
+
+typedef struct FreeListPage {
+    uint8_t page_type;
+    uint8_t reserved;
+    uint16_t num_page_ids;
+    uint32_t page_id;
+    uint32_t next_page_id;
+    uint32_t page_ids[FREE_LIST_CAPACITY];
+} FreeListPage;
+
+typedef struct FsmPage {
+    uint8_t page_type;
+    uint8_t reserved[3];
+    uint32_t page_id;
+    uint32_t next_page_id;
+    uint8_t free_space_classes[FSM_CAPACITY];
+} FsmPage;
+
+_Static_assert(sizeof(Page) <= PAGE_SIZE, "bpt page does not fit in a page");
+_Static_assert(sizeof(DataPage) == PAGE_SIZE, "data page must fill a page");
+_Static_assert(sizeof(Superblock) <= PAGE_SIZE, "superblock does not fit in a page");
+_Static_assert(sizeof(FreeListPage) == PAGE_SIZE, "free-list page must fill a page");
+_Static_assert(sizeof(FsmPage) == PAGE_SIZE, "free-space map page must fill a page");
+
 // Probably needs length aswell
 typedef struct OverflowPage {
     uint8_t *data;
@@ -129,5 +236,99 @@ void u16_to_bytes_be(uint8_t b[2], uint16_t v);
 void u32_to_bytes_be(uint8_t b[4], uint32_t v);
 void u64_to_bytes_be(uint8_t b[8], uint64_t v);
 
-void write_page_to_db(char *db_file_path, void *page);
-void *read_page_from_db(char *db_file_path, uint32_t page_id);
\ No newline at end of file
+// Owns one file descriptor for the lifetime of the database, all page
+// transfers are positional (pread/pwrite) so a miss or a writeback is a
+// single syscall
+typedef struct Pager Pager;
+
+typedef struct PagerStats {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t syscalls;
+} PagerStats;
+
+// Backends for pager_run_batch. PAGER_IO_SYNC (the default) does one
+// transfer at a time, PAGER_IO_AUTO uses io_uring when the kernel allows
+// it and a thread pool otherwise.
+#define PAGER_IO_SYNC (uint8_t)0x0
+#define PAGER_IO_URING (uint8_t)0x1
+#define PAGER_IO_THREADS (uint8_t)0x2
+#define PAGER_IO_AUTO (uint8_t)0x3
+
+#define PAGER_DEFAULT_QUEUE_DEPTH 32
+#define PAGER_DEFAULT_MAX_COALESCE 64
+
+// What happens to pages in the OS page cache. PAGER_OS_CACHE_KEEP (the
+// default) uses buffered I/O. PAGER_OS_CACHE_DIRECT opens the file with
+// O_DIRECT so pages are only cached by the caller, and falls back to
+// PAGER_OS_CACHE_DROP where the file system does not support it. DROP
+// uses buffered I/O without readahead and asks the kernel (posix_fadvise
+// DONTNEED) to drop pages after they were transferred, waiting for
+// written pages to reach the disk first like O_DIRECT does.
+#define PAGER_OS_CACHE_KEEP (uint8_t)0x0
+#define PAGER_OS_CACHE_DIRECT (uint8_t)0x1
+#define PAGER_OS_CACHE_DROP (uint8_t)0x2
+
+// With O_DIRECT, buffers aligned to this are transferred as they are,
+// others are copied through an aligned buffer
+#define PAGER_IO_ALIGNMENT 4096
+
+// Passing NULL to pager_open uses the defaults
+typedef struct PagerOptions {
+    uint8_t io_backend;
+    // Transfers of a batch in flight at once, 0 for the default
+    uint32_t queue_depth;
+    // Most consecutive pages merged into one preadv/pwritev, 0 for the
+    // default and 1 to transfer every page on its own
+    uint32_t max_coalesce;
+    uint8_t os_cache;
+    // Opens the file read-only and maps it, pages are then read in place
+    // with pager_mapped_page. os_cache is ignored, the mapping is the OS
+    // page cache.
+    uint8_t read_only;
+} PagerOptions;
+
+#define PAGE_IO_READ (uint8_t)0x0
+#define PAGE_IO_WRITE (uint8_t)0x1
+
+typedef struct PageIO {
+    uint8_t op;
+    uint32_t page_id;
+    uint8_t *buffer;
+    // Set by pager_run_batch, 0 or -1 if the transfer failed
+    int result;
+} PageIO;
+
+Pager *pager_open(char *db_file_path, PagerOptions *options);
+void pager_close(Pager *pager);
+int pager_read(Pager *pager, uint32_t page_id, uint8_t buffer[PAGE_SIZE]);
+int pager_write(Pager *pager, uint32_t page_id, uint8_t buffer[PAGE_SIZE]);
+// Runs every transfer with up to queue_depth of them in flight and returns
+// once all are done, -1 if any failed. Neighbouring entries for consecutive
+// page ids in the same direction share one call, so callers sort batches by
+// page id. With O_DIRECT, buffers not aligned to PAGER_IO_ALIGNMENT fall
+// back to one transfer each. Reads past the end of the file give zeroes
+// like pager_read. Batches are run one at a time.
+int pager_run_batch(Pager *pager, PageIO *ios, uint32_t count);
+// Waits until the pages written so far are on disk (fdatasync)
+int pager_sync(Pager *pager);
+// The backend actually used, PAGER_IO_AUTO resolved
+uint8_t pager_io_backend(Pager *pager);
+// The OS cache mode actually used
+uint8_t pager_os_cache(Pager *pager);
+// Pages in the file, a partial last page counts as a page
+uint32_t pager_num_pages(Pager *pager);
+PagerStats pager_get_stats(Pager *pager);
+// Page page_id inside the mapping of a read-only pager, NULL past the end
+// of the file as it was when opened or if the pager is not read-only
+void *pager_mapped_page(Pager *pager, uint32_t page_id);
+// madvise (MADV_WILLNEED, MADV_SEQUENTIAL, ...) for the mapped pages
+// [page_id, page_id + count), no-op if the pager is not read-only
+void pager_advise(Pager *pager, uint32_t page_id, uint32_t count, int advice);
+
+// Every page type stores its page_id at 0x4
+uint32_t page_get_id(void *page);
+
+// -1 if the page is not of a known type or could not be written
+int write_page_to_db(Pager *pager, void *page);
+int read_page_from_db(Pager *pager, uint32_t page_id, void *page);
\ No newline at end of file
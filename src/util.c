@@ -93,6 +93,10 @@ uint8_t stack_is_empty(Stack *stack) {
     return stack->size == 0;
 }
 
+uint32_t stack_size(Stack *stack) {
+    return stack->size;
+}
+
 Stack *stack_clone(Stack *stack) {
     Stack *new_stack = malloc(sizeof(Stack));
     new_stack->size = stack->size;
@@ -394,7 +398,9 @@ void rbt_delete_node(RBTree *rbt, RBTreeNode *node, size_t data_size) {
         parent = node->parent;
     }
 
-    if (case_6) {
+    // Close nephew red (distant black): rotate it into the distant
+    // position first, then finish as with a red distant nephew
+    if (case_5) {
         rbt_rotate(rbt, sibling, !left_child);
         sibling->color = RBTN_RED;
         close_nephew->color = RBTN_BLACK;
@@ -531,12 +537,16 @@ Heap *new_minheap() {
     return new_heap(u32_lesser, sizeof(uint32_t));
 }
 
+#define HEAP_SWAP_BUFFER_SIZE 64
+
 void swap(Heap *heap, void *a, void *b) {
-    void *tmp = malloc(heap->type_size);
+    // Heaps of small elements swap without an allocation
+    uint8_t buffer[HEAP_SWAP_BUFFER_SIZE];
+    void *tmp = heap->type_size <= sizeof(buffer) ? buffer : malloc(heap->type_size);
     memcpy(tmp, a, heap->type_size);
     memcpy(a, b, heap->type_size);
     memcpy(b, tmp, heap->type_size);
-    free(tmp);
+    if (tmp != buffer) free(tmp);
 }
 
 uint32_t ileftchild(uint32_t i) {
@@ -1,3 +1,4 @@
+#pragma once
 #include <stdint.h>
 #include <stddef.h>
 
@@ -13,6 +14,7 @@ void stack_pop(Stack *stack);
 void stack_push(Stack *stack, uint32_t value);
 void stack_clear(Stack *stack);
 uint8_t stack_is_empty(Stack *stack);
+uint32_t stack_size(Stack *stack);
 Stack *stack_clone(Stack *stack);
 
 typedef struct RBTree RBTree;
@@ -0,0 +1,269 @@
+// fallocate
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "wal.h"
+
+typedef struct WalRecord {
+    uint32_t type;
+    uint32_t page_id;
+    uint64_t checksum;
+} WalRecord;
+
+#define WAL_RECORD_SIZE (sizeof(WalRecord) + PAGE_SIZE)
+
+struct Wal {
+    int fd;
+    uint32_t salt;
+    // Where the next group is written, and the end of the file (zeros after
+    // the records)
+    off_t log_end;
+    off_t file_end;
+    uint32_t commits_per_sync;
+    uint64_t sync_interval_us;
+    // Commits in the current group and when the first of them was made
+    uint32_t num_commits;
+    uint64_t group_start_us;
+    WalStats stats;
+};
+
+uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Fletcher-style sums over the 64-bit words of the header (with checksum
+// 0) and the page if there is one, the second sum makes the result depend
+// on their order
+uint64_t record_checksum(uint32_t salt, WalRecord header, const uint8_t *page) {
+    header.checksum = 0;
+    const uint64_t *words = (const uint64_t*)&header;
+    uint64_t a = salt + 1 + words[0];
+    uint64_t b = a;
+    a += words[1];
+    b += a;
+    words = (const uint64_t*)page;
+    for (size_t i = 0; page && i < PAGE_SIZE / sizeof(uint64_t); i++) {
+        a += words[i];
+        b += a;
+    }
+    return a ^ (b * 0x9e3779b97f4a7c15ULL);
+}
+
+Wal *wal_open(const char *path, uint32_t commits_per_sync, uint32_t sync_interval_us) {
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        perror("wal open");
+        return NULL;
+    }
+
+    // A new log (or one whose header was torn) gets a salt unlikely to
+    // match records of an older log
+    WalRecord header;
+    uint32_t salt = (uint32_t)now_us() ^ ((uint32_t)getpid() << 16);
+    if (pread(fd, &header, sizeof(WalRecord), 0) == sizeof(WalRecord) &&
+        header.type == WAL_HEADER && record_checksum(0, header, NULL) == header.checksum) {
+        salt = header.page_id;
+    }
+
+    Wal *wal = malloc(sizeof(Wal));
+    wal->fd = fd;
+    wal->salt = salt;
+    wal->log_end = sizeof(WalRecord);
+    struct stat st;
+    wal->file_end = fstat(fd, &st) == 0 ? st.st_size : 0;
+    wal->commits_per_sync = commits_per_sync ? commits_per_sync : 1;
+    wal->sync_interval_us = sync_interval_us;
+    wal->num_commits = 0;
+    wal->group_start_us = 0;
+    memset(&wal->stats, 0, sizeof(WalStats));
+    return wal;
+}
+
+void wal_close(Wal *wal) {
+    if (!wal) return;
+    close(wal->fd);
+    free(wal);
+}
+
+// Reads the record at offset, -1 at the end of the log or at a record that
+// was not written completely
+int read_record(Wal *wal, off_t offset, uint8_t *record) {
+    if (pread(wal->fd, record, WAL_RECORD_SIZE, offset) != (ssize_t)WAL_RECORD_SIZE) {
+        return -1;
+    }
+    WalRecord *header = (WalRecord*)record;
+    if (header->type != WAL_PAGE && header->type != WAL_COMMIT) return -1;
+    uint64_t checksum = record_checksum(wal->salt, *header, record + sizeof(WalRecord));
+    return checksum == header->checksum ? 0 : -1;
+}
+
+int wal_recover(Wal *wal, Pager *pager, WalPosition from) {
+    uint8_t *record = malloc(WAL_RECORD_SIZE);
+    WalRecord *header = (WalRecord*)record;
+    off_t group_start = sizeof(WalRecord);
+    if (from.salt == wal->salt && from.offset > sizeof(WalRecord) &&
+        (from.offset - sizeof(WalRecord)) % WAL_RECORD_SIZE == 0) {
+
+        group_start = from.offset;
+    }
+    off_t offset = group_start;
+    int groups = 0;
+    while (read_record(wal, offset, record) == 0) {
+        offset += WAL_RECORD_SIZE;
+        if (header->type != WAL_COMMIT) continue;
+
+        // Every record of the group was read intact, apply them
+        for (off_t at = group_start; at < offset; at += WAL_RECORD_SIZE) {
+            read_record(wal, at, record);
+            pager_write(pager, header->page_id, record + sizeof(WalRecord));
+        }
+        group_start = offset;
+        groups++;
+    }
+    free(record);
+    if (groups) pager_sync(pager);
+    return groups;
+}
+
+uint8_t wal_commit(Wal *wal) {
+    wal->stats.commits++;
+    if (wal->num_commits++ == 0) wal->group_start_us = now_us();
+    return wal->num_commits >= wal->commits_per_sync || (wal->sync_interval_us &&
+        now_us() - wal->group_start_us >= wal->sync_interval_us);
+}
+
+uint32_t wal_pending_commits(Wal *wal) {
+    return wal->num_commits;
+}
+
+uint64_t wal_group_deadline(Wal *wal) {
+    if (!wal->num_commits || !wal->sync_interval_us) return 0;
+    return wal->group_start_us + wal->sync_interval_us;
+}
+
+// pwritev of every iovec, continuing after short writes
+int write_all(int fd, struct iovec *iov, uint32_t iovcnt, off_t offset) {
+    while (iovcnt > 0) {
+        int n = iovcnt < UIO_MAXIOV ? iovcnt : UIO_MAXIOV;
+        ssize_t written = pwritev(fd, iov, n, offset);
+        if (written <= 0) return -1;
+        offset += written;
+        while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (written > 0) {
+            iov->iov_base = (uint8_t*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+// Writes zeros from the end of the file to past end, in steps of
+// WAL_EXTEND_SIZE. The fdatasync of a group written within the file only
+// flushes data, appending would also commit the new blocks and size.
+int extend_file(Wal *wal, off_t end) {
+    const size_t chunk = 1 << 20;
+    uint8_t *zeros = calloc(1, chunk);
+    off_t file_end = (end + WAL_EXTEND_SIZE - 1) / WAL_EXTEND_SIZE * WAL_EXTEND_SIZE;
+    int result = 0;
+    for (off_t at = wal->file_end; at < file_end && result == 0; at += chunk) {
+        size_t size = file_end - at < (off_t)chunk ? (size_t)(file_end - at) : chunk;
+        if (pwrite(wal->fd, zeros, size, at) != (ssize_t)size) result = -1;
+    }
+    free(zeros);
+    if (result == 0) wal->file_end = file_end;
+    return result;
+}
+
+int wal_write_group(Wal *wal, void **pages, uint32_t count, const Superblock *superblock) {
+    uint8_t *commit_page = calloc(1, PAGE_SIZE);
+    memcpy(commit_page, superblock, sizeof(Superblock));
+    WalRecord *headers = malloc(sizeof(WalRecord) * (count + 1));
+    struct iovec *iov = malloc(sizeof(struct iovec) * 2 * (count + 1));
+    for (uint32_t i = 0; i <= count; i++) {
+        uint8_t *page = i < count ? pages[i] : commit_page;
+        WalRecord header = { i < count ? WAL_PAGE : WAL_COMMIT, page_get_id(page), 0 };
+        header.checksum = record_checksum(wal->salt, header, page);
+        headers[i] = header;
+        iov[2 * i].iov_base = &headers[i];
+        iov[2 * i].iov_len = sizeof(WalRecord);
+        iov[2 * i + 1].iov_base = page;
+        iov[2 * i + 1].iov_len = PAGE_SIZE;
+    }
+
+    off_t group_end = wal->log_end + (off_t)(count + 1) * WAL_RECORD_SIZE;
+    int result = group_end > wal->file_end ? extend_file(wal, group_end) : 0;
+    if (result == 0) result = write_all(wal->fd, iov, 2 * (count + 1), wal->log_end);
+    if (result == 0) result = fdatasync(wal->fd);
+    free(iov);
+    free(headers);
+    free(commit_page);
+    if (result < 0) {
+        perror("wal write");
+        return -1;
+    }
+
+    wal->log_end = group_end;
+    wal->num_commits = 0;
+    wal->stats.groups++;
+    wal->stats.pages += count;
+    return 0;
+}
+
+int wal_reset(Wal *wal) {
+    // Made durable right away, records of the old log must not be replayed
+    // after the database moved past them
+    WalRecord header = { WAL_HEADER, wal->salt + 1, 0 };
+    header.checksum = record_checksum(0, header, NULL);
+    uint8_t truncate = wal->log_end > WAL_KEEP_SIZE;
+    if ((truncate && ftruncate(wal->fd, 0) < 0) ||
+        pwrite(wal->fd, &header, sizeof(WalRecord), 0) != sizeof(WalRecord) ||
+        fdatasync(wal->fd) < 0) {
+
+        perror("wal reset");
+        return -1;
+    }
+    wal->salt = header.page_id;
+    wal->log_end = sizeof(WalRecord);
+    if (truncate || wal->file_end < (off_t)sizeof(WalRecord)) wal->file_end = sizeof(WalRecord);
+    return 0;
+}
+
+WalPosition wal_position(Wal *wal) {
+    WalPosition position = { wal->salt, wal->log_end };
+    return position;
+}
+
+uint64_t wal_bytes_since(Wal *wal, WalPosition position) {
+    if (position.salt != wal->salt || position.offset < sizeof(WalRecord)) {
+        return wal->log_end - sizeof(WalRecord);
+    }
+    return wal->log_end - position.offset;
+}
+
+int wal_discard(Wal *wal, WalPosition position) {
+    if (position.salt != wal->salt) return 0;
+    if (position.offset == (uint64_t)wal->log_end) return wal_reset(wal);
+    // Only a hint, the groups are never read again either way
+    if (position.offset > sizeof(WalRecord)) {
+        fallocate(wal->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, sizeof(WalRecord),
+            position.offset - sizeof(WalRecord));
+    }
+    return 0;
+}
+
+WalStats wal_get_stats(Wal *wal) {
+    return wal->stats;
+}
@@ -0,0 +1,92 @@
+#pragma once
+#include <stdint.h>
+#include "pager.h"
+
+// Write-ahead log next to the database file, holding after-images of whole
+// pages. Commits are collected into a group, which is written when it is
+// full (or older than the sync interval) as the pages its commits changed
+// followed by a commit record with the superblock, and made durable with
+// one fdatasync. The commits of a group not yet written are not durable. A
+// page changed by several commits of a group is written once. Recovery
+// rewrites the pages of every complete group in log order.
+//
+// The log starts with a header, followed by the records. The file is
+// extended with zeros ahead of the records, WAL_EXTEND_SIZE at a time, and
+// emptying the log only writes a new salt to the header, so the file keeps
+// its size and fdatasync does not have to update it. Records left from
+// before fail their checksum, which is seeded with the salt, zeros fail
+// their type.
+//
+// Header, 16 bytes
+// 0x0: 4 bytes for type: WAL_HEADER
+// 0x4: 4 bytes for salt
+// 0x8: 8 bytes for checksum, of the header with checksum 0
+//
+// A checkpoint records a position in the superblock once the file holds
+// every group before it. Recovery starts there, and the disk space of the
+// groups before it is given back (a hole is punched, offsets stay valid).
+//
+// Record, 16 + PAGE_SIZE bytes
+// 0x0: 4 bytes for type: WAL_PAGE or WAL_COMMIT
+// 0x4: 4 bytes for page_id
+// 0x8: 8 bytes for checksum, of the record with checksum 0
+// 0x10: PAGE_SIZE bytes for the page, the superblock page for WAL_COMMIT
+typedef struct Wal Wal;
+
+#define WAL_PAGE (uint32_t)0x1
+#define WAL_COMMIT (uint32_t)0x2
+#define WAL_HEADER (uint32_t)0x3
+
+#define WAL_KEEP_SIZE ((off_t)64 << 20) // 64 MB
+#define WAL_EXTEND_SIZE ((off_t)4 << 20) // 4 MB
+
+// The salt the log had and the offset of the next group
+typedef struct WalPosition {
+    uint32_t salt;
+    uint64_t offset;
+} WalPosition;
+
+typedef struct WalStats {
+    uint64_t commits;
+    // Groups written, one fdatasync each
+    uint64_t groups;
+    // Page images written, commit records not included
+    uint64_t pages;
+} WalStats;
+
+// commits_per_sync of 0 or 1 makes every commit due on its own,
+// sync_interval_us of 0 lets a group wait until it is full. NULL if the
+// log cannot be opened. The log is recovered (or discarded) and then
+// reset before anything is written to it.
+Wal *wal_open(const char *path, uint32_t commits_per_sync, uint32_t sync_interval_us);
+void wal_close(Wal *wal);
+// Writes the pages of each complete group after from (the whole log if it
+// was emptied since from was taken) to the database, the superblock of the
+// last one to page 0, and waits for them to reach the disk. A torn group at
+// the end, from a crash while it was written, is ignored. The log is left
+// as it is, see wal_reset. Number of groups applied.
+int wal_recover(Wal *wal, Pager *pager, WalPosition from);
+// Counts a commit into the current group, 1 once the group is due
+uint8_t wal_commit(Wal *wal);
+// Commits in the current group
+uint32_t wal_pending_commits(Wal *wal);
+// When the current group becomes due by sync_interval_us (CLOCK_MONOTONIC
+// microseconds), 0 if it has no commits or there is no interval
+uint64_t wal_group_deadline(Wal *wal);
+// Writes the current group, the pages (any page type, page_id at 0x4) as
+// they are now and the superblock, and waits until it is durable. The next
+// commit starts a new group. -1 if it could not be written.
+int wal_write_group(Wal *wal, void **pages, uint32_t count, const Superblock *superblock);
+// Empties the log, once the database holds everything in it. The file is
+// only truncated when it grew past WAL_KEEP_SIZE.
+int wal_reset(Wal *wal);
+// Where the next group will be written
+WalPosition wal_position(Wal *wal);
+// Bytes of the groups written after position
+uint64_t wal_bytes_since(Wal *wal, WalPosition position);
+// Gives back the space of the groups before position, once the database
+// holds them and position is recorded as the start of recovery. Empties
+// the log if nothing was written after position. No-op if the log was
+// emptied since position was taken.
+int wal_discard(Wal *wal, WalPosition position);
+WalStats wal_get_stats(Wal *wal);
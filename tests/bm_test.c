@@ -1,5 +1,7 @@
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 #include "../src/buffer_manager.h"
 
 typedef struct TestStruct {
@@ -9,38 +11,49 @@ typedef struct TestStruct {
 } TestStruct;
 
 int main() {
-    BufferManager *bm = buffer_manager_init("db/test.db");
+    FILE *f = fopen("db/test.db", "w");
+    fclose(f);
+    BufferManager *bm = buffer_manager_init("db/test.db", NULL);
 
     uint32_t v1 = 12345678;
     RID rid1 = buffer_manager_request_slot(bm, sizeof(uint32_t), &v1);
     void *res = buffer_manager_get_data(bm, rid1);
     assert(res);
     assert(*(uint32_t*)res == v1);
+    buffer_manager_unpin_page(bm, res);
 
     uint32_t v2 = 15;
     RID rid2 = buffer_manager_request_slot(bm, sizeof(uint32_t), &v2);
     res = buffer_manager_get_data(bm, rid2);
     assert(res);
     assert(*(uint32_t*)res == v2);
+    buffer_manager_unpin_page(bm, res);
     res = buffer_manager_get_data(bm, rid1);
     assert(res);
     assert(*(uint32_t*)res == v1);
+    buffer_manager_unpin_page(bm, res);
 
     Page *page = buffer_manager_new_bpt_page(bm, LEAF);
     assert(page);
+    uint32_t bpt_page_id = page->header.page_id;
     Page *bpt_res = buffer_manager_get_page(bm, page->header.page_id);
-    assert(bpt_res);
+    assert(bpt_res == page);
+    buffer_manager_unpin_page(bm, bpt_res);
+    buffer_manager_unpin_page(bm, page);
 
     buffer_manager_flush_cache(bm);
     res = buffer_manager_get_data(bm, rid2);
     assert(res);
     assert(*(uint32_t*)res == v2);
+    buffer_manager_unpin_page(bm, res);
     res = buffer_manager_get_data(bm, rid1);
     assert(res);
     assert(*(uint32_t*)res == v1);
+    buffer_manager_unpin_page(bm, res);
 
-    res = buffer_manager_get_page(bm, 2);
+    res = buffer_manager_get_page(bm, bpt_page_id);
     assert(res);
+    buffer_manager_unpin_page(bm, res);
 
     TestStruct v3 = {
         28734651,
@@ -53,9 +66,404 @@ int main() {
     assert((*(TestStruct*)res).field1 == v3.field1);
     assert((*(TestStruct*)res).field2 == v3.field2);
     assert((*(TestStruct*)res).field3 == v3.field3);
+    buffer_manager_unpin_page(bm, res);
 
+    // Pages that were only read are dropped without being written back
+    buffer_manager_flush_cache(bm);
+    BufferManagerStats before = buffer_manager_get_stats(bm);
+    res = buffer_manager_get_data(bm, rid1);
+    assert(*(uint32_t*)res == v1);
+    buffer_manager_unpin_page(bm, res);
+    res = buffer_manager_get_data(bm, rid3);
+    assert((*(TestStruct*)res).field1 == v3.field1);
+    buffer_manager_unpin_page(bm, res);
+    buffer_manager_flush_cache(bm);
+    BufferManagerStats after = buffer_manager_get_stats(bm);
+    assert(after.writes == before.writes);
+    assert(after.writes_avoided > before.writes_avoided);
+
+    // Modified pages are written
+    buffer_manager_free_data(bm, rid2);
+    buffer_manager_flush_cache(bm);
+    after = buffer_manager_get_stats(bm);
+    assert(after.writes == before.writes + 1);
+
+    // A sync keeps the pages cached, every read right after it is a hit.
+    // Once the cache is dropped every page is read again.
+    static RID synced[1000];
+    uint8_t synced_record[400];
+    for (uint32_t i = 0; i < 1000; i++) {
+        memset(synced_record, i & 0xFF, sizeof(synced_record));
+        synced[i] = buffer_manager_request_slot(bm, sizeof(synced_record), synced_record);
+    }
+    buffer_manager_sync(bm);
+    before = buffer_manager_get_stats(bm);
+    assert(before.writes > after.writes);
+    for (uint32_t i = 0; i < 1000; i++) {
+        uint8_t *data = buffer_manager_get_data(bm, synced[i]);
+        assert(data[0] == (i & 0xFF));
+        buffer_manager_unpin_page(bm, data);
+    }
+    buffer_manager_sync(bm);
+    after = buffer_manager_get_stats(bm);
+    double hit_ratio = (double)(after.hits - before.hits) /
+        (after.hits - before.hits + after.misses - before.misses);
+    assert(hit_ratio == 1.0);
+    assert(after.writes == before.writes && after.evictions == before.evictions);
+    buffer_manager_drop_cache(bm);
+    before = buffer_manager_get_stats(bm);
+    uint32_t synced_pages = 0;
+    for (uint32_t i = 0; i < 1000; i++) {
+        uint8_t *data = buffer_manager_get_data(bm, synced[i]);
+        assert(data[0] == (i & 0xFF));
+        buffer_manager_unpin_page(bm, data);
+        if (i == 0 || synced[i].page_id != synced[i - 1].page_id) synced_pages++;
+    }
+    after = buffer_manager_get_stats(bm);
+    assert(after.misses - before.misses == synced_pages);
+
+    buffer_manager_free(bm);
+
+    // Pinned pages are never evicted, the pool fails instead
+    BufferManagerOptions small = { 0 };
+    small.pool_size = 64 * PAGE_SIZE;
+    bm = buffer_manager_init("db/test.db", &small);
+    assert(buffer_manager_get_pool_size(bm) == 64 * PAGE_SIZE);
+    Page *pinned[64];
+    for (int i = 0; i < 64; i++) {
+        pinned[i] = buffer_manager_new_bpt_page(bm, LEAF);
+        assert(pinned[i]);
+    }
+    assert(!buffer_manager_new_bpt_page(bm, LEAF));
+    for (int i = 0; i < 64; i++) {
+        assert(pinned[i]->header.is_leaf && pinned[i]->header.num_keys == 0);
+        buffer_manager_unpin_page(bm, pinned[i]);
+    }
+    page = buffer_manager_new_bpt_page(bm, LEAF);
+    assert(page);
+    buffer_manager_unpin_page(bm, page);
+    buffer_manager_free(bm);
+
+    // The superblock keeps the roots, the page count and the free list
+    f = fopen("db/test_reopen.db", "w");
+    fclose(f);
+    bm = buffer_manager_init("db/test_reopen.db", NULL);
+    static uint32_t page_ids[3000];
+    for (uint32_t i = 0; i < 3000; i++) {
+        page = buffer_manager_new_bpt_page(bm, LEAF);
+        page_ids[i] = page->header.page_id;
+        assert(page_ids[i] == i + 1);
+        buffer_manager_unpin_page(bm, page);
+    }
+    buffer_manager_set_root(bm, 3, page_ids[2999]);
+    for (uint32_t i = 0; i < 2000; i++) {
+        buffer_manager_free_page(bm, page_ids[i]);
+    }
+    buffer_manager_flush_cache(bm);
+    buffer_manager_free(bm);
+
+    bm = buffer_manager_init("db/test_reopen.db", NULL);
+    assert(buffer_manager_get_root(bm, 3) == page_ids[2999]);
+    assert(buffer_manager_get_root(bm, 0) == 0);
+    page = buffer_manager_get_page(bm, page_ids[2999]);
+    assert(page && page->header.page_id == page_ids[2999]);
+    buffer_manager_unpin_page(bm, page);
+    // Every freed page is handed out again before the file grows
+    static uint8_t reused[3001];
+    for (uint32_t i = 0; i < 2000; i++) {
+        page = buffer_manager_new_bpt_page(bm, LEAF);
+        uint32_t page_id = page->header.page_id;
+        assert(page_id >= 1 && page_id <= 2000 && !reused[page_id]);
+        reused[page_id] = 1;
+        buffer_manager_unpin_page(bm, page);
+    }
+    page = buffer_manager_new_bpt_page(bm, LEAF);
+    assert(page->header.page_id == 3001);
+    buffer_manager_unpin_page(bm, page);
+    buffer_manager_free(bm);
+    remove("db/test_reopen.db");
 
+    // Free space in data pages is found through the free-space map after
+    // reopening instead of growing the file
+    f = fopen("db/test_fsm.db", "w");
+    fclose(f);
+    bm = buffer_manager_init("db/test_fsm.db", NULL);
+    static RID fsm_rids[400];
+    uint8_t chunk[1000];
+    uint32_t last_page_id = 0;
+    for (uint32_t i = 0; i < 400; i++) {
+        memset(chunk, i & 0xFF, sizeof(chunk));
+        fsm_rids[i] = buffer_manager_request_slot(bm, sizeof(chunk), chunk);
+        if (fsm_rids[i].page_id > last_page_id) last_page_id = fsm_rids[i].page_id;
+    }
+    for (uint32_t i = 0; i < 400; i += 4) {
+        buffer_manager_free_data(bm, fsm_rids[i]);
+    }
+    buffer_manager_flush_cache(bm);
+    buffer_manager_free(bm);
+
+    bm = buffer_manager_init("db/test_fsm.db", NULL);
+    for (uint32_t i = 0; i < 400; i += 4) {
+        memset(chunk, i & 0xFF, sizeof(chunk));
+        fsm_rids[i] = buffer_manager_request_slot(bm, sizeof(chunk), chunk);
+        assert(fsm_rids[i].page_id && fsm_rids[i].page_id <= last_page_id);
+    }
+    for (uint32_t i = 0; i < 400; i++) {
+        uint8_t *data = buffer_manager_get_data(bm, fsm_rids[i]);
+        assert(data[0] == (i & 0xFF) && data[sizeof(chunk) - 1] == (i & 0xFF));
+        buffer_manager_unpin_page(bm, data);
+    }
+    buffer_manager_free(bm);
+    remove("db/test_fsm.db");
+
+    // Batched writes (flushes and evictions) and prefetches on every backend
+    uint8_t backends[] = { PAGER_IO_URING, PAGER_IO_THREADS, PAGER_IO_SYNC };
+    for (uint32_t b = 0; b < sizeof(backends); b++) {
+        f = fopen("db/test_io.db", "w");
+        fclose(f);
+        BufferManagerOptions io_options = { 0 };
+        io_options.pool_size = 256 * PAGE_SIZE;
+        io_options.io_backend = backends[b];
+        io_options.io_queue_depth = 8;
+        io_options.io_max_coalesce = PAGER_DEFAULT_MAX_COALESCE;
+        bm = buffer_manager_init("db/test_io.db", &io_options);
+        static RID io_rids[1000];
+        static uint8_t large[4000];
+        for (uint32_t i = 0; i < 1000; i++) {
+            memset(large, i & 0xFF, sizeof(large));
+            io_rids[i] = buffer_manager_request_slot(bm, sizeof(large), large);
+        }
+        // The records fill data pages with consecutive ids, which are written
+        // by far fewer calls than pages
+        before = buffer_manager_get_stats(bm);
+        buffer_manager_flush_cache(bm);
+        after = buffer_manager_get_stats(bm);
+        assert(after.writes - before.writes >= 32);
+        assert((after.syscalls - before.syscalls) * 8 < after.writes - before.writes);
 
+        uint32_t page_ids[32];
+        // Records far enough apart to be on different pages for any page size
+        uint32_t stride = PAGE_SIZE / sizeof(large) + 10;
+        for (uint32_t i = 0; i < 32; i++) page_ids[i] = io_rids[i * stride].page_id;
+        buffer_manager_prefetch(bm, page_ids, 32);
+        before = buffer_manager_get_stats(bm);
+        assert(before.prefetches == 32);
+        for (uint32_t i = 0; i < 32; i++) {
+            uint8_t *data = buffer_manager_get_data(bm, io_rids[i * stride]);
+            uint8_t expected = (i * stride) & 0xFF;
+            assert(data[0] == expected && data[sizeof(large) - 1] == expected);
+            buffer_manager_unpin_page(bm, data);
+        }
+        after = buffer_manager_get_stats(bm);
+        assert(after.misses == before.misses && after.hits == before.hits + 32);
+
+        for (uint32_t i = 0; i < 1000; i++) {
+            uint8_t *data = buffer_manager_get_data(bm, io_rids[i]);
+            assert(data[0] == (i & 0xFF) && data[sizeof(large) - 1] == (i & 0xFF));
+            buffer_manager_unpin_page(bm, data);
+        }
+        buffer_manager_free(bm);
+        remove("db/test_io.db");
+    }
+
+    // Pages bypassing (or dropped from) the OS cache, written through
+    // evictions and a flush and read back after reopening
+    uint8_t os_caches[] = { PAGER_OS_CACHE_DIRECT, PAGER_OS_CACHE_DROP };
+    for (uint32_t c = 0; c < sizeof(os_caches); c++) {
+        f = fopen("db/test_os_cache.db", "w");
+        fclose(f);
+        BufferManagerOptions cache_options = { 0 };
+        cache_options.pool_size = 64 * PAGE_SIZE;
+        cache_options.io_backend = PAGER_IO_SYNC;
+        cache_options.os_cache = os_caches[c];
+        bm = buffer_manager_init("db/test_os_cache.db", &cache_options);
+        static RID cache_rids[300];
+        static uint8_t large[4000];
+        for (uint32_t i = 0; i < 300; i++) {
+            memset(large, i & 0xFF, sizeof(large));
+            cache_rids[i] = buffer_manager_request_slot(bm, sizeof(large), large);
+        }
+        buffer_manager_flush_cache(bm);
+        buffer_manager_free(bm);
+
+        bm = buffer_manager_init("db/test_os_cache.db", &cache_options);
+        for (uint32_t i = 0; i < 300; i++) {
+            uint8_t *data = buffer_manager_get_data(bm, cache_rids[i]);
+            assert(data[0] == (i & 0xFF) && data[sizeof(large) - 1] == (i & 0xFF));
+            buffer_manager_unpin_page(bm, data);
+        }
+        buffer_manager_free(bm);
+        remove("db/test_os_cache.db");
+    }
+
+    // The page size and format version are recorded, a file made by a
+    // build with another page size or version is refused
+    f = fopen("db/test_page_size.db", "w");
+    fclose(f);
+    bm = buffer_manager_init("db/test_page_size.db", NULL);
+    buffer_manager_flush_cache(bm);
     buffer_manager_free(bm);
+    static uint8_t superblock_page[PAGE_SIZE];
+    f = fopen("db/test_page_size.db", "r+");
+    assert(fread(superblock_page, PAGE_SIZE, 1, f) == 1);
+    Superblock *superblock = (Superblock*)superblock_page;
+    assert(superblock->page_size == PAGE_SIZE);
+    superblock->page_size = PAGE_SIZE * 2;
+    fseek(f, 0, SEEK_SET);
+    fwrite(superblock_page, PAGE_SIZE, 1, f);
+    fflush(f);
+    assert(!buffer_manager_init("db/test_page_size.db", NULL));
+    superblock->page_size = PAGE_SIZE;
+    superblock->version = SUPERBLOCK_VERSION - 1;
+    fseek(f, 0, SEEK_SET);
+    fwrite(superblock_page, PAGE_SIZE, 1, f);
+    fclose(f);
+    assert(!buffer_manager_init("db/test_page_size.db", NULL));
+    remove("db/test_page_size.db");
+
+    // Resizing keeps the cached pages usable
+    f = fopen("db/test_resize.db", "w");
+    fclose(f);
+    BufferManagerOptions sized = { 0 };
+    sized.policy = REPLACEMENT_2Q;
+    sized.pool_size = 1024 * PAGE_SIZE;
+    bm = buffer_manager_init("db/test_resize.db", &sized);
+    static RID records[4000];
+    uint8_t buf[1000];
+    for (uint32_t i = 0; i < 4000; i++) {
+        memset(buf, i & 0xFF, sizeof(buf));
+        records[i] = buffer_manager_request_slot(bm, sizeof(buf), buf);
+    }
+    assert(buffer_manager_resize(bm, 128 * PAGE_SIZE) == 0);
+    for (uint32_t round = 0; round < 2; round++) {
+        for (uint32_t i = 0; i < 4000; i++) {
+            uint8_t *data = buffer_manager_get_data(bm, records[i]);
+            assert(data[0] == (i & 0xFF) && data[sizeof(buf) - 1] == (i & 0xFF));
+            buffer_manager_unpin_page(bm, data);
+        }
+    }
+    assert(buffer_manager_get_pool_size(bm) == 128 * PAGE_SIZE);
+    assert(buffer_manager_resize(bm, 2048 * PAGE_SIZE) == 0);
+    assert(buffer_manager_get_pool_size(bm) == 2048 * PAGE_SIZE);
+    for (uint32_t i = 0; i < 4000; i++) {
+        uint8_t *data = buffer_manager_get_data(bm, records[i]);
+        assert(data[0] == (i & 0xFF) && data[sizeof(buf) - 1] == (i & 0xFF));
+        buffer_manager_unpin_page(bm, data);
+    }
+    buffer_manager_free(bm);
+    remove("db/test_resize.db");
+
+    // Background cleaner, more data pages than frames so it has to evict
+    BufferManagerOptions options = { 0 };
+    options.low_watermark = 64;
+    options.high_watermark = 128;
+    bm = buffer_manager_init("db/test_cleaner.db", &options);
+    static RID rids[20000];
+    uint8_t record[1000];
+    for (uint32_t i = 0; i < 20000; i++) {
+        memset(record, i & 0xFF, sizeof(record));
+        rids[i] = buffer_manager_request_slot(bm, sizeof(record), record);
+    }
+    for (uint32_t i = 0; i < 20000; i++) {
+        uint8_t *data = buffer_manager_get_data(bm, rids[i]);
+        assert(data[0] == (i & 0xFF) && data[sizeof(record) - 1] == (i & 0xFF));
+        buffer_manager_unpin_page(bm, data);
+    }
+    buffer_manager_free(bm);
+    remove("db/test_cleaner.db");
+
+    // Random reads over more pages than frames, histogram of the pages each
+    // read evicted itself (0, 1 to 15, a whole batch or more). The reads
+    // that evict a batch inline make the tail latency (see cleaner_bench),
+    // with the cleaner nearly every read finds a free frame instead.
+    uint32_t inline_reads[2];
+    for (uint32_t cleaner = 0; cleaner < 2; cleaner++) {
+        f = fopen("db/test_cleaner.db", "w");
+        fclose(f);
+        BufferManagerOptions pool_options = { 0 };
+        pool_options.pool_size = 1024 * PAGE_SIZE;
+        if (cleaner) {
+            pool_options.low_watermark = 256;
+            pool_options.high_watermark = 512;
+        }
+        bm = buffer_manager_init("db/test_cleaner.db", &pool_options);
+        for (uint32_t i = 0; i < 20000; i++) {
+            memset(record, i & 0xFF, sizeof(record));
+            rids[i] = buffer_manager_request_slot(bm, sizeof(record), record);
+        }
+        buffer_manager_sync(bm);
+
+        uint32_t histogram[3] = { 0 };
+        uint32_t state = 1;
+        for (uint32_t i = 0; i < 20000; i++) {
+            state = state * 1103515245 + 12345;
+            uint32_t r = (state >> 8) % 20000;
+            BufferManagerStats before = buffer_manager_get_stats(bm);
+            uint8_t *data = buffer_manager_get_data(bm, rids[r]);
+            assert(data[0] == (r & 0xFF));
+            buffer_manager_unpin_page(bm, data);
+            BufferManagerStats after = buffer_manager_get_stats(bm);
+            uint64_t evicted = (after.evictions - after.cleaner_evictions) -
+                (before.evictions - before.cleaner_evictions);
+            histogram[evicted == 0 ? 0 : evicted < 16 ? 1 : 2]++;
+        }
+        inline_reads[cleaner] = histogram[1] + histogram[2];
+        buffer_manager_free(bm);
+        remove("db/test_cleaner.db");
+    }
+    assert(inline_reads[0] > 500);
+    assert(inline_reads[1] * 10 < inline_reads[0]);
+
+    // Warm restart, the hot pages of the last run are cached again on open
+    for (uint8_t mode = WARM_RESTART_PRELOAD; mode <= WARM_RESTART_BACKGROUND; mode++) {
+        f = fopen("db/test_warm.db", "w");
+        fclose(f);
+        remove("db/test_warm.db-warm");
+        BufferManagerOptions warm = { 0 };
+        warm.policy = REPLACEMENT_2Q;
+        warm.pool_size = 256 * PAGE_SIZE;
+        warm.warm_restart = mode;
+        bm = buffer_manager_init("db/test_warm.db", &warm);
+        for (uint32_t i = 0; i < 4000; i++) {
+            memset(buf, i & 0xFF, sizeof(buf));
+            records[i] = buffer_manager_request_slot(bm, sizeof(buf), buf);
+        }
+        buffer_manager_sync(bm);
+        // The first 200 records are used over and over, the rest are cold
+        for (uint32_t round = 0; round < 4; round++) {
+            for (uint32_t i = 0; i < 4000; i += round ? 20 : 1) {
+                uint32_t r = round ? i / 20 : i;
+                uint8_t *data = buffer_manager_get_data(bm, records[r]);
+                buffer_manager_unpin_page(bm, data);
+            }
+        }
+        buffer_manager_free(bm);
+
+        bm = buffer_manager_init("db/test_warm.db", &warm);
+        // The hot pages are read back first, in one batch
+        for (uint32_t tries = 0; buffer_manager_get_stats(bm).preloads == 0; tries++) {
+            assert(tries < 1000);
+            usleep(1000);
+        }
+        BufferManagerStats before = buffer_manager_get_stats(bm);
+        for (uint32_t i = 0; i < 4000; i++) {
+            uint8_t *data = buffer_manager_get_data(bm, records[i]);
+            assert(data[0] == (i & 0xFF) && data[sizeof(buf) - 1] == (i & 0xFF));
+            buffer_manager_unpin_page(bm, data);
+            if (i == 199) assert(buffer_manager_get_stats(bm).misses == before.misses);
+        }
+        buffer_manager_free(bm);
+
+        // A damaged file is ignored
+        f = fopen("db/test_warm.db-warm", "r+");
+        fputc(0, f);
+        fclose(f);
+        bm = buffer_manager_init("db/test_warm.db", &warm);
+        usleep(10000);
+        assert(buffer_manager_get_stats(bm).preloads == 0);
+        buffer_manager_free(bm);
+        remove("db/test_warm.db");
+        remove("db/test_warm.db-warm");
+    }
     return 0;
 }
\ No newline at end of file
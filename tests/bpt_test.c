@@ -3,7 +3,10 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 static int remaining_count;
 static void count_cb(uint32_t key, void *data) {
@@ -18,8 +21,15 @@ uint32_t pseudo_random(uint32_t v) {
 }
 
 void test_empty_db() {
-    BufferManager *bm = buffer_manager_init("db/test.db");
-    BPTree *bpt = bpt_new(bm);
+    FILE *f = fopen("db/test.db", "w");
+    if (!f) {
+        perror("fopen");
+        return;
+    }
+    fclose(f);
+
+    BufferManager *bm = buffer_manager_init("db/test.db", NULL);
+    BPTree *bpt = bpt_open(bm, 0);
 
     assert(bpt_height(bpt) == 1);
 
@@ -36,6 +46,7 @@ void test_empty_db() {
         uint32_t *v = bpt_get(bpt, key);
         assert(v);
         assert(*v == i);
+        bpt_release(bpt, v);
     }
 
     buffer_manager_flush_cache(bm);
@@ -47,6 +58,7 @@ void test_empty_db() {
         uint32_t *v = bpt_get(bpt, key);
         assert(v);
         assert(*v == fib1);
+        bpt_release(bpt, v);
         fib2 = fib1 + fib2;
         fib1 = fib2 - fib1;
     }
@@ -56,8 +68,8 @@ void test_empty_db() {
 }
 
 void test_filled_db() {
-    BufferManager *bm = buffer_manager_init("db/test.db");
-    BPTree *bpt = bpt_read(bm, 4); // In this case page_id 4 will be the root
+    BufferManager *bm = buffer_manager_init("db/test.db", NULL);
+    BPTree *bpt = bpt_open(bm, 0);
 
     assert(bpt_height(bpt) == 2);
 
@@ -66,6 +78,7 @@ void test_filled_db() {
         uint32_t *v = bpt_get(bpt, key);
         assert(v);
         assert(*v == i);
+        bpt_release(bpt, v);
     }
 
     uint32_t fib1 = 0, fib2 = 1;
@@ -74,13 +87,14 @@ void test_filled_db() {
         uint32_t *v = bpt_get(bpt, key);
         assert(v);
         assert(*v == fib1);
+        bpt_release(bpt, v);
         fib2 = fib1 + fib2;
         fib1 = fib2 - fib1;
     }
 }
 
 void test_with_deletion() {
-    BufferManager *bm = buffer_manager_init("db/test.db");
+    BufferManager *bm = buffer_manager_init("db/test.db", NULL);
     BPTree *bpt = bpt_new(bm);
 
     assert(bpt_height(bpt) == 1);
@@ -133,7 +147,7 @@ void test_massive() {
     }
     fclose(f);
 
-    BufferManager *bm = buffer_manager_init("db/test.db");
+    BufferManager *bm = buffer_manager_init("db/test.db", NULL);
     BPTree *bpt = bpt_new(bm);
     Map *m = rbt_init();
 
@@ -153,11 +167,786 @@ void test_massive() {
         assert(v);
         uint32_t expected_v = *(uint32_t*)rbt_get(m, key);
         assert(*v == expected_v);
+        bpt_release(bpt, v);
         fib2 = fib1 + fib2;
         fib1 = fib2 - fib1;
     }
 }
 
+void test_reopen() {
+    FILE *f = fopen("db/test_reopen.db", "w");
+    if (!f) {
+        perror("fopen");
+        return;
+    }
+    fclose(f);
+
+    BufferManager *bm = buffer_manager_init("db/test_reopen.db", NULL);
+    BPTree *bpt = bpt_open(bm, 1);
+    for (uint32_t i = 0; i < 20000; i++) {
+        bpt_insert(bpt, pseudo_random(i), &i, sizeof(uint32_t));
+    }
+    for (uint32_t i = 0; i < 20000; i += 2) {
+        bpt_delete(bpt, pseudo_random(i));
+    }
+    uint32_t root_page_id = bpt_root_page_id(bpt);
+    buffer_manager_flush_cache(bm);
+    bpt_free(bpt);
+    buffer_manager_free(bm);
+
+    // The root is found through the superblock
+    bm = buffer_manager_init("db/test_reopen.db", NULL);
+    bpt = bpt_open(bm, 1);
+    assert(bpt_root_page_id(bpt) == root_page_id);
+    for (uint32_t i = 0; i < 20000; i++) {
+        uint32_t *v = bpt_get(bpt, pseudo_random(i));
+        if (i % 2) {
+            assert(v && *v == i);
+            bpt_release(bpt, v);
+        }
+        else {
+            assert(!v);
+        }
+    }
+    bpt_free(bpt);
+
+    // An unused slot starts an empty tree
+    bpt = bpt_open(bm, 2);
+    assert(bpt_empty(bpt) && bpt_root_page_id(bpt) != root_page_id);
+    bpt_free(bpt);
+    buffer_manager_free(bm);
+    remove("db/test_reopen.db");
+}
+
+static uint32_t scanned;
+static uint32_t last_scanned;
+void check_scan(uint32_t key, void *data) {
+    assert(scanned == 0 || key > last_scanned);
+    assert(*(uint32_t*)data == key * 3);
+    last_scanned = key;
+    scanned++;
+}
+
+void test_read_only() {
+    FILE *f = fopen("db/test_read_only.db", "w");
+    if (!f) {
+        perror("fopen");
+        return;
+    }
+    fclose(f);
+
+    BufferManager *bm = buffer_manager_init("db/test_read_only.db", NULL);
+    BPTree *bpt = bpt_open(bm, 0);
+    for (uint32_t i = 0; i < 50000; i++) {
+        uint32_t value = i * 3;
+        bpt_insert(bpt, i, &value, sizeof(uint32_t));
+    }
+    buffer_manager_flush_cache(bm);
+    bpt_free(bpt);
+    buffer_manager_free(bm);
+
+    // Pages come from the mapping, the pool is never used
+    BufferManagerOptions options = { 0 };
+    options.read_only = 1;
+    bm = buffer_manager_init("db/test_read_only.db", &options);
+    bpt = bpt_open(bm, 0);
+    for (uint32_t i = 0; i < 50000; i += 7) {
+        uint32_t *v = bpt_get(bpt, i);
+        assert(v && *v == i * 3);
+        bpt_release(bpt, v);
+    }
+    assert(!bpt_get(bpt, 50000));
+    scanned = 0;
+    bpt_range_query(bpt, 1000, 40999, check_scan);
+    assert(scanned == 40000 && last_scanned == 40999);
+    BufferManagerStats stats = buffer_manager_get_stats(bm);
+    assert(stats.hits == 0 && stats.misses == 0);
+
+    // Nothing can be written
+    uint32_t value = 0;
+    RID rid = buffer_manager_request_slot(bm, sizeof(value), &value);
+    assert(rid.page_id == 0);
+    assert(!bpt_open(bm, 1));
+    bpt_free(bpt);
+    buffer_manager_free(bm);
+    remove("db/test_read_only.db");
+
+    // A missing file is not created, nor one in a missing directory
+    assert(!buffer_manager_init("db/test_read_only.db", &options));
+    assert(access("db/test_read_only.db", F_OK) < 0);
+    assert(!buffer_manager_init("/nonexistent_dir/x.db", NULL));
+}
+
+// Child process making updates through a write-ahead log, exiting without
+// flushing or freeing anything as if it crashed. The first half of the
+// inserts is checkpointed, every third key is deleted again at the end.
+void crash_after_updates(BufferManagerOptions *options, uint32_t count) {
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        BufferManager *bm = buffer_manager_init("db/test_wal.db", options);
+        BPTree *bpt = bpt_open(bm, 0);
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t value = i * 3;
+            bpt_insert(bpt, pseudo_random(i), &value, sizeof(uint32_t));
+            if (i == count / 2) buffer_manager_flush_cache(bm);
+        }
+        for (uint32_t i = 0; i < count; i += 3) {
+            bpt_delete(bpt, pseudo_random(i));
+        }
+        if (options->checkpoint_replay_ms) {
+            assert(buffer_manager_get_stats(bm).checkpoints > 0);
+        }
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+// Keys of deleted entries still found after recovery, each one of the
+// last deletes
+uint32_t check_recovered(BPTree *bpt, uint32_t count) {
+    uint32_t undeleted = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t *v = bpt_get(bpt, pseudo_random(i));
+        if (i % 3) {
+            assert(v && *v == i * 3);
+        }
+        else if (v) {
+            assert(*v == i * 3);
+            undeleted++;
+        }
+        else {
+            assert(undeleted == 0);
+        }
+        if (v) bpt_release(bpt, v);
+    }
+    return undeleted;
+}
+
+void test_wal_recovery() {
+    FILE *f = fopen("db/test_wal.db", "w");
+    assert(f);
+    fclose(f);
+    remove("db/test_wal.db-wal");
+
+    // Every commit durable on return, nothing may be lost. The small pool
+    // makes eviction write pages whose commit is still in the group.
+    BufferManagerOptions options = { 0 };
+    options.pool_size = 64 * PAGE_SIZE;
+    options.wal = 1;
+    crash_after_updates(&options, 3000);
+    BufferManager *bm = buffer_manager_init("db/test_wal.db", &options);
+    BPTree *bpt = bpt_open(bm, 0);
+    assert(check_recovered(bpt, 3000) == 0);
+    bpt_free(bpt);
+    buffer_manager_free(bm);
+
+    // Groups of 100 commits, at most the commits of the last group are lost
+    f = fopen("db/test_wal.db", "w");
+    assert(f);
+    fclose(f);
+    remove("db/test_wal.db-wal");
+    options.wal_commits_per_sync = 100;
+    crash_after_updates(&options, 30000);
+
+    // A torn group at the end of the log is skipped
+    f = fopen("db/test_wal.db-wal", "a");
+    assert(f);
+    for (uint32_t i = 0; i < 1000; i++) fputc(i, f);
+    fclose(f);
+
+    bm = buffer_manager_init("db/test_wal.db", &options);
+    bpt = bpt_open(bm, 0);
+    assert(check_recovered(bpt, 30000) < 100);
+    assert(bpt_get(bpt, pseudo_random(30000)) == NULL);
+
+    // Recovered and checkpointed, the log is empty and updates go on
+    uint32_t value = 30000 * 3;
+    bpt_insert(bpt, pseudo_random(30000), &value, sizeof(uint32_t));
+    BufferManagerStats stats = buffer_manager_get_stats(bm);
+    assert(stats.commits == 1 && stats.log_flushes == 0);
+    buffer_manager_flush_log(bm);
+    stats = buffer_manager_get_stats(bm);
+    assert(stats.log_flushes == 1);
+    bpt_free(bpt);
+    buffer_manager_free(bm);
+
+    // With an interval, the commits of a writer that went idle are written
+    // once it is over, without a commit after it
+    f = fopen("db/test_wal.db", "w");
+    assert(f);
+    fclose(f);
+    remove("db/test_wal.db-wal");
+    options.wal_commits_per_sync = 1000;
+    options.wal_sync_interval_us = 10000;
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        bm = buffer_manager_init("db/test_wal.db", &options);
+        bpt = bpt_open(bm, 0);
+        for (uint32_t i = 0; i < 30; i++) {
+            value = i * 3;
+            bpt_insert(bpt, pseudo_random(i), &value, sizeof(uint32_t));
+        }
+        usleep(100000);
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    bm = buffer_manager_init("db/test_wal.db", &options);
+    bpt = bpt_open(bm, 0);
+    for (uint32_t i = 0; i < 30; i++) {
+        uint32_t *v = bpt_get(bpt, pseudo_random(i));
+        assert(v && *v == i * 3);
+        bpt_release(bpt, v);
+    }
+    bpt_free(bpt);
+    buffer_manager_free(bm);
+    remove("db/test_wal.db");
+    remove("db/test_wal.db-wal");
+}
+
+void test_checkpointer() {
+    FILE *f = fopen("db/test_wal.db", "w");
+    assert(f);
+    fclose(f);
+    remove("db/test_wal.db-wal");
+
+    // A bound of 2 ms of replay makes the checkpointer run all the time,
+    // recovery starts from the position the last checkpoint recorded
+    BufferManagerOptions options = { 0 };
+    options.pool_size = 256 * PAGE_SIZE;
+    options.wal = 1;
+    options.wal_commits_per_sync = 100;
+    options.checkpoint_replay_ms = 2;
+    options.checkpoint_pages_per_second = 100000;
+    crash_after_updates(&options, 30000);
+
+    Superblock superblock;
+    f = fopen("db/test_wal.db", "r");
+    assert(f && fread(&superblock, sizeof(Superblock), 1, f) == 1);
+    fclose(f);
+    assert(superblock.checkpoint_offset > 0);
+
+    BufferManager *bm = buffer_manager_init("db/test_wal.db", &options);
+    BPTree *bpt = bpt_open(bm, 0);
+    assert(check_recovered(bpt, 30000) < 100);
+
+    // Along with the cleaner, then reopened after a clean shutdown
+    bpt_free(bpt);
+    buffer_manager_free(bm);
+    options.low_watermark = 16;
+    options.high_watermark = 32;
+    bm = buffer_manager_init("db/test_wal.db", &options);
+    bpt = bpt_open(bm, 0);
+    for (uint32_t i = 0; i < 30000; i += 3) {
+        uint32_t value = i * 3;
+        bpt_insert(bpt, pseudo_random(i), &value, sizeof(uint32_t));
+    }
+    BufferManagerStats stats = buffer_manager_get_stats(bm);
+    assert(stats.checkpoints > 0 && stats.checkpoint_writes > 0);
+    bpt_free(bpt);
+    buffer_manager_free(bm);
+    bm = buffer_manager_init("db/test_wal.db", &options);
+    bpt = bpt_open(bm, 0);
+    assert(check_recovered(bpt, 30000) == 30000 / 3);
+    bpt_free(bpt);
+    buffer_manager_free(bm);
+    remove("db/test_wal.db");
+    remove("db/test_wal.db-wal");
+}
+
+// Keys 0, 2, 4, ... with value key * 3, every key twice when repeat is set
+// (the first time with a wrong value), descending_at makes the keys go
+// down once there
+typedef struct BulkSource {
+    uint32_t next;
+    uint32_t count;
+    uint8_t repeat;
+    uint8_t repeated;
+    uint32_t descending_at;
+    uint32_t value;
+} BulkSource;
+
+int bulk_next(void *context, uint32_t *key, void **data, size_t *size) {
+    BulkSource *source = context;
+    if (source->next == source->count) return 0;
+    *key = source->next * 2;
+    if (source->next == source->descending_at) *key = 1;
+    source->value = *key * 3;
+    if (source->repeat && !source->repeated) {
+        source->repeated = 1;
+        source->value = 7;
+    }
+    else {
+        source->repeated = 0;
+        source->next++;
+    }
+    *data = &source->value;
+    *size = sizeof(uint32_t);
+    return 1;
+}
+
+static uint32_t range_count;
+static uint32_t range_last;
+static void bulk_range_cb(uint32_t key, void *data) {
+    assert(range_count == 0 || key == range_last + 2);
+    assert(*(uint32_t*)data == key * 3);
+    range_last = key;
+    range_count++;
+}
+
+void test_bulk_load() {
+    // Sizes that end the leaf level with a leaf merged into the one before
+    // it, one that takes entries from it, and a three level tree
+    uint32_t counts[] = { 0, 1, MIN_ENTRIES_LEAF * 3 + 1, MAX_ENTRIES_LEAF + 1, 50000, 300000 };
+    uint8_t fills[] = { 100, 100, 50, 100, 70, 100 };
+    for (uint32_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        FILE *f = fopen("db/test_bulk.db", "w");
+        assert(f);
+        fclose(f);
+        remove("db/test_bulk.db-wal");
+        BufferManagerOptions options = { 0 };
+        options.wal = c == 4;
+        options.wal_commits_per_sync = 1000;
+        BufferManager *bm = buffer_manager_init("db/test_bulk.db", &options);
+        BPTree *bpt = bpt_open(bm, 0);
+        BulkSource source = { 0, counts[c], c == 3, 0, UINT32_MAX, 0 };
+        assert(bpt_bulk_load(bpt, fills[c], bulk_next, &source) == 0);
+        bpt_verify_tree(bpt);
+        range_count = 0;
+        bpt_range_query(bpt, 0, 0x7fffffff, bulk_range_cb);
+        assert(range_count == counts[c]);
+        if (counts[c] > MAX_ENTRIES_LEAF * MAX_CHILDREN) assert(bpt_height(bpt) == 3);
+
+        // A loaded tree takes inserts and deletes like any other
+        uint32_t updates = 20000;
+        for (uint32_t i = 0; i < counts[c] && i < updates; i++) {
+            uint32_t key = pseudo_random(i) % (counts[c] * 2);
+            if (i % 2) {
+                uint32_t value = (key | 1) * 3;
+                bpt_insert(bpt, key | 1, &value, sizeof(uint32_t));
+            }
+            else {
+                bpt_delete(bpt, key & ~1u);
+            }
+        }
+        bpt_verify_tree(bpt);
+        bpt_free(bpt);
+        buffer_manager_free(bm);
+
+        bm = buffer_manager_init("db/test_bulk.db", &options);
+        bpt = bpt_open(bm, 0);
+        for (uint32_t i = 0; i < counts[c] && i < updates; i += 2) {
+            uint32_t key = pseudo_random(i) % (counts[c] * 2) & ~1u;
+            assert(!bpt_get(bpt, key));
+        }
+        bpt_verify_tree(bpt);
+        bpt_free(bpt);
+        buffer_manager_free(bm);
+    }
+
+    // Keys out of order leave the tree empty, a filled tree is not loaded
+    BufferManager *bm = buffer_manager_init("db/test_bulk.db", NULL);
+    BPTree *bpt = bpt_new(bm);
+    BulkSource source = { 0, 5000, 0, 0, 4000, 0 };
+    assert(bpt_bulk_load(bpt, 100, bulk_next, &source) < 0);
+    assert(bpt_empty(bpt));
+    uint32_t value = 1;
+    bpt_insert(bpt, 1, &value, sizeof(uint32_t));
+    source.next = 0;
+    source.descending_at = UINT32_MAX;
+    assert(bpt_bulk_load(bpt, 100, bulk_next, &source) < 0);
+    bpt_free(bpt);
+    buffer_manager_free(bm);
+    remove("db/test_bulk.db");
+    remove("db/test_bulk.db-wal");
+}
+
+// Keys 0 to 99999 with 100 byte records starting with the key
+int record_next(void *context, uint32_t *key, void **data, size_t *size) {
+    static uint8_t record[100];
+    uint32_t *next = context;
+    if (*next == 100000) return 0;
+    *key = *next;
+    memcpy(record, next, sizeof(uint32_t));
+    *data = record;
+    *size = sizeof(record);
+    (*next)++;
+    return 1;
+}
+
+void test_cursor() {
+    // An empty tree, one leaf, and trees of two and three levels
+    uint32_t counts[] = { 0, 100, 50000, 300000 };
+    for (uint32_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        uint32_t count = counts[c];
+        FILE *f = fopen("db/test_cursor.db", "w");
+        assert(f);
+        fclose(f);
+        BufferManager *bm = buffer_manager_init("db/test_cursor.db", NULL);
+        BPTree *bpt = bpt_open(bm, 0);
+        BulkSource source = { 0, count, 0, 0, UINT32_MAX, 0 };
+        assert(bpt_bulk_load(bpt, 100, bulk_next, &source) == 0);
+        uint32_t last = count ? (count - 1) * 2 : 0;
+
+        // Keys 0, 2, 4, ..., last with value key * 3
+        BptCursor *cursor = bpt_cursor_open(bpt);
+        assert(!bpt_cursor_valid(cursor));
+        for (uint32_t i = 0; i < 1000 && count; i++) {
+            uint32_t key = pseudo_random(i) % (last + 2);
+            bpt_cursor_seek(cursor, key);
+            assert(key > last ? !bpt_cursor_valid(cursor) :
+                bpt_cursor_key(cursor) == (key + 1) / 2 * 2);
+            bpt_cursor_seek_last(cursor, key);
+            assert(bpt_cursor_key(cursor) == (key > last ? last : key / 2 * 2));
+            assert(*(uint32_t*)bpt_cursor_value(cursor) == bpt_cursor_key(cursor) * 3);
+        }
+        bpt_cursor_seek(cursor, last + 1);
+        assert(!bpt_cursor_valid(cursor));
+        bpt_cursor_seek_last(cursor, 0);
+        assert(bpt_cursor_valid(cursor) == (count > 0));
+
+        // Every entry forward, then back, stepping off either end
+        uint32_t seen = 0;
+        for (bpt_cursor_seek(cursor, 0); bpt_cursor_valid(cursor); bpt_cursor_next(cursor)) {
+            assert(bpt_cursor_key(cursor) == seen * 2);
+            assert(*(uint32_t*)bpt_cursor_value(cursor) == seen * 6);
+            seen++;
+        }
+        assert(seen == count);
+        bpt_cursor_next(cursor);
+        assert(!bpt_cursor_valid(cursor));
+        for (bpt_cursor_seek_last(cursor, UINT32_MAX); bpt_cursor_valid(cursor);
+            bpt_cursor_prev(cursor)) {
+
+            seen--;
+            assert(bpt_cursor_key(cursor) == seen * 2);
+        }
+        assert(seen == 0);
+
+        // Back and forth over the boundary between two leaves
+        if (count > MAX_ENTRIES_LEAF) {
+            bpt_cursor_seek(cursor, 0);
+            for (uint32_t i = 0; i < MAX_ENTRIES_LEAF; i++) bpt_cursor_next(cursor);
+            uint32_t boundary = bpt_cursor_key(cursor);
+            bpt_cursor_prev(cursor);
+            assert(bpt_cursor_key(cursor) == boundary - 2);
+            bpt_cursor_next(cursor);
+            bpt_cursor_next(cursor);
+            assert(bpt_cursor_key(cursor) == boundary + 2);
+        }
+
+        // Pages of entries, with and without their data
+        uint32_t keys[1000];
+        void *values[1000];
+        uint32_t page_sizes[] = { 1, 7, 1000 };
+        for (uint32_t p = 0; p < 3; p++) {
+            bpt_cursor_seek(cursor, 0);
+            seen = 0;
+            uint32_t n;
+            while ((n = bpt_cursor_next_n(cursor, page_sizes[p], keys, p == 1 ? NULL : values))) {
+                assert(n == page_sizes[p] || seen + n == count);
+                for (uint32_t i = 0; i < n; i++) {
+                    assert(keys[i] == (seen + i) * 2);
+                    assert(p == 1 || *(uint32_t*)values[i] == keys[i] * 3);
+                }
+                seen += n;
+            }
+            assert(seen == count && !bpt_cursor_valid(cursor));
+        }
+        bpt_cursor_close(cursor);
+        bpt_free(bpt);
+        buffer_manager_free(bm);
+    }
+
+    // The data of more entries than fit in a small pool, read in pages that
+    // stop short of n
+    FILE *f = fopen("db/test_cursor.db", "w");
+    assert(f);
+    fclose(f);
+    BufferManagerOptions options = { 0 };
+    options.pool_size = 1 << 20;
+    BufferManager *bm = buffer_manager_init("db/test_cursor.db", &options);
+    BPTree *bpt = bpt_open(bm, 0);
+    uint32_t next = 0;
+    assert(bpt_bulk_load(bpt, 100, record_next, &next) == 0);
+    BptCursor *cursor = bpt_cursor_open(bpt);
+    static uint32_t keys[20000];
+    static void *values[20000];
+    uint32_t seen = 0;
+    uint32_t n;
+    bpt_cursor_seek(cursor, 0);
+    while ((n = bpt_cursor_next_n(cursor, 20000, keys, values))) {
+        assert(n < 20000);
+        for (uint32_t i = 0; i < n; i++) {
+            assert(keys[i] == seen + i && *(uint32_t*)values[i] == keys[i]);
+        }
+        seen += n;
+    }
+    assert(seen == 100000);
+    bpt_cursor_close(cursor);
+    bpt_free(bpt);
+    buffer_manager_free(bm);
+    remove("db/test_cursor.db");
+}
+
+static uint32_t reverse_count;
+static uint32_t reverse_last;
+static uint8_t *reverse_present;
+void reverse_cb(uint32_t key, void *data) {
+    assert(reverse_present[key] && *(uint32_t*)data == key * 3);
+    assert(reverse_count == 0 || key < reverse_last);
+    reverse_last = key;
+    reverse_count++;
+}
+
+// Checks bpt_range_query_reverse over [low, high] against present, which
+// covers the keys below num_keys
+void check_reverse(BPTree *bpt, uint8_t *present, uint32_t num_keys, uint32_t low,
+    uint32_t high) {
+
+    uint32_t expected = 0;
+    for (uint32_t key = low; key <= high && key < num_keys; key++) expected += present[key];
+    reverse_count = 0;
+    reverse_present = present;
+    bpt_range_query_reverse(bpt, low, high, reverse_cb);
+    assert(reverse_count == expected);
+}
+
+void test_range_query_reverse() {
+    FILE *f = fopen("db/test_reverse.db", "w");
+    assert(f);
+    fclose(f);
+    BufferManager *bm = buffer_manager_init("db/test_reverse.db", NULL);
+    BPTree *bpt = bpt_open(bm, 0);
+
+    // Splits in random order, then deletes that borrow from and merge
+    // leaves, the links back are kept up by both
+    const uint32_t num_keys = 100000;
+    uint8_t *present = calloc(num_keys, 1);
+    check_reverse(bpt, present, num_keys, 0, num_keys - 1);
+    for (uint32_t i = 0; i < num_keys; i++) {
+        uint32_t key = (uint32_t)(i * 2654435761ULL % num_keys);
+        uint32_t value = key * 3;
+        bpt_insert(bpt, key, &value, sizeof(uint32_t));
+        present[key] = 1;
+    }
+    bpt_verify_tree(bpt);
+    for (uint32_t i = 0; i < num_keys; i++) {
+        uint32_t key = pseudo_random(i) % num_keys;
+        if (key % 10 < 7 || (key > 30000 && key < 40000)) {
+            bpt_delete(bpt, key);
+            present[key] = 0;
+        }
+    }
+    assert(bpt_height(bpt) == 2);
+    bpt_verify_tree(bpt);
+
+    check_reverse(bpt, present, num_keys, 0, UINT32_MAX);
+    check_reverse(bpt, present, num_keys, 0, 0);
+    check_reverse(bpt, present, num_keys, 31000, 39000);
+    for (uint32_t i = 0; i < 100; i++) {
+        uint32_t a = pseudo_random(i) % num_keys;
+        uint32_t b = pseudo_random(a) % num_keys;
+        check_reverse(bpt, present, num_keys, a < b ? a : b, a < b ? b : a);
+    }
+
+    // The latest 1000 entries, back from the end with a cursor
+    BptCursor *cursor = bpt_cursor_open(bpt);
+    uint32_t key = num_keys;
+    bpt_cursor_seek_last(cursor, UINT32_MAX);
+    for (uint32_t i = 0; i < 1000; i++, bpt_cursor_prev(cursor)) {
+        while (!present[--key]);
+        assert(bpt_cursor_key(cursor) == key);
+    }
+    bpt_cursor_close(cursor);
+
+    bpt_free(bpt);
+    buffer_manager_free(bm);
+    free(present);
+    remove("db/test_reverse.db");
+}
+
+// Checks every key of the tree against values (0 for a key not in it)
+void check_batch_tree(BPTree *bpt, uint32_t *values, uint32_t num_keys) {
+    for (uint32_t key = 0; key < num_keys; key++) {
+        uint32_t *v = bpt_get(bpt, key);
+        assert(values[key] ? v && *v == values[key] : !v);
+        if (v) bpt_release(bpt, v);
+    }
+    bpt_verify_tree(bpt);
+}
+
+void test_write_batch() {
+    FILE *f = fopen("db/test_batch.db", "w");
+    assert(f);
+    fclose(f);
+    remove("db/test_batch.db-wal");
+    BufferManagerOptions options = { 0 };
+    options.wal = 1;
+    options.wal_commits_per_sync = 1000;
+    BufferManager *bm = buffer_manager_init("db/test_batch.db", &options);
+    BPTree *bpt = bpt_open(bm, 0);
+
+    // Enough keys for three levels with 4 KB pages
+    const uint32_t num_keys = 600000;
+    uint32_t *values = calloc(num_keys, sizeof(uint32_t));
+    BptWriteBatch *batch = bpt_batch_init();
+
+    // Every other key in one batch, the root leaf is split into many
+    for (uint32_t key = 0; key < num_keys; key += 2) {
+        values[key] = key + 1;
+        bpt_batch_insert(batch, key, &values[key], sizeof(uint32_t));
+    }
+    assert(bpt_batch_size(batch) == num_keys / 2);
+    bpt_write_batch(bpt, batch);
+    assert(bpt_batch_size(batch) == 0);
+    assert(bpt_height(bpt) == (num_keys / 2 > MAX_ENTRIES_LEAF * MAX_CHILDREN ? 3 : 2));
+    check_batch_tree(bpt, values, num_keys);
+
+    // Random inserts, replacements and deletes, keys repeat within a batch
+    // where the last operation decides
+    uint32_t sizes[] = { 1, 10, 500, 5000, 40000 };
+    uint32_t state = 3;
+    for (uint32_t round = 0; round < 10; round++) {
+        uint32_t size = sizes[round % 5];
+        for (uint32_t i = 0; i < size; i++) {
+            state = pseudo_random(state);
+            uint32_t key = state % num_keys;
+            if (state % 3 == 0) {
+                values[key] = 0;
+                bpt_batch_delete(batch, key);
+            }
+            else {
+                values[key] = state | 1;
+                bpt_batch_insert(batch, key, &values[key], sizeof(uint32_t));
+            }
+        }
+        bpt_write_batch(bpt, batch);
+        check_batch_tree(bpt, values, num_keys);
+    }
+
+    // Emptying ranges leaves leaves below half full, merged through the
+    // single deletes, and with them internal nodes
+    for (uint32_t key = num_keys / 5; key < num_keys * 3 / 5; key++) {
+        if (key % 1000 < 900) {
+            values[key] = 0;
+            bpt_batch_delete(batch, key);
+        }
+    }
+    bpt_write_batch(bpt, batch);
+    check_batch_tree(bpt, values, num_keys);
+    bpt_free(bpt);
+    buffer_manager_free(bm);
+
+    bm = buffer_manager_init("db/test_batch.db", &options);
+    bpt = bpt_open(bm, 0);
+    check_batch_tree(bpt, values, num_keys);
+    bpt_free(bpt);
+    buffer_manager_free(bm);
+    bpt_batch_free(batch);
+    free(values);
+    remove("db/test_batch.db");
+    remove("db/test_batch.db-wal");
+}
+
+static uint8_t *exhausted_present;
+static uint32_t exhausted_count;
+void exhausted_cb(uint32_t key, void *data) {
+    assert(exhausted_present[key] && *(uint32_t*)data == key);
+    exhausted_count++;
+}
+
+// Operations that run out of frames fail and leave the tree as it was
+void test_pool_exhausted() {
+    FILE *f = fopen("db/test_exhausted.db", "w");
+    assert(f);
+    fclose(f);
+    BufferManagerOptions options = { 0 };
+    options.pool_size = 64 * PAGE_SIZE;
+    BufferManager *bm = buffer_manager_init("db/test_exhausted.db", &options);
+    BPTree *bpt = bpt_open(bm, 0);
+    BPTree *empty = bpt_open(bm, 1);
+    const uint32_t num_keys = 40000;
+    uint8_t *present = calloc(num_keys, 1);
+    for (uint32_t key = 0; key < num_keys; key += 2) {
+        assert(bpt_insert(bpt, key, &key, sizeof(key)) == 0);
+        present[key] = 1;
+    }
+    exhausted_present = present;
+    BptWriteBatch *batch = bpt_batch_init();
+
+    // Every frame but a few holds a pinned page of no tree
+    Page *held[64];
+    uint32_t free_frames[] = { 0, 2, 3, 5, 8 };
+    uint32_t state = 7;
+    for (uint32_t r = 0; r < sizeof(free_frames) / sizeof(free_frames[0]); r++) {
+        uint32_t num_held = 0;
+        while (buffer_manager_unpinned_frames(bm) > free_frames[r]) {
+            held[num_held] = buffer_manager_new_bpt_page(bm, LEAF);
+            assert(held[num_held++]);
+        }
+
+        uint32_t failed = 0;
+        for (uint32_t i = 0; i < 2000; i++) {
+            state = pseudo_random(state);
+            uint32_t key = state % num_keys;
+            if (state % 4 == 0) {
+                if (bpt_delete(bpt, key) == 0) present[key] = 0;
+                else failed++;
+            }
+            else {
+                if (bpt_insert(bpt, key, &key, sizeof(key)) == 0) present[key] = 1;
+                else failed++;
+            }
+        }
+        if (free_frames[r] == 0) {
+            assert(failed == 2000);
+            assert(!bpt_get(bpt, 0));
+            exhausted_count = 0;
+            bpt_range_query(bpt, 0, num_keys, exhausted_cb);
+            bpt_range_query_reverse(bpt, 0, num_keys, exhausted_cb);
+            assert(exhausted_count == 0);
+            BptCursor *cursor = bpt_cursor_open(bpt);
+            bpt_cursor_seek(cursor, 0);
+            assert(!bpt_cursor_valid(cursor));
+            bpt_cursor_close(cursor);
+            bpt_batch_insert(batch, 1, &state, sizeof(state));
+            bpt_batch_delete(batch, 2);
+            assert(bpt_write_batch(bpt, batch) == -1 && bpt_batch_size(batch) == 2);
+            bpt_batch_clear(batch);
+        }
+        if (free_frames[r] <= 3) {
+            uint32_t next = 0;
+            assert(bpt_bulk_load(empty, 100, record_next, &next) == -1);
+        }
+
+        for (uint32_t i = 0; i < num_held; i++) {
+            uint32_t page_id = held[i]->header.page_id;
+            buffer_manager_unpin_page(bm, held[i]);
+            buffer_manager_free_page(bm, page_id);
+        }
+        assert(bpt_empty(empty));
+        bpt_verify_tree(bpt);
+        uint32_t expected = 0;
+        for (uint32_t key = 0; key < num_keys; key++) expected += present[key];
+        exhausted_count = 0;
+        bpt_range_query(bpt, 0, num_keys, exhausted_cb);
+        assert(exhausted_count == expected);
+    }
+
+    bpt_batch_free(batch);
+    bpt_free(empty);
+    bpt_free(bpt);
+    buffer_manager_free(bm);
+    free(present);
+    remove("db/test_exhausted.db");
+}
+
 int main() {
 
     // test_filled_db can be used if test_empty_db has been used eariler
@@ -166,6 +955,15 @@ int main() {
     // test_empty_db();
     // test_filled_db();
     // test_with_deletion();
+    test_reopen();
+    test_read_only();
+    test_wal_recovery();
+    test_checkpointer();
+    test_bulk_load();
+    test_write_batch();
+    test_cursor();
+    test_range_query_reverse();
+    test_pool_exhausted();
     test_massive();
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,183 @@
+#include "../src/external_sort.h"
+#include "../src/bptree.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+uint32_t pseudo_random(uint32_t v) {
+    return (1103515245ULL * (unsigned long long)v + 12345ULL) & 0x7fffffff;
+}
+
+// Record i has key_of(i), its data is i followed by size_of(i) - 4 bytes
+// of the low byte of i. Keys repeat every distinct_keys records.
+uint32_t key_of(uint32_t i, uint32_t distinct_keys) {
+    return pseudo_random(i % distinct_keys);
+}
+
+uint32_t size_of(uint32_t i, uint32_t max_size) {
+    return 4 + pseudo_random(i ^ 0x5555) % (max_size - 3);
+}
+
+// Adds count records, checks they come out in key order, records with the
+// same key in the order they were added, and that they are intact
+ExternalSortStats sort_records(uint32_t count, uint32_t distinct_keys, uint32_t max_size,
+    size_t memory_limit, uint32_t num_threads) {
+
+    ExternalSort *sort = external_sort_init("db", memory_limit, num_threads);
+    assert(sort);
+    uint8_t *record = malloc(max_size);
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t size = size_of(i, max_size);
+        memset(record, i & 0xff, size);
+        memcpy(record, &i, sizeof(uint32_t));
+        assert(external_sort_add(sort, key_of(i, distinct_keys), record, size) == 0);
+    }
+    assert(external_sort_finish(sort) == 0);
+    assert(external_sort_add(sort, 0, record, 4) == -1);
+
+    uint32_t seen = 0;
+    uint32_t last_key = 0;
+    uint32_t last_index = 0;
+    uint32_t key;
+    void *data;
+    size_t size;
+    while (external_sort_next(sort, &key, &data, &size)) {
+        uint32_t i;
+        memcpy(&i, data, sizeof(uint32_t));
+        assert(i < count);
+        assert(key == key_of(i, distinct_keys));
+        assert(size == size_of(i, max_size));
+        for (size_t b = sizeof(uint32_t); b < size; b++) {
+            assert(((uint8_t*)data)[b] == (i & 0xff));
+        }
+        if (seen) {
+            assert(key > last_key || (key == last_key && i > last_index));
+        }
+        last_key = key;
+        last_index = i;
+        seen++;
+    }
+    assert(seen == count);
+    assert(!external_sort_next(sort, &key, &data, &size));
+    assert(!external_sort_failed(sort));
+
+    ExternalSortStats stats = external_sort_get_stats(sort);
+    assert(stats.records == count);
+    external_sort_free(sort);
+    free(record);
+    return stats;
+}
+
+void test_sort() {
+    size_t min_memory = 4 * EXTERNAL_SORT_BLOCK_SIZE;
+    assert(external_sort_init("db", min_memory - 1, 1) == NULL);
+
+    ExternalSort *sort = external_sort_init("db", min_memory, 1);
+    uint8_t *record = calloc(1, EXTERNAL_SORT_MAX_RECORD + 1);
+    assert(external_sort_add(sort, 1, record, EXTERNAL_SORT_MAX_RECORD + 1) == -1);
+    assert(external_sort_add(sort, 1, record, EXTERNAL_SORT_MAX_RECORD) == 0);
+    free(record);
+    external_sort_free(sort);
+
+    // Nothing to sort, and input that fits in memory is never written
+    ExternalSortStats stats = sort_records(0, 1, 8, min_memory, 1);
+    assert(stats.runs == 0);
+    stats = sort_records(10000, 1000, 16, 64 << 20, 0);
+    assert(stats.runs == 0 && stats.bytes_written == 0);
+
+    // Runs merged at once
+    stats = sort_records(200000, 50000, 64, 16 << 20, 4);
+    assert(stats.runs > 1 && stats.merge_passes == 0);
+    assert(stats.bytes_read == stats.bytes_written);
+
+    // More runs than blocks fit in memory, merged in passes, with records
+    // up to the largest there are
+    stats = sort_records(100000, 100000, 200, min_memory, 2);
+    assert(stats.merge_passes > 0);
+    stats = sort_records(200, 200, EXTERNAL_SORT_MAX_RECORD, min_memory, 1);
+    assert(stats.merge_passes > 0);
+}
+
+// A run file that cannot be created fails the sort, whether it is for the
+// runs written while records are added or for a merge pass
+void test_run_file_fails() {
+    ExternalSort *sort = external_sort_init("db/missing", 4 * EXTERNAL_SORT_BLOCK_SIZE, 1);
+    uint32_t value = 0;
+    int added = 0;
+    for (uint32_t i = 0; i < 200000 && added == 0; i++) {
+        added = external_sort_add(sort, pseudo_random(i), &value, sizeof(uint32_t));
+    }
+    assert(added < 0 || external_sort_finish(sort) < 0);
+    assert(external_sort_failed(sort));
+    external_sort_free(sort);
+
+    // Runs are written, then every file descriptor but one is taken, so at
+    // most the last run and the first merge get a file
+    sort = external_sort_init("db", 4 * EXTERNAL_SORT_BLOCK_SIZE, 1);
+    for (uint32_t i = 0; i < 200000; i++) {
+        assert(external_sort_add(sort, pseudo_random(i), &i, sizeof(uint32_t)) == 0);
+    }
+    struct rlimit limit;
+    assert(getrlimit(RLIMIT_NOFILE, &limit) == 0);
+    struct rlimit capped = limit;
+    capped.rlim_cur = 256;
+    assert(setrlimit(RLIMIT_NOFILE, &capped) == 0);
+    int fillers[256];
+    uint32_t num_fillers = 0;
+    int fd;
+    while ((fd = open("/dev/null", O_RDONLY)) >= 0) fillers[num_fillers++] = fd;
+    close(fillers[--num_fillers]);
+
+    assert(external_sort_finish(sort) < 0);
+    assert(external_sort_failed(sort));
+    uint32_t key;
+    void *data;
+    size_t size;
+    assert(!external_sort_next(sort, &key, &data, &size));
+    for (uint32_t i = 0; i < num_fillers; i++) close(fillers[i]);
+    assert(setrlimit(RLIMIT_NOFILE, &limit) == 0);
+    external_sort_free(sort);
+}
+
+void test_bulk_load_unsorted() {
+    FILE *f = fopen("db/test_external_sort.db", "w");
+    assert(f);
+    fclose(f);
+
+    // Keys repeat, the record added last is the one kept
+    const uint32_t count = 300000;
+    const uint32_t distinct_keys = 100000;
+    ExternalSort *sort = external_sort_init("db", 4 << 20, 0);
+    for (uint32_t i = 0; i < count; i++) {
+        assert(external_sort_add(sort, key_of(i, distinct_keys), &i, sizeof(uint32_t)) == 0);
+    }
+    assert(external_sort_finish(sort) == 0);
+    assert(external_sort_get_stats(sort).runs > 1);
+
+    BufferManager *bm = buffer_manager_init("db/test_external_sort.db", NULL);
+    BPTree *bpt = bpt_open(bm, 0);
+    assert(bpt_bulk_load(bpt, 0, external_sort_next, sort) == 0);
+    assert(!external_sort_failed(sort));
+    external_sort_free(sort);
+
+    for (uint32_t k = 0; k < distinct_keys; k++) {
+        uint32_t *v = bpt_get(bpt, key_of(k, distinct_keys));
+        assert(v && *v == k + (count / distinct_keys - 1) * distinct_keys);
+        bpt_release(bpt, v);
+    }
+    bpt_verify_tree(bpt);
+    bpt_free(bpt);
+    buffer_manager_free(bm);
+    remove("db/test_external_sort.db");
+}
+
+int main() {
+    test_sort();
+    test_run_file_fails();
+    test_bulk_load_unsorted();
+    return 0;
+}
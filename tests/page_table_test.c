@@ -0,0 +1,87 @@
+#include "../src/page_table.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+uint32_t pseudo_random(uint32_t v) {
+    return (1103515245ULL * (unsigned long long)v + 12345ULL) & 0x7fffffff;
+}
+
+void insert_and_delete_test() {
+    PageTable *pt = pt_init(4);
+    pt_insert(pt, 200, 10); assert(pt_size(pt) == 1);
+    pt_insert(pt, 270, 11);
+    pt_insert(pt, 221, 12);
+    pt_insert(pt, 1, 13);
+    pt_insert(pt, 20000000, 14);
+    assert(pt_size(pt) == 5);
+
+    assert(pt_get(pt, 200) == 10);
+    assert(pt_get(pt, 270) == 11);
+    assert(pt_get(pt, 221) == 12);
+    assert(pt_get(pt, 1) == 13);
+    assert(pt_get(pt, 20000000) == 14);
+    assert(pt_get(pt, 5) == PT_NOT_FOUND);
+
+    // Overwrite
+    pt_insert(pt, 221, 99);
+    assert(pt_get(pt, 221) == 99);
+    assert(pt_size(pt) == 5);
+
+    pt_delete(pt, 200); assert(pt_get(pt, 200) == PT_NOT_FOUND);
+    pt_delete(pt, 20000000); assert(pt_get(pt, 20000000) == PT_NOT_FOUND);
+    pt_delete(pt, 12345); // Not present
+    assert(pt_size(pt) == 3);
+    assert(pt_get(pt, 270) == 11);
+    assert(pt_get(pt, 1) == 13);
+
+    pt_clear(pt);
+    assert(pt_size(pt) == 0);
+    assert(pt_get(pt, 270) == PT_NOT_FOUND);
+
+    pt_free(pt);
+}
+
+// Mixes inserts and deletes so that backward-shift deletion moves entries
+// around, and checks every key against a plain array
+void random_ops_test() {
+    uint32_t n = 1 << 14;
+    uint32_t *expected = calloc(n, sizeof(uint32_t));
+    PageTable *pt = pt_init(64);
+
+    uint32_t v = 1;
+    for (int i = 0; i < 200000; i++) {
+        v = pseudo_random(v);
+        uint32_t page_id = v % (n - 1) + 1;
+        if (v & 0x100) {
+            pt_insert(pt, page_id, i);
+            expected[page_id] = i + 1;
+        }
+        else {
+            pt_delete(pt, page_id);
+            expected[page_id] = 0;
+        }
+    }
+
+    uint32_t size = 0;
+    for (uint32_t page_id = 1; page_id < n; page_id++) {
+        uint32_t got = pt_get(pt, page_id);
+        if (expected[page_id]) {
+            assert(got == expected[page_id] - 1);
+            size++;
+        }
+        else {
+            assert(got == PT_NOT_FOUND);
+        }
+    }
+    assert(pt_size(pt) == size);
+
+    free(expected);
+    pt_free(pt);
+}
+
+int main() {
+    insert_and_delete_test();
+    random_ops_test();
+    return 0;
+}